@@ -0,0 +1,197 @@
+/* ============================================================================================================
+ *  File: async.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Asynchronous (separate) responses (RFC 7252, section 5.2.2). Requests that cannot be answered
+ *      right away are acknowledged by the library and answered later, so that slow handlers do not
+ *      stall the dispatch loop.
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_ASYNC_H_
+#define COAP_ASYNC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libcoap.h"
+#include "coap_session.h"
+#include "coap_time.h"
+#include "pdu.h"
+#include "str.h"
+#include "uthash.h"
+
+struct coap_context_t;
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of requests waiting for the separate response within a single context
+ */
+#ifndef COAP_ASYNC_MAX_PENDING
+#define COAP_ASYNC_MAX_PENDING 4
+#endif
+
+/**
+ * @brief: Time (in seconds) after which the pending request is answered with 5.03 (Service
+ *    Unavailable), if the application has not completed it
+ */
+#ifndef COAP_ASYNC_TIMEOUT
+#define COAP_ASYNC_TIMEOUT 30
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: State of the request waiting for the separate response
+ */
+typedef struct coap_async_state_t {
+
+    /**
+     * @note: @a session, @a token_length and @a token fields form the key of the context's
+     *    index of pending requests (@see COAP_ASYNC_KEY_SIZE); they must be kept adjacent.
+     */
+
+    // Session that the request was received from (reference is held until the state is freed)
+    coap_session_t *session;
+    // Actual length of the request's token
+    size_t token_length;
+    // Request's token (zero-padded)
+    uint8_t token[8];
+
+    // Copy of the request (its options and payload remain available to the application)
+    coap_pdu_t *request;
+    // Absolute time (in ticks) of the state's expiration
+    coap_tick_t expires;
+    // Application-specific data
+    void *app_data;
+    // Set while the request is handled by the worker pool (state does not expire then)
+    uint8_t offloaded;
+
+    // Handle of the context's index
+    UT_hash_handle hh;
+
+} coap_async_state_t;
+
+/**
+ * @brief: Size of the (session, token) key used to index pending requests
+ */
+#define COAP_ASYNC_KEY_SIZE \
+    (offsetof(coap_async_state_t, token) + 8 - offsetof(coap_async_state_t, session))
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Registers the @p request to be answered with the separate response. Function is
+ *    called by the resource's handler, which leaves the response untouched - the library
+ *    acknowledges the CON request with an Empty ACK (NON request is not answered at all).
+ *    The application completes the request later with coap_async_send().
+ *
+ *    @code
+ *      static void hnd_get(coap_resource_t *resource, coap_session_t *session, coap_pdu_t *request,
+ *          coap_binary_t *token, coap_string_t *query, coap_pdu_t *response)
+ *      {
+ *          coap_register_async(session, request, NULL);
+ *      }
+ *
+ *      // ... when the value is ready
+ *      coap_pdu_t *response = coap_async_response_init(async);
+ *      if (response) {
+ *          response->code = COAP_RESPONSE_CONTENT;
+ *          coap_add_data(response, length, data);
+ *          coap_async_send(async, response);
+ *      }
+ *    @endcode
+ *
+ * @param session:
+ *    session that the request was received from
+ * @param request:
+ *    request to be answered later (it's copied)
+ * @param app_data:
+ *    application-specific data associated with the request
+ * @returns:
+ *    state of the pending request on success
+ *    NULL if the request is already pending, the limit of pending requests is reached
+ *    or memory could not be allocated
+ */
+coap_async_state_t *coap_register_async(
+    coap_session_t *session,
+    coap_pdu_t *request,
+    void *app_data
+);
+
+/**
+ * @brief: Looks for the request received from the @p session with the @p token that waits
+ *    for the separate response
+ *
+ * @param session:
+ *    session that the request was received from
+ * @param token:
+ *    request's token
+ * @returns:
+ *    state of the pending request or NULL if not found
+ */
+coap_async_state_t *coap_find_async(coap_session_t *session, const coap_binary_t *token);
+
+/**
+ * @brief: Creates the separate response to the pending request. The response is confirmable
+ *    if the request was, it carries the request's token and a new message ID.
+ *
+ * @param async:
+ *    pending request
+ * @returns:
+ *    response (with code to be set by the application) on success
+ *    NULL on failure
+ */
+coap_pdu_t *coap_async_response_init(coap_async_state_t *async);
+
+/**
+ * @brief: Sends the separate @p response and frees the @p async state
+ *
+ * @param async:
+ *    pending request
+ * @param response:
+ *    response created with coap_async_response_init(); if NULL, the state is kept so that
+ *    the application can retry
+ * @returns:
+ *    message ID of the response on success
+ *    COAP_INVALID_TID on failure
+ */
+coap_tid_t coap_async_send(coap_async_state_t *async, coap_pdu_t *response);
+
+/**
+ * @brief: Frees the @p async state without answering the request
+ *
+ * @param async:
+ *    pending request
+ */
+void coap_remove_async(coap_async_state_t *async);
+
+/**
+ * @brief: Answers the @p context's pending requests that have expired with 5.03 (Service
+ *    Unavailable)
+ *
+ * @param context:
+ *    context to check requests of
+ * @param now:
+ *    current time
+ * @returns:
+ *    time (in ticks) remaining to the next request's expiration
+ *    0 if no request is pending
+ */
+coap_tick_t coap_async_expire(struct coap_context_t *context, coap_tick_t now);
+
+/**
+ * @brief: Frees all @p context's pending requests without answering them
+ *
+ * @param context:
+ *    context to free requests of
+ */
+void coap_async_clear(struct coap_context_t *context);
+
+#endif /* COAP_ASYNC_H_ */
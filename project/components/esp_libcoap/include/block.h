@@ -35,10 +35,13 @@
 #ifndef COAP_BLOCK_H_
 #define COAP_BLOCK_H_
 
+#include "libcoap.h"
+#include "coap_time.h"
 #include "encode.h"
 #include "option.h"
 #include "pdu.h"
 
+struct coap_context_t;
 struct coap_resource_t;
 struct coap_session_t;
 
@@ -52,6 +55,76 @@ struct coap_session_t;
 #define COAP_MAX_BLOCK_SZX 6
 #endif
 
+/**
+ * @brief: SZX value of the BERT block (RFC 8323, section 6). BERT block carries one or more
+ *    1024-byte blocks and can be exchanged only within sessions using TCP.
+ */
+#define COAP_BERT_SZX 7
+
+/**
+ * @brief: Size of the unit that BERT blocks' numbers and lengths are expressed in
+ */
+#define COAP_BERT_BLOCK_SIZE 1024
+
+/**
+ * @brief: Maximal size (in bytes) of the request's body reassembled from Block1 transfer.
+ *    Bodies of resources with COAP_RESOURCE_FLAGS_BLOCK1_STREAM set are not limited.
+ */
+#ifndef COAP_BLOCK1_MAX_BODY_SIZE
+#define COAP_BLOCK1_MAX_BODY_SIZE 4096
+#endif
+
+/**
+ * @brief: Maximal number of Block1 transfers handled by the context simultaneously
+ */
+#ifndef COAP_BLOCK1_MAX_TRANSFERS
+#define COAP_BLOCK1_MAX_TRANSFERS 2
+#endif
+
+/**
+ * @brief: Time (in seconds) after which the Block1 transfer is abandoned if no next block
+ *    is received
+ */
+#ifndef COAP_BLOCK1_TRANSFER_TIMEOUT
+#define COAP_BLOCK1_TRANSFER_TIMEOUT 30
+#endif
+
+/**
+ * @brief: Number of blocks sent back to back, without waiting for the peer, in a single set of
+ *    the Q-Block transfer (MAX_PAYLOADS of RFC 9177)
+ */
+#ifndef COAP_QBLOCK_MAX_PAYLOADS
+#define COAP_QBLOCK_MAX_PAYLOADS 10
+#endif
+
+/**
+ * @brief: Time (in seconds) the receiver of the Q-Block1 transfer waits for the missing blocks
+ *    of the set before reporting them (NON_TIMEOUT of RFC 9177; blocks are reported after
+ *    NON_RECEIVE_TIMEOUT, i.e. twice the NON_TIMEOUT)
+ */
+#ifndef COAP_QBLOCK_NON_TIMEOUT
+#define COAP_QBLOCK_NON_TIMEOUT 2
+#endif
+
+/**
+ * @brief: Maximal number of blocks of the reassembled Q-Block1 body (blocks of the smallest size)
+ */
+#define COAP_QBLOCK1_MAX_BLOCKS \
+    ((COAP_BLOCK1_MAX_BODY_SIZE + 15) / 16)
+
+/**
+ * @brief: Value of the representation's length passed to coap_add_data_produced_response()
+ *    when the length is not known in advance
+ */
+#define COAP_BLOCK2_LENGTH_UNKNOWN ((size_t) -1)
+
+/**
+ * @brief: Results of the coap_block1_handle()
+ */
+#define COAP_BLOCK1_NONE     0
+#define COAP_BLOCK1_DELIVER  1
+#define COAP_BLOCK1_ANSWERED 2
+
 /**
  * @returns: 
  *    the value of the least significant byte of a Block option @p opt.
@@ -93,6 +166,88 @@ typedef struct {
     
 } coap_block_t;
 
+/**
+ * @brief: Producer of the resource's representation used by coap_add_data_produced_response().
+ *    It writes bytes [@p offset, @p offset + @p length) of the representation into @p data.
+ *
+ * @param resource:
+ *    the resource whose representation is produced
+ * @param session:
+ *    session that the response is sent with
+ * @param offset:
+ *    offset of the first byte to be written
+ * @param data:
+ *    buffer inside the response PDU to write bytes to
+ * @param length:
+ *    number of bytes to be written
+ * @param arg:
+ *    argument passed to coap_add_data_produced_response()
+ * @returns:
+ *    number of bytes written (less than @p length only if the representation ends)
+ */
+typedef size_t (*coap_block2_producer_t)(
+    struct coap_resource_t *resource,
+    struct coap_session_t *session,
+    size_t offset,
+    uint8_t *data,
+    size_t length,
+    void *arg
+);
+
+/**
+ * @brief: State of the Block1 transfer (i.e. request's body received in a sequence of blocks)
+ */
+typedef struct coap_block1_transfer_t {
+
+    // Values used to create the context's list of transfers
+    struct coap_block1_transfer_t *prev;
+    struct coap_block1_transfer_t *next;
+
+    // Session that the request is received from
+    struct coap_session_t *session;
+    // Requested resource
+    struct coap_resource_t *resource;
+    // Request's method
+    uint8_t code;
+    // Option the body is sent with (COAP_OPTION_BLOCK1 or COAP_OPTION_Q_BLOCK1)
+    uint16_t type;
+
+    // Number of bytes of the body received so far (offset of the next expected block)
+    size_t offset;
+    // Absolute time (in ticks) of the transfer's expiration
+    coap_tick_t expires;
+
+    // Reassembled body (NULL for resources with COAP_RESOURCE_FLAGS_BLOCK1_STREAM set)
+    uint8_t *body;
+    // Size of the @a body's storage
+    size_t capacity;
+
+    /**
+     * @note: Following fields are used by Q-Block1 transfers only, whose blocks may arrive
+     *    out of order. In the reassembly mode, @a offset holds the end of the furthest block
+     *    received.
+     */
+
+    // Encoded size of the transfer's blocks
+    uint8_t szx;
+    // Bitmap of the received blocks (reassembly mode only)
+    uint8_t received[(COAP_QBLOCK1_MAX_BLOCKS + 7) / 8];
+    // Number of the highest block received so far
+    unsigned int highest;
+    // Number of blocks of the body (0 until the last block is received)
+    unsigned int total;
+    // Set if missing blocks have been reported and the client has not sent them all yet
+    uint8_t reported;
+    // Set once the body has been delivered (the transfer is kept for a while to absorb late duplicates)
+    uint8_t done;
+    // Absolute time (in ticks) when missing blocks are reported if no block arrives (0 if not scheduled)
+    coap_tick_t report;
+    // Token of the latest block (used by the report)
+    uint8_t token[8];
+    uint8_t token_length;
+
+} coap_block1_transfer_t;
+
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
 /**
@@ -172,12 +327,149 @@ int coap_add_block(
     coap_block_t *block
 );
 
+/**
+ * @brief: Handles the Block1 option of the @p request to the @p resource. Subsequent blocks
+ *    must arrive in order; missing blocks are reported with 4.08 (Request Entity Incomplete).
+ *
+ *    By default, blocks are reassembled into a buffer bounded by COAP_BLOCK1_MAX_BODY_SIZE
+ *    (4.13 (Request Entity Too Large) is sent if exceeded). Every block but the last one is
+ *    answered with 2.31 (Continue), while the last one results in the handler being called
+ *    with the request holding the whole body (without Block1 and Size1 options, unless the
+ *    body was sent in a single block).
+ *
+ *    If COAP_RESOURCE_FLAGS_BLOCK1_STREAM is set for the @p resource, handler is called for
+ *    every block with the original @p request. It can obtain the block's position with
+ *    coap_get_block(request, COAP_OPTION_BLOCK1, ...) (COAP_OPTION_Q_BLOCK1 for
+ *    Q-Block1 transfers) and must start a new body when the block's num is 0.
+ *
+ *    Bodies sent with Q-Block1 option (RFC 9177) are handled in the same way, except that
+ *    blocks of a set (COAP_QBLOCK_MAX_PAYLOADS blocks) may arrive in any order and only the
+ *    last block of the set is answered: with 2.31 (Continue) if the whole set was received or
+ *    with 4.08 (Request Entity Incomplete) listing numbers of the missing blocks otherwise.
+ *    Remaining blocks are not answered (only acknowledged, if confirmable). Missing blocks are
+ *    also reported if no block arrives for the NON_RECEIVE_TIMEOUT. In the streaming mode,
+ *    blocks arriving ahead of the expected one are dropped and reported as missing.
+ *
+ * @param session:
+ *    session that the @p request was received from
+ * @param resource:
+ *    requested resource
+ * @param request:
+ *    the request
+ * @param response:
+ *    response to the @p request (filled if COAP_BLOCK1_ANSWERED is returned)
+ * @param body [out]:
+ *    request to be passed to the handler if COAP_BLOCK1_DELIVER is returned
+ * @returns:
+ *    COAP_BLOCK1_NONE if @p request has neither Block1 nor Q-Block1 option
+ *    COAP_BLOCK1_DELIVER if the handler must be called with @p body
+ *    COAP_BLOCK1_ANSWERED if the @p response has been filled and handler must not be called
+ *
+ * @note: When COAP_BLOCK1_DELIVER is returned, coap_block1_complete() must be called after
+ *    the handler.
+ */
+int coap_block1_handle(
+    struct coap_session_t *session,
+    struct coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_pdu_t *response,
+    coap_pdu_t **body
+);
+
+/**
+ * @brief: Completes the @p response produced by the handler for a @p body delivered by
+ *    coap_block1_handle(). Block1 option is inserted into the response and, in the streaming
+ *    mode, a successful response to the not-last block is turned into 2.31 (Continue).
+ *    Reassembled @p body is freed.
+ *
+ * @param session:
+ *    session that the @p request was received from
+ * @param resource:
+ *    requested resource
+ * @param request:
+ *    the request (as received)
+ * @param body:
+ *    request passed to the handler
+ * @param response:
+ *    handler's response
+ */
+void coap_block1_complete(
+    struct coap_session_t *session,
+    struct coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_pdu_t *body,
+    coap_pdu_t *response
+);
+
+/**
+ * @brief: Abandons the @p context's Block1 transfers that have expired and reports missing
+ *    blocks of the Q-Block1 transfers that have stalled
+ *
+ * @param context:
+ *    context to check transfers of
+ * @param now:
+ *    current time
+ * @returns:
+ *    time (in ticks) remaining to the next transfer's expiration (or report)
+ *    0 if no transfer is in progress
+ */
+coap_tick_t coap_block1_expire(struct coap_context_t *context, coap_tick_t now);
+
+/**
+ * @brief: Abandons the @p context's Block1 transfers related to the @p session or to the
+ *    @p resource (any of them may be NULL)
+ *
+ * @param context:
+ *    context to remove transfers from
+ * @param session:
+ *    session being freed
+ * @param resource:
+ *    resource being freed
+ */
+void coap_block1_remove(
+    struct coap_context_t *context,
+    const struct coap_session_t *session,
+    const struct coap_resource_t *resource
+);
+
+/**
+ * @brief: Sends the remaining blocks of the Q-Block2 set requested by the GET @p request
+ *    (RFC 9177, section 4.4), after the response with the first @p block has been sent. Every
+ *    block is rendered by the resource's GET handler called with a copy of the @p request
+ *    holding the single Q-Block2 option and is sent as a separate non-confirmable response
+ *    with the request's token.
+ *
+ *    If the first Q-Block2 option of the @p request has the M bit set, following blocks are
+ *    sent up to the set's size (COAP_QBLOCK_MAX_PAYLOADS) or to the last block; the client
+ *    asks for the next set in the same way. Otherwise, blocks listed by the subsequent
+ *    Q-Block2 options (i.e. the missing ones) are sent.
+ *
+ * @param session:
+ *    session that the @p request was received from
+ * @param resource:
+ *    requested resource
+ * @param request:
+ *    the request
+ * @param query:
+ *    request's query (may be NULL)
+ * @param block:
+ *    Q-Block2 option of the response that has been sent
+ */
+void coap_qblock2_send_set(
+    struct coap_session_t *session,
+    struct coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_string_t *query,
+    const coap_block_t *block
+);
+
 /**
  * @brief: Helper function used to construct simple response to the GET request. Adds
  *    basic options deduced from the @p request (block2, maxage, content-format, observe).
  *    If block transfer is required adds only requested block of @p data to the @p response.
  *    Block responses are also flavoured with the ETag option that's value is a hash of the
- *    whole @p data block.
+ *    whole @p data block. If the @p request contains Q-Block2 option, it is used instead of
+ *    Block2 (@see coap_qblock2_send_set()).
  * 
  * @note: @p response PDU must be a clean one, without options and data.
  *
@@ -214,6 +506,58 @@ coap_add_data_blocked_response(
     const uint8_t* data
 );
 
+/**
+ * @brief: Counterpart of the coap_add_data_blocked_response() for representations that are
+ *    not materialised in memory. Instead of slicing the whole @p data, only the requested block
+ *    is written by the @p producer directly into the @p response, so that every request costs
+ *    O(block size) rather than O(representation size).
+ * 
+ *    If the representation is known to fit into the @p response and the @p request does not
+ *    contain Block2 option, it is sent as a whole. Otherwise, the requested block (the first
+ *    one, by default) is sent with Block2 option (and Size2, if @p length is known). If the
+ *    @p length is not known, the end of the representation is detected by the @p producer
+ *    writing less bytes than requested. If the @p request contains Q-Block2 option, it is used
+ *    instead of Block2.
+ * 
+ * @note: @p response PDU must be a clean one, without options and data.
+ *
+ * @param resource:
+ *    the resource the data is associated with.
+ * @param session:
+ *    the coap session.
+ * @param request:
+ *    the requesting pdu (NULL for notifications)
+ * @param response:
+ *    the response pdu.
+ * @param token:
+ *    the token taken from the (original) requesting pdu.
+ * @param media_type:
+ *    the format of the data.
+ * @param maxage:
+ *    the maxmimum life of the data. If -1, then there is no maxage.
+ * @param etag:
+ *    ETag of the representation (may be NULL, as it cannot be computed from the whole data)
+ * @param length:
+ *    the total length of the representation or COAP_BLOCK2_LENGTH_UNKNOWN
+ * @param producer:
+ *    callback writing requested bytes of the representation
+ * @param arg:
+ *    argument passed to the @p producer
+ */
+void coap_add_data_produced_response(
+    struct coap_resource_t *resource,
+    struct coap_session_t *session,
+    coap_pdu_t *request,
+    coap_pdu_t *response,
+    const coap_binary_t *token,
+    uint16_t media_type,
+    int maxage,
+    const coap_binary_t *etag,
+    size_t length,
+    coap_block2_producer_t producer,
+    void *arg
+);
+
 
 /* ---------------------------------------- [Static-inline functions] ----------------------------------------- */
 
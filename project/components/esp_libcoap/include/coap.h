@@ -44,9 +44,11 @@
 #include "libcoap.h"
 
 #include "address.h"
+#include "async.h"
 #include "bits.h"
 #include "block.h"
 #include "coap_io.h"
+#include "coap_tcp.h"
 #include "coap_time.h"
 #include "coap_debug.h"
 #include "encode.h"
@@ -56,8 +58,10 @@
 #include "pdu.h"
 #include "prng.h"
 #include "resource.h"
+#include "shard.h"
 #include "str.h"
 #include "subscribe.h"
 #include "uri.h"
+#include "worker.h"
 
 #endif /* _COAP_H_ */
@@ -42,6 +42,7 @@
 struct coap_packet_t;
 struct coap_session_t;
 struct coap_pdu_t;
+struct coap_context_t;
 
 struct coap_endpoint_t *coap_malloc_endpoint( void );
 void coap_mfree_endpoint( struct coap_endpoint_t *ep );
@@ -61,6 +62,16 @@ void coap_mfree_endpoint( struct coap_endpoint_t *ep );
 #define COAP_RXBUFFER_SIZE 1472
 #endif
 
+/**
+ * @brief: Maximal number of datagrams drained from a single socket after select() reported
+ *    it as readable. The first datagram is read in the regular way and the following ones
+ *    are read with the non-blocking flag until the socket's queue is empty or the limit is
+ *    reached. Setting the value to 1 restores the single-datagram-per-wakeup behaviour.
+ */
+#ifndef COAP_IO_BATCH_SIZE
+#define COAP_IO_BATCH_SIZE 8
+#endif
+
 /**
  * @brief: States assoctaed with CoAP sockets' file descriptors
  */
@@ -76,15 +87,28 @@ void coap_mfree_endpoint( struct coap_endpoint_t *ep );
 #define COAP_SOCKET_BOUND        0x0002  /**< the socket is bound */
 #define COAP_SOCKET_CONNECTED    0x0004  /**< the socket is connected */
 #define COAP_SOCKET_WANT_READ    0x0010  /**< non blocking socket is waiting for reading */
+#define COAP_SOCKET_WANT_WRITE   0x0020  /**< non blocking socket is waiting for writing */
 #define COAP_SOCKET_CAN_READ     0x0100  /**< non blocking socket can now read without blocking */
+#define COAP_SOCKET_READ_MORE    0x0200  /**< socket is being drained; next read must not block */
+#define COAP_SOCKET_REGISTERED   0x0400  /**< socket is observed by the context's I/O backend */
+#define COAP_SOCKET_CAN_WRITE    0x0800  /**< non blocking socket can now write without blocking */
 #define COAP_SOCKET_MULTICAST    0x1000  /**< socket is used for multicast communication */
+#define COAP_SOCKET_REUSE_PORT   0x2000  /**< socket shares its port with other sockets (SO_REUSEPORT) */
 
 /**
- * @brief: Max number of the sockets' file descriptors observed by the select()
- *    call in the coap_run_once()
+ * @brief: Max number of the sockets' file descriptors gathered by the coap_write() for
+ *    applications running their own event loop. coap_run_once() does not use this limit,
+ *    as it waits on all sockets registered in the context's I/O backend.
  */
 #define COAP_MAX_SOCKET_OBSERVED 64
 
+/**
+ * @brief: Number of pending TCP connections queued by the listening socket
+ */
+#ifndef COAP_TCP_LISTEN_BACKLOG
+#define COAP_TCP_LISTEN_BACKLOG 4
+#endif
+
 /* -------------------------------------------- [Data structures] --------------------------------------------- */
 
 /**
@@ -108,8 +132,48 @@ typedef struct coap_socket_t {
     // Socket's state (bit mask)
     coap_socket_flags_t flags;
 
+    // Next socket registered in the context's I/O backend
+    struct coap_socket_t *next;
+
 } coap_socket_t;
 
+/**
+ * @brief: Readiness backend used by coap_run_once() to wait for the context's sockets. Sockets
+ *    are registered in the backend once, when the owning endpoint or session is created, and
+ *    unregistered when it is freed, so that backend can keep its state between calls.
+ * 
+ * @note: The default backend (coap_io_select_backend) keeps a persistent fd_set. Platforms
+ *    providing a scalable readiness API (e.g. epoll) can provide their own implementation.
+ */
+typedef struct coap_io_backend_t {
+
+    // Initializes backend's state for the context (returns 0 on error)
+    int (*init)(struct coap_context_t *context);
+    // Releases backend's state
+    void (*release)(struct coap_context_t *context);
+
+    // Starts observing @p sock (returns 0 on error)
+    int (*add)(struct coap_context_t *context, coap_socket_t *sock);
+    // Stops observing @p sock
+    void (*del)(struct coap_context_t *context, coap_socket_t *sock);
+    // Starts (@p enable is 1) or stops waiting for @p sock to become writable (may be NULL)
+    void (*want_write)(struct coap_context_t *context, coap_socket_t *sock, int enable);
+
+    /**
+     * @brief: Waits at most @p timeout_ms (forever if 0) for registered sockets to become
+     *    readable and marks them with COAP_SOCKET_CAN_READ. Sockets marked with
+     *    COAP_SOCKET_WANT_WRITE (@see want_write) are also waited for to become writable and
+     *    are marked with COAP_SOCKET_CAN_WRITE. Returns number of ready sockets or -1 on error.
+     */
+    int (*wait)(struct coap_context_t *context, unsigned int timeout_ms);
+
+} coap_io_backend_t;
+
+/**
+ * @brief: Default, select()-based I/O backend
+ */
+extern const coap_io_backend_t coap_io_select_backend;
+
 /**
  * @brief: Represenation of the generic CoAP packet
  */
@@ -194,6 +258,169 @@ coap_socket_bind_udp(
     coap_address_t *bound_addr 
 );
 
+/**
+ * @brief: Creates and configures system TCP socket and associates it with @p sock structure.
+ *    Binds the socket with @p listen_addr and starts listening for incoming connections.
+ *    Actual address assigned by the system is copied to the @p bound_addr.
+ * 
+ * @param sock:
+ *     CoAP-specific to be configured
+ * @param listen_addr:
+ *     address that socket will be listening on
+ * @param bound_addr [out]:
+ *     actual address assigned to the socket by the system
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+int
+coap_socket_bind_tcp(
+    coap_socket_t *sock,
+    const coap_address_t *listen_addr,
+    coap_address_t *bound_addr 
+);
+
+/**
+ * @brief: Accepts the connection pending on the listening @p server socket and associates
+ *    it with the @p new_client structure. Accepted socket is configured to the non-blocking
+ *    mode.
+ * 
+ * @param server:
+ *    listening socket
+ * @param new_client [out]:
+ *    socket of the accepted connection
+ * @param local_addr [out]:
+ *    local address of the connection
+ * @param remote_addr [out]:
+ *    address of the peer
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+int
+coap_socket_accept_tcp(
+    coap_socket_t *server,
+    coap_socket_t *new_client,
+    coap_address_t *local_addr,
+    coap_address_t *remote_addr
+);
+
+/**
+ * @brief: Creates system TCP socket, associates it with @p sock structure and connects it
+ *    with the @p server. If @p local_if address is given, socket is bound with this address
+ *    before connecting. Connected socket is configured to the non-blocking mode.
+ * 
+ * @param sock:
+ *    CoAP-specific to be configured
+ * @param local_if:
+ *    address to bind() with the @p sock
+ * @param server:
+ *    address of the server that socket will be connected with
+ * @param default_port:
+ *    default destination port set for the server's address if @p server's current
+ *    port is set to 0
+ * @param local_addr [out]:
+ *    actual socket (address + port) assigned to the @p sock
+ * @param remote_addr [out]:
+ *    actual destination socket (address + port) that the @p socket has been connected with
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+int
+coap_socket_connect_tcp(
+    coap_socket_t *sock,
+    const coap_address_t *local_if,
+    const coap_address_t *server,
+    int default_port,
+    coap_address_t *local_addr,
+    coap_address_t *remote_addr
+);
+
+/**
+ * @brief: Reads up to @p data_len bytes from the connected stream socket without blocking
+ * 
+ * @param sock:
+ *    socket to read from
+ * @param data [out]:
+ *    buffer to read to
+ * @param data_len:
+ *    size of the @p data buffer
+ * @returns:
+ *    number of bytes read on success
+ *    0 if no data is available at the moment
+ *    -1 on error or when the connection has been closed by the peer
+ */
+ssize_t coap_socket_read(
+    coap_socket_t *sock,
+    uint8_t *data,
+    size_t data_len
+);
+
+/**
+ * @brief: Writes up to @p data_len bytes to the connected stream socket without blocking
+ * 
+ * @param sock:
+ *    socket to write to
+ * @param data:
+ *    data to be written
+ * @param data_len:
+ *    length of the @p data
+ * @returns:
+ *    number of bytes written on success (0 if socket's buffer is full at the moment)
+ *    -1 on error
+ */
+ssize_t coap_socket_write(
+    coap_socket_t *sock,
+    const uint8_t *data,
+    size_t data_len
+);
+
+/**
+ * @brief: Registers @p sock in the I/O backend of the @p context so that coap_run_once()
+ *    waits for the data incoming to the socket.
+ * 
+ * @param context:
+ *    context to register socket in
+ * @param sock:
+ *    socket to be registered
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+int coap_socket_register(
+    struct coap_context_t *context,
+    coap_socket_t *sock
+);
+
+/**
+ * @brief: Removes @p sock from the I/O backend of the @p context. Does nothing if @p sock
+ *    was not registered.
+ * 
+ * @param context:
+ *    context that socket was registered in
+ * @param sock:
+ *    socket to be unregistered
+ */
+void coap_socket_unregister(
+    struct coap_context_t *context,
+    coap_socket_t *sock
+);
+
+/**
+ * @brief: Marks @p sock with COAP_SOCKET_WANT_WRITE (if @p enable is 1) or clears the flag and
+ *    lets the I/O backend of the @p context know, so that the socket is waited for to become
+ *    writable only while it has pending output.
+ * 
+ * @param context:
+ *    context that socket is registered in
+ * @param sock:
+ *    socket to be updated
+ * @param enable:
+ *    1 if socket has pending output, 0 otherwise
+ */
+void coap_socket_want_write(
+    struct coap_context_t *context,
+    coap_socket_t *sock,
+    int enable
+);
+
 /**
  * @brief: Closes system socket associated with @p sock. Does nothing if @p sock is not associated
  *    with any system socket.
@@ -203,6 +430,37 @@ coap_socket_bind_udp(
  */
 void coap_socket_close(coap_socket_t *sock);
 
+/**
+ * @brief: Opens the loopback UDP socket connected to itself. Writing a byte to it (from any
+ *    thread) wakes up the loop waiting for the socket in coap_run_once(). It replaces
+ *    the self-pipe (lwIP provides neither pipes nor eventfd).
+ *
+ * @param sock:
+ *    socket to be opened (it's to be registered in the context by the caller)
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+int coap_socket_wakeup_open(coap_socket_t *sock);
+
+/**
+ * @brief: Wakes up the loop waiting for the @p sock opened with coap_socket_wakeup_open().
+ *    Function can be called from any thread.
+ *
+ * @param sock:
+ *    wake-up socket
+ */
+void coap_socket_wakeup(coap_socket_t *sock);
+
+/**
+ * @brief: Discards wake-ups received by the @p sock opened with coap_socket_wakeup_open(),
+ *    if it has been marked as readable
+ *
+ * @param sock:
+ *    wake-up socket
+ */
+void coap_socket_wakeup_drain(coap_socket_t *sock);
+
 
 /**
  * @brief: Sends data to the remote address associated with @p session. Uses system socket associated
@@ -261,8 +519,14 @@ ssize_t coap_network_send(
  *    Received packet metadata and payload. src and dst should be preset.
  * @returns:
  *    the number of bytes received on success
+ *    0 when @p sock is marked with COAP_SOCKET_READ_MORE and no more datagrams are queued
  *    -2 when previously connected address to read from is unreachable
  *    -1 on other error (also when address is unreachable, but it was not connected previously)
+ * 
+ * @note: When @p sock is marked with COAP_SOCKET_READ_MORE flag, the function is called to
+ *    drain the socket after the first datagram of the batch has been read. In such a case
+ *    the read is performed in the non-blocking mode. Custom network_read() handlers should
+ *    follow the same rule.
  */
 ssize_t coap_network_read(
     coap_socket_t *sock,
@@ -37,11 +37,15 @@
 
 #include "coap_io.h"
 #include "coap_time.h"
+#include "dedup.h"
 #include "pdu.h"
+#include "uthash.h"
 
 struct coap_endpoint_t;
 struct coap_context_t;
 struct coap_queue_t;
+struct coap_subscription_t;
+struct coap_tcp_state_t;
 
 typedef struct coap_fixed_point_t coap_fixed_point_t;
 
@@ -61,6 +65,18 @@ typedef struct coap_fixed_point_t coap_fixed_point_t;
 #define COAP_SESSION_TYPE_SERVER 2  // Server-side session
 
 
+/**
+ * @brief: possible values of @t coap_proto_t type
+ */
+#define COAP_PROTO_UDP 1  // Datagram transport (RFC 7252)
+#define COAP_PROTO_TCP 2  // Reliable, stream transport (RFC 8323)
+
+/**
+ * @brief: Checks whether messages are carried by a reliable transport, i.e. without message
+ *    types, IDs, ACKs and retransmissions
+ */
+#define COAP_PROTO_RELIABLE(proto) ((proto) == COAP_PROTO_TCP)
+
 /**
  * @brief: possible values of @t coap_session_state_t type
  */
@@ -117,6 +133,29 @@ typedef uint8_t coap_session_type_t;
  */
 typedef uint8_t coap_session_state_t;
 
+/**
+ * @brief: Transport protocol of the CoAP session / endpoint
+ */
+typedef uint8_t coap_proto_t;
+
+
+/**
+ * @brief: Key identifying server session within the endpoint. It's a canonical (i.e. padding-free
+ *    and zero-filled) form of the (local, remote) addresses pair, so that it can be compared
+ *    byte-wise by the hash table.
+ */
+typedef struct coap_session_key_t {
+
+    // Addresses' family
+    uint16_t family;
+    // Local and remote ports (network byte order)
+    uint16_t local_port;
+    uint16_t remote_port;
+    // Local and remote IP addresses (IPv4 addresses occupy first 4 bytes)
+    uint8_t local_ip[16];
+    uint8_t remote_ip[16];
+
+} coap_session_key_t;
 
 /**
  * @brief: Structure describing abstraction of the CoAP-level client-server session
@@ -136,6 +175,8 @@ typedef struct coap_session_t {
 
     // Session's type ( @see @t coap_session_type_t)
     coap_session_type_t type;
+    // Session's transport protocol ( @see @t coap_proto_t)
+    coap_proto_t proto;
     // Session's state (@see coap_session_state_t)
     coap_session_state_t state;
     // Count of refferences to the session from message queues
@@ -162,6 +203,19 @@ typedef struct coap_session_t {
     coap_socket_t sock;
     // Session's endpoint [?]
     struct coap_endpoint_t *endpoint;
+    // State of the TCP connection (framing buffers, peer's capabilities); NULL for UDP sessions
+    struct coap_tcp_state_t *tcp;
+
+    // Key of the session in the endpoint's sessions index (server sessions only)
+    coap_session_key_t key;
+    // Handle of the endpoint's sessions index
+    UT_hash_handle hh;
+
+    // Neighbours on the endpoint's list of idle sessions
+    struct coap_session_t *idle_prev;
+    struct coap_session_t *idle_next;
+    // Set when session is on the endpoint's list of idle sessions
+    uint8_t idle;
 
     /* -------------------------- Messages' info --------------------------------- */
 
@@ -173,6 +227,9 @@ typedef struct coap_session_t {
     // List of delayed messages waiting to be sent (only the CON messages can be delayed)
     struct coap_queue_t *delayqueue;
 
+    // List of subscriptions made by the session's peer
+    struct coap_subscription_t *subscriptions;
+
     // Session's timestamps
     coap_tick_t last_rx_tx;
     coap_tick_t last_tx_rst;
@@ -202,6 +259,9 @@ typedef struct coap_endpoint_t {
     // Endpoint's context
     struct coap_context_t *context; 
 
+    // Endpoint's transport protocol ( @see @t coap_proto_t)
+    coap_proto_t proto;
+
     // Default mtu for this interface
     uint16_t default_mtu;
     
@@ -212,6 +272,20 @@ typedef struct coap_endpoint_t {
 
     // list of active sessions
     coap_session_t *sessions;
+    // Index of sessions hashed by (local, remote) address pair
+    coap_session_t *sessions_index;
+
+    /**
+     * @brief: List of idle sessions, i.e. server sessions that are not referenced and have
+     *    no delayed messages. Sessions are appended to the list when they become idle or
+     *    receive a message, so that the head of the list is the least recently used one.
+     */
+    coap_session_t *idle_sessions;
+    // Number of sessions on the idle_sessions list
+    unsigned int num_idle;
+
+    // ACKs sent in reply to CON requests (used to answer duplicated requests)
+    coap_dedup_cache_t dedup;
 
 } coap_endpoint_t;
 
@@ -322,6 +396,27 @@ coap_session_t *coap_new_client_session(
     const coap_address_t *server
 );
 
+/**
+ * @brief: Creates a new client session connected to the designated server over TCP (RFC 8323).
+ *    Capabilities and Settings Message is sent to the server as soon as the connection is
+ *    established.
+ *
+ * @param ctx:
+ *    the CoAP context.
+ * @param local_if:
+ *    address of local interface. It is recommended to use NULL to let the operating 
+ *    system choose a suitable local interface.
+ * @param server:
+ *    the server's address. If the port number is zero, the default port will be used.
+ * @returns:
+ *    a new CoAP session or NULL if failed. Call coap_session_release to free.
+ */
+coap_session_t *coap_new_client_session_tcp(
+    struct coap_context_t *ctx,
+    const coap_address_t *local_if,
+    const coap_address_t *server
+);
+
 /**
  * @brief: Function interface for datagram data transmission. This function returns the
  *    number of bytes that have been transmitted, or a value less than zero on error.
@@ -363,7 +458,7 @@ ssize_t coap_session_send_pdu(
  * @param session:
  *   the CoAP session.
  * @returns:
- *   description string.
+ *   description string (held in the calling thread's buffer, valid until the thread's next call).
  */
 const char *coap_session_str(const coap_session_t *session);
 
@@ -409,6 +504,23 @@ coap_endpoint_t *coap_new_endpoint(
     const coap_address_t *listen_addr
 );
 
+/**
+ * @brief: Create a new endpoint accepting CoAP over TCP connections (RFC 8323). Every accepted
+ *    connection is handled by a separate server session owning the connection's socket.
+ * 
+ * @param context:
+ *    the coap context that will own the new endpoint
+ * @param listen_addr:
+ *    address the endpoint will listen for incoming connections on
+ * @returns:
+ *    created endpoint on success
+ *    NULL on failure
+ */
+coap_endpoint_t *coap_new_endpoint_tcp(
+    struct coap_context_t *context,
+    const coap_address_t *listen_addr
+);
+
 /**
  * @brief: Set the endpoint's default MTU. This is the maximum message size that can be
  *    sent, excluding IP and UDP overhead.
@@ -438,7 +550,7 @@ void coap_free_endpoint(coap_endpoint_t *ep);
  * @param endpoint:
  *    the CoAP endpoint.
  * @returns:
- *    description string.
+ *    description string (held in the calling thread's buffer, valid until the thread's next call).
  */
 const char *coap_endpoint_str(const coap_endpoint_t *endpoint);
 
@@ -461,6 +573,34 @@ coap_session_t *coap_endpoint_get_session(
     coap_tick_t now
 );
 
+/**
+ * @brief: Accepts the connection pending on the TCP @p endpoint and creates a new server
+ *    session for it.
+ *
+ * @param endpoint:
+ *    TCP endpoint whose socket is ready to accept a connection
+ * @param now:
+ *    the current time in ticks.
+ * @returns:
+ *    the CoAP session on success
+ *    NULL on failure
+ */
+coap_session_t *coap_endpoint_accept_session(
+    coap_endpoint_t *endpoint,
+    coap_tick_t now
+);
+
+/**
+ * @brief: Updates RX/TX timestamp of the @p session. If the session is idle, it becomes the
+ *    most recently used session on the endpoint's idle list.
+ *
+ * @param session:
+ *    the CoAP session
+ * @param now:
+ *    the current time in ticks.
+ */
+void coap_session_touch(coap_session_t *session, coap_tick_t now);
+
 /**
  * @brief: Releases resources allocated by the library fo the session
  * 
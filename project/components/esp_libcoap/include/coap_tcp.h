@@ -0,0 +1,187 @@
+/* ============================================================================================================
+ *  File: coap_tcp.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      CoAP over TCP (RFC 8323): messages' framing, signaling messages (CSM, Ping, Pong, Release,
+ *      Abort) and BERT support for sessions using the reliable transport
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_TCP_H_
+#define COAP_TCP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libcoap.h"
+#include "coap_session.h"
+#include "coap_time.h"
+#include "pdu.h"
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal size of the message (header included) accepted over TCP. It's announced to
+ *    the peer in the CSM message and determines size of the session's framing buffers. Value
+ *    must not exceed 65804, so that the header never takes more than COAP_HEADER_SIZE bytes.
+ *
+ * @note: BERT blocks carry more than a single 1024-byte block only if both peers accept
+ *    messages larger than 2 KiB.
+ */
+#ifndef COAP_TCP_MAX_MESSAGE_SIZE
+#define COAP_TCP_MAX_MESSAGE_SIZE 1152
+#endif
+
+/**
+ * @brief: Max-Message-Size assumed for the peer until its CSM message is received
+ *    (RFC 8323, section 5.3.1)
+ */
+#define COAP_TCP_DEFAULT_MAX_MESSAGE_SIZE 1152
+
+/**
+ * @brief: Maximal size of the message's header (Len/TKL byte, up to 4 bytes of the extended
+ *    length and the code)
+ */
+#define COAP_TCP_MAX_HEADER_SIZE 6
+
+// Signaling codes (RFC 8323, section 5)
+#define COAP_SIGNALING_CSM     COAP_RESPONSE_CODE(701)  /* 7.01 Capabilities and Settings Message */
+#define COAP_SIGNALING_PING    COAP_RESPONSE_CODE(702)  /* 7.02 Ping                              */
+#define COAP_SIGNALING_PONG    COAP_RESPONSE_CODE(703)  /* 7.03 Pong                              */
+#define COAP_SIGNALING_RELEASE COAP_RESPONSE_CODE(704)  /* 7.04 Release                           */
+#define COAP_SIGNALING_ABORT   COAP_RESPONSE_CODE(705)  /* 7.05 Abort                             */
+
+// Signaling options (numbers are specific to the signaling code)
+#define COAP_SIGNALING_OPTION_MAX_MESSAGE_SIZE    2  /* CSM     */
+#define COAP_SIGNALING_OPTION_BLOCK_WISE_TRANSFER 4  /* CSM     */
+#define COAP_SIGNALING_OPTION_CUSTODY             2  /* Ping    */
+#define COAP_SIGNALING_OPTION_BAD_CSM_OPTION      2  /* Abort   */
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: State of the TCP connection kept by the session. Buffers are allocated together with
+ *    the session, so that partial reads and writes are handled without per-message allocations.
+ */
+typedef struct coap_tcp_state_t {
+
+    // Peer's Max-Message-Size
+    size_t peer_max_message_size;
+    // Set when the peer's CSM message has been received
+    uint8_t csm_received;
+    // Set when the peer accepts BERT blocks
+    uint8_t bert;
+    // Set when writing to the socket failed (connection is closed by the read path)
+    uint8_t failed;
+
+    // Number of received bytes kept in the rx_buffer (after the headroom)
+    size_t rx_length;
+    /**
+     * @brief: Bytes received from the stream. Messages are parsed in place. COAP_HEADER_SIZE
+     *    bytes of headroom let the header of the first message be rewritten (to the form
+     *    expected by the PDU's parser) in front of the message's token.
+     */
+    uint8_t rx_buffer[COAP_HEADER_SIZE + COAP_TCP_MAX_MESSAGE_SIZE];
+
+    // Number of bytes waiting in the tx_buffer
+    size_t tx_length;
+    // Framed messages that have not been written to the socket yet
+    uint8_t tx_buffer[COAP_TCP_MAX_MESSAGE_SIZE];
+
+} coap_tcp_state_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Allocates the TCP state of the connected @p session and sends the CSM message
+ *    to the peer.
+ *
+ * @param session:
+ *    session to initialize
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+int coap_tcp_session_init(coap_session_t *session);
+
+/**
+ * @brief: Releases the TCP state of the @p session
+ *
+ * @param session:
+ *    session to be released
+ */
+void coap_tcp_session_free(coap_session_t *session);
+
+/**
+ * @brief: Reads data available on the @p session's socket and dispatches all complete messages.
+ *    Incomplete message is kept in the session's buffer until the rest of it arrives. Session
+ *    is disconnected when the peer closes the connection or violates the protocol.
+ *
+ * @param session:
+ *    session to read from
+ * @param now:
+ *    timestamp for the session's RX/TX
+ */
+void coap_tcp_read(coap_session_t *session, coap_tick_t now);
+
+/**
+ * @brief: Frames the @p pdu and writes it to the @p session's socket. Bytes that socket
+ *    cannot accept at the moment are kept in the session's buffer and written by
+ *    coap_tcp_flush() when socket becomes writable.
+ *
+ * @param session:
+ *    session to send with
+ * @param pdu:
+ *    pdu to be sent
+ * @returns:
+ *    length of the framed message on success
+ *    -1 if the session is not connected or its buffer cannot hold the message
+ */
+ssize_t coap_tcp_send_pdu(coap_session_t *session, coap_pdu_t *pdu);
+
+/**
+ * @brief: Writes bytes kept in the @p session's buffer to its socket
+ *
+ * @param session:
+ *    session to flush
+ */
+void coap_tcp_flush(coap_session_t *session);
+
+/**
+ * @brief: Handles signaling message (code 7.xx) received by the @p session
+ *
+ * @param session:
+ *    session that received the message
+ * @param pdu:
+ *    received message
+ */
+void coap_tcp_handle_signaling(coap_session_t *session, coap_pdu_t *pdu);
+
+/**
+ * @brief: Sends the Ping signaling message. Peer answers with the Pong message.
+ *
+ * @param session:
+ *    session to send with
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+int coap_tcp_ping(coap_session_t *session);
+
+/**
+ * @param session:
+ *    session to be checked
+ * @returns:
+ *    non-zero if BERT blocks (SZX 7) can be exchanged within the @p session, i.e. the session uses
+ *    TCP and the peer announced support for them in the CSM message
+ */
+COAP_STATIC_INLINE int coap_tcp_bert(const coap_session_t *session) {
+    return COAP_PROTO_RELIABLE(session->proto) && session->tcp && session->tcp->bert;
+}
+
+#endif /* COAP_TCP_H_ */
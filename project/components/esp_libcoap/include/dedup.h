@@ -0,0 +1,172 @@
+/* ============================================================================================================
+ *  File: dedup.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Per-endpoint cache of the ACKs sent in reply to CON requests, used to answer retransmitted
+ *      (duplicated) requests without handling them again (RFC 7252, section 4.5)
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_DEDUP_H_
+#define COAP_DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libcoap.h"
+#include "coap_time.h"
+#include "pdu.h"
+#include "uthash.h"
+
+struct coap_session_t;
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of ACKs cached by a single endpoint
+ */
+#ifndef COAP_DEDUP_MAX_ENTRIES
+#define COAP_DEDUP_MAX_ENTRIES 8
+#endif
+
+/**
+ * @brief: Maximal number of bytes of ACKs (header included) cached by a single endpoint.
+ *    Larger ACKs are not cached at all.
+ */
+#ifndef COAP_DEDUP_MAX_BYTES
+#define COAP_DEDUP_MAX_BYTES 1024
+#endif
+
+/**
+ * @brief: Time (in seconds) after which cached ACK expires. It defaults to the EXCHANGE_LIFETIME
+ *    computed for the default transmission parameters.
+ */
+#ifndef COAP_DEDUP_LIFETIME
+#define COAP_DEDUP_LIFETIME 247
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Cached ACK
+ */
+typedef struct coap_dedup_entry_t {
+
+    // Values used to create the cache's LRU list
+    struct coap_dedup_entry_t *prev;
+    struct coap_dedup_entry_t *next;
+
+    /**
+     * @note: @a session and @a mid fields form the key of the cache's index
+     *    (@see COAP_DEDUP_KEY_SIZE); they must be kept adjacent.
+     */
+
+    // Session that the request was received from
+    struct coap_session_t *session;
+    // Message ID of the request (and the ACK)
+    uint16_t mid;
+
+    // Absolute time (in ticks) of the entry's expiration
+    coap_tick_t expires;
+
+    // Handle of the cache's index
+    UT_hash_handle hh;
+
+    // Serialized ACK (header included)
+    size_t length;
+    uint8_t data[];
+
+} coap_dedup_entry_t;
+
+/**
+ * @brief: Size of the (session, mid) key used to index cached ACKs
+ */
+#define COAP_DEDUP_KEY_SIZE \
+    (offsetof(coap_dedup_entry_t, mid) + sizeof(uint16_t) - offsetof(coap_dedup_entry_t, session))
+
+/**
+ * @brief: Cache of the ACKs sent by the endpoint
+ */
+typedef struct coap_dedup_cache_t {
+
+    // Index of entries keyed by (session, mid)
+    coap_dedup_entry_t *index;
+    // List of entries (the head is the least recently used one)
+    coap_dedup_entry_t *lru;
+
+    // Number of cached entries
+    size_t num;
+    // Number of bytes of the cached ACKs
+    size_t bytes;
+
+} coap_dedup_cache_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Looks for the ACK sent in reply to the request with @p mid received from the
+ *    @p session. Expired entry is removed.
+ *
+ * @param cache:
+ *    cache to look in
+ * @param session:
+ *    session that the request was received from
+ * @param mid:
+ *    message ID of the request
+ * @param now:
+ *    current time
+ * @returns:
+ *    cached entry on success
+ *    NULL if the ACK is not cached
+ */
+const coap_dedup_entry_t *coap_dedup_find(
+    coap_dedup_cache_t *cache,
+    struct coap_session_t *session,
+    uint16_t mid,
+    coap_tick_t now
+);
+
+/**
+ * @brief: Stores serialized @p ack in the @p cache. The least recently used entries are evicted
+ *    if the cache is full.
+ *
+ * @param cache:
+ *    cache to store the ACK in
+ * @param session:
+ *    session that the ACK is sent with
+ * @param ack:
+ *    ACK whose header has already been encoded
+ * @param now:
+ *    current time
+ */
+void coap_dedup_store(
+    coap_dedup_cache_t *cache,
+    struct coap_session_t *session,
+    const coap_pdu_t *ack,
+    coap_tick_t now
+);
+
+/**
+ * @brief: Removes all entries related to the @p session
+ *
+ * @param cache:
+ *    cache to remove entries from
+ * @param session:
+ *    session being freed
+ */
+void coap_dedup_remove_session(coap_dedup_cache_t *cache, struct coap_session_t *session);
+
+/**
+ * @brief: Removes all entries from the @p cache
+ *
+ * @param cache:
+ *    cache to be cleared
+ */
+void coap_dedup_clear(coap_dedup_cache_t *cache);
+
+#endif /* COAP_DEDUP_H_ */
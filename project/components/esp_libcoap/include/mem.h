@@ -35,10 +35,133 @@
 #ifndef COAP_MEM_H_
 #define COAP_MEM_H_
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <libcoap.h>
 
 
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Capacities (number of blocks) of the pools serving fixed-size objects. Pools are allocated
+ *    statically, so that the most frequent allocations on the message path do not touch the heap.
+ *    When a pool is exhausted (or it's capacity is set to 0) the allocation falls back to
+ *    coap_malloc().
+ */
+#ifndef COAP_MEMPOOL_PDU_NUM
+#define COAP_MEMPOOL_PDU_NUM 8
+#endif
+
+#ifndef COAP_MEMPOOL_NODE_NUM
+#define COAP_MEMPOOL_NODE_NUM 8
+#endif
+
+#ifndef COAP_MEMPOOL_SESSION_NUM
+#define COAP_MEMPOOL_SESSION_NUM 4
+#endif
+
+/**
+ * @brief: Size classes of the PDUs' buffers. Sizes do not include the CoAP header, so that
+ *    they can be directly compared with the @a alloc_size of the PDU. The biggest class
+ *    can hold a PDU of the default MTU size.
+ */
+#ifndef COAP_MEMPOOL_BUF_SMALL_SIZE
+#define COAP_MEMPOOL_BUF_SMALL_SIZE 64
+#endif
+
+#ifndef COAP_MEMPOOL_BUF_MEDIUM_SIZE
+#define COAP_MEMPOOL_BUF_MEDIUM_SIZE 256
+#endif
+
+#ifndef COAP_MEMPOOL_BUF_MTU_SIZE
+#define COAP_MEMPOOL_BUF_MTU_SIZE COAP_DEFAULT_MTU
+#endif
+
+/**
+ * @brief: Capacities of the PDUs' buffers pools
+ */
+#ifndef COAP_MEMPOOL_BUF_SMALL_NUM
+#define COAP_MEMPOOL_BUF_SMALL_NUM 8
+#endif
+
+#ifndef COAP_MEMPOOL_BUF_MEDIUM_NUM
+#define COAP_MEMPOOL_BUF_MEDIUM_NUM 4
+#endif
+
+#ifndef COAP_MEMPOOL_BUF_MTU_NUM
+#define COAP_MEMPOOL_BUF_MTU_NUM 2
+#endif
+
+/**
+ * @brief: Size of the context's per-request arena. Requests needing more scratch memory
+ *    get it from the heap (it is still released with the arena's reset).
+ */
+#ifndef COAP_ARENA_SIZE
+#define COAP_ARENA_SIZE 256
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Types of objects allocated with coap_malloc_type()
+ */
+typedef enum coap_memory_tag_t {
+    COAP_PDU,
+    COAP_PDU_BUF,
+    COAP_NODE,
+    COAP_SESSION
+} coap_memory_tag_t;
+
+/**
+ * @brief: Identifiers of the memory pools
+ */
+typedef enum coap_memory_pool_t {
+    COAP_POOL_PDU,
+    COAP_POOL_BUF_SMALL,
+    COAP_POOL_BUF_MEDIUM,
+    COAP_POOL_BUF_MTU,
+    COAP_POOL_NODE,
+    COAP_POOL_SESSION,
+    COAP_POOL_NUM
+} coap_memory_pool_t;
+
+/**
+ * @brief: Usage statistics of the memory pool
+ */
+typedef struct coap_memory_stats_t {
+
+    // Size of the pool's block
+    size_t block_size;
+    // Number of blocks in the pool
+    size_t capacity;
+
+    // Number of blocks currently in use
+    size_t used;
+    // Maximal number of blocks used at the same time
+    size_t high_water;
+    // Number of allocations that had to fall back to the heap
+    size_t fallbacks;
+
+} coap_memory_stats_t;
+
+/**
+ * @brief: Bump-pointer arena for transient allocations. Objects are not freed one-by-one;
+ *    all of them are released at once with coap_arena_reset().
+ */
+typedef struct coap_arena_t {
+
+    // Arena's buffer (allocated with the first allocation)
+    uint8_t *buf;
+    // Number of bytes of the @a buf in use
+    size_t used;
+
+    // List of heap blocks allocated when the @a buf was exhausted
+    struct coap_arena_chunk_t *overflow;
+
+} coap_arena_t;
+
+
 /* ---------------------------------------- [Static-inline functions] ----------------------------------------- */
 
 /**
@@ -57,4 +180,101 @@ coap_free(void *object) {
     free(object);
 }
 
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Allocates @p size bytes for the object of the @p type. Memory is taken from the
+ *    smallest pool serving the @p type that can fit @p size bytes. If there is no such pool
+ *    or the pool is exhausted, memory is allocated on the heap.
+ * 
+ * @param type:
+ *    type of the object
+ * @param size:
+ *    number of bytes to allocate
+ * @returns:
+ *    pointer to the allocated memory on success
+ *    NULL on failure
+ * 
+ * @note: After coap_memory_set_shared() has been called (by coap_shards_start() or
+ *    coap_workers_start()) objects are allocated on the heap and pools only take back blocks
+ *    handed out before. Otherwise, the library is expected to run in a single thread.
+ */
+void *coap_malloc_type(coap_memory_tag_t type, size_t size);
+
+/**
+ * @brief: Changes size of the @p object allocated with coap_malloc_type() to @p size bytes.
+ *    If block holding the @p object is big enough, it is returned without copying. 
+ * 
+ * @param type:
+ *    type of the object
+ * @param object:
+ *    object to be resized (may be NULL)
+ * @param size:
+ *    desired number of bytes
+ * @returns:
+ *    pointer to the resized object on success (old pointer must not be used anymore)
+ *    NULL on failure (@p object is left intact)
+ */
+void *coap_realloc_type(coap_memory_tag_t type, void *object, size_t size);
+
+/**
+ * @brief: Frees @p object allocated with coap_malloc_type(). Does nothing if @p object is NULL.
+ * 
+ * @param type:
+ *    type of the object (the same as passed to coap_malloc_type())
+ * @param object:
+ *    object to be freed
+ */
+void coap_free_type(coap_memory_tag_t type, void *object);
+
+/**
+ * @brief: Reads usage statistics of the @p pool
+ * 
+ * @param pool:
+ *    pool to read statistics of
+ * @param stats [out]:
+ *    statistics of the @p pool
+ */
+void coap_memory_stats(coap_memory_pool_t pool, coap_memory_stats_t *stats);
+
+/**
+ * @brief: Makes allocations safe for contexts running in different threads. Pools are sized
+ *    for a single context, so from then on new objects are allocated on the heap and pools
+ *    only take back (under the lock) blocks handed out before. Called by coap_shards_start()
+ *    and coap_workers_start().
+ */
+void coap_memory_set_shared(void);
+
+/**
+ * @brief: Allocates @p size bytes from the @p arena. If the arena's buffer is exhausted,
+ *    memory is taken from the heap and tracked by the arena.
+ * 
+ * @param arena:
+ *    arena to allocate from
+ * @param size:
+ *    number of bytes to allocate
+ * @returns:
+ *    pointer to the allocated memory on success (valid until the next coap_arena_reset())
+ *    NULL on failure
+ */
+void *coap_arena_alloc(coap_arena_t *arena, size_t size);
+
+/**
+ * @brief: Releases all objects allocated from the @p arena. Arena's buffer is kept for
+ *    the later use.
+ * 
+ * @param arena:
+ *    arena to be reset
+ */
+void coap_arena_reset(coap_arena_t *arena);
+
+/**
+ * @brief: Releases all objects allocated from the @p arena and the arena's buffer
+ * 
+ * @param arena:
+ *    arena to be released
+ */
+void coap_arena_release(coap_arena_t *arena);
+
 #endif /* COAP_MEM_H_ */
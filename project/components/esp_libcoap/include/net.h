@@ -43,10 +43,14 @@
 
 #include "coap_io.h"
 #include "coap_time.h"
+#include "mem.h"
 #include "option.h"
 #include "pdu.h"
 #include "prng.h"
+#include "route.h"
+#include "timer_heap.h"
 #include "coap_session.h"
+#include "uthash.h"
 
 struct coap_queue_t;
 struct coap_resource_t;
@@ -60,6 +64,14 @@ struct coap_context_t;
  */
 #define MAX_RST_FREQ 4
 
+/**
+ * @brief: Number of /.well-known/core renderings (one per distinct query filter) cached
+ *    by the context
+ */
+#ifndef COAP_WKC_CACHE_SIZE
+#define COAP_WKC_CACHE_SIZE 4
+#endif
+
 /**
  * @brief: Structure descibing a node of a queue holding informations about
  *    CoAP packets to be send.
@@ -69,6 +81,11 @@ typedef struct coap_queue_t {
     // Value used to form a forward-list
     struct coap_queue_t *next;
 
+    /**
+     * @note: @a session and @a id fields form the key of the context's sendqueue index
+     *    (@see COAP_QUEUE_KEY_SIZE); they must be kept adjacent.
+     */
+
     // The CoAP session associated with the packet
     coap_session_t *session;      
 
@@ -80,15 +97,28 @@ typedef struct coap_queue_t {
 
     /* -------------------------- Time-related informations -------------------------- */
 
-    // Description of when to send PDU for the next time
+    // Absolute time (in ticks) of the next PDU's (re)transmission when the node is in the sendqueue
     coap_tick_t t;
     // Retransmission counter (node and it's PDU will be removed when reaches zero)
     unsigned char retransmit_cnt;
     // The randomized timeout value
     unsigned int timeout;
 
+    /* ------------------------------ Sendqueue's data ------------------------------- */
+
+    // Position of the node in the sendqueue's heap plus 1 (0 when node is not in the sendqueue)
+    size_t heap_index;
+    // Handle of the sendqueue's (session, id) index
+    UT_hash_handle hh;
+
 } coap_queue_t;
 
+/**
+ * @brief: Size of the (session, id) key used to index the sendqueue's nodes
+ */
+#define COAP_QUEUE_KEY_SIZE \
+    (offsetof(coap_queue_t, id) + sizeof(coap_tid_t) - offsetof(coap_queue_t, session))
+
 
 /**
  * @brief: Response handler that is used as call-back in coap_context_t.
@@ -153,6 +183,26 @@ typedef void (*coap_ping_handler_t)(
     const coap_tid_t id
 );
 
+/**
+ * @brief: Cached rendering of the /.well-known/core document for a single query filter
+ */
+typedef struct coap_wkc_cache_t {
+
+    // Version of the context's resources' set that the document was rendered for (0 if entry is empty)
+    unsigned int version;
+
+    // Query filter's length (the filter is stored at the beginning of @a buf)
+    size_t query_length;
+    // Document's length (the document is stored in @a buf after the query filter)
+    size_t length;
+    // Storage of the query filter and the document
+    uint8_t *buf;
+
+    // ETag of the document (hash of it's content)
+    uint8_t etag[4];
+
+} coap_wkc_cache_t;
+
 /**
  * @brief: Structure describing the CoAP stack's global state.
  * 
@@ -170,16 +220,39 @@ typedef struct coap_context_t {
     struct coap_resource_t *resources; 
     // Hash table or list of unknown resources (can be used for handling requests related to unknown resources )
     struct coap_resource_t *unknown_resource; 
-
-    // Queue of of sent packets (waiting for ACK) (retransmisssion queue)
-    coap_queue_t *sendqueue;
-    // Base time for time stamps of packets in a sendqueue
-    coap_tick_t sendqueue_basetime;
-
-    /**
-     * @note: The time stamp in the first element of the sendqeue is relative
-     *    to sendqueue_basetime. 
-     */
+    // List of resources (dirty or partially dirty) whose observers wait for notifications
+    struct coap_resource_t *dirty_resources;
+    // Index of all resources' subscriptions keyed by (session, token)
+    struct coap_subscription_t *observers;
+    // List of Block1 transfers in progress
+    struct coap_block1_transfer_t *block1_transfers;
+    // Number of Block1 transfers in progress
+    size_t num_block1_transfers;
+    // Index of the requests waiting for the separate response keyed by (session, token)
+    struct coap_async_state_t *async_state;
+    // Number of requests waiting for the separate response
+    size_t num_async;
+    // Pool of threads running handlers of resources created with COAP_RESOURCE_FLAGS_WORKER (NULL if not started)
+    struct coap_worker_pool_t *workers;
+
+    // Timers of the subscriptions with conditional attributes (pmin/pmax) ordered by their @a timer
+    coap_timer_heap_t observe_timers;
+    // Tree of the resources registered with templated paths (they are also kept in the @a resources)
+    coap_route_node_t *routes;
+    // Segments captured by the route of the currently handled request
+    coap_route_match_t route_match;
+    // Counter bumped each time the set of resources or their links' description changes
+    unsigned int resources_version;
+
+    // Cached /.well-known/core renderings (valid while their version matches @a resources_version)
+    coap_wkc_cache_t wkc_cache[COAP_WKC_CACHE_SIZE];
+    // Index of the cache's entry to be replaced next
+    unsigned int wkc_cache_next;
+
+    // Queue of of sent packets (waiting for ACK) (retransmisssion queue) ordered by their @a t
+    coap_timer_heap_t sendqueue;
+    // Hash table indexing sendqueue's nodes by the (session, transaction ID) pair
+    coap_queue_t *sendqueue_index;
     
     // The list of endpoints used for listening (for servers)
     coap_endpoint_t *endpoint;
@@ -205,6 +278,16 @@ typedef struct coap_context_t {
     // Network IO routines used by the context
     ssize_t (*network_send)(coap_socket_t *sock, const coap_session_t *session, const uint8_t *data, size_t datalen);
     ssize_t (*network_read)(coap_socket_t *sock, struct coap_packet_t *packet);
+
+    // Readiness backend used by coap_run_once() (Default: coap_io_select_backend)
+    const coap_io_backend_t *io_backend;
+    // List of sockets registered in the backend
+    coap_socket_t *io_sockets;
+    // Backend-specific state
+    void *io_data;
+
+    // Arena holding transient allocations of the currently dispatched message (reset by coap_dispatch())
+    coap_arena_t request_arena;
     
 
     /* ----------------------------- Context's parameters ---------------------------- */
@@ -216,6 +299,8 @@ typedef struct coap_context_t {
     unsigned int session_timeout;        
     // Maximum number of simultaneous unused sessions per endpoint (0 means no maximum)
     unsigned int max_idle_sessions;                    
+    // If non-zero, UDP endpoints are bound with SO_REUSEPORT, so that several contexts can share the port
+    unsigned int reuse_port;
   
 } coap_context_t;
 
@@ -223,15 +308,27 @@ typedef struct coap_context_t {
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
 /**
- * @brief: Adds @p node to given @p queue, ordered by variable t in @p node.
+ * @brief: Adds @p node to the @p context's sendqueue, ordered by variable t in @p node.
+ *    Complexity is O(log n).
  *
- * @param queue:
- *    Queue to add to
+ * @param context:
+ *    Context to add to
  * @param node:
- *    Node entry to add to Queue
+ *    Node entry to add to the sendqueue
  * @return @c 1 added to queue, @c 0 failure.
  */
-int coap_insert_node(coap_queue_t **queue, coap_queue_t *node);
+int coap_sendqueue_insert(coap_context_t *context, coap_queue_t *node);
+
+/**
+ * @brief: Detaches @p node from the @p context's sendqueue. Does nothing if the node is not
+ *    in the sendqueue. Complexity is O(log n).
+ *
+ * @param context:
+ *    Context to remove from
+ * @param node:
+ *    Node entry to be removed
+ */
+void coap_sendqueue_remove(coap_context_t *context, coap_queue_t *node);
 
 /**
  * @brief: Destroys specified @p node.
@@ -261,18 +358,6 @@ void coap_delete_all(coap_queue_t *queue);
  */
 coap_queue_t *coap_new_node(void);
 
-/**
- * @brief: Sets sendqueue_basetime in the given context object @p context to @p now.
- * 
- * @param context:
- *    CoAP context to be adjusted
- * @param now:
- *     current time
- * @returns:
- *    the number of elements in the @pcontext->sendqueue that have timed out.
- */
-unsigned int coap_adjust_basetime(coap_context_t *context, coap_tick_t now);
-
 /**
  * @param context:
  *    context to be checked
@@ -284,7 +369,7 @@ coap_queue_t *coap_peek_next( coap_context_t *context );
 
 /**
  * @param context:
- *    context to adjust basetime for 
+ *    context to pop pdu from
  * @returns:
  *    the next pdu to send and removes it from the sendqeue.
  */
@@ -312,6 +397,19 @@ coap_context_t *coap_new_context(const coap_address_t *listen_addr);
  */
 void coap_free_context(coap_context_t *context);
 
+/**
+ * @brief: Replaces readiness backend used by the coap_run_once() with @p backend. All
+ *    sockets registered in the current backend are moved to the new one.
+ *
+ * @param context:
+ *    The CoAP context
+ * @param backend:
+ *    backend to be used
+ * @returns:
+ *    0 if procedure fails (the previous backend is kept then), 1 otherwise
+ */
+int coap_context_set_io_backend(coap_context_t *context, const coap_io_backend_t *backend);
+
 /**
  * @brief: Stores @p data with the given CoAP context. This function
  *    overwrites any value that has previously been stored with @p
@@ -528,11 +626,12 @@ int coap_handle_dgram(
 );
 
 /**
- * @brief: This function removes the element with given @p id from the given list. If @p id was found,
- *    @p node is updated to point to the removed element. 
+ * @brief: This function removes the element with given @p id and @p session from the 
+ *    @p context's sendqueue. If @p id was found, @p node is updated to point to the removed
+ *    element. Complexity is O(log n).
  * 
- * @param queue:
- *    the queue to search for @p id
+ * @param context:
+ *    the context whose sendqueue should be searched for @p id
  * @param session:
  *    the session to look for
  * @param id:
@@ -549,23 +648,24 @@ int coap_handle_dgram(
  *    coap_delete_node(). 
  */
 int coap_remove_from_queue(
-    coap_queue_t **queue,
+    coap_context_t *context,
     coap_session_t *session,
     coap_tid_t id,
     coap_queue_t **node
 );
 
 /**
- * @brief: Insertes @p node to the retransmit @p session->context->sendqueue queue. Timeout of the packet is
- *    set to the initial value that is relative to the @p session->context->sendqueue_basetime (if sendqueue 
- *    is not empty) or absolute (otherwise). Reference ounter on the @p sessio is incremented.
+ * @brief: Insertes @p node to the retransmit @p session->context->sendqueue queue. Retransmission time
+ *    of the packet is set to the current time increased by the node's timeout. Reference ounter on the
+ *    @p sessio is incremented.
  * 
  * @param session:
  *    session associated with the @p node
  * @param node:
  *    packet node to be retransmitted
  * @return:
- *    transaction ID of the node 
+ *    transaction ID of the node on success
+ *    COAP_INVALID_TID if node could not be queued (it's not freed then)
  */
 coap_tid_t coap_wait_ack(
     coap_session_t *session,
@@ -573,11 +673,11 @@ coap_tid_t coap_wait_ack(
 );
 
 /**
- * @brief: Retrieves transaction related to given @p sesssion OR of the given @p id
- *    from the queue.
+ * @brief: Retrieves transaction related to given @p sesssion and of the given @p id
+ *    from the @p context's sendqueue.
  *
- * @param queue:
- *    the transaction queue to be searched
+ * @param context:
+ *    the context whose sendqueue should be searched
  * @param session:
  *    the session to find
  * @param id:
@@ -588,7 +688,7 @@ coap_tid_t coap_wait_ack(
  *    NULL if not found
  */
 coap_queue_t *coap_find_transaction(
-    coap_queue_t *queue, 
+    coap_context_t *context, 
     coap_session_t *session, 
     coap_tid_t id
 );
@@ -631,6 +731,9 @@ coap_cancel_session_messages(
  *    session associated with the @p pdu
  * @param pdu 
  *    PDU to be dispatched
+ * 
+ * @note: All objects allocated from the context's @a request_arena while dispatching
+ *    the @p pdu are released before the function returns.
  */
 void coap_dispatch(
     coap_session_t *session,
@@ -712,6 +815,29 @@ coap_pdu_t *coap_wellknown_response(
     coap_pdu_t *request
 );
 
+/**
+ * @brief: Completes the @p response produced by the worker pool (@see coap_workers_submit())
+ *    as the loop completes responses of its own handlers: response to GET is cached (if the
+ *    @p resource was created with COAP_RESOURCE_FLAGS_CACHE_RESPONSES) and turned into 2.03
+ *    (Valid) if the request lists its ETag; successful response to other method drops the
+ *    resource's cached responses and ETag.
+ *
+ * @param resource:
+ *    resource that the request targets
+ * @param request:
+ *    the request
+ * @param query:
+ *    request's query (may be NULL)
+ * @param response:
+ *    response filled by the handler
+ */
+void coap_handle_offloaded_response(
+    struct coap_resource_t *resource,
+    coap_pdu_t *request,
+    const struct coap_string_t *query,
+    coap_pdu_t *response
+);
+
 /**
  * @brief: Calculates the initial timeout based on the @p session's CoAP transmission
  *    parameters 'ack_timeout', 'ack_random_factor' and COAP_TICKS_PER_SECOND.
@@ -112,6 +112,8 @@
 #define COAP_OPTION_OBSERVE         6 /* E, empty/uint, 0 B/0-3 B, (none)              (RFC 7641) */
 #define COAP_OPTION_BLOCK2         23 /* C,       uint,    0--3 B, (none)              (RFC 7959) */
 #define COAP_OPTION_BLOCK1         27 /* C,       uint,    0--3 B, (none)              (RFC 7959) */
+#define COAP_OPTION_Q_BLOCK1       19 /* C,       uint,    0--3 B, (none)              (RFC 9177) */
+#define COAP_OPTION_Q_BLOCK2       31 /* C,       uint,    0--3 B, (none)              (RFC 9177) */
 #define COAP_OPTION_NORESPONSE    258 /* N,       uint,    0--1 B,  0                  (RFC 7967) */
 // Synonymous options
 #define COAP_OPTION_CONTENT_TYPE \
@@ -73,6 +73,11 @@ struct coap_session_t;
 #define COAP_DEFAULT_MTU 1152
 #endif
 
+// Size of the buffer initially allocated for a new PDU (grows on demand up to the PDU's max_size)
+#ifndef COAP_PDU_INITIAL_SIZE
+#define COAP_PDU_INITIAL_SIZE 64
+#endif
+
 // 8 MiB max-message-size plus some space for options
 #ifndef COAP_DEFAULT_MAX_PDU_RX_SIZE
 #define COAP_DEFAULT_MAX_PDU_RX_SIZE (8*1024*1024+256)
@@ -123,6 +128,7 @@ struct coap_session_t;
 #define COAP_RESPONSE_203       COAP_RESPONSE_CODE(203)  /* 2.03 Valid                    */
 #define COAP_RESPONSE_204       COAP_RESPONSE_CODE(204)  /* 2.04 Changed                  */
 #define COAP_RESPONSE_205       COAP_RESPONSE_CODE(205)  /* 2.05 Content                  */
+#define COAP_RESPONSE_231       COAP_RESPONSE_CODE(231)  /* 2.31 Continue                 */
 
 #define COAP_RESPONSE_400       COAP_RESPONSE_CODE(400)  /* 4.00 Bad Request              */
 #define COAP_RESPONSE_401       COAP_RESPONSE_CODE(401)  /* 4.01 Unauthorized             */
@@ -131,6 +137,7 @@ struct coap_session_t;
 #define COAP_RESPONSE_404       COAP_RESPONSE_CODE(404)  /* 4.04 Not Found                */
 #define COAP_RESPONSE_405       COAP_RESPONSE_CODE(405)  /* 4.05 Method Not Allowed       */
 #define COAP_RESPONSE_406       COAP_RESPONSE_CODE(400)  /* 4.06 Not Acceptable           */
+#define COAP_RESPONSE_408       COAP_RESPONSE_CODE(408)  /* 4.08 Request Entity Incomplete*/
 #define COAP_RESPONSE_412       COAP_RESPONSE_CODE(412)  /* 4.12 Precondition Failed      */
 #define COAP_RESPONSE_413       COAP_RESPONSE_CODE(413)  /* 4.13 Request Entity Too Large */
 #define COAP_RESPONSE_415       COAP_RESPONSE_CODE(415)  /* 4.15 Unsupported Media Type   */
@@ -149,6 +156,7 @@ struct coap_session_t;
 #define COAP_RESPONSE_VALID                    COAP_RESPONSE_CODE(203)
 #define COAP_RESPONSE_CHANGED                  COAP_RESPONSE_CODE(204)
 #define COAP_RESPONSE_CONTENT                  COAP_RESPONSE_CODE(205)
+#define COAP_RESPONSE_CONTINUE                 COAP_RESPONSE_CODE(231)
 
 #define COAP_RESPONSE_BAD_REQUEST              COAP_RESPONSE_CODE(400)
 #define COAP_RESPONSE_UNAUTHORIZED             COAP_RESPONSE_CODE(401)
@@ -157,6 +165,7 @@ struct coap_session_t;
 #define COAP_RESPONSE_NOT_FOUND                COAP_RESPONSE_CODE(404)
 #define COAP_RESPONSE_METHOD_NOT_ALLOWED       COAP_RESPONSE_CODE(405)
 #define COAP_RESPONSE_NOT_ACCEPTABLE           COAP_RESPONSE_CODE(400)
+#define COAP_RESPONSE_REQUEST_ENTITY_INCOMPLETE COAP_RESPONSE_CODE(408)
 #define COAP_RESPONSE_PRECONDITION_FAILED      COAP_RESPONSE_CODE(412)
 #define COAP_RESPONSE_REQUEST_ENTITY_TOO_LARGE COAP_RESPONSE_CODE(413)
 #define COAP_RESPONSE_UNSUPPORTED_MEDIA_TYPE   COAP_RESPONSE_CODE(415)
@@ -199,6 +208,9 @@ struct coap_session_t;
 #define COAP_MEDIATYPE_APPLICATION_SENML_XML    310 /* application/senml+xml   */
 #define COAP_MEDIATYPE_APPLICATION_SENSML_XML   311 /* application/sensml+xml  */
 
+// Content formats from RFC 9177
+#define COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ  272 /* application/missing-blocks+cbor-seq */
+
 /**
  * @brief: Any media type.
  * 
@@ -238,6 +250,7 @@ struct coap_session_t;
 #define COAP_PDU_IS_EMPTY(pdu)     ((pdu)->code == 0)
 #define COAP_PDU_IS_REQUEST(pdu)   (!COAP_PDU_IS_EMPTY(pdu) && (pdu)->code < 32)
 #define COAP_PDU_IS_RESPONSE(pdu)  ((pdu)->code >= 64 && (pdu)->code < 224)
+#define COAP_PDU_IS_SIGNALING(pdu) ((pdu)->code >= 224)
 
 
 /* -------------------------------------------- [Data structures] --------------------------------------------- */
@@ -273,6 +286,8 @@ typedef struct coap_pdu_t {
 
     // Length of Token
     uint8_t token_length;
+    // Set when storage is borrowed from an external (e.g. receive) buffer and so it's not owned by the PDU
+    uint8_t borrowed;
     
     // Storage allocated for token, options and payload
     size_t alloc_size;
@@ -302,9 +317,9 @@ typedef struct coap_pdu_t {
 const char *coap_response_phrase(unsigned char code);
 
 /**
- * @brief: Creates a new CoAP PDU and allocates at least enough storage space for the
- *    given @p size bytes of the message. @a alloc_size and @a max_size are set to
- *    @p size.    
+ * @brief: Creates a new CoAP PDU that can hold up to @p size bytes of the message. @a max_size
+ *    is set to @p size. Initially at most COAP_PDU_INITIAL_SIZE bytes are allocated; the
+ *    storage grows when the options and payload are added.
  *
  * @param type:
  *    the type of the PDU (one of: COAP_MESSAGE_CON, COAP_MESSAGE_NON, COAP_MESSAGE_ACK,
@@ -428,6 +443,58 @@ int coap_pdu_parse(
     coap_pdu_t *pdu
 );
 
+/**
+ * @brief: Parses @p data into the CoAP PDU structure given in @p pdu without copying it. 
+ *    The @p pdu is turned into a view over the @p data buffer, so the buffer must outlive
+ *    the PDU. Any previous content of the @p pdu is discarded without being freed.
+ * 
+ *    Such a PDU can be passed to all PDU-related routines. If it needs to grow (only possible
+ *    if @a max_size is zero), its content is moved to the heap. Storage of the view is not
+ *    freed by coap_delete_pdu(). To retain the PDU after the @p data buffer is reused,
+ *    a heap copy must be made with coap_pdu_copy().
+ *
+ * @param data:
+ *    the raw data to parse as CoAP PDU
+ * @param length:
+ *    the actual size of @p data.
+ * @param pdu:
+ *    the PDU structure to fill
+ * @returns:
+ *    1 on success 
+ *    0 on error.
+ */
+int coap_pdu_parse_view(
+    uint8_t *data,
+    size_t length,
+    coap_pdu_t *pdu
+);
+
+/**
+ * @brief: Creates a heap-allocated copy of the @p pdu. Resulting PDU owns its storage
+ *    regardless of whether @p pdu was a view created with coap_pdu_parse_view().
+ *
+ * @param pdu:
+ *    the PDU to be copied
+ * @returns:
+ *    a new PDU that should be freed with coap_delete_pdu() on success
+ *    NULL on error
+ */
+coap_pdu_t *coap_pdu_copy(const coap_pdu_t *pdu);
+
+/**
+ * @brief: Replaces code, options and payload of the @p pdu with those of the @p source. Token,
+ *    type and message ID of the @p pdu are kept.
+ *
+ * @param pdu:
+ *    the PDU to be filled (its token must have been already added)
+ * @param source:
+ *    the PDU whose content is copied
+ * @returns:
+ *    1 on success
+ *    0 if the content does not fit into @p pdu (@p pdu is not modified then)
+ */
+int coap_pdu_copy_content(coap_pdu_t *pdu, const coap_pdu_t *source);
+
 /**
  * @brief: Adds token of length @p len to @p pdu. Adding the token destroys any following contents
  *    of the pdu. Hence options and data must be added after coap_add_token() has been called. 
@@ -475,6 +542,30 @@ size_t coap_add_option(
     const uint8_t *data
 );
 
+/**
+ * @brief: Inserts option of given type into the @p pdu keeping the order of options. Unlike
+ *    coap_add_option(), it can be called after options of the higher type or the payload
+ *    have been added (the following options and the payload are moved then).
+ * 
+ * @param pdu:
+ *    PDU to insert option into
+ * @param type:
+ *     option's type
+ * @param len:
+ *     length of the @p data
+ * @param data:
+ *     option's value data buffer
+ * @returns:
+ *     the number of bytes written on success
+ *     0 on error (@p pdu is not modified then)
+ */
+size_t coap_insert_option(
+    coap_pdu_t *pdu,
+    uint16_t type,
+    size_t len,
+    const uint8_t *data
+);
+
 /**
  * @brief: Adds option of given type to @p pdu that is passed as first parameter, but does
  *    not write a value. It works like @f coap_add_option with respect to calling sequence
@@ -45,7 +45,9 @@
 #include "str.h"
 #include "pdu.h"
 #include "net.h"
+#include "response_cache.h"
 #include "subscribe.h"
+#include "uri.h"
 
 
 /* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
@@ -73,6 +75,12 @@
 #define COAP_RESOURCE_FLAGS_RELEASE_URI 0x1
 #define COAP_RESOURCE_FLAGS_NOTIFY_NON  0x0
 #define COAP_RESOURCE_FLAGS_NOTIFY_CON  0x2
+#define COAP_RESOURCE_FLAGS_NOTIFY_PER_OBSERVER 0x4
+#define COAP_RESOURCE_FLAGS_NOTIFY_LATEST 0x8
+#define COAP_RESOURCE_FLAGS_CACHE_RESPONSES 0x10
+#define COAP_RESOURCE_FLAGS_BLOCK1_STREAM 0x20
+#define COAP_RESOURCE_FLAGS_WORKER 0x40
+#define COAP_RESOURCE_FLAGS_VALIDATE 0x80
 
 /**
  * @brief: Print masks
@@ -86,14 +94,19 @@
 /**
  * @brief: Adds @p obj resource of type @t coap_resource_t* to the @p r array
  *    of @t coap_resource_t *.
+ * 
+ * @note: Resources are hashed with coap_uri_path_hash() instead of the uthash's default
+ *    function, so that they can be found directly from the request's Uri-Path options
+ *    (see coap_get_resource_from_request())
  *  
  * @param r:
  *    list of resources to add the resource to
  * @param obj:
  *    pointer to the resource to be added
  */
-#define RESOURCES_ADD(r, obj)    \
-  HASH_ADD(hh, (r), uri_path->s[0], (obj)->uri_path->length, (obj))
+#define RESOURCES_ADD(r, obj)                                                       \
+  HASH_ADD_KEYPTR_BYHASHVALUE(hh, (r), (obj)->uri_path->s, (obj)->uri_path->length, \
+    coap_uri_path_hash((obj)->uri_path->s, (obj)->uri_path->length), (obj))
 
 /**
  * @brief: Deletes @p obj resource of type @t coap_resource_t* from the @p r array
@@ -140,8 +153,9 @@
  *    result resource given as @t coap_resource_t*
  *    NULL if not found
  */
-#define RESOURCES_FIND(r, k, res) {                 \
-    HASH_FIND(hh, (r), (k)->s, (k)->length, (res)); \
+#define RESOURCES_FIND(r, k, res) {                                    \
+    HASH_FIND_BYHASHVALUE(hh, (r), (k)->s, (k)->length,                \
+      coap_uri_path_hash((k)->s, (k)->length), (res));                 \
   }
 
 /* -------------------------------------------- [Data structures] --------------------------------------------- */
@@ -158,7 +172,12 @@
  * @param token:
  *    request's token
  * @param query_string:
- *    string that pointed to the @p resource
+ *    string that pointed to the @p resource (valid only until the handler returns)
+ * 
+ * @note: If the @p resource was registered with a templated path, segments captured from the
+ *    request's path can be read with coap_route_get_match(session->context). Handler run by
+ *    the worker pool gets segments captured from its copy of the request. When handler is
+ *    called to produce a notification (@p request is NULL), no segments are captured.
  * @param response [out]:
  *    response PDU (established by the handler)
  * 
@@ -213,10 +232,19 @@ typedef struct coap_resource_t {
     unsigned int partiallydirty:1;
     // Set if can be observed 
     unsigned int observable:1;
-    // Set if can be cached 
+    // Set if responses to GET requests can be cached (@see COAP_RESOURCE_FLAGS_CACHE_RESPONSES)
     unsigned int cacheable:1;
     // Set if resource was created with unknown handler 
     unsigned int is_unknown:1;
+    // Set if resource's path is a template registered in the context's routes' tree
+    unsigned int is_template:1;
+    // Set if resource is linked into the context's list of dirty resources
+    unsigned int is_queued:1;
+    // Set if resource was deleted while referenced (it's freed when the last reference is released)
+    unsigned int is_deleted:1;
+
+    // Number of references held by jobs of the worker pool (@see coap_resource_reference())
+    unsigned int ref;
 
     /**
      * @brief: Resource's flags
@@ -240,6 +268,9 @@ typedef struct coap_resource_t {
     // Hash used to store resources in the hash table
     UT_hash_handle hh;
 
+    // Context that resource was added to (NULL if not added yet)
+    struct coap_context_t *context;
+
     // attributes to be included with the link format in the response to /.well-known/core requests
     coap_attr_t *link_attr;
 
@@ -256,12 +287,55 @@ typedef struct coap_resource_t {
     // List of observers for this resource
     coap_subscription_t *subscribers;  
 
+    // Neighbours on the context's list of resources waiting for notifications to be sent
+    struct coap_resource_t *prev_dirty;
+    struct coap_resource_t *next_dirty;
+
     /**
     * @brief: The next value for the Observe option. This field must be increased each time the resource
     *    changes. Only the lower 24 bits are sent.
     */
     unsigned int observe;
 
+    /**
+     * @brief: Notification rendered by the GET handler for the @a notification_observe value. Its
+     *    options and payload are copied into notifications sent to the following observers, so that
+     *    the handler is called once per resource's change.
+     * 
+     * @see: COAP_RESOURCE_FLAGS_NOTIFY_PER_OBSERVER
+     */
+    coap_pdu_t *notification;
+    // Value of the @a observe that @a notification was rendered for
+    unsigned int notification_observe;
+
+    // Resource's value compared against the observers' conditional attributes (st/gt/lt)
+    float value;
+    // Set if @a value was set with coap_resource_set_value()
+    unsigned int has_value:1;
+
+    /* ---------------------------- Cached responses ----------------------------- */
+
+    /**
+     * @brief: Responses to GET requests cached for the time given by their Max-Age option. Cache
+     *    is cleared when coap_resource_notify_observers() is called or when the resource is
+     *    successfully modified by other method.
+     *
+     * @see: COAP_RESOURCE_FLAGS_CACHE_RESPONSES
+     */
+    coap_response_cache_t responses;
+
+    /* ------------------------------- Validation -------------------------------- */
+
+    /**
+     * @brief: ETag of the resource's default representation, recorded from the last 2.05 response
+     *    to GET without query and Accept. It is forgotten (@a etag_length is set to 0) when
+     *    coap_resource_notify_observers() is called or when the resource is successfully modified
+     *    by other method. Recorded only for resources created with COAP_RESOURCE_FLAGS_VALIDATE.
+     */
+    uint8_t etag[8];
+    // Length of the @a etag (0 if unknown)
+    uint8_t etag_length;
+
 } coap_resource_t;
 
 
@@ -305,6 +379,52 @@ typedef unsigned int coap_print_status_t;
  *        If this flag is set, coap-observe notifications
  *        will be sent non-confirmable by default.@n
  *       
+ *       COAP_RESOURCE_FLAGS_NOTIFY_PER_OBSERVER
+ *        If this flag is set, GET handler is called for
+ *        each notified observer (required when handler's
+ *        output depends on observer's query or session).
+ *        Otherwise, the representation is rendered once
+ *        per resource's change and shared by observers.@n
+ *       
+ *       COAP_RESOURCE_FLAGS_NOTIFY_LATEST
+ *        If this flag is set, at most one notification
+ *        per observer waits in the session's delayqueue.
+ *        Further changes replace it's content, so that
+ *        the latest state is sent when the in-flight
+ *        CON notification is acknowledged.@n
+ *       
+ *       COAP_RESOURCE_FLAGS_CACHE_RESPONSES
+ *        If this flag is set, responses to GET requests
+ *        (without Observe) are cached for Max-Age seconds
+ *        and repeated requests with the same query, Accept
+ *        and Block2 options are answered without calling
+ *        the handler. Handler's output must not depend on
+ *        the requesting session.@n
+ *       
+ *       COAP_RESOURCE_FLAGS_BLOCK1_STREAM
+ *        If this flag is set, handler is called for every
+ *        block of the request sent with Block1 option.
+ *        Otherwise, blocks are reassembled and handler is
+ *        called once with the whole body.@n
+ *       
+ *       COAP_RESOURCE_FLAGS_WORKER
+ *        If this flag is set and the context's worker pool
+ *        is running (@see coap_workers_start()), handler
+ *        is called by one of the workers and the request
+ *        is answered with the separate response. Requests
+ *        with Observe or Block1 option are handled by the
+ *        loop.@n
+ *       
+ *       COAP_RESOURCE_FLAGS_VALIDATE
+ *        If this flag is set, ETag of the default
+ *        representation (GET without query and Accept)
+ *        is recorded and such requests listing it are
+ *        answered with 2.03 without calling the handler.
+ *        Requests with If-Match not listing the known
+ *        ETag are answered with 4.12.
+ *        Application must call coap_resource_notify_observers()
+ *        whenever the representation changes.@n
+ *       
  *        If flags is set to 0 then the
  *        COAP_RESOURCE_FLAGS_NOTIFY_NON is considered.
  *                 
@@ -358,7 +478,9 @@ void coap_add_resource(coap_context_t *context, coap_resource_t *resource);
 
 /**
  * @brief: Deletes a resource identified by @p resource. The storage allocated for that
- *    resource is freed, and removed from the context.
+ *    resource is freed, and removed from the context. If the resource is referenced
+ *    (@see coap_resource_reference()), it's removed from the context and its observers
+ *    are dropped, but the storage is freed when the last reference is released.
  *
  * @param context:
  *    the context where the resources are stored
@@ -379,6 +501,26 @@ int coap_delete_resource(coap_context_t *context, coap_resource_t *resource);
  */
 void coap_delete_all_resources(coap_context_t *context);
 
+/**
+ * @brief: Increments reference counter of the @p resource, so that its storage is kept
+ *    when the resource is deleted. Used by the worker pool for jobs targeting the resource.
+ *
+ * @param resource:
+ *    resource to be referenced
+ * @returns:
+ *    the @p resource
+ */
+coap_resource_t *coap_resource_reference(coap_resource_t *resource);
+
+/**
+ * @brief: Decrements reference counter of the @p resource. Resource deleted while it was
+ *    referenced is freed when the last reference is released.
+ *
+ * @param resource:
+ *    resource to be released
+ */
+void coap_resource_release(coap_resource_t *resource);
+
 /**
  * @brief: Registers a new attribute with the given @p resource. As the attribute's
  *    coap_str_const_ fields will point to @p name and @p value the caller must ensure
@@ -509,6 +651,25 @@ coap_resource_t *coap_get_resource_from_uri_path(
     coap_str_const_t *uri_path
 );
 
+/**
+ * @brief: Finds resource addressed by the @p request's Uri-Path options. Path is hashed and
+ *    compared directly from the options, so no string is built. If no resource is registered
+ *    with the exact path, the context's routes' tree is searched for the matching template.
+ * 
+ * @param context:
+ *    the context to look for this resource
+ * @param request:
+ *    the request
+ *
+ * @returns:
+ *    a pointer to the resource if found
+ *    NULL if not found
+ */
+coap_resource_t *coap_get_resource_from_request(
+    coap_context_t *context,
+    const coap_pdu_t *request
+);
+
 /**
  * @brief: Adds the specified peer as observer for @p resource. The subscription is
  *    identified by the given @p token. 
@@ -520,7 +681,8 @@ coap_resource_t *coap_get_resource_from_uri_path(
  * @param token:
  *    the token that identifies this subscription
  * @param query:
- *    the query string, if any; subscription will take ownership of the string.
+ *    the query string, if any; subscription keeps a heap copy of the string, so it may
+ *    be allocated from the per-request arena
  * @param has_block2:
  *    if Option Block2 defined
  * @param block2:
@@ -533,7 +695,7 @@ coap_subscription_t *coap_add_observer(
     coap_resource_t *resource,
     coap_session_t *session,
     const coap_binary_t *token,
-    coap_string_t *query,
+    const coap_string_t *query,
     int has_block2,
     coap_block_t block2
 );
@@ -588,6 +750,22 @@ int coap_delete_observer(
     const coap_binary_t *token
 );
 
+/**
+ * @brief: Removes all subscriptions made by the @p session with the @p token (from all
+ *    resources) and releases the allocated storage.
+ *
+ * @param session:
+ *    the observer's session
+ * @param token:
+ *    the token that identifies subscriptions
+ * @returns:
+ *    number of deleted subscriptions
+ */
+int coap_delete_observers_by_token(
+    coap_session_t *session,
+    const coap_binary_t *token
+);
+
 /**
  * @brief: Removes any subscription for @p session and releases the allocated storage.
  *
@@ -599,7 +777,8 @@ void coap_delete_observers(
 );
 
 /**
- * @brief: Checks for all known resources, if they are dirty and notifies subscribed observers.
+ * @brief: Notifies observers of resources queued on the context's dirty list. Resources whose
+ *    observers could not be all notified are queued again and handled in the next call.
  * 
  * @param context:
  *    context to perform notifications on
@@ -644,9 +823,9 @@ coap_print_status_t coap_print_wellknown(
 );
 
 /**
- * @brief: Deals with observer's notification failure. Iterates over all resources in the 
- *    @p session->context and checks the failure counter for all (peer, token) tuples. Removes peer
- *    from the list of observers for the given resource when COAP_OBS_MAX_FAIL is reached.
+ * @brief: Deals with observer's notification failure. Checks the failure counter of all
+ *    subscriptions made with the (peer, token) tuple. Removes peer from the list of observers
+ *    for the given resource when COAP_OBS_MAX_FAIL is reached.
  * 
  * @param session:
  *    session associated with the failed notification
@@ -680,6 +859,27 @@ int coap_resource_notify_observers(
     const coap_string_t *query
 );
 
+/**
+ * @brief: Sets the numeric value of the @p resource and marks it's observers as notifications-
+ *    requiring. Observers that subscribed with the change step ('st') or thresholds ('gt', 'lt')
+ *    in the query are notified only if the new value satisfies their conditions. Observers
+ *    that subscribed with the minimal period ('pmin') receive at most one notification per
+ *    period (carrying the latest state).
+ *
+ * @param resource:
+ *    the CoAP resource to use
+ * @param value:
+ *    resource's new value
+ *
+ * @returns:
+ *    1 if the Observe has been triggered
+ *    0 otherwise
+ */
+int coap_resource_set_value(
+    coap_resource_t *resource,
+    float value
+);
+
 
 /* ---------------------------------------- [Static-inline functions] ----------------------------------------- */
 
@@ -739,6 +939,9 @@ coap_resource_get_userdata(coap_resource_t *resource){
 COAP_STATIC_INLINE void
 coap_resource_set_observable(coap_resource_t *resource, int mode){
   resource->observable = mode ? 1 : 0;
+  // Resource's link description changes
+  if (resource->context)
+    resource->context->resources_version++;
 }
 
 /**
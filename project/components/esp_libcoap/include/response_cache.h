@@ -0,0 +1,164 @@
+/* ============================================================================================================
+ *  File: response_cache.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Per-resource cache of the responses to GET requests, used to answer repeated requests
+ *      without calling the resource's handler as long as the response is fresh (i.e. for Max-Age
+ *      seconds set by the handler)
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_RESPONSE_CACHE_H_
+#define COAP_RESPONSE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libcoap.h"
+#include "coap_time.h"
+#include "pdu.h"
+#include "str.h"
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of responses cached by a single resource
+ */
+#ifndef COAP_RESPONSE_CACHE_MAX_ENTRIES
+#define COAP_RESPONSE_CACHE_MAX_ENTRIES 4
+#endif
+
+/**
+ * @brief: Maximal size of the response (header excluded) that can be cached
+ */
+#ifndef COAP_RESPONSE_CACHE_MAX_BYTES
+#define COAP_RESPONSE_CACHE_MAX_BYTES 512
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Parameters of the request that the cached response depends on (apart from the query)
+ */
+typedef struct coap_response_cache_key_t {
+
+    // Value of the Accept option (-1 if absent)
+    int32_t accept;
+    // Value of the Block2 option, i.e. block's number and size (-1 if absent)
+    int32_t block2;
+    // Value of the (first) Q-Block2 option (-1 if absent)
+    int32_t q_block2;
+    // Maximal size of the response PDU (Block2 may be chosen by the handler basing on it)
+    size_t pdu_size;
+
+} coap_response_cache_key_t;
+
+/**
+ * @brief: Cached response
+ */
+typedef struct coap_response_cache_entry_t {
+
+    // Values used to create the cache's LRU list
+    struct coap_response_cache_entry_t *prev;
+    struct coap_response_cache_entry_t *next;
+
+    // Key of the entry
+    coap_response_cache_key_t key;
+
+    // Absolute time (in ticks) of the entry's expiration
+    coap_tick_t expires;
+
+    // Copy of the response (its token and message ID are irrelevant)
+    coap_pdu_t *response;
+
+    // Query of the request
+    size_t query_length;
+    uint8_t query[];
+
+} coap_response_cache_entry_t;
+
+/**
+ * @brief: Cache of the responses produced by the resource's GET handler
+ */
+typedef struct coap_response_cache_t {
+
+    // List of entries (the head is the least recently used one)
+    coap_response_cache_entry_t *lru;
+    // Number of cached entries
+    size_t num;
+
+} coap_response_cache_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Looks for the response to the GET @p request and copies it into the @p response
+ *    (whose token and message ID are kept). Max-Age of the copy is set to the remaining
+ *    freshness of the cached response. Expired entry is removed.
+ *
+ * @param cache:
+ *    cache to look in
+ * @param request:
+ *    the request
+ * @param query:
+ *    request's query (may be NULL)
+ * @param pdu_size:
+ *    maximal size of the response PDU
+ * @param now:
+ *    current time
+ * @param response [out]:
+ *    response to be filled
+ * @returns:
+ *    1 if the @p response has been served from the cache
+ *    0 if the response is not cached (or cannot be copied; the @p response is left empty)
+ */
+int coap_response_cache_serve(
+    coap_response_cache_t *cache,
+    const coap_pdu_t *request,
+    const coap_string_t *query,
+    size_t pdu_size,
+    coap_tick_t now,
+    coap_pdu_t *response
+);
+
+/**
+ * @brief: Stores a copy of the @p response to the GET @p request in the @p cache. Only 2.05
+ *    (Content) responses are cached, for the time given by their Max-Age option (60 seconds
+ *    if absent). The least recently used entry is evicted if the cache is full.
+ *
+ * @param cache:
+ *    cache to store the response in
+ * @param request:
+ *    the request
+ * @param query:
+ *    request's query (may be NULL)
+ * @param pdu_size:
+ *    maximal size of the response PDU
+ * @param response:
+ *    response produced by the handler
+ * @param now:
+ *    current time
+ */
+void coap_response_cache_store(
+    coap_response_cache_t *cache,
+    const coap_pdu_t *request,
+    const coap_string_t *query,
+    size_t pdu_size,
+    const coap_pdu_t *response,
+    coap_tick_t now
+);
+
+/**
+ * @brief: Removes all entries from the @p cache
+ *
+ * @param cache:
+ *    cache to be cleared
+ */
+void coap_response_cache_clear(coap_response_cache_t *cache);
+
+#endif /* COAP_RESPONSE_CACHE_H_ */
@@ -0,0 +1,181 @@
+/* ============================================================================================================
+ *  File: route.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Prefix-tree router matching requests' Uri-Path options against resources registered with
+ *      templated paths (e.g. "dev/{id}/temp") and trailing wildcard segments ("*")
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_ROUTE_H_
+#define COAP_ROUTE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "str.h"
+
+struct coap_context_t;
+struct coap_resource_t;
+struct coap_pdu_t;
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of the Uri-Path segments of the request matched against the routes.
+ *    Requests with more segments can be matched only by the resources registered with an
+ *    exact path.
+ */
+#ifndef COAP_ROUTE_MAX_DEPTH
+#define COAP_ROUTE_MAX_DEPTH 16
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Node of the routes' tree. Each node corresponds to a single segment of the path.
+ */
+typedef struct coap_route_node_t {
+
+    // Next sibling with a literal segment
+    struct coap_route_node_t *next;
+    // Children with literal segments
+    struct coap_route_node_t *children;
+    // Child with a templated segment ('{name}')
+    struct coap_route_node_t *param;
+
+    // Resource whose path ends at this node
+    struct coap_resource_t *resource;
+    // Resource whose path ends at this node with a trailing wildcard ('*')
+    struct coap_resource_t *wildcard;
+
+    // Literal segment of the node (percent-decoded)
+    size_t length;
+    uint8_t segment[];
+
+} coap_route_node_t;
+
+/**
+ * @brief: Segments captured by the last route lookup
+ *
+ * @note: Captures point into the request's options and are valid only while the request
+ *    is being handled.
+ */
+typedef struct coap_route_match_t {
+
+    // Captured segments (values of the templated segments followed by segments matched by the wildcard)
+    coap_str_const_t captures[COAP_ROUTE_MAX_DEPTH];
+    // Number of captured segments
+    size_t num_captures;
+    // Index of the first segment matched by the wildcard (equal to @a num_captures if none)
+    size_t wildcard_start;
+
+} coap_route_match_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Checks whether the @p uri_path is a route's template, i.e. contains a '{name}'
+ *    segment or ends with the '*' segment.
+ *
+ * @param uri_path:
+ *    path to be checked
+ * @returns:
+ *    1 if @p uri_path is a template, 0 otherwise
+ */
+int coap_route_is_template(const coap_str_const_t *uri_path);
+
+/**
+ * @brief: Adds @p resource to the @p context's routes' tree. If other resource was registered
+ *    with the same shape of the path, it is replaced.
+ *
+ * @param context:
+ *    context to add the route to
+ * @param resource:
+ *    resource whose uri_path is a template
+ * @returns:
+ *    1 on success, 0 on failure
+ */
+int coap_route_add(struct coap_context_t *context, struct coap_resource_t *resource);
+
+/**
+ * @brief: Removes @p resource from the @p context's routes' tree. Tree's nodes are kept
+ *    for the later use.
+ *
+ * @param context:
+ *    context to remove the route from
+ * @param resource:
+ *    resource to be removed
+ */
+void coap_route_delete(struct coap_context_t *context, struct coap_resource_t *resource);
+
+/**
+ * @brief: Frees the @p context's routes' tree (resources are not freed)
+ *
+ * @param context:
+ *    context to free tree of
+ */
+void coap_route_delete_all(struct coap_context_t *context);
+
+/**
+ * @brief: Finds the resource whose route matches @p request's Uri-Path options. Literal
+ *    segments take precedence over templated ones, and those over the wildcards. Captured
+ *    segments are stored in the @p context's @a route_match.
+ *
+ * @param context:
+ *    context to look for the route in
+ * @param request:
+ *    the request
+ * @returns:
+ *    matching resource on success
+ *    NULL if no route matches
+ */
+struct coap_resource_t *coap_route_find(struct coap_context_t *context, const struct coap_pdu_t *request);
+
+/**
+ * @brief: Finds the resource whose route matches @p request's Uri-Path options as
+ *    coap_route_find() does, but stores captured segments in the @p match
+ *
+ * @param context:
+ *    context to look for the route in
+ * @param request:
+ *    the request (captures point into its options)
+ * @param match [out]:
+ *    captured segments
+ * @returns:
+ *    matching resource on success
+ *    NULL if no route matches
+ */
+struct coap_resource_t *coap_route_find_match(
+    struct coap_context_t *context,
+    const struct coap_pdu_t *request,
+    coap_route_match_t *match
+);
+
+/**
+ * @brief: Returns segments captured when the request currently being handled was routed.
+ *    Should be called by the resource's handler. Handler run by the worker thread gets
+ *    segments captured for its job (@see coap_route_set_thread_match()).
+ *
+ * @param context:
+ *    context handling the request
+ * @returns:
+ *    captured segments (num_captures is 0 if the resource was found by the exact path)
+ */
+const coap_route_match_t *coap_route_get_match(const struct coap_context_t *context);
+
+/**
+ * @brief: Sets segments returned by coap_route_get_match() in the calling thread. Used by
+ *    the worker pool for the time of the offloaded handler's call.
+ *
+ * @param match:
+ *    segments captured for the request handled by the thread (NULL to use the context's ones)
+ */
+void coap_route_set_thread_match(const coap_route_match_t *match);
+
+#endif /* COAP_ROUTE_H_ */
@@ -0,0 +1,169 @@
+/* ============================================================================================================
+ *  File: shard.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Sharded server mode. Each of N threads owns a full context whose UDP endpoint is bound to the
+ *      same port with SO_REUSEPORT, so that the system spreads clients between shards. Contexts are
+ *      not synchronized - only notifications of the resources' changes are passed between threads.
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_SHARD_H_
+#define COAP_SHARD_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libcoap.h"
+#include "address.h"
+#include "coap_io.h"
+#include "str.h"
+
+struct coap_context_t;
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of shards within a group
+ */
+#ifndef COAP_SHARDS_MAX
+#define COAP_SHARDS_MAX 8
+#endif
+
+/**
+ * @brief: Maximal time (in ms) that the shard's loop waits in coap_run_once()
+ */
+#ifndef COAP_SHARD_WAIT_TIME
+#define COAP_SHARD_WAIT_TIME 1000
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Routine registering resources in the shard's @p context. It's called for every
+ *    shard (in the thread calling coap_shards_start()), so that each shard owns its copy of
+ *    the resource set along with observers and cached responses of its clients.
+ *
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+typedef int (*coap_shard_setup_t)(struct coap_context_t *context, void *arg);
+
+/**
+ * @brief: Change of the resource to be delivered to the shard
+ */
+typedef struct coap_shard_notify_t {
+
+    // Next change
+    struct coap_shard_notify_t *next;
+    // Length of the resource's path
+    size_t length;
+    // Resource's path
+    uint8_t uri_path[];
+
+} coap_shard_notify_t;
+
+/**
+ * @brief: Thread owning a context
+ */
+typedef struct coap_shard_t {
+
+    // Group that the shard belongs to
+    struct coap_shard_group_t *group;
+    // Shard's context (touched only by the shard's thread once it's started)
+    struct coap_context_t *context;
+
+    // Shard's thread
+    pthread_t thread;
+    // Set when the thread has been started
+    int started;
+
+    /**
+     * @brief: Stack of the resources' changes. Any thread pushes changes with compare-and-swap
+     *    and the shard takes all of them at once with an atomic exchange.
+     */
+    coap_shard_notify_t *notifications;
+
+    // Loopback socket waking the shard's loop up (@see coap_socket_wakeup_open())
+    coap_socket_t wakeup;
+
+} coap_shard_t;
+
+/**
+ * @brief: Group of shards serving the same port
+ */
+typedef struct coap_shard_group_t {
+
+    // Shards
+    coap_shard_t shards[COAP_SHARDS_MAX];
+    // Number of initialized shards
+    unsigned int num_shards;
+
+    // Set when shards are to finish
+    int stop;
+
+} coap_shard_group_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Creates @p num_shards contexts with UDP endpoints sharing the port and starts a thread
+ *    running coap_run_once() for each of them. Memory pools are bypassed from then on.
+ *
+ * @note: Datagrams are spread between shards by the system. Linux assigns clients to sockets
+ *    by the hash of the addresses and ports, so that the client's session is kept by a single
+ *    shard. lwIP delivers unicast datagrams to the first matching socket, i.e. all clients
+ *    are served by a single shard.
+ *
+ * @param listen_addr:
+ *    address to listen on (if its port is 0, the port bound by the first shard is used by
+ *    the remaining ones)
+ * @param num_shards:
+ *    number of shards (at most COAP_SHARDS_MAX)
+ * @param setup:
+ *    routine registering resources in the shard's context
+ * @param arg:
+ *    argument passed to the @p setup
+ * @returns:
+ *    group of running shards on success
+ *    NULL on failure
+ */
+coap_shard_group_t *coap_shards_start(
+    const coap_address_t *listen_addr,
+    unsigned int num_shards,
+    coap_shard_setup_t setup,
+    void *arg
+);
+
+/**
+ * @brief: Stops shards' threads and frees their contexts along with the @p group
+ *
+ * @param group:
+ *    group to be stopped
+ */
+void coap_shards_stop(coap_shard_group_t *group);
+
+/**
+ * @brief: Notifies observers of the resource registered under the @p uri_path in all shards
+ *    (each of them keeps observers of its own clients). Resource is marked as changed by the
+ *    shard's thread with coap_resource_notify_observers(). Function can be called from any
+ *    thread, including shards' handlers.
+ *
+ * @param group:
+ *    group of shards
+ * @param uri_path:
+ *    path of the changed resource
+ * @returns:
+ *    1 if the change has been passed to all shards
+ *    0 on failure
+ */
+int coap_shards_notify(coap_shard_group_t *group, const coap_str_const_t *uri_path);
+
+#endif /* COAP_SHARD_H_ */
@@ -38,6 +38,7 @@
 #include <string.h>
 
 typedef struct coap_str_const_t coap_str_const_t;
+struct coap_arena_t;
 
 
 /* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
@@ -125,6 +126,20 @@ typedef struct coap_binary_t {
  */
 coap_string_t *coap_new_string(size_t size);
 
+/**
+ * @brief: Returns a new string object with at least size + 1 bytes storage allocated
+ *    from the @p arena. The string must not be released with coap_delete_string(); it's
+ *    freed when the @p arena is reset.
+ *
+ * @param arena:
+ *    arena to allocate the string from
+ * @param size:
+ *    the size to allocate for the binary string data.
+ * @returns:
+ *    a pointer to the new object or @c NULL on error.
+ */
+coap_string_t *coap_arena_new_string(struct coap_arena_t *arena, size_t size);
+
 /**
  * @biref: Deletes the given string and releases any memory allocated.
  *
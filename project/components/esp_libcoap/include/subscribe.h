@@ -36,10 +36,15 @@
 #ifndef COAP_SUBSCRIBE_H_
 #define COAP_SUBSCRIBE_H_
 
+#include <stddef.h>
 #include "address.h"
 #include "coap_io.h"
 #include "coap_session.h"
 #include "block.h"
+#include "coap_time.h"
+#include "uthash.h"
+
+struct coap_resource_t;
 
 
 /* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
@@ -82,11 +87,21 @@
  */
 typedef struct coap_subscription_t {
 
-    // Value used to create forward list
+    // Values used to create the resource's list of subscribers
     struct coap_subscription_t *next;
+    struct coap_subscription_t *prev;
+
+    /**
+     * @note: @a session, @a token_length and @a token fields form the key of the context's
+     *    observers' index (@see COAP_SUBSCRIPTION_KEY_SIZE); they must be kept adjacent.
+     */
 
     // Session used for communication with subscriber
     coap_session_t *session;
+    // Actual length of token
+    size_t token_length;
+    // Token used for subscription (zero-padded)
+    unsigned char token[8];
 
     // Non-confirmable notifies allowed (up to 15)
     unsigned int non_cnt:4;
@@ -105,16 +120,63 @@ typedef struct coap_subscription_t {
     // GET request's Block2 definition
     coap_block_t block2;
 
-    // Actual length of token
-    size_t token_length;
-    // Token used for subscription
-    unsigned char token[8];
-
     // Query string used for subscription (if any)
     coap_string_t *query;
 
+    /* ------------------------ Conditional attributes --------------------------- */
+
+    // Set if the corresponding attribute was given in the subscription's query
+    unsigned int has_pmin:1;
+    unsigned int has_pmax:1;
+    unsigned int has_st:1;
+    unsigned int has_gt:1;
+    unsigned int has_lt:1;
+
+    // Set if the change is held back until @a pmin passes since the last notification
+    unsigned int pending:1;
+    // Set if @a pmax passed since the last notification (notification is sent regardless of the value)
+    unsigned int expired:1;
+    // Set if @a last_value holds the value reported by the last notification
+    unsigned int has_last_value:1;
+
+    // Minimal and maximal period between notifications (in ticks)
+    coap_tick_t pmin;
+    coap_tick_t pmax;
+    // Change step and thresholds of the resource's value
+    float st;
+    float gt;
+    float lt;
+
+    // Resource's value reported by the last notification
+    float last_value;
+    // Time of the last notification
+    coap_tick_t last_notified;
+
+    // Absolute time of the subscription's timer (valid if @a timer_index is not 0)
+    coap_tick_t timer;
+    // Position of the subscription in the context's observers' timers heap plus 1 (0 if not scheduled)
+    size_t timer_index;
+
+    /* ---------------------------------- Links ---------------------------------- */
+
+    // Observed resource
+    struct coap_resource_t *resource;
+
+    // Neighbours on the session's list of subscriptions
+    struct coap_subscription_t *session_prev;
+    struct coap_subscription_t *session_next;
+
+    // Handle of the context's (session, token) index
+    UT_hash_handle hh;
+
 } coap_subscription_t;
 
+/**
+ * @brief: Size of the (session, token) key used to index subscriptions
+ */
+#define COAP_SUBSCRIPTION_KEY_SIZE \
+    (offsetof(coap_subscription_t, token) + 8 - offsetof(coap_subscription_t, session))
+
 
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
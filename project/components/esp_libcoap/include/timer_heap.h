@@ -0,0 +1,141 @@
+/* ============================================================================================================
+ *  File: timer_heap.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Binary min-heap of timers ordered by their absolute expiration time. Items of any type are
+ *      kept in the heap as long as they hold the expiration time (coap_tick_t) and the position
+ *      in the heap (size_t) at offsets given when the heap is initialized. Used by the context's
+ *      sendqueue (retransmissions) and the observers' pmin/pmax timers.
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_TIMER_HEAP_H_
+#define COAP_TIMER_HEAP_H_
+
+#include <stddef.h>
+#include "libcoap.h"
+#include "coap_time.h"
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Initial number of items that the heap can hold. The heap's storage is doubled every
+ *    time it gets full.
+ */
+#ifndef COAP_TIMER_HEAP_INITIAL_SIZE
+#define COAP_TIMER_HEAP_INITIAL_SIZE 8
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Heap of timers. Item to be run first is always at index 0.
+ */
+typedef struct coap_timer_heap_t {
+
+    // Items of the heap
+    void **items;
+    // Number of items in the heap
+    size_t len;
+    // Number of items that the heap's storage can hold
+    size_t size;
+
+    // Offset of the item's expiration time (coap_tick_t)
+    size_t time_offset;
+    // Offset of the item's position in the heap plus 1 (size_t; 0 when item is not in the heap)
+    size_t index_offset;
+
+} coap_timer_heap_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Initializes the empty @p heap of items holding their expiration time and position
+ *    at the given offsets
+ *
+ * @param heap:
+ *    heap to be initialized
+ * @param time_offset:
+ *    offset of the item's expiration time (coap_tick_t)
+ * @param index_offset:
+ *    offset of the item's position in the heap (size_t)
+ */
+void coap_timer_heap_init(coap_timer_heap_t *heap, size_t time_offset, size_t index_offset);
+
+/**
+ * @brief: Frees the @p heap's storage (items are not freed)
+ *
+ * @param heap:
+ *    heap to be freed
+ */
+void coap_timer_heap_free(coap_timer_heap_t *heap);
+
+/**
+ * @brief: Adds @p item to the @p heap, ordered by it's expiration time. Complexity is O(log n).
+ *
+ * @param heap:
+ *    heap to add the item to
+ * @param item:
+ *    item to be added (it must not be in the heap)
+ * @returns:
+ *    1 on success, 0 on failure
+ */
+int coap_timer_heap_insert(coap_timer_heap_t *heap, void *item);
+
+/**
+ * @brief: Detaches @p item from the @p heap. Does nothing if the item is not in the heap.
+ *    Complexity is O(log n).
+ *
+ * @param heap:
+ *    heap to remove the item from
+ * @param item:
+ *    item to be removed
+ */
+void coap_timer_heap_remove(coap_timer_heap_t *heap, void *item);
+
+/**
+ * @brief: Restores the @p heap's order after the expiration time of the @p item (being in
+ *    the heap) has changed. Complexity is O(log n).
+ *
+ * @param heap:
+ *    heap holding the item
+ * @param item:
+ *    item whose expiration time has changed
+ */
+void coap_timer_heap_update(coap_timer_heap_t *heap, void *item);
+
+
+/* ---------------------------------------- [Static-inline functions] ----------------------------------------- */
+
+/**
+ * @returns:
+ *    item of the @p heap expiring first
+ *    NULL if the heap is empty
+ */
+COAP_STATIC_INLINE void *coap_timer_heap_peek(const coap_timer_heap_t *heap) {
+    return heap->len ? heap->items[0] : NULL;
+}
+
+/**
+ * @returns:
+ *    @c 1 if the @p item is in the heap, @c 0 otherwise
+ */
+COAP_STATIC_INLINE int coap_timer_heap_contains(const coap_timer_heap_t *heap, const void *item) {
+    return *(const size_t *) ((const char *) item + heap->index_offset) != 0;
+}
+
+/**
+ * @returns:
+ *    expiration time of the @p item
+ */
+COAP_STATIC_INLINE coap_tick_t coap_timer_heap_time(const coap_timer_heap_t *heap, const void *item) {
+    return *(const coap_tick_t *) ((const char *) item + heap->time_offset);
+}
+
+#endif /* COAP_TIMER_HEAP_H_ */
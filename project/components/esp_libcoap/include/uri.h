@@ -195,9 +195,86 @@ coap_string_t *coap_get_query(const struct coap_pdu_t *request);
  */
 coap_string_t *coap_get_uri_path(const struct coap_pdu_t *request);
 
+/**
+ * @brief: Works like coap_get_query() but allocates the string from the @p arena
+ * 
+ * @param request:
+ *    request PDU.
+ * @param arena:
+ *    arena to allocate the string from
+ * @returns:
+ *    reconstructed and escaped query string part (valid until the @p arena is reset)
+ */
+coap_string_t *coap_get_query_arena(const struct coap_pdu_t *request, struct coap_arena_t *arena);
+
+/**
+ * @brief: Works like coap_get_uri_path() but allocates the string from the @p arena
+ * 
+ * @param request:
+ *    request PDU.
+ * @param arena:
+ *    arena to allocate the string from
+ * @returns:
+ *    reconstructed and escaped uri path string part (valid until the @p arena is reset)
+ */
+coap_string_t *coap_get_uri_path_arena(const struct coap_pdu_t *request, struct coap_arena_t *arena);
+
+/**
+ * @brief: Computes hash of the @p s URI path. The hash is used to index the context's
+ *    resources, so that they can be found directly from the request's Uri-Path options.
+ * 
+ * @param s:
+ *    URI path (escaped, as produced by coap_get_uri_path())
+ * @param length:
+ *    length of the @p s
+ * @returns:
+ *    hash of the path
+ */
+unsigned coap_uri_path_hash(const uint8_t *s, size_t length);
+
+/**
+ * @brief: Computes hash of the @p request's URI path in a single pass over the Uri-Path
+ *    options, without building the path's string. The result is equal to the 
+ *    coap_uri_path_hash() of the string returned by coap_get_uri_path().
+ * 
+ * @param request:
+ *    request PDU.
+ * @param length [out]:
+ *    length of the escaped path
+ * @returns:
+ *    hash of the path
+ */
+unsigned coap_request_uri_path_hash(const struct coap_pdu_t *request, size_t *length);
+
+/**
+ * @brief: Compares the @p request's URI path with the @p path without building the path's
+ *    string.
+ * 
+ * @param request:
+ *    request PDU.
+ * @param path:
+ *    URI path (escaped, as produced by coap_get_uri_path())
+ * @returns:
+ *    1 if paths are equal, 0 otherwise
+ */
+int coap_request_uri_path_equal(const struct coap_pdu_t *request, const coap_str_const_t *path);
+
 
 /* ---------------------------------------- [Static-inline functions] ----------------------------------------- */
 
+/**
+ * @brief: Initial value of the URI path's hash (FNV-1a offset basis)
+ */
+#define COAP_URI_PATH_HASH_INIT 2166136261u
+
+/**
+ * @brief: Updates URI path's @p hash with the next character @p c of the path (FNV-1a)
+ */
+static inline unsigned
+coap_uri_path_hash_byte(unsigned hash, uint8_t c) {
+    return (hash ^ c) * 16777619u;
+}
+
 /**
  * @brief: Checks whether URI scheme is secure
  * 
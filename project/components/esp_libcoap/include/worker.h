@@ -0,0 +1,176 @@
+/* ============================================================================================================
+ *  File: worker.h
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Pool of worker threads that run handlers of resources created with COAP_RESOURCE_FLAGS_WORKER.
+ *      Requests are answered with separate responses (@see async.h) that workers pass back to the
+ *      dispatch loop through a lock-free queue. The loop remains the only thread touching sessions
+ *      and sockets.
+ *
+ * ============================================================================================================ */
+
+
+#ifndef COAP_WORKER_H_
+#define COAP_WORKER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include "libcoap.h"
+#include "async.h"
+#include "coap_io.h"
+#include "coap_session.h"
+#include "pdu.h"
+#include "resource.h"
+#include "route.h"
+#include "str.h"
+
+struct coap_context_t;
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Maximal number of the worker threads within a single context
+ */
+#ifndef COAP_WORKERS_MAX
+#define COAP_WORKERS_MAX 4
+#endif
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Request handed over to the worker pool
+ */
+typedef struct coap_worker_job_t {
+
+    // Next job in the queue
+    struct coap_worker_job_t *next;
+
+    // Pending request (the state is not expired while the job is in progress)
+    coap_async_state_t *async;
+    // Resource that the request targets (referenced until the job is completed)
+    coap_resource_t *resource;
+    // Handler to be called
+    coap_method_handler_t handler;
+    // Copy of the request's query (may be NULL)
+    coap_string_t *query;
+    // Segments captured from the copy of the request (if the resource's path is a template)
+    coap_route_match_t match;
+    // Separate response filled by the handler
+    coap_pdu_t *response;
+
+} coap_worker_job_t;
+
+/**
+ * @brief: Pool of the worker threads
+ */
+typedef struct coap_worker_pool_t {
+
+    // Worker threads
+    pthread_t threads[COAP_WORKERS_MAX];
+    // Number of started threads
+    unsigned int num_threads;
+
+    // Lock protecting the queue of submitted jobs and the @a stop flag
+    pthread_mutex_t lock;
+    // Condition signalled when a job is submitted or the pool is stopped
+    pthread_cond_t cond;
+    // Queue of submitted jobs (FIFO)
+    coap_worker_job_t *submitted;
+    // Last submitted job
+    coap_worker_job_t *submitted_tail;
+    // Set when threads are to finish
+    int stop;
+
+    /**
+     * @brief: Stack of completed jobs. Workers push jobs with compare-and-swap and the loop
+     *    takes all of them at once with an atomic exchange, so that neither side blocks
+     *    the other.
+     */
+    coap_worker_job_t *completed;
+
+    /**
+     * @brief: Loopback UDP socket connected to itself. Worker completing a job writes a single
+     *    byte to it when the stack of completed jobs was empty, which wakes the loop waiting
+     *    in coap_run_once().
+     */
+    coap_socket_t wakeup;
+
+} coap_worker_pool_t;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+/**
+ * @brief: Starts @p num_workers threads running handlers of the @p context's resources
+ *    created with COAP_RESOURCE_FLAGS_WORKER. Without the pool, such handlers are called
+ *    by the loop as any other ones. Memory pools are bypassed from then on.
+ *
+ * @param context:
+ *    context to start workers for
+ * @param num_workers:
+ *    number of threads (at most COAP_WORKERS_MAX)
+ * @returns:
+ *    1 on success
+ *    0 on failure (or if the pool has been already started)
+ */
+int coap_workers_start(struct coap_context_t *context, unsigned int num_workers);
+
+/**
+ * @brief: Stops the @p context's worker threads. Jobs that have not been completed are dropped
+ *    and requests are left unanswered. Called by coap_free_context().
+ *
+ * @param context:
+ *    context to stop workers of
+ */
+void coap_workers_stop(struct coap_context_t *context);
+
+/**
+ * @brief: Hands the @p request over to the worker pool. The request is registered for the
+ *    separate response and the @p handler is called by one of the workers with the response
+ *    prepared by coap_async_response_init(). The response is sent by the loop once the
+ *    handler returns; if the handler leaves its code unset, the request is not answered.
+ *
+ * @note: Offloaded handler runs concurrently with the loop. It may build the response with
+ *    the PDU-level functions (including coap_add_data_blocked_response()), but must not
+ *    send messages, register pending requests nor modify resources. Resource is referenced
+ *    until the job is completed, so it may be deleted in the meantime (its storage is freed
+ *    after the handler returns and the response of the deleted resource is not cached).
+ *
+ * @param session:
+ *    session that the request was received from
+ * @param resource:
+ *    resource that the request targets
+ * @param handler:
+ *    handler to be called
+ * @param request:
+ *    request to be handled (it's copied)
+ * @param query:
+ *    request's query (it's copied; may be NULL)
+ * @returns:
+ *    1 if the request has been handed over
+ *    0 if the pool is not running or the request cannot be registered (it should be handled
+ *    by the loop)
+ */
+int coap_workers_submit(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_method_handler_t handler,
+    coap_pdu_t *request,
+    const coap_string_t *query
+);
+
+/**
+ * @brief: Sends responses of the jobs completed by the @p context's workers. Responses are
+ *    cached and validated as the ones produced by the loop (@see coap_handle_offloaded_response()).
+ *    Called by coap_read().
+ *
+ * @param context:
+ *    context to complete jobs of
+ */
+void coap_workers_complete(struct coap_context_t *context);
+
+#endif /* COAP_WORKER_H_ */
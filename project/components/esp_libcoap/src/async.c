@@ -0,0 +1,206 @@
+/* ============================================================================================================
+ *  File: async.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Asynchronous (separate) responses (RFC 7252, section 5.2.2). Requests that cannot be answered
+ *      right away are acknowledged by the library and answered later, so that slow handlers do not
+ *      stall the dispatch loop.
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "async.h"
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "mem.h"
+#include "net.h"
+
+static void coap_async_free(coap_context_t *context, coap_async_state_t *async);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+coap_async_state_t *coap_register_async(
+    coap_session_t *session,
+    coap_pdu_t *request,
+    void *app_data
+) {
+    coap_context_t *context = session->context;
+
+    // Check if the request is not pending already
+    const coap_binary_t token = { request->token_length, request->token };
+    if (coap_find_async(session, &token)) {
+        coap_log(LOG_DEBUG, "coap_register_async: request already pending\n");
+        return NULL;
+    }
+
+    // Check the limit of pending requests
+    if (context->num_async >= COAP_ASYNC_MAX_PENDING) {
+        coap_log(LOG_DEBUG, "coap_register_async: too many pending requests\n");
+        return NULL;
+    }
+
+    // Allocate the state
+    coap_async_state_t *async = (coap_async_state_t *) coap_malloc(sizeof(coap_async_state_t));
+    if (!async) {
+        coap_log(LOG_WARNING, "coap_register_async: malloc failed\n");
+        return NULL;
+    }
+
+    // Fill the key (padding included, as the key is compared byte by byte)
+    memset(async, 0, sizeof(coap_async_state_t));
+    async->session = session;
+    async->token_length = request->token_length;
+    if (request->token_length)
+        memcpy(async->token, request->token, request->token_length);
+
+    // Copy the request (received PDU is a view over the receive buffer)
+    async->request = coap_pdu_copy(request);
+    if (!async->request) {
+        coap_log(LOG_WARNING, "coap_register_async: cannot copy the request\n");
+        coap_free(async);
+        return NULL;
+    }
+
+    // Fill the rest of the state
+    coap_tick_t now;
+    coap_ticks(&now);
+    async->expires = now + COAP_ASYNC_TIMEOUT * COAP_TICKS_PER_SECOND;
+    async->app_data = app_data;
+
+    // Keep the session alive until the request is answered
+    coap_session_reference(session);
+
+    // Register the state
+    HASH_ADD(hh, context->async_state, session, COAP_ASYNC_KEY_SIZE, async);
+    context->num_async++;
+
+    coap_log(LOG_DEBUG, "** %s: request registered for the separate response\n", coap_session_str(session));
+
+    return async;
+}
+
+
+coap_async_state_t *coap_find_async(coap_session_t *session, const coap_binary_t *token) {
+
+    if (!session->context->async_state || token->length > 8)
+        return NULL;
+
+    // Prepare the key
+    coap_async_state_t key;
+    memset(&key, 0, sizeof(key));
+    key.session = session;
+    key.token_length = token->length;
+    if (token->length)
+        memcpy(key.token, token->s, token->length);
+
+    coap_async_state_t *async = NULL;
+    HASH_FIND(hh, session->context->async_state, &key.session, COAP_ASYNC_KEY_SIZE, async);
+
+    return async;
+}
+
+
+coap_pdu_t *coap_async_response_init(coap_async_state_t *async) {
+
+    coap_session_t *session = async->session;
+
+    // Separate response is confirmable if the request was
+    uint8_t type = (async->request->type == COAP_MESSAGE_CON) ? COAP_MESSAGE_CON : COAP_MESSAGE_NON;
+
+    // Create the response
+    coap_pdu_t *response = coap_pdu_init(type, 0, coap_new_message_id(session), coap_session_max_pdu_size(session));
+    if (!response)
+        return NULL;
+
+    // Response is matched with the request by the token
+    if (!coap_add_token(response, async->token_length, async->token)) {
+        coap_delete_pdu(response);
+        return NULL;
+    }
+
+    return response;
+}
+
+
+coap_tid_t coap_async_send(coap_async_state_t *async, coap_pdu_t *response) {
+
+    if (!response)
+        return COAP_INVALID_TID;
+
+    coap_context_t *context = async->session->context;
+
+    // Send the response
+    coap_tid_t tid = coap_send(async->session, response);
+    if (tid == COAP_INVALID_TID)
+        coap_log(LOG_DEBUG, "coap_async_send: cannot send the separate response\n");
+
+    // The request has been answered
+    coap_async_free(context, async);
+
+    return tid;
+}
+
+
+void coap_remove_async(coap_async_state_t *async) {
+    coap_async_free(async->session->context, async);
+}
+
+
+coap_tick_t coap_async_expire(coap_context_t *context, coap_tick_t now) {
+
+    coap_tick_t timeout = 0;
+    coap_async_state_t *async, *tmp;
+
+    HASH_ITER(hh, context->async_state, async, tmp) {
+
+        // Requests handled by the worker pool are answered by the pool
+        if (async->offloaded)
+            continue;
+
+        // Answer the expired request with 5.03 ...
+        if (async->expires <= now) {
+            coap_log(LOG_DEBUG, "coap_async_expire: request not completed in time\n");
+            coap_pdu_t *response = coap_async_response_init(async);
+            if (response) {
+                response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+                coap_async_send(async, response);
+            } else
+                coap_async_free(context, async);
+        }
+        // ... or update the time remaining to the next expiration
+        else if (timeout == 0 || async->expires - now < timeout)
+            timeout = async->expires - now;
+    }
+
+    return timeout;
+}
+
+
+void coap_async_clear(coap_context_t *context) {
+
+    coap_async_state_t *async, *tmp;
+
+    HASH_ITER(hh, context->async_state, async, tmp)
+        coap_async_free(context, async);
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Unregisters @p async state from the @p context and frees it
+ */
+static void coap_async_free(coap_context_t *context, coap_async_state_t *async) {
+
+    HASH_DELETE(hh, context->async_state, async);
+    context->num_async--;
+
+    coap_session_release(async->session);
+    coap_delete_pdu(async->request);
+    coap_free(async);
+}
@@ -36,7 +36,12 @@
 #include "coap_hashkey.h"
 #include "libcoap.h"
 #include "block.h"
+#include "coap_session.h"
+#include "coap_tcp.h"
+#include "mem.h"
+#include "net.h"
 #include "resource.h"
+#include "utlist.h"
 
 /* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
 
@@ -44,6 +49,29 @@
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+static coap_block1_transfer_t *coap_block1_find(coap_context_t *context, coap_session_t *session, coap_resource_t *resource);
+static coap_block1_transfer_t *coap_block1_create(coap_context_t *context, coap_session_t *session, coap_resource_t *resource, uint8_t code, uint16_t type, coap_tick_t now);
+static void coap_block1_free(coap_context_t *context, coap_block1_transfer_t *transfer);
+static int coap_block1_store(coap_block1_transfer_t *transfer, size_t offset, const uint8_t *data, size_t length);
+static coap_pdu_t *coap_block1_make_request(coap_pdu_t *request, const uint8_t *data, size_t length);
+static void coap_block1_write_opt(coap_pdu_t *response, uint16_t type, const coap_block_t *block);
+static void coap_block1_reject_size(coap_pdu_t *response);
+static int coap_qblock1_handle(coap_session_t *session, coap_resource_t *resource, coap_pdu_t *request, coap_pdu_t *response, coap_pdu_t **body);
+static int coap_qblock1_received(const coap_block1_transfer_t *transfer, unsigned int num);
+static unsigned int coap_qblock1_first_missing(const coap_block1_transfer_t *transfer);
+static void coap_qblock1_report(coap_block1_transfer_t *transfer, coap_pdu_t *response);
+static void coap_qblock1_send_report(coap_block1_transfer_t *transfer, coap_tick_t now);
+static void coap_qblock1_finish(coap_block1_transfer_t *transfer, coap_tick_t now);
+static size_t coap_qblock1_encode_num(uint8_t *buf, unsigned int num);
+static uint16_t coap_block2_type(coap_pdu_t *request);
+static coap_subscription_t *coap_block2_find_observer(coap_resource_t *resource, coap_session_t *session, coap_pdu_t *request, const coap_binary_t *token);
+static size_t coap_block2_copy_data(coap_resource_t *resource, coap_session_t *session, size_t offset, uint8_t *data, size_t length, void *arg);
+static coap_pdu_t *coap_qblock2_make_request(coap_pdu_t *request, const coap_block_t *block);
+
 
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
@@ -201,6 +229,261 @@ int coap_add_block(
 }
 
 
+int coap_block1_handle(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_pdu_t *response,
+    coap_pdu_t **body
+) {
+    // Block1 is meaningful only for requests carrying a body
+    if (request->code == COAP_REQUEST_GET || request->code == COAP_REQUEST_DELETE)
+        return COAP_BLOCK1_NONE;
+
+    // Bodies sent with Q-Block1 option are handled separately
+    coap_opt_iterator_t opt_iter;
+    if (coap_check_option(request, COAP_OPTION_Q_BLOCK1, &opt_iter))
+        return coap_qblock1_handle(session, resource, request, response, body);
+
+    // Check if the request contains Block1 option
+    if (!coap_check_option(request, COAP_OPTION_BLOCK1, &opt_iter))
+        return COAP_BLOCK1_NONE;
+
+    coap_context_t *context = session->context;
+    bool stream = (resource->flags & COAP_RESOURCE_FLAGS_BLOCK1_STREAM) != 0;
+
+    // Parse the option (block's number out of range and the reserved SZX are rejected; BERT is accepted over TCP)
+    coap_block_t block1;
+    bool bert = false;
+    if (!coap_get_block(request, COAP_OPTION_BLOCK1, &block1)) {
+        response->code = COAP_RESPONSE_BAD_REQUEST;
+        return COAP_BLOCK1_ANSWERED;
+    } else if (block1.szx > COAP_MAX_BLOCK_SZX) {
+        if (block1.szx != COAP_BERT_SZX || !coap_tcp_bert(session)) {
+            response->code = COAP_RESPONSE_BAD_REQUEST;
+            return COAP_BLOCK1_ANSWERED;
+        }
+        bert = true;
+    }
+
+    // Get the block's data
+    size_t length = 0;
+    uint8_t *data = NULL;
+    coap_get_data(request, &length, &data);
+
+    // Compute the block's position (BERT blocks are numbered in 1024-byte units)
+    size_t block_size = bert ? COAP_BERT_BLOCK_SIZE : (size_t) 1 << (block1.szx + 4);
+    size_t offset = (size_t) block1.num * block_size;
+
+    // All blocks but the last one must be full (BERT block carries a multiple of 1024 bytes)
+    if (block1.m && (bert ? (length == 0 || length % block_size != 0) : length != block_size)) {
+        response->code = COAP_RESPONSE_BAD_REQUEST;
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    coap_tick_t now;
+    coap_ticks(&now);
+
+    // Get the transfer in progress (the first block restarts the transfer)
+    coap_block1_transfer_t *transfer = coap_block1_find(context, session, resource);
+    if (transfer && (transfer->expires <= now || transfer->type != COAP_OPTION_BLOCK1 || block1.num == 0)) {
+        coap_block1_free(context, transfer);
+        transfer = NULL;
+    }
+
+    // If the first block was received ...
+    if (block1.num == 0) {
+
+        // Check the body's size declared by the client
+        coap_opt_t *size1 = coap_check_option(request, COAP_OPTION_SIZE1, &opt_iter);
+        if (!stream && size1 && coap_decode_var_bytes(coap_opt_value(size1), coap_opt_length(size1)) > COAP_BLOCK1_MAX_BODY_SIZE) {
+            coap_block1_reject_size(response);
+            return COAP_BLOCK1_ANSWERED;
+        }
+
+        // Body sent in a single block does not need to be reassembled
+        if (!block1.m) {
+            *body = request;
+            return COAP_BLOCK1_DELIVER;
+        }
+
+        // Start a new transfer
+        transfer = coap_block1_create(context, session, resource, request->code, COAP_OPTION_BLOCK1, now);
+        if (!transfer) {
+            response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+            return COAP_BLOCK1_ANSWERED;
+        }
+    }
+    // ... otherwise, the block must follow the already received ones
+    else if (!transfer || transfer->code != request->code || transfer->offset != offset) {
+        coap_log(LOG_DEBUG, "coap_block1_handle: unexpected block %u\n", block1.num);
+        response->code = COAP_RESPONSE_REQUEST_ENTITY_INCOMPLETE;
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    // Append the block to the reassembled body
+    if (!stream) {
+
+        // Check the body's size
+        if (offset + length > COAP_BLOCK1_MAX_BODY_SIZE) {
+            coap_block1_free(context, transfer);
+            coap_block1_reject_size(response);
+            return COAP_BLOCK1_ANSWERED;
+        }
+
+        // Copy the block
+        if (!coap_block1_store(transfer, offset, data, length)) {
+            coap_block1_free(context, transfer);
+            response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+            return COAP_BLOCK1_ANSWERED;
+        }
+    }
+
+    // Update transfer's state
+    transfer->offset = offset + length;
+    transfer->expires = now + COAP_BLOCK1_TRANSFER_TIMEOUT * COAP_TICKS_PER_SECOND;
+
+    // In the streaming mode, every block is delivered to the handler (transfer ends with the last one)
+    if (stream) {
+        if (!block1.m)
+            coap_block1_free(context, transfer);
+        *body = request;
+        return COAP_BLOCK1_DELIVER;
+    }
+
+    // Ask for the next block
+    if (block1.m) {
+        response->code = COAP_RESPONSE_CONTINUE;
+        coap_block1_write_opt(response, COAP_OPTION_BLOCK1, &block1);
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    // Deliver the reassembled body
+    *body = coap_block1_make_request(request, transfer->body, transfer->offset);
+    coap_block1_free(context, transfer);
+    if (!*body) {
+        response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    return COAP_BLOCK1_DELIVER;
+}
+
+
+void coap_block1_complete(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_pdu_t *body,
+    coap_pdu_t *response
+) {
+    // Get the block of the request (sent with Block1 or Q-Block1 option)
+    uint16_t type = COAP_OPTION_BLOCK1;
+    coap_block_t block1;
+    int has_block = coap_get_block(request, type, &block1);
+    if (!has_block) {
+        type = COAP_OPTION_Q_BLOCK1;
+        has_block = coap_get_block(request, type, &block1);
+    }
+
+    if (has_block) {
+
+        // In the streaming mode, handler's decision is applied to the not-last block
+        if ((resource->flags & COAP_RESOURCE_FLAGS_BLOCK1_STREAM) && block1.m) {
+
+            coap_block1_transfer_t *transfer = coap_block1_find(session->context, session, resource);
+
+            // Abandon the transfer if the handler failed ...
+            if (COAP_RESPONSE_CLASS(response->code) > 2) {
+                if (transfer)
+                    coap_block1_free(session->context, transfer);
+            }
+            // ... ask for the next block ...
+            else if (type == COAP_OPTION_BLOCK1 || !transfer)
+                response->code = COAP_RESPONSE_CONTINUE;
+            // ... or, for Q-Block1, ask for the next set once all blocks of the current one are received
+            else {
+
+                bool boundary = (block1.num + 1) % COAP_QBLOCK_MAX_PAYLOADS == 0;
+                unsigned int missing = coap_qblock1_first_missing(transfer);
+
+                if ((boundary || transfer->reported) && missing > transfer->highest) {
+                    response->code = COAP_RESPONSE_CONTINUE;
+                    transfer->reported = 0;
+                } else {
+
+                    // Drop the handler's response (blocks inside the set are not answered)
+                    response->code = 0;
+                    response->used_size = response->token_length;
+                    response->max_delta = 0;
+                    response->data = NULL;
+
+                    // Report blocks dropped as they arrived ahead of the expected one
+                    if (boundary && missing <= transfer->highest)
+                        coap_qblock1_report(transfer, response);
+
+                    coap_tick_t now;
+                    coap_ticks(&now);
+                    transfer->report = now + 2 * COAP_QBLOCK_NON_TIMEOUT * COAP_TICKS_PER_SECOND;
+                }
+            }
+        }
+
+        // Acknowledge the received block
+        if (COAP_RESPONSE_CLASS(response->code) == 2)
+            coap_block1_write_opt(response, type, &block1);
+    }
+
+    // Free the reassembled request
+    if (body != request)
+        coap_delete_pdu(body);
+}
+
+
+coap_tick_t coap_block1_expire(coap_context_t *context, coap_tick_t now) {
+
+    coap_tick_t timeout = 0;
+    coap_block1_transfer_t *transfer, *tmp;
+
+    DL_FOREACH_SAFE(context->block1_transfers, transfer, tmp) {
+
+        // Abandon the expired transfer ...
+        if (transfer->expires <= now) {
+            coap_log(LOG_DEBUG, "coap_block1_expire: transfer abandoned\n");
+            coap_block1_free(context, transfer);
+        }
+        // ... or update the time remaining to the next expiration
+        else {
+
+            // Report blocks missing from the stalled Q-Block1 transfer
+            if (transfer->report && transfer->report <= now)
+                coap_qblock1_send_report(transfer, now);
+
+            coap_tick_t next = transfer->expires;
+            if (transfer->report && transfer->report < next)
+                next = transfer->report;
+            if (timeout == 0 || next - now < timeout)
+                timeout = next - now;
+        }
+    }
+
+    return timeout;
+}
+
+
+void coap_block1_remove(
+    coap_context_t *context,
+    const coap_session_t *session,
+    const coap_resource_t *resource
+) {
+    coap_block1_transfer_t *transfer, *tmp;
+
+    DL_FOREACH_SAFE(context->block1_transfers, transfer, tmp)
+        if ((session && transfer->session == session) || (resource && transfer->resource == resource))
+            coap_block1_free(context, transfer);
+}
+
+
 void coap_add_data_blocked_response(
     coap_resource_t *resource,
     coap_session_t *session,
@@ -213,8 +496,23 @@ void coap_add_data_blocked_response(
     const uint8_t* data
 ) {
 
+    // BERT blocks (unless the client asked for a smaller one) are cut from the data by the producer's path
+    coap_block_t requested;
+    if (coap_tcp_bert(session) && coap_block2_type(request) == COAP_OPTION_BLOCK2 &&
+        (!request || !coap_get_block(request, COAP_OPTION_BLOCK2, &requested) || requested.szx == COAP_BERT_SZX)) {
+
+        coap_key_t etag;
+        memset(etag, 0, sizeof(etag));
+        coap_hash(data, length, etag);
+        const coap_binary_t etag_binary = { sizeof(etag), etag };
+
+        coap_add_data_produced_response(resource, session, request, response, token, media_type, maxage,
+            &etag_binary, length, coap_block2_copy_data, (void *) data);
+        return;
+    }
+
     coap_subscription_t *subscription =
-        coap_find_observer(resource, session, token);
+        coap_block2_find_observer(resource, session, request, token);
 
     /*
     * Need to check that a valid block is getting asked for so that the
@@ -222,12 +520,13 @@ void coap_add_data_blocked_response(
     */
     coap_block_t block2 = { 0, 0, 0 };
     int block2_requested = 0;
+    uint16_t block2_type = coap_block2_type(request);
 
     // If created message is associated with some request ...
     if(request){
 
         // Check requested block parameters
-        if (coap_get_block(request, COAP_OPTION_BLOCK2, &block2)) {
+        if (coap_get_block(request, block2_type, &block2)) {
 
             // Denote that Block2 was requested
             block2_requested = 1;
@@ -309,9 +608,14 @@ void coap_add_data_blocked_response(
         size_t size_two_opt_len = 
             coap_encode_var_safe(opt_val, sizeof(opt_val), length);
 
+        // Q-Block2 option follows the 'Size2' one, so 'Size2' is written first in such a case
+        int q_block2 = (block2_type == COAP_OPTION_Q_BLOCK2);
+        if (q_block2)
+            coap_add_option(response, COAP_OPTION_SIZE2, size_two_opt_len, opt_val);
+
         // Write 'Block2' option as the last one
         int res = 
-            coap_write_block_opt(&block2, COAP_OPTION_BLOCK2, response, length + (size_two_opt_len + 1));
+            coap_write_block_opt(&block2, block2_type, response, length + (q_block2 ? 0 : size_two_opt_len + 1));
 
         /**
          * @note: At this place we know exactly how much will the Size2 option as
@@ -329,12 +633,13 @@ void coap_add_data_blocked_response(
         }
 
         // Write 'Size2' option
-        coap_add_option(
-            response,
-            COAP_OPTION_SIZE2,
-            size_two_opt_len,
-            opt_val
-        );
+        if (!q_block2)
+            coap_add_option(
+                response,
+                COAP_OPTION_SIZE2,
+                size_two_opt_len,
+                opt_val
+            );
 
         // Write data block into PDU
         coap_add_block(response, length, data, &block2);
@@ -373,3 +678,855 @@ error:
         (const unsigned char *)coap_response_phrase(response->code)
     );
 }
+
+
+void coap_add_data_produced_response(
+    coap_resource_t *resource,
+    coap_session_t *session,
+    coap_pdu_t *request,
+    coap_pdu_t *response,
+    const coap_binary_t *token,
+    uint16_t media_type,
+    int maxage,
+    const coap_binary_t *etag,
+    size_t length,
+    coap_block2_producer_t producer,
+    void *arg
+) {
+    coap_subscription_t *subscription =
+        coap_block2_find_observer(resource, session, request, token);
+
+    int length_known = (length != COAP_BLOCK2_LENGTH_UNKNOWN);
+
+    uint16_t block2_type = coap_block2_type(request);
+
+    // BERT blocks are sent within TCP sessions whose peer supports them
+    int bert = coap_tcp_bert(session) && block2_type == COAP_OPTION_BLOCK2;
+    uint8_t default_szx = bert ? COAP_BERT_SZX : COAP_MAX_BLOCK_SZX;
+
+    // Requested block (the first one of the largest size, by default)
+    coap_block_t block2 = { 0, 0, default_szx };
+    int block2_requested = 0;
+
+    // If created message is associated with some request, check requested block parameters
+    if (request) {
+        if (coap_get_block(request, block2_type, &block2))
+            block2_requested = 1;
+        else
+            block2.szx = default_szx;
+    }
+    // Otherwise, check if subscriber to be notified has the Block2 option set
+    else if (subscription && subscription->has_block2) {
+        block2_requested = 1;
+        block2 = subscription->block2;
+        block2.num = 0;
+    }
+
+    // Reserved SZX (BERT) is supported over TCP only
+    if (block2.szx > COAP_MAX_BLOCK_SZX && !bert)
+        block2.szx = COAP_MAX_BLOCK_SZX;
+
+    // If requested block is outside of the data scope ... (BERT blocks are numbered in 1024-byte units)
+    size_t offset = (block2.szx == COAP_BERT_SZX) ?
+        (size_t) block2.num * COAP_BERT_BLOCK_SIZE : (size_t) block2.num << (block2.szx + 4);
+    if (length_known && offset > 0 && offset >= length) {
+        coap_log(LOG_DEBUG, "Illegal block requested (%u)\n", block2.num);
+        response->code = COAP_RESPONSE_BAD_REQUEST;
+        goto error;
+    }
+
+    // Set default response code
+    response->code = COAP_RESPONSE_CONTENT;
+
+    unsigned char opt_val[4];
+    size_t opt_len;
+
+    // Add etag for the resource
+    if (etag && etag->length)
+        coap_add_option(response, COAP_OPTION_ETAG, etag->length, etag->s);
+
+    // If message is sent as the first block of notification, add 'Observe' option to the PDU
+    if (block2.num == 0 && subscription != NULL){
+        opt_len = coap_encode_var_safe(opt_val, sizeof(opt_val), resource->observe);
+        coap_add_option(response, COAP_OPTION_OBSERVE, opt_len, opt_val);
+    }
+
+    // Add 'Content-type' option to the PDU
+    opt_len = coap_encode_var_safe(opt_val, sizeof(opt_val), media_type);
+    coap_add_option(response, COAP_OPTION_CONTENT_FORMAT, opt_len, opt_val);
+
+    // If maxage is set, add 'Maxage' option to the PDU
+    if (maxage >= 0) {
+        opt_len = coap_encode_var_safe(opt_val, sizeof(opt_val), maxage);
+        coap_add_option(response, COAP_OPTION_MAXAGE, opt_len, opt_val);
+    }
+
+    // Send the whole representation, if it fits into the PDU ...
+    if (!block2_requested && length_known && response->used_size + 1 + length <= response->max_size) {
+
+        if (length) {
+            uint8_t *payload = coap_add_data_after(response, length);
+            if (!payload) {
+                response->code = COAP_RESPONSE_INTERNAL_SERVER_ERROR;
+                goto error;
+            }
+            size_t written = producer(resource, session, 0, payload, length, arg);
+            if (written < length)
+                response->used_size -= length - written;
+        }
+
+        return;
+    }
+
+    // ... otherwise, compute space available for the block (Block2 option takes up to 4
+    // bytes, Size2 up to 5 bytes and the payload marker 1 byte)
+    size_t reserved = response->used_size + 4 + (length_known ? 5 : 0) + 1;
+    size_t available = response->max_size > reserved ? response->max_size - reserved : 0;
+
+    // BERT block carries as many 1024-byte blocks as the PDU can hold (at least one)
+    size_t block_size = 0;
+    if (block2.szx == COAP_BERT_SZX) {
+        block_size = available / COAP_BERT_BLOCK_SIZE * COAP_BERT_BLOCK_SIZE;
+        // Otherwise, fall back to a 1024-byte block (numbered in the same units) and shrink it
+        if (block_size == 0)
+            block2.szx = COAP_BERT_SZX - 1;
+    }
+
+    // Decrease the block's size, if it does not fit into the PDU
+    if (block2.szx != COAP_BERT_SZX) {
+        while (block2.szx > 0 && ((size_t) 16 << block2.szx) > available) {
+            block2.szx--;
+            block2.num <<= 1;
+        }
+        block_size = (size_t) 16 << block2.szx;
+    }
+    if (block_size > available) {
+        coap_log(LOG_DEBUG, "not enough space, even the smallest block does not fit");
+        response->code = COAP_RESPONSE_INTERNAL_SERVER_ERROR;
+        goto error;
+    }
+
+    // Write 'Size2' option (before the Q-Block2 one, as it follows the 'Size2')
+    if (length_known && block2_type == COAP_OPTION_Q_BLOCK2) {
+        opt_len = coap_encode_var_safe(opt_val, sizeof(opt_val), length);
+        coap_add_option(response, COAP_OPTION_SIZE2, opt_len, opt_val);
+    }
+
+    // Reserve the 'Block2' option (its value is written when the block's length is known)
+    size_t block2_len = coap_encode_var_safe(opt_val, sizeof(opt_val), (block2.num << 4) | (1 << 3) | block2.szx);
+    uint8_t *block2_val = coap_add_option_later(response, block2_type, block2_len);
+    if (!block2_val) {
+        response->code = COAP_RESPONSE_INTERNAL_SERVER_ERROR;
+        goto error;
+    }
+    size_t block2_pos = block2_val - response->token;
+
+    // Write 'Size2' option
+    if (length_known && block2_type == COAP_OPTION_BLOCK2) {
+        opt_len = coap_encode_var_safe(opt_val, sizeof(opt_val), length);
+        coap_add_option(response, COAP_OPTION_SIZE2, opt_len, opt_val);
+    }
+
+    // Produce the block straight into the PDU
+    size_t to_produce = length_known ? min(block_size, length - offset) : block_size;
+    size_t written = 0;
+    if (to_produce) {
+        uint8_t *payload = coap_add_data_after(response, to_produce);
+        if (!payload) {
+            response->code = COAP_RESPONSE_INTERNAL_SERVER_ERROR;
+            goto error;
+        }
+        written = producer(resource, session, offset, payload, to_produce, arg);
+        if (written > to_produce)
+            written = to_produce;
+
+        // Drop the unused space (and the payload marker, if nothing was written)
+        response->used_size -= to_produce - written;
+        if (written == 0) {
+            response->used_size--;
+            response->data = NULL;
+        }
+    }
+
+    // Check if more blocks follow
+    if (length_known)
+        block2.m = offset + written < length;
+    else
+        block2.m = written == block_size;
+
+    // Write value of the 'Block2' option (with the same length as reserved)
+    unsigned int value = (block2.num << 4) | (block2.m << 3) | block2.szx;
+    for (size_t i = 0; i < block2_len; i++)
+        response->token[block2_pos + i] = (uint8_t) (value >> (8 * (block2_len - 1 - i)));
+
+    return;
+
+error:
+    // On error, set payload to the human-readable error code
+    coap_add_data(
+        response,
+        strlen(coap_response_phrase(response->code)),
+        (const unsigned char *)coap_response_phrase(response->code)
+    );
+}
+
+
+void coap_qblock2_send_set(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_string_t *query,
+    const coap_block_t *block
+) {
+    coap_method_handler_t handler = resource->handler[COAP_REQUEST_GET - 1];
+    if (!handler)
+        return;
+
+    // Request's token (used by every block of the set)
+    coap_binary_t token = { request->token_length, request->token };
+
+    // Iterate over Q-Block2 options of the request (the first one has been already answered)
+    coap_opt_filter_t filter;
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_Q_BLOCK2);
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, filter);
+    coap_opt_t *option = coap_option_next(&opt_iter);
+
+    // Check whether the client asks for the whole set or for the listed blocks only
+    int whole_set = option && COAP_OPT_BLOCK_MORE(option);
+    if (whole_set && !block->m)
+        return;
+
+    coap_block_t next = *block;
+    for (unsigned int sent = 1; sent < COAP_QBLOCK_MAX_PAYLOADS; sent++) {
+
+        // Pick the next block of the set ...
+        if (whole_set)
+            next.num++;
+        // ... or the next block listed by the client
+        else {
+            if (!(option = coap_option_next(&opt_iter)))
+                break;
+            next.num = coap_opt_block_num(option);
+            next.szx = COAP_OPT_BLOCK_SZX(option);
+        }
+        next.m = 0;
+
+        // Create the request asking for the single block and the response
+        coap_pdu_t *block_request = coap_qblock2_make_request(request, &next);
+        coap_pdu_t *response = coap_pdu_init(
+            COAP_MESSAGE_NON,
+            0,
+            coap_new_message_id(session),
+            coap_session_max_pdu_size(session)
+        );
+        if (!block_request || !response || !coap_add_token(response, request->token_length, request->token)) {
+            coap_log(LOG_WARNING, "coap_qblock2_send_set: cannot create the response\n");
+            coap_delete_pdu(block_request);
+            coap_delete_pdu(response);
+            break;
+        }
+
+        // Render the block
+        handler(resource, session, block_request, &token, query, response);
+        coap_delete_pdu(block_request);
+
+        // Stop if the block could not be rendered
+        coap_block_t rendered;
+        if (response->code != COAP_RESPONSE_CONTENT || !coap_get_block(response, COAP_OPTION_Q_BLOCK2, &rendered)) {
+            coap_log(LOG_DEBUG, "coap_qblock2_send_set: block %u not rendered\n", next.num);
+            coap_delete_pdu(response);
+            break;
+        }
+
+        // Send the block
+        if (coap_send(session, response) == COAP_INVALID_TID) {
+            coap_log(LOG_DEBUG, "coap_qblock2_send_set: cannot send block %u\n", next.num);
+            break;
+        }
+
+        // Stop after the last block (the handler may also have decreased the block's size)
+        if (whole_set) {
+            if (!rendered.m)
+                break;
+            next = rendered;
+        }
+    }
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Finds the Block1 transfer of the @p session to the @p resource
+ */
+static coap_block1_transfer_t *coap_block1_find(
+    coap_context_t *context,
+    coap_session_t *session,
+    coap_resource_t *resource
+) {
+    coap_block1_transfer_t *transfer;
+    DL_FOREACH(context->block1_transfers, transfer)
+        if (transfer->session == session && transfer->resource == resource)
+            return transfer;
+
+    return NULL;
+}
+
+
+/**
+ * @brief: Creates a new Block1 transfer of the @p session to the @p resource. Expired
+ *    transfers are abandoned first.
+ * 
+ * @returns:
+ *    the new transfer on success
+ *    NULL if COAP_BLOCK1_MAX_TRANSFERS are in progress or allocation failed
+ */
+static coap_block1_transfer_t *coap_block1_create(
+    coap_context_t *context,
+    coap_session_t *session,
+    coap_resource_t *resource,
+    uint8_t code,
+    uint16_t type,
+    coap_tick_t now
+) {
+    // Make room for the new transfer (finished Q-Block1 transfers are dropped first)
+    coap_block1_expire(context, now);
+    if (context->num_block1_transfers >= COAP_BLOCK1_MAX_TRANSFERS) {
+        coap_block1_transfer_t *finished;
+        DL_FOREACH(context->block1_transfers, finished)
+            if (finished->done)
+                break;
+        if (finished)
+            coap_block1_free(context, finished);
+    }
+    if (context->num_block1_transfers >= COAP_BLOCK1_MAX_TRANSFERS) {
+        coap_log(LOG_DEBUG, "coap_block1_create: too many transfers in progress\n");
+        return NULL;
+    }
+
+    // Allocate the transfer
+    coap_block1_transfer_t *transfer =
+        (coap_block1_transfer_t *) coap_malloc(sizeof(coap_block1_transfer_t));
+    if (!transfer) {
+        coap_log(LOG_WARNING, "coap_block1_create: malloc failed\n");
+        return NULL;
+    }
+
+    // Fill the transfer
+    memset(transfer, 0, sizeof(coap_block1_transfer_t));
+    transfer->session = session;
+    transfer->resource = resource;
+    transfer->code = code;
+    transfer->type = type;
+
+    // Register the transfer
+    DL_APPEND(context->block1_transfers, transfer);
+    context->num_block1_transfers++;
+
+    return transfer;
+}
+
+
+/**
+ * @brief: Unlinks @p transfer from the @p context and frees it
+ */
+static void coap_block1_free(coap_context_t *context, coap_block1_transfer_t *transfer) {
+
+    DL_DELETE(context->block1_transfers, transfer);
+    context->num_block1_transfers--;
+
+    coap_free(transfer->body);
+    coap_free(transfer);
+}
+
+
+/**
+ * @brief: Copies the block of @p length bytes at @p offset into the @p transfer's body, growing
+ *    its storage if needed
+ *
+ * @returns:
+ *    1 on success
+ *    0 if the storage could not be grown
+ */
+static int coap_block1_store(coap_block1_transfer_t *transfer, size_t offset, const uint8_t *data, size_t length) {
+
+    // Grow the body's storage
+    if (offset + length > transfer->capacity) {
+        size_t capacity = min(max(2 * transfer->capacity, offset + length), COAP_BLOCK1_MAX_BODY_SIZE);
+        uint8_t *new_body = (uint8_t *) realloc(transfer->body, capacity);
+        if (!new_body) {
+            coap_log(LOG_WARNING, "coap_block1_store: realloc failed\n");
+            return 0;
+        }
+        transfer->body = new_body;
+        transfer->capacity = capacity;
+    }
+
+    // Copy the block
+    if (length)
+        memcpy(transfer->body + offset, data, length);
+
+    return 1;
+}
+
+
+/**
+ * @brief: Creates a copy of the @p request with the payload replaced by the reassembled body
+ *    (Block1, Q-Block1 and Size1 options are skipped)
+ */
+static coap_pdu_t *coap_block1_make_request(coap_pdu_t *request, const uint8_t *data, size_t length) {
+
+    // Create the PDU (size of the reassembled request is not limited)
+    coap_pdu_t *body = coap_pdu_init(request->type, request->code, request->tid, 0);
+    if (!body || !coap_add_token(body, request->token_length, request->token))
+        goto error;
+
+    // Copy options
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+    coap_opt_t *option;
+    while ((option = coap_option_next(&opt_iter))) {
+        if (opt_iter.type == COAP_OPTION_BLOCK1 || opt_iter.type == COAP_OPTION_Q_BLOCK1 ||
+            opt_iter.type == COAP_OPTION_SIZE1)
+            continue;
+        if (!coap_add_option(body, opt_iter.type, coap_opt_length(option), coap_opt_value(option)))
+            goto error;
+    }
+
+    // Add the body
+    if (!coap_add_data(body, length, data))
+        goto error;
+
+    return body;
+
+error:
+    coap_log(LOG_WARNING, "coap_block1_make_request: cannot create the request\n");
+    coap_delete_pdu(body);
+    return NULL;
+}
+
+
+/**
+ * @brief: Inserts Block1 (or Q-Block1, depending on @p type) option describing the @p block
+ *    into the @p response
+ */
+static void coap_block1_write_opt(coap_pdu_t *response, uint16_t type, const coap_block_t *block) {
+
+    unsigned char buf[4];
+    size_t length =
+        coap_encode_var_safe(buf, sizeof(buf), ((block->num << 4) | (block->m << 3) | block->szx));
+
+    coap_insert_option(response, type, length, buf);
+}
+
+
+/**
+ * @brief: Fills the @p response with 4.13 (Request Entity Too Large) and the Size1 option
+ *    holding the maximal body's size
+ */
+static void coap_block1_reject_size(coap_pdu_t *response) {
+
+    response->code = COAP_RESPONSE_REQUEST_ENTITY_TOO_LARGE;
+
+    unsigned char buf[4];
+    size_t length = coap_encode_var_safe(buf, sizeof(buf), COAP_BLOCK1_MAX_BODY_SIZE);
+    coap_add_option(response, COAP_OPTION_SIZE1, length, buf);
+}
+
+
+
+/**
+ * @brief: Handles the Q-Block1 option of the @p request (@see coap_block1_handle())
+ */
+static int coap_qblock1_handle(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    coap_pdu_t *response,
+    coap_pdu_t **body
+) {
+    coap_context_t *context = session->context;
+    bool stream = (resource->flags & COAP_RESOURCE_FLAGS_BLOCK1_STREAM) != 0;
+
+    // Parse the option (block's number out of range and the reserved SZX are rejected)
+    coap_block_t block1;
+    if (!coap_get_block(request, COAP_OPTION_Q_BLOCK1, &block1) || block1.szx > COAP_MAX_BLOCK_SZX) {
+        response->code = COAP_RESPONSE_BAD_REQUEST;
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    // Get the block's data
+    size_t length = 0;
+    uint8_t *data = NULL;
+    coap_get_data(request, &length, &data);
+
+    // Compute the block's position
+    size_t block_size = (size_t) 1 << (block1.szx + 4);
+    size_t offset = (size_t) block1.num << (block1.szx + 4);
+
+    // All blocks but the last one must be full
+    if (block1.m && length != block_size) {
+        response->code = COAP_RESPONSE_BAD_REQUEST;
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    coap_tick_t now;
+    coap_ticks(&now);
+
+    // Get the transfer in progress (transfer of another kind or with another block size is abandoned)
+    coap_block1_transfer_t *transfer = coap_block1_find(context, session, resource);
+    if (transfer && (transfer->expires <= now || transfer->type != COAP_OPTION_Q_BLOCK1 ||
+                     transfer->code != request->code || transfer->szx != block1.szx)) {
+        coap_block1_free(context, transfer);
+        transfer = NULL;
+    }
+
+    // Finished transfer absorbs late duplicates of its blocks ...
+    if (transfer && transfer->done && block1.num != 0)
+        return COAP_BLOCK1_ANSWERED;
+
+    // ... while the first block received once again starts a new body
+    if (transfer && block1.num == 0 && (transfer->done || coap_qblock1_received(transfer, 0))) {
+        coap_block1_free(context, transfer);
+        transfer = NULL;
+    }
+
+    // Check the body's size (declared by the client or implied by the block's position)
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *size1 = coap_check_option(request, COAP_OPTION_SIZE1, &opt_iter);
+    if (!stream && ((size1 && coap_decode_var_bytes(coap_opt_value(size1), coap_opt_length(size1)) > COAP_BLOCK1_MAX_BODY_SIZE) ||
+                    offset + length > COAP_BLOCK1_MAX_BODY_SIZE || block1.num >= COAP_QBLOCK1_MAX_BLOCKS)) {
+        if (transfer)
+            coap_block1_free(context, transfer);
+        coap_block1_reject_size(response);
+        return COAP_BLOCK1_ANSWERED;
+    }
+
+    // Start a new transfer (blocks of the set may arrive in any order) ...
+    if (!transfer) {
+
+        // Body sent in a single block does not need to be reassembled
+        if (block1.num == 0 && !block1.m) {
+            *body = request;
+            return COAP_BLOCK1_DELIVER;
+        }
+
+        transfer = coap_block1_create(context, session, resource, request->code, COAP_OPTION_Q_BLOCK1, now);
+        if (!transfer) {
+            response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+            return COAP_BLOCK1_ANSWERED;
+        }
+        transfer->szx = block1.szx;
+    }
+    // ... or ignore the block following the last one
+    else if (transfer->total && block1.num >= transfer->total)
+        return COAP_BLOCK1_ANSWERED;
+
+    // Update transfer's state
+    transfer->expires = now + COAP_BLOCK1_TRANSFER_TIMEOUT * COAP_TICKS_PER_SECOND;
+    transfer->report = 0;
+    transfer->token_length = request->token_length;
+    memcpy(transfer->token, request->token, request->token_length);
+    if (block1.num > transfer->highest)
+        transfer->highest = block1.num;
+    if (!block1.m)
+        transfer->total = block1.num + 1;
+
+    // In the streaming mode, the expected block is delivered to the handler (transfer ends with the last one) ...
+    if (stream) {
+        if (offset == transfer->offset) {
+            transfer->offset = offset + length;
+            if (!block1.m)
+                coap_qblock1_finish(transfer, now);
+            *body = request;
+            return COAP_BLOCK1_DELIVER;
+        }
+    }
+    // ... otherwise, the block is copied into the reassembled body
+    else {
+
+        if (!coap_block1_store(transfer, offset, data, length)) {
+            coap_block1_free(context, transfer);
+            response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+            return COAP_BLOCK1_ANSWERED;
+        }
+        transfer->received[block1.num / 8] |= (uint8_t) (1 << (block1.num % 8));
+        if (offset + length > transfer->offset)
+            transfer->offset = offset + length;
+
+        // Deliver the body once all its blocks are received
+        if (transfer->total && coap_qblock1_first_missing(transfer) >= transfer->total) {
+            *body = coap_block1_make_request(request, transfer->body, transfer->offset);
+            coap_qblock1_finish(transfer, now);
+            if (!*body) {
+                response->code = COAP_RESPONSE_SERVICE_UNAVAILABLE;
+                return COAP_BLOCK1_ANSWERED;
+            }
+            return COAP_BLOCK1_DELIVER;
+        }
+    }
+
+    // Answer the last block of the set (or the block filling the gaps reported earlier) ...
+    bool boundary = !block1.m || (block1.num + 1) % COAP_QBLOCK_MAX_PAYLOADS == 0;
+    unsigned int missing = coap_qblock1_first_missing(transfer);
+    if (boundary || (transfer->reported && missing > transfer->highest)) {
+
+        // ... asking for the next set, if all blocks received so far are in order ...
+        if (missing > transfer->highest) {
+            coap_block_t next = { transfer->highest, 1, transfer->szx };
+            response->code = COAP_RESPONSE_CONTINUE;
+            coap_block1_write_opt(response, COAP_OPTION_Q_BLOCK1, &next);
+            transfer->reported = 0;
+            return COAP_BLOCK1_ANSWERED;
+        }
+
+        // ... or reporting the missing ones
+        coap_qblock1_report(transfer, response);
+    }
+
+    // Report missing blocks if no block arrives for the NON_RECEIVE_TIMEOUT
+    transfer->report = now + 2 * COAP_QBLOCK_NON_TIMEOUT * COAP_TICKS_PER_SECOND;
+
+    return COAP_BLOCK1_ANSWERED;
+}
+
+
+/**
+ * @brief: Checks whether the block @p num of the Q-Block1 @p transfer has been received
+ */
+static int coap_qblock1_received(const coap_block1_transfer_t *transfer, unsigned int num) {
+
+    // In the streaming mode, blocks are received in order
+    if (transfer->resource->flags & COAP_RESOURCE_FLAGS_BLOCK1_STREAM)
+        return num < (transfer->offset >> (transfer->szx + 4));
+
+    if (num >= COAP_QBLOCK1_MAX_BLOCKS)
+        return 0;
+
+    return (transfer->received[num / 8] >> (num % 8)) & 1;
+}
+
+
+/**
+ * @returns:
+ *    number of the first block of the Q-Block1 @p transfer that has not been received
+ *    (transfer->highest + 1 if all blocks received so far are in order)
+ */
+static unsigned int coap_qblock1_first_missing(const coap_block1_transfer_t *transfer) {
+
+    unsigned int num = 0;
+    while (num <= transfer->highest && coap_qblock1_received(transfer, num))
+        num++;
+
+    return num;
+}
+
+
+/**
+ * @brief: Fills the @p response with 4.08 (Request Entity Incomplete) listing blocks of the
+ *    Q-Block1 @p transfer missing below the highest received one (as many as fit into the
+ *    @p response)
+ */
+static void coap_qblock1_report(coap_block1_transfer_t *transfer, coap_pdu_t *response) {
+
+    response->code = COAP_RESPONSE_REQUEST_ENTITY_INCOMPLETE;
+    transfer->reported = 1;
+
+    // Add 'Content-type' option to the PDU
+    unsigned char buf[4];
+    size_t length = coap_encode_var_safe(buf, sizeof(buf), COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ);
+    coap_add_option(response, COAP_OPTION_CONTENT_FORMAT, length, buf);
+
+    // Reserve all the space left in the PDU for the payload
+    size_t available = response->max_size > response->used_size + 1 ? response->max_size - response->used_size - 1 : 0;
+    uint8_t *payload = available ? coap_add_data_after(response, available) : NULL;
+    if (!payload)
+        return;
+
+    // Write numbers of the missing blocks as a CBOR sequence of unsigned integers (RFC 9177, section 5)
+    size_t used = 0;
+    for (unsigned int num = coap_qblock1_first_missing(transfer); num <= transfer->highest; num++) {
+        if (coap_qblock1_received(transfer, num))
+            continue;
+        if (available - used < 5)
+            break;
+        used += coap_qblock1_encode_num(payload + used, num);
+    }
+
+    // Drop the unused space (and the payload marker, if nothing was written)
+    response->used_size -= available - used;
+    if (used == 0) {
+        response->used_size--;
+        response->data = NULL;
+    }
+}
+
+
+/**
+ * @brief: Sends the report of blocks missing from the stalled Q-Block1 @p transfer (as a
+ *    non-confirmable response with the token of the latest block) and schedules the next one
+ */
+static void coap_qblock1_send_report(coap_block1_transfer_t *transfer, coap_tick_t now) {
+
+    transfer->report = 0;
+
+    // Nothing to report if all blocks received so far are in order
+    if (coap_qblock1_first_missing(transfer) > transfer->highest)
+        return;
+
+    // Create the response
+    coap_session_t *session = transfer->session;
+    coap_pdu_t *response = coap_pdu_init(
+        COAP_MESSAGE_NON,
+        0,
+        coap_new_message_id(session),
+        coap_session_max_pdu_size(session)
+    );
+    if (!response || !coap_add_token(response, transfer->token_length, transfer->token)) {
+        coap_log(LOG_WARNING, "coap_qblock1_send_report: cannot create the report\n");
+        coap_delete_pdu(response);
+        return;
+    }
+
+    // Send the report
+    coap_qblock1_report(transfer, response);
+    if (coap_send(session, response) == COAP_INVALID_TID)
+        coap_log(LOG_DEBUG, "coap_qblock1_send_report: cannot send the report\n");
+
+    // Repeat the report if missing blocks do not arrive
+    transfer->report = now + 2 * COAP_QBLOCK_NON_TIMEOUT * COAP_TICKS_PER_SECOND;
+}
+
+
+/**
+ * @brief: Marks the Q-Block1 @p transfer whose body has been delivered as finished. It's kept
+ *    (without the body) for the NON_RECEIVE_TIMEOUT, so that late duplicates of its blocks do
+ *    not start a new transfer.
+ */
+static void coap_qblock1_finish(coap_block1_transfer_t *transfer, coap_tick_t now) {
+
+    coap_free(transfer->body);
+    transfer->body = NULL;
+    transfer->capacity = 0;
+
+    transfer->done = 1;
+    transfer->report = 0;
+    transfer->expires = now + 2 * COAP_QBLOCK_NON_TIMEOUT * COAP_TICKS_PER_SECOND;
+}
+
+
+/**
+ * @brief: Encodes @p num as a CBOR unsigned integer
+ *
+ * @returns:
+ *    number of bytes written to @p buf (at most 5)
+ */
+static size_t coap_qblock1_encode_num(uint8_t *buf, unsigned int num) {
+
+    // Small values are held by the initial byte ...
+    if (num < 24) {
+        buf[0] = (uint8_t) num;
+        return 1;
+    }
+
+    // ... larger ones follow it in 1, 2 or 4 bytes
+    size_t length = num <= 0xFF ? 1 : num <= 0xFFFF ? 2 : 4;
+    buf[0] = (uint8_t) (length == 1 ? 0x18 : length == 2 ? 0x19 : 0x1A);
+    for (size_t i = 0; i < length; i++)
+        buf[1 + i] = (uint8_t) (num >> (8 * (length - 1 - i)));
+
+    return 1 + length;
+}
+
+
+/**
+ * @returns:
+ *    COAP_OPTION_Q_BLOCK2 if the @p request (may be NULL) contains Q-Block2 option
+ *    COAP_OPTION_BLOCK2 otherwise
+ */
+static uint16_t coap_block2_type(coap_pdu_t *request) {
+
+    coap_opt_iterator_t opt_iter;
+    if (request && coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter))
+        return COAP_OPTION_Q_BLOCK2;
+
+    return COAP_OPTION_BLOCK2;
+}
+
+
+/**
+ * @brief: Looks for the subscription that the response is built for. Only notifications
+ *    (@p request is NULL) and requests with the Observe option are looked for, so that
+ *    handlers offloaded to the worker pool do not touch the context's index of observers.
+ */
+static coap_subscription_t *coap_block2_find_observer(
+    coap_resource_t *resource,
+    coap_session_t *session,
+    coap_pdu_t *request,
+    const coap_binary_t *token
+) {
+    coap_opt_iterator_t opt_iter;
+    if (request && !coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter))
+        return NULL;
+
+    return coap_find_observer(resource, session, token);
+}
+
+
+/**
+ * @brief: Producer copying the representation from the buffer pointed by the @p arg
+ */
+static size_t coap_block2_copy_data(
+    coap_resource_t *resource,
+    coap_session_t *session,
+    size_t offset,
+    uint8_t *data,
+    size_t length,
+    void *arg
+) {
+    memcpy(data, (const uint8_t *) arg + offset, length);
+    return length;
+}
+
+
+/**
+ * @brief: Creates a copy of the GET @p request with its Q-Block2 options replaced by the single
+ *    one describing the @p block
+ */
+static coap_pdu_t *coap_qblock2_make_request(coap_pdu_t *request, const coap_block_t *block) {
+
+    // Create the PDU
+    coap_pdu_t *copy = coap_pdu_init(request->type, request->code, request->tid, 0);
+    if (!copy || !coap_add_token(copy, request->token_length, request->token))
+        goto error;
+
+    // Encode the Q-Block2 option
+    unsigned char buf[4];
+    size_t length =
+        coap_encode_var_safe(buf, sizeof(buf), ((block->num << 4) | (block->m << 3) | block->szx));
+    int written = 0;
+
+    // Copy options (Q-Block2 option is written in place of the first original one)
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+    coap_opt_t *option;
+    while ((option = coap_option_next(&opt_iter))) {
+        if (opt_iter.type == COAP_OPTION_Q_BLOCK2) {
+            if (!written && !coap_add_option(copy, COAP_OPTION_Q_BLOCK2, length, buf))
+                goto error;
+            written = 1;
+            continue;
+        }
+        if (!coap_add_option(copy, opt_iter.type, coap_opt_length(option), coap_opt_value(option)))
+            goto error;
+    }
+
+    return copy;
+
+error:
+    coap_log(LOG_WARNING, "coap_qblock2_make_request: cannot create the request\n");
+    coap_delete_pdu(copy);
+    return NULL;
+}
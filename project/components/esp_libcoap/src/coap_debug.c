@@ -529,6 +529,10 @@ int coap_debug_set_packet_loss(const char *loss_level) {
 
 int coap_debug_send_packet(void){
 
+    // Packets are not counted unless loss is simulated (counter would be shared by shards' threads)
+    if (num_packet_loss_intervals == 0 && packet_loss_level == 0)
+        return 1;
+
     // Increment packet's counter
     ++send_packet_count;
 
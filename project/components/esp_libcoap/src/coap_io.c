@@ -46,6 +46,13 @@
 #include "utlist.h"
 #include "resource.h"
 
+static int coap_select_init(coap_context_t *context);
+static void coap_select_release(coap_context_t *context);
+static int coap_select_add(coap_context_t *context, coap_socket_t *sock);
+static void coap_select_del(coap_context_t *context, coap_socket_t *sock);
+static void coap_select_want_write(coap_context_t *context, coap_socket_t *sock, int enable);
+static int coap_select_wait(coap_context_t *context, unsigned int timeout_ms);
+
 
 /* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
 
@@ -61,6 +68,37 @@
 #endif
 
 
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: State of the select()-based I/O backend kept between coap_run_once() calls
+ */
+typedef struct coap_select_state_t {
+
+    // Set of the registered sockets' descriptors
+    fd_set readfds;
+    // Set of the descriptors of sockets with pending output
+    fd_set writefds;
+    // Number of descriptors in @a writefds
+    unsigned int num_write;
+    // Highest registered descriptor plus 1
+    coap_fd_t nfds;
+
+} coap_select_state_t;
+
+
+/* ---------------------------------------- [Global and static data] ------------------------------------------ */
+
+const coap_io_backend_t coap_io_select_backend = {
+    .init       = coap_select_init,
+    .release    = coap_select_release,
+    .add        = coap_select_add,
+    .del        = coap_select_del,
+    .want_write = coap_select_want_write,
+    .wait       = coap_select_wait
+};
+
+
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
 
@@ -103,6 +141,16 @@ int coap_socket_bind_udp(
             coap_socket_strerror());
     }
 
+#ifdef SO_REUSEPORT
+    // Let sockets of several contexts share the port
+    if (sock->flags & COAP_SOCKET_REUSE_PORT) {
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR){
+            coap_log(LOG_WARNING, "coap_socket_bind_udp: setsockopt SO_REUSEPORT: %s\n",
+                coap_socket_strerror());
+        }
+    }
+#endif
+
     // Set IP-gen-dependent options
     switch (listen_addr->addr.sa.sa_family){
         case AF_INET: // IPv4
@@ -288,6 +336,314 @@ error:
 }
 
 
+int coap_socket_bind_tcp(
+    coap_socket_t *sock,
+    const coap_address_t *listen_addr,
+    coap_address_t *bound_addr
+){
+    // Define options for @f setsockopt()
+    int on = 1, off = 0;
+
+    // Create system socket
+    sock->fd = socket(listen_addr->addr.sa.sa_family, SOCK_STREAM, 0);
+    if (sock->fd == COAP_INVALID_SOCKET) {
+        coap_log(LOG_WARNING, "coap_socket_bind_tcp: socket: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    // Set socket to have reusable address
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR){
+        coap_log(LOG_WARNING, "coap_socket_bind_tcp: setsockopt SO_REUSEADDR: %s\n",
+            coap_socket_strerror());
+    }
+
+    // Configure IPv6 socket as dual-stacked
+    if (listen_addr->addr.sa.sa_family == AF_INET6) {
+        if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, OPTVAL_T(&off), sizeof(off)) == COAP_SOCKET_ERROR)
+            coap_log(LOG_ALERT, "coap_socket_bind_tcp: setsockopt IPV6_V6ONLY: %s\n",
+                coap_socket_strerror());
+    }
+
+    // Bind socket to the @p listen_addr
+    if (bind(sock->fd, &listen_addr->addr.sa, listen_addr->size) == COAP_SOCKET_ERROR) {
+        coap_log(LOG_WARNING, "coap_socket_bind_tcp: bind: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    // Start listening for incoming connections
+    if (listen(sock->fd, COAP_TCP_LISTEN_BACKLOG) == COAP_SOCKET_ERROR) {
+        coap_log(LOG_WARNING, "coap_socket_bind_tcp: listen: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    // Get local address bound with the socket by the system
+    bound_addr->size = (socklen_t)sizeof(*bound_addr);
+    if (getsockname(sock->fd, &bound_addr->addr.sa, &bound_addr->size) < 0) {
+        coap_log(LOG_WARNING, "coap_socket_bind_tcp: getsockname: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    return 1;
+
+error:
+    // On error, close the socket
+    coap_socket_close(sock);
+    return 0;
+}
+
+
+int coap_socket_accept_tcp(
+    coap_socket_t *server,
+    coap_socket_t *new_client,
+    coap_address_t *local_addr,
+    coap_address_t *remote_addr
+){
+    // Define options for @f setsockopt()
+    int on = 1;
+
+    // Clear 'readable' flag of the listening socket (pending connection is accepted in a moment)
+    server->flags &= ~COAP_SOCKET_CAN_READ;
+
+    // Accept the connection
+    remote_addr->size = (socklen_t)sizeof(remote_addr->addr);
+    new_client->flags = COAP_SOCKET_EMPTY;
+    new_client->next = NULL;
+    new_client->fd = accept(server->fd, &remote_addr->addr.sa, &remote_addr->size);
+    if (new_client->fd == COAP_INVALID_SOCKET) {
+        coap_log(LOG_WARNING, "coap_socket_accept_tcp: accept: %s\n", coap_socket_strerror());
+        return 0;
+    }
+
+    // Get the local address of the connection
+    local_addr->size = (socklen_t)sizeof(local_addr->addr);
+    if (getsockname(new_client->fd, &local_addr->addr.sa, &local_addr->size) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_accept_tcp: getsockname: %s\n", coap_socket_strerror());
+
+    // Set socket to non-blocking mode, so that partial reads and writes never stall the context
+    if (ioctl(new_client->fd, FIONBIO, &on) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_accept_tcp: ioctl FIONBIO: %s\n", coap_socket_strerror());
+
+#ifdef TCP_NODELAY
+    // Small messages are sent immediately
+    if (setsockopt(new_client->fd, IPPROTO_TCP, TCP_NODELAY, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_accept_tcp: setsockopt TCP_NODELAY: %s\n", coap_socket_strerror());
+#endif
+
+    new_client->flags |= COAP_SOCKET_CONNECTED;
+
+    return 1;
+}
+
+
+int coap_socket_connect_tcp(
+    coap_socket_t *sock,
+    const coap_address_t *local_if,
+    const coap_address_t *server,
+    int default_port,
+    coap_address_t *local_addr,
+    coap_address_t *remote_addr
+){
+    // Define options for @f setsockopt()
+    int on = 1, off = 0;
+
+    // Make local copy of the address
+    coap_address_t connect_addr;
+    coap_address_copy(&connect_addr, server);
+
+    // Reset socket's flags and associate it with a new system socket
+    sock->flags &= ~(COAP_SOCKET_CONNECTED | COAP_SOCKET_MULTICAST);
+    sock->fd = socket(connect_addr.addr.sa.sa_family, SOCK_STREAM, 0);
+    if (sock->fd == COAP_INVALID_SOCKET) {
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: socket: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    // Set IP-gen-dependent options
+    switch (connect_addr.addr.sa.sa_family) {
+        case AF_INET: // IPv4
+
+            // Set port, if'ts not set yet
+            if (connect_addr.addr.sin.sin_port == 0)
+                connect_addr.addr.sin.sin_port = htons(default_port);
+            break;
+
+        case AF_INET6: // IPv6
+
+            // Set port, if'ts not set yet
+            if (connect_addr.addr.sin6.sin6_port == 0)
+                connect_addr.addr.sin6.sin6_port = htons(default_port);
+            
+            // Configure the socket as dual-stacked
+            if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, OPTVAL_T(&off), sizeof(off)) == COAP_SOCKET_ERROR)
+                coap_log(LOG_WARNING, "coap_socket_connect_tcp: setsockopt IPV6_V6ONLY: %s\n",
+                    coap_socket_strerror());
+            break;
+
+        default: // Unknown protocol
+
+            coap_log(LOG_ALERT, "coap_socket_connect_tcp: unsupported sa_family\n");
+            break;
+    }
+
+    // Bind socket with the local interface, if given
+    if (local_if && local_if->addr.sa.sa_family) {
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR)
+            coap_log(LOG_WARNING, "coap_socket_connect_tcp: setsockopt SO_REUSEADDR: %s\n",
+                coap_socket_strerror());
+        if (bind(sock->fd, &local_if->addr.sa, local_if->size) == COAP_SOCKET_ERROR) {
+            coap_log(LOG_WARNING, "coap_socket_connect_tcp: bind: %s\n", coap_socket_strerror());
+            goto error;
+        }
+    }
+
+    // Establish the connection (in the blocking mode)
+    if (connect(sock->fd, &connect_addr.addr.sa, connect_addr.size) == COAP_SOCKET_ERROR) {
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: connect: %s\n", coap_socket_strerror());
+        goto error;
+    }
+
+    // Set socket to non-blocking mode, so that partial reads and writes never stall the context
+    if (ioctl(sock->fd, FIONBIO, &on) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: ioctl FIONBIO: %s\n", coap_socket_strerror());
+
+#ifdef TCP_NODELAY
+    // Small messages are sent immediately
+    if (setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: setsockopt TCP_NODELAY: %s\n", coap_socket_strerror());
+#endif
+
+    // Get the address actually bound to the socket (local interface)
+    if (getsockname(sock->fd, &local_addr->addr.sa, &local_addr->size) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: getsockname: %s\n", coap_socket_strerror());
+
+    // Get the address that socket actually connected to (remote interface)
+    if (getpeername(sock->fd, &remote_addr->addr.sa, &remote_addr->size) == COAP_SOCKET_ERROR)
+        coap_log(LOG_WARNING, "coap_socket_connect_tcp: getpeername: %s\n", coap_socket_strerror());
+
+    // Mark socket as connected
+    sock->flags |= COAP_SOCKET_CONNECTED;
+
+    return 1;
+
+error:
+    // On error, close the socket
+    coap_socket_close(sock);
+    return 0;
+}
+
+
+ssize_t coap_socket_read(coap_socket_t *sock, uint8_t *data, size_t data_len){
+
+    // Receive available data
+    ssize_t len = recv(sock->fd, data, data_len, 0);
+
+    // Connection has been closed by the peer
+    if (len == 0)
+        return -1;
+
+    // On error ...
+    if (len < 0) {
+
+        // No data is available at the moment
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        coap_log(LOG_WARNING, "coap_socket_read: %s\n", coap_socket_strerror());
+        return -1;
+    }
+
+    return len;
+}
+
+
+ssize_t coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len){
+
+    // Broken connection must not raise a signal, the error is reported instead
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    // Send as much data as socket's buffer accepts
+    ssize_t len = send(sock->fd, data, data_len, flags);
+
+    // On error ...
+    if (len < 0) {
+
+        // Socket's buffer is full at the moment
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        coap_log(LOG_WARNING, "coap_socket_write: %s\n", coap_socket_strerror());
+        return -1;
+    }
+
+    return len;
+}
+
+
+int coap_socket_register(coap_context_t *context, coap_socket_t *sock){
+
+    assert(context);
+    assert(sock);
+
+    // Socket can be registered only once
+    if (sock->flags & COAP_SOCKET_REGISTERED)
+        return 1;
+
+    // Let the backend observe the socket
+    if (!context->io_backend->add(context, sock)) {
+        coap_log(LOG_WARNING, "coap_socket_register: cannot register socket %d\n", sock->fd);
+        return 0;
+    }
+
+    // Put the socket on the context's list
+    LL_PREPEND(context->io_sockets, sock);
+    sock->flags |= COAP_SOCKET_REGISTERED;
+
+    return 1;
+}
+
+
+void coap_socket_unregister(coap_context_t *context, coap_socket_t *sock){
+
+    assert(sock);
+
+    // Skip sockets that was not registered
+    if (!context || (sock->flags & COAP_SOCKET_REGISTERED) == 0)
+        return;
+
+    // Stop observing the socket
+    context->io_backend->del(context, sock);
+
+    // Remove the socket from the context's list
+    LL_DELETE(context->io_sockets, sock);
+    sock->flags &= ~COAP_SOCKET_REGISTERED;
+    sock->next = NULL;
+}
+
+
+void coap_socket_want_write(coap_context_t *context, coap_socket_t *sock, int enable){
+
+    assert(sock);
+
+    // Skip sockets whose state does not change
+    if (((sock->flags & COAP_SOCKET_WANT_WRITE) != 0) == (enable != 0))
+        return;
+
+    // Update socket's flags
+    if (enable)
+        sock->flags |= COAP_SOCKET_WANT_WRITE;
+    else
+        sock->flags &= ~COAP_SOCKET_WANT_WRITE;
+
+    // Let the backend update its state
+    if (context && (sock->flags & COAP_SOCKET_REGISTERED) && context->io_backend->want_write)
+        context->io_backend->want_write(context, sock, enable);
+}
+
+
 void coap_socket_close(coap_socket_t *sock){
 
     // Close the socket and mark it with an invalid file descriptor
@@ -301,6 +657,57 @@ void coap_socket_close(coap_socket_t *sock){
 }
 
 
+int coap_socket_wakeup_open(coap_socket_t *sock){
+
+    // Bind the socket to the ephemeral port of the loopback interface
+    coap_address_t addr, bound;
+    coap_address_init(&addr);
+    addr.addr.sin.sin_family = AF_INET;
+    addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.size = sizeof(struct sockaddr_in);
+    if (!coap_socket_bind_udp(sock, &addr, &bound)) {
+        coap_log(LOG_WARNING, "coap_socket_wakeup_open: cannot bind the socket\n");
+        return 0;
+    }
+
+    // Connect the socket to itself
+    if (connect(sock->fd, &bound.addr.sa, bound.size) == COAP_SOCKET_ERROR) {
+        coap_log(LOG_WARNING, "coap_socket_wakeup_open: connect: %s\n", coap_socket_strerror());
+        coap_socket_close(sock);
+        return 0;
+    }
+
+    // Socket is drained until no more data is available
+    int on = 1;
+    if (ioctl(sock->fd, FIONBIO, &on) == COAP_SOCKET_ERROR) {
+        coap_log(LOG_WARNING, "coap_socket_wakeup_open: ioctl FIONBIO: %s\n", coap_socket_strerror());
+        coap_socket_close(sock);
+        return 0;
+    }
+
+    sock->flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_BOUND | COAP_SOCKET_CONNECTED | COAP_SOCKET_WANT_READ;
+
+    return 1;
+}
+
+
+void coap_socket_wakeup(coap_socket_t *sock){
+    uint8_t wakeup = 0;
+    coap_socket_write(sock, &wakeup, 1);
+}
+
+
+void coap_socket_wakeup_drain(coap_socket_t *sock){
+
+    if ((sock->flags & COAP_SOCKET_CAN_READ) == 0)
+        return;
+    sock->flags &= ~COAP_SOCKET_CAN_READ;
+
+    uint8_t buf[16];
+    while (coap_socket_read(sock, buf, sizeof(buf)) > 0);
+}
+
+
 ssize_t coap_socket_send(
     coap_socket_t *sock,
     coap_session_t *session,
@@ -362,15 +769,22 @@ ssize_t coap_network_read(
 
     ssize_t len = -1;
 
+    // If the socket is being drained, don't block when it has no more datagrams queued
+    int flags = (sock->flags & COAP_SOCKET_READ_MORE) ? MSG_DONTWAIT : 0;
+
     // If socket was connected ... (i.e. 'bound' when it comes to receiving)
     if (sock->flags & COAP_SOCKET_CONNECTED) {
 
         // Receive from the socket
-        len = recv(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0);
+        len = recv(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, flags);
 
         // On error ...
         if (len < 0) {
 
+            // Socket's queue has been drained
+            if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+
             // If client-side ICMP destination unreachable ...
             if (errno == ECONNREFUSED) {
                 coap_log(LOG_WARNING, "coap_network_read: unreachable\n");
@@ -389,11 +803,15 @@ ssize_t coap_network_read(
     else {
 
         // Receive from the address encoded in the @p packet
-        len = recvfrom(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0, &packet->src.addr.sa, &packet->src.size);
+        len = recvfrom(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, flags, &packet->src.addr.sa, &packet->src.size);
 
         // On error ...
         if (len < 0) {
 
+            // Socket's queue has been drained
+            if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+
             // Unconnected source address is unreachable, ignore it
             if (errno == ECONNREFUSED)
                 return 0;
@@ -427,48 +845,201 @@ int coap_run_once(coap_context_t *context, unsigned timeout_ms) {
     coap_tick_t before;
     coap_ticks(&before);
 
-    // Prepare array of sockets that potentially need to read data 
-    coap_socket_t *sockets[COAP_MAX_SOCKET_OBSERVED];
+    /**
+     * @note: Sockets are observed by the context's I/O backend since they are created,
+     *    so coap_write() is not asked to gather them.
+     */
     unsigned int num_sockets = 0;
 
     // Perform all operations required to establish what sessions should send messages
-    unsigned int timeout = coap_write(context, sockets, (unsigned int)(sizeof(sockets) / sizeof(sockets[0])), &num_sockets, before);
+    unsigned int timeout = coap_write(context, NULL, 0, &num_sockets, before);
 
     // Set timeout as a minimum of timeout returned by the coap_write and the one determined by the user
     if (timeout == 0 || timeout_ms < timeout)
         timeout = timeout_ms;
 
-    // Define three sets of file descriptors (sockets) 
-    fd_set readfds, writefds, exceptfds;
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_ZERO(&exceptfds);
+    // Wait for the one of the registered sockets to be ready
+    if (context->io_backend->wait(context, timeout) < 0)
+        return -1;
+
+    // Get time stamp of the routine's end
+    coap_tick_t now;
+    coap_ticks(&now);
+
+    // Handle incoming data
+    coap_read(context, now);
+
+    // Return number of miliseconds that passed during the procedure call
+    return (int)(((now - before) * 1000) / COAP_TICKS_PER_SECOND);
+}
+
+
+const char *coap_socket_strerror(void) {
+      return strerror(errno);
+}
+
+
+/* -------------------------------------------- [Static Functions] -------------------------------------------- */
+
+/**
+ * @brief: Allocates state of the select() backend for the @p context
+ * 
+ * @param context:
+ *    context to initialize backend for
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+static int coap_select_init(coap_context_t *context){
+
+    // Allocate backend's state
+    coap_select_state_t *state = (coap_select_state_t *) coap_malloc(sizeof(coap_select_state_t));
+    if (!state)
+        return 0;
+
+    // Initially, no descriptors are observed
+    FD_ZERO(&state->readfds);
+    FD_ZERO(&state->writefds);
+    state->num_write = 0;
+    state->nfds = 0;
+
+    context->io_data = state;
 
-    // Highest file descriptors (sockets) that needs to perform an action (plus 1) [@see select(2) man]
-    coap_fd_t nfds = 0;
+    return 1;
+}
+
+
+/**
+ * @brief: Frees state of the select() backend of the @p context
+ * 
+ * @param context:
+ *    context to release backend of
+ */
+static void coap_select_release(coap_context_t *context){
+    coap_free(context->io_data);
+    context->io_data = NULL;
+}
+
+
+/**
+ * @brief: Adds descriptor of the @p sock to the persistent set of observed descriptors
+ * 
+ * @param context:
+ *    context that socket is registered in
+ * @param sock:
+ *    socket to be observed
+ * @returns:
+ *    0 if procedure fails, 1 otherwise
+ */
+static int coap_select_add(coap_context_t *context, coap_socket_t *sock){
+
+    coap_select_state_t *state = (coap_select_state_t *) context->io_data;
+
+    // select() cannot observe descriptors exceeding FD_SETSIZE
+    if (sock->fd < 0 || sock->fd >= FD_SETSIZE)
+        return 0;
+
+    // Add descriptor to the set
+    FD_SET(sock->fd, &state->readfds);
+    state->nfds = max(sock->fd + 1, state->nfds);
+
+    // Socket may have pending output already
+    if (sock->flags & COAP_SOCKET_WANT_WRITE)
+        coap_select_want_write(context, sock, 1);
 
-    // Iterate over all sockets marked by the @f coap_write() to lt select() observe them
-    for(unsigned int i = 0; i < num_sockets; i++) {
-        nfds = max(sockets[i]->fd + 1, nfds);
-        FD_SET(sockets[i]->fd, &readfds);
+    return 1;
+}
+
+
+/**
+ * @brief: Removes descriptor of the @p sock from the persistent set of observed descriptors
+ * 
+ * @param context:
+ *    context that socket is registered in
+ * @param sock:
+ *    socket to stop observing
+ */
+static void coap_select_del(coap_context_t *context, coap_socket_t *sock){
+
+    coap_select_state_t *state = (coap_select_state_t *) context->io_data;
+
+    // Remove descriptor from the sets
+    FD_CLR(sock->fd, &state->readfds);
+    if (sock->flags & COAP_SOCKET_WANT_WRITE)
+        coap_select_want_write(context, sock, 0);
+
+    // If the highest descriptor was removed, find a new one among remaining sockets
+    if (sock->fd + 1 == state->nfds) {
+        state->nfds = 0;
+        coap_socket_t *s;
+        LL_FOREACH(context->io_sockets, s) {
+            if (s != sock)
+                state->nfds = max(s->fd + 1, state->nfds);
+        }
     }
+}
 
-    // Convert actual timeout to the timeval
-    struct timeval tv = {0, 0};
-    if (timeout > 0) {
-        tv.tv_usec = (timeout % 1000) * 1000;
-        tv.tv_sec = (long)(timeout / 1000);
+
+/**
+ * @brief: Adds (removes) descriptor of the @p sock to (from) the persistent set of descriptors
+ *    waited for to become writable
+ * 
+ * @param context:
+ *    context that socket is registered in
+ * @param sock:
+ *    socket to be updated
+ * @param enable:
+ *    1 if socket has pending output, 0 otherwise
+ */
+static void coap_select_want_write(coap_context_t *context, coap_socket_t *sock, int enable){
+
+    coap_select_state_t *state = (coap_select_state_t *) context->io_data;
+
+    // Update the set and the number of its descriptors
+    if (enable && !FD_ISSET(sock->fd, &state->writefds)) {
+        FD_SET(sock->fd, &state->writefds);
+        state->num_write++;
+    } else if (!enable && FD_ISSET(sock->fd, &state->writefds)) {
+        FD_CLR(sock->fd, &state->writefds);
+        state->num_write--;
     }
+}
+
+
+/**
+ * @brief: Waits for registered sockets to become readable (or writable, if they have pending
+ *    output) using select() call.
+ * 
+ * @param context:
+ *    context to wait for
+ * @param timeout_ms:
+ *    maximal time to wait (0 means infinity)
+ * @returns:
+ *    number of sockets' readiness flags set
+ *    -1 on error
+ */
+static int coap_select_wait(coap_context_t *context, unsigned int timeout_ms){
 
-    // Wait for the one of the sockets checked by coap_write() to be ready
-    int result = select(nfds, &readfds, &writefds, &exceptfds, timeout > 0 ? &tv : NULL);
+    coap_select_state_t *state = (coap_select_state_t *) context->io_data;
 
     /**
-     * @note: before passing fd_sets to the select() the read/write-wanting sockets are set inside them.
-     *    It means that select() will observer if they are ready and return either when the @v timeout
-     *    is reached or some of the are ready. Before returning it will clear all fd_sets and set them
-     *    to those descriptors that have become ready.
+     * @note: select() overwrites sets passed to it with sets of descriptors that have become
+     *    ready, so the persistent set is copied instead of being rebuilt on every call.
      */
+    fd_set readfds = state->readfds;
+
+    // Sockets with pending output are waited for to become writable as well
+    fd_set writefds = state->writefds;
+    int want_write = state->num_write > 0;
+
+    // Convert actual timeout to the timeval
+    struct timeval tv = {0, 0};
+    if (timeout_ms > 0) {
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tv.tv_sec = (long)(timeout_ms / 1000);
+    }
+
+    // Wait for the one of the sockets to be ready
+    int result = select(state->nfds, &readfds, want_write ? &writefds : NULL, NULL, timeout_ms > 0 ? &tv : NULL);
 
     // On select's error ...
     if (result < 0) {
@@ -477,32 +1048,24 @@ int coap_run_once(coap_context_t *context, unsigned timeout_ms) {
             coap_log(LOG_DEBUG, "%s", coap_socket_strerror());
             return -1;
         }
+        return 0;
     }
 
-    // When seom descriptors are ready to perform an action ...
-    if (result > 0) {
-
-        // Iterate over all sockets that possibly want to perform an action
-        for (int i = 0; i < num_sockets; i++) {
-            // If socket is ready to be read, mark it as read-able
-            if (FD_ISSET(sockets[i]->fd, &readfds))
-                sockets[i]->flags |= COAP_SOCKET_CAN_READ;
+    // Mark ready sockets as read-able (write-able); stop when all of them have been found
+    int ready = 0;
+    coap_socket_t *sock;
+    LL_FOREACH(context->io_sockets, sock) {
+        if (ready == result)
+            break;
+        if (FD_ISSET(sock->fd, &readfds)) {
+            sock->flags |= COAP_SOCKET_CAN_READ;
+            ready++;
+        }
+        if (want_write && FD_ISSET(sock->fd, &writefds)) {
+            sock->flags |= COAP_SOCKET_CAN_WRITE;
+            ready++;
         }
     }
 
-    // Get time stamp of the routine's end
-    coap_tick_t now;
-    coap_ticks(&now);
-
-    // Handle incoming data
-    coap_read(context, now);
-
-    // Return number of miliseconds that passed during the procedure call
-    return (int)(((now - before) * 1000) / COAP_TICKS_PER_SECOND);
+    return ready;
 }
-
-
-const char *coap_socket_strerror(void) {
-      return strerror(errno);
-}
-
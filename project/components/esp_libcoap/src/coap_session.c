@@ -30,9 +30,11 @@
 
 /* ------------------------------------------------------------------------------------------------------------ */
 
+#include "block.h"
 #include "coap_config.h"
 #include "coap_io.h"
 #include "coap_session.h"
+#include "coap_tcp.h"
 #include "net.h"
 #include "coap_debug.h"
 #include "mem.h"
@@ -41,8 +43,11 @@
 #include "encode.h"
 #include <stdio.h>
 
-static coap_session_t *coap_session_create_client(coap_context_t *ctx, const coap_address_t *local_if, const coap_address_t *server);
+static coap_session_t *coap_session_create_client(coap_context_t *ctx, const coap_address_t *local_if, const coap_address_t *server, coap_proto_t proto);
+static coap_endpoint_t *coap_endpoint_create(coap_context_t *context, const coap_address_t *listen_addr, coap_proto_t proto);
 static coap_session_t *coap_make_session(coap_session_type_t type, const coap_address_t *local_addr, const coap_address_t *remote_addr, coap_context_t *context, coap_endpoint_t *endpoint );
+static void coap_session_make_key(coap_session_key_t *key, const coap_address_t *local_addr, const coap_address_t *remote_addr);
+static void coap_session_update_idle(coap_session_t *session);
 
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
@@ -107,6 +112,7 @@ coap_fixed_point_t coap_session_get_ack_random_factor (coap_session_t *session)
 
 coap_session_t *coap_session_reference(coap_session_t *session) {
     ++(session->ref);
+    coap_session_update_idle(session);
     return session;
 }
 
@@ -118,6 +124,8 @@ void coap_session_release(coap_session_t *session){
             --session->ref;
         if(session->ref == 0 && session->type == COAP_SESSION_TYPE_CLIENT)
             coap_session_free(session);
+        else
+            coap_session_update_idle(session);
     }
 }
 
@@ -137,8 +145,14 @@ void coap_session_mfree(coap_session_t *session){
     coap_queue_t *q, *tmp;
 
     // Close used socket
-    if (session->sock.flags != COAP_SOCKET_EMPTY)
+    if (session->sock.flags != COAP_SOCKET_EMPTY) {
+        coap_socket_unregister(session->context, &session->sock);
         coap_socket_close(&session->sock);
+    }
+
+    // Free state of the TCP connection
+    if (session->tcp)
+        coap_tcp_session_free(session);
 
     // If some packets was delayed, send NACK responses now
     LL_FOREACH_SAFE(session->delayqueue, q, tmp) {
@@ -159,10 +173,17 @@ void coap_session_free(coap_session_t *session) {
     if(session->ref)
         return;
 
-    // If we free endpoint's session, delete it from the endpoint's list
+    // If we free endpoint's session, delete it from the endpoint's list, index and idle list
     if (session->endpoint) {
         if (session->endpoint->sessions)
             LL_DELETE(session->endpoint->sessions, session);
+        HASH_DELETE(hh, session->endpoint->sessions_index, session);
+        coap_dedup_remove_session(&session->endpoint->dedup, session);
+        coap_block1_remove(session->context, session, NULL);
+        if (session->idle) {
+            DL_DELETE2(session->endpoint->idle_sessions, session, idle_prev, idle_next);
+            session->endpoint->num_idle--;
+        }
     } 
     // If we free context's session, delete it from the context's list
     else if (session->context) {
@@ -177,7 +198,7 @@ void coap_session_free(coap_session_t *session) {
     coap_log(LOG_DEBUG, "***%s: session closed\n", coap_session_str(session));
 
     // Free session itself
-    coap_free(session);
+    coap_free_type(COAP_SESSION, session);
 }
 
 
@@ -209,7 +230,9 @@ ssize_t coap_session_send(
 
     // Log informations about session's transaction
     if (bytes_written == (ssize_t)datalen){
-        coap_ticks(&session->last_rx_tx);
+        coap_tick_t now;
+        coap_ticks(&now);
+        coap_session_touch(session, now);
         coap_log(LOG_DEBUG, "*  %s: sent %lu bytes\n", coap_session_str(session), (unsigned long) datalen);
     } else
         coap_log(LOG_DEBUG, "*  %s: failed to send %lu bytes\n", coap_session_str(session), (unsigned long) datalen);
@@ -228,7 +251,7 @@ ssize_t coap_session_delay_pdu(
         
         // Remove pdu from the context's sendqueue
         coap_queue_t *removed = NULL;
-        coap_remove_from_queue(&session->context->sendqueue, session, node->id, &removed);
+        coap_remove_from_queue(session->context, session, node->id, &removed);
         assert(removed == node);
 
         // Release reference to the session that was hold by the node
@@ -270,6 +293,7 @@ ssize_t coap_session_delay_pdu(
 
     // Append node to the delayqueue
     LL_APPEND(session->delayqueue, node);
+    coap_session_update_idle(session);
     coap_log(LOG_DEBUG, "** %s: tid=%d: delayed\n", coap_session_str(session), node->id);
 
     return COAP_PDU_DELAYED;
@@ -315,6 +339,9 @@ void coap_session_connected(coap_session_t *session){
                 coap_delete_node(q);
         }
     }
+
+    // Session may have become idle after the delayqueue has been flushed
+    coap_session_update_idle(session);
 }
 
 
@@ -359,6 +386,9 @@ void coap_session_disconnected(
             coap_delete_node(q);
         }
     }
+
+    // Session may have become idle after the delayqueue has been flushed
+    coap_session_update_idle(session);
 }
 
 coap_session_t *coap_endpoint_get_session(
@@ -366,48 +396,21 @@ coap_session_t *coap_endpoint_get_session(
     const coap_packet_t *packet, 
     coap_tick_t now
 ){
-
-    /**
-     * @brief: At the beggining make an overwiev of sessions already hold be the endpoint
-     */
-
-    // Number of IDLE sessions hold by the endpoint
-    unsigned int num_idle = 0;
-    // Pointer to the session with the oldest last_rx_tx timestamp
-    coap_session_t *oldest = NULL;
-
-    // Iterate over all sessions hold by the endpoint
+    // Look for the session associated with the @p packet
+    coap_session_key_t key;
+    coap_session_make_key(&key, &packet->dst, &packet->src);
     coap_session_t *session = NULL;
-    LL_FOREACH(endpoint->sessions, session){
-
-        // If @p packet can be unambiguously associated with a session, refresh session's time stamp
-        if (coap_address_equals(&session->local_addr, &packet->dst) &&
-            coap_address_equals(&session->remote_addr, &packet->src)
-        ){
-            session->last_rx_tx = now;
-            return session;
-        }
-
-        // If session of the 'server' type is unreferred and has no messages to send in the delayqueue mark it as IDLE
-        if (session->ref == 0 && session->delayqueue == NULL && session->type == COAP_SESSION_TYPE_SERVER){
-
-            ++num_idle;
-
-            // Update the oldest session (with respect to last_rx_tx timestamp)
-            if (oldest == NULL || session->last_rx_tx < oldest->last_rx_tx)
-                oldest = session;
-        }
-    }
+    HASH_FIND(hh, endpoint->sessions_index, &key, sizeof(key), session);
 
-    // Check if maximum number of IDLE sessions doen't cross the limit
-    if (endpoint->context->max_idle_sessions > 0 && num_idle >= endpoint->context->max_idle_sessions) {
-        coap_session_free(oldest);
+    // If @p packet can be unambiguously associated with a session, refresh session's time stamp
+    if (session) {
+        coap_session_touch(session, now);
+        return session;
     }
 
-    /**
-     * @brief: After the review, if no session associated with the packe was found,
-     *    create a new session
-     */
+    // Check if maximum number of IDLE sessions doen't cross the limit; if so, free the least recently used one
+    if (endpoint->context->max_idle_sessions > 0 && endpoint->num_idle >= endpoint->context->max_idle_sessions)
+        coap_session_free(endpoint->idle_sessions);
 
     // Create a new session for the endpoint
     session = coap_make_session(
@@ -430,6 +433,65 @@ coap_session_t *coap_endpoint_get_session(
 }
 
 
+coap_session_t *coap_endpoint_accept_session(
+    coap_endpoint_t *endpoint,
+    coap_tick_t now
+){
+    // Accept the pending connection
+    coap_socket_t sock;
+    coap_address_t local_addr, remote_addr;
+    if (!coap_socket_accept_tcp(&endpoint->sock, &sock, &local_addr, &remote_addr))
+        return NULL;
+
+    // Check if maximum number of IDLE sessions doen't cross the limit; if so, free the least recently used one
+    if (endpoint->context->max_idle_sessions > 0 && endpoint->num_idle >= endpoint->context->max_idle_sessions)
+        coap_session_free(endpoint->idle_sessions);
+
+    // Create a new session for the connection
+    coap_session_t *session = coap_make_session(
+        COAP_SESSION_TYPE_SERVER,
+        &local_addr, &remote_addr,
+        endpoint->context,
+        endpoint
+    );
+    if (!session) {
+        coap_socket_close(&sock);
+        return NULL;
+    }
+
+    // Initialize rest of the session's parameters
+    session->sock = sock;
+    session->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_WANT_READ;
+    session->last_rx_tx = now;
+    session->state = COAP_SESSION_STATE_ESTABLISHED;
+    LL_PREPEND(endpoint->sessions, session);
+
+    // Let the context's I/O backend observe the socket and send the CSM to the client
+    if (!coap_socket_register(endpoint->context, &session->sock) || !coap_tcp_session_init(session)) {
+        coap_session_free(session);
+        return NULL;
+    }
+
+    coap_log(LOG_DEBUG, "***%s: new incoming session\n",
+        coap_session_str(session));
+
+    return session;
+}
+
+
+void coap_session_touch(coap_session_t *session, coap_tick_t now){
+
+    // Update session's timestamp
+    session->last_rx_tx = now;
+
+    // Move idle session to the end of the endpoint's idle list
+    if (session->idle) {
+        DL_DELETE2(session->endpoint->idle_sessions, session, idle_prev, idle_next);
+        DL_APPEND2(session->endpoint->idle_sessions, session, idle_prev, idle_next);
+    }
+}
+
+
 coap_session_t *coap_new_client_session(
     struct coap_context_t *context,
     const coap_address_t *local_if,
@@ -438,7 +500,23 @@ coap_session_t *coap_new_client_session(
     assert(context);
     
     // Create a new session, connect it to the @p server and bound with the @p local_if
-    coap_session_t *session = coap_session_create_client(context, local_if, server);
+    coap_session_t *session = coap_session_create_client(context, local_if, server, COAP_PROTO_UDP);
+    if (session)
+        coap_log(LOG_DEBUG, "***%s: new outgoing session\n", coap_session_str(session));
+    
+    return session;
+}
+
+
+coap_session_t *coap_new_client_session_tcp(
+    struct coap_context_t *context,
+    const coap_address_t *local_if,
+    const coap_address_t *server
+){
+    assert(context);
+    
+    // Create a new session, connect it to the @p server and bound with the @p local_if
+    coap_session_t *session = coap_session_create_client(context, local_if, server, COAP_PROTO_TCP);
     if (session)
         coap_log(LOG_DEBUG, "***%s: new outgoing session\n", coap_session_str(session));
     
@@ -450,54 +528,15 @@ coap_endpoint_t *coap_new_endpoint(
     coap_context_t *context,
     const coap_address_t *listen_addr
 ){  
-    assert(context);
-    assert(listen_addr);
-
-    // Allocate memory for the new endpoint
-    struct coap_endpoint_t *ep = NULL;
-    ep = coap_malloc_endpoint();
-    if (!ep) {
-        coap_log(LOG_WARNING, "coap_new_endpoint: malloc");
-        goto error;
-    }
-
-    // Cleanup memory of the endpoint
-    memset(ep, 0, sizeof(struct coap_endpoint_t));
-
-    ep->context = context;
-
-    // Try to bind endpoin's socket to the @p listen_addr
-    if (!coap_socket_bind_udp(&ep->sock, listen_addr, &ep->bind_addr))
-        goto error;
-    ep->sock.flags |= COAP_SOCKET_WANT_READ;
-
-    // Conditionally log some info 
-    #ifndef NDEBUG
-    if (LOG_DEBUG <= coap_get_log_level()) {
-
-        #ifndef INET6_ADDRSTRLEN
-        #define INET6_ADDRSTRLEN 40
-        #endif
-
-        unsigned char addr_str[INET6_ADDRSTRLEN + 8];
-        if (coap_print_addr(&ep->bind_addr, addr_str, INET6_ADDRSTRLEN + 8)) {
-            coap_log(LOG_DEBUG, "created an endpoint %s\n", addr_str);
-        }
-    }
-    #endif /* NDEBUG */
-
-    // Set endpoint's socket's library-specific flags & MTU
-    ep->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_BOUND;
-    ep->default_mtu = COAP_DEFAULT_MTU;
-
-    // Add the endpoint to the @p context
-    LL_PREPEND(context->endpoint, ep);
+    return coap_endpoint_create(context, listen_addr, COAP_PROTO_UDP);
+}
 
-    return ep;
 
-error:
-    coap_free_endpoint(ep);
-    return NULL;
+coap_endpoint_t *coap_new_endpoint_tcp(
+    coap_context_t *context,
+    const coap_address_t *listen_addr
+){  
+    return coap_endpoint_create(context, listen_addr, COAP_PROTO_TCP);
 }
 
 
@@ -511,14 +550,27 @@ void coap_free_endpoint(coap_endpoint_t *ep){
     if (ep){
 
         // Close the endpoint's socket
-        if (ep->sock.flags != COAP_SOCKET_EMPTY)
+        if (ep->sock.flags != COAP_SOCKET_EMPTY) {
+            coap_socket_unregister(ep->context, &ep->sock);
             coap_socket_close(&ep->sock);
+        }
+
+        // Drop the sessions' index and cached ACKs (sessions are freed below)
+        HASH_CLEAR(hh, ep->sessions_index);
+        coap_dedup_clear(&ep->dedup);
+        ep->idle_sessions = NULL;
+        ep->num_idle = 0;
 
         // Close all sessions hold by the endpoint
         coap_session_t *session, *tmp;
         LL_FOREACH_SAFE(ep->sessions, session, tmp) {
             assert(session->ref == 0);
             if (session->ref == 0) {
+
+                // Drop the session's state kept by the context, before back-pointers are cleared
+                coap_socket_unregister(ep->context, &session->sock);
+                coap_block1_remove(ep->context, session, NULL);
+
                 session->endpoint = NULL;
                 session->context = NULL;
                 coap_session_free(session);
@@ -532,7 +584,8 @@ void coap_free_endpoint(coap_endpoint_t *ep){
 
 const char *coap_session_str(const coap_session_t *session) {
     
-    static char szSession[256];
+    // Buffer is per thread, as sessions of shards and workers are described concurrently
+    static __thread char szSession[256];
     char *start = szSession, *end = szSession + sizeof(szSession);
 
     // Write session's local address
@@ -553,7 +606,7 @@ const char *coap_session_str(const coap_session_t *session) {
     
     // Write name of the transport layter protocol 
     if (start + 6 < end) {
-        strcpy(start, " UDP ");
+        strcpy(start, COAP_PROTO_RELIABLE(session->proto) ? " TCP " : " UDP ");
         start += 4;
     }
 
@@ -563,7 +616,8 @@ const char *coap_session_str(const coap_session_t *session) {
 
 const char *coap_endpoint_str(const coap_endpoint_t *endpoint) {
 
-    static char szEndpoint[128];
+    // Buffer is per thread, as endpoints of shards are described concurrently
+    static __thread char szEndpoint[128];
     char *p = szEndpoint, *end = szEndpoint + sizeof(szEndpoint);
 
     // Write the local address that the endpoint listens on
@@ -572,7 +626,7 @@ const char *coap_endpoint_str(const coap_endpoint_t *endpoint) {
 
     // Write name of the transport layter protocol 
     if (p + 6 < end) {
-        strcpy(p, " UDP");
+        strcpy(p, COAP_PROTO_RELIABLE(endpoint->proto) ? " TCP" : " UDP");
         p += 4;
     }
 
@@ -609,7 +663,7 @@ static coap_session_t *coap_make_session(
     assert(context);
 
     // Allocate memory for the session
-    coap_session_t *session = (coap_session_t*) coap_malloc(sizeof(coap_session_t));
+    coap_session_t *session = (coap_session_t*) coap_malloc_type(COAP_SESSION, sizeof(coap_session_t));
     if(!session)
         return NULL;
 
@@ -620,6 +674,7 @@ static coap_session_t *coap_make_session(
     session->type = type;
     session->context = context;
     session->endpoint = endpoint;
+    session->proto = endpoint ? endpoint->proto : COAP_PROTO_UDP;
     session->max_retransmit = COAP_DEFAULT_MAX_RETRANSMIT;
     session->ack_timeout = COAP_DEFAULT_ACK_TIMEOUT;
     session->ack_random_factor = COAP_DEFAULT_ACK_RANDOM_FACTOR;
@@ -641,6 +696,13 @@ static coap_session_t *coap_make_session(
     // Initialize ID's of the sent message with a random value
     prng((unsigned char *)&session->tx_mid, sizeof(session->tx_mid));
 
+    // Put server session into the endpoint's index
+    if (endpoint) {
+        coap_session_make_key(&session->key, &session->local_addr, &session->remote_addr);
+        HASH_ADD(hh, endpoint->sessions_index, key, sizeof(session->key), session);
+        coap_session_update_idle(session);
+    }
+
     return session;
 }
 
@@ -655,6 +717,8 @@ static coap_session_t *coap_make_session(
  *    local address to be bound with the session
  * @param server:
  *    remote server that the session will connect with
+ * @param proto:
+ *    session's transport protocol
  * @returns:
  *    created session on success
  *    NULL on error
@@ -662,7 +726,8 @@ static coap_session_t *coap_make_session(
 static coap_session_t *coap_session_create_client(
     coap_context_t *context,
     const coap_address_t *local_if,
-    const coap_address_t *server
+    const coap_address_t *server,
+    coap_proto_t proto
 ){
     assert(context);
     assert(server);
@@ -675,19 +740,29 @@ static coap_session_t *coap_session_create_client(
     );
     if (!session)
         goto error;
+    session->proto = proto;
 
     // Increment references counter on the session
     coap_session_reference(session);
 
     // Connect the session to the remote endpoint
-    int ret = coap_socket_connect(
-        &session->sock, 
-        &session->local_addr, 
-        server,
-        COAP_DEFAULT_PORT, 
-        &session->local_addr, 
-        &session->remote_addr
-    );
+    int ret = (proto == COAP_PROTO_TCP) ?
+        coap_socket_connect_tcp(
+            &session->sock, 
+            &session->local_addr, 
+            server,
+            COAP_DEFAULT_PORT, 
+            &session->local_addr, 
+            &session->remote_addr
+        ) :
+        coap_socket_connect(
+            &session->sock, 
+            &session->local_addr, 
+            server,
+            COAP_DEFAULT_PORT, 
+            &session->local_addr, 
+            &session->remote_addr
+        );
     if (!ret)
         goto error;
 
@@ -696,6 +771,10 @@ static coap_session_t *coap_session_create_client(
     if (local_if)
         session->sock.flags |= COAP_SOCKET_BOUND;
     session->state = COAP_SESSION_STATE_ESTABLISHED;
+
+    // Let the context's I/O backend observe the socket
+    if (!coap_socket_register(context, &session->sock))
+        goto error;
     
     // Set the timestamp on the session
     coap_ticks(&session->last_rx_tx);
@@ -703,6 +782,10 @@ static coap_session_t *coap_session_create_client(
     // Append session to the context's sessions list
     LL_PREPEND(context->sessions, session);
 
+    // Send the CSM to the TCP server
+    if (proto == COAP_PROTO_TCP && !coap_tcp_session_init(session))
+        goto error;
+
     return session;
 
 error:
@@ -710,3 +793,155 @@ error:
     coap_session_release(session);
     return NULL;
 }
+
+
+/**
+ * @brief: Creates a new endpoint listening on the @p listen_addr with the given transport
+ *    protocol and adds it to the @p context
+ * 
+ * @param context:
+ *    context that will own the new endpoint
+ * @param listen_addr:
+ *    address the endpoint will listen on
+ * @param proto:
+ *    endpoint's transport protocol
+ * @returns:
+ *    created endpoint on success
+ *    NULL on failure
+ */
+static coap_endpoint_t *coap_endpoint_create(
+    coap_context_t *context,
+    const coap_address_t *listen_addr,
+    coap_proto_t proto
+){
+    assert(context);
+    assert(listen_addr);
+
+    // Allocate memory for the new endpoint
+    struct coap_endpoint_t *ep = NULL;
+    ep = coap_malloc_endpoint();
+    if (!ep) {
+        coap_log(LOG_WARNING, "coap_endpoint_create: malloc");
+        goto error;
+    }
+
+    // Cleanup memory of the endpoint
+    memset(ep, 0, sizeof(struct coap_endpoint_t));
+
+    ep->context = context;
+    ep->proto = proto;
+
+    // Share the port with other contexts, if requested
+    if (context->reuse_port && proto == COAP_PROTO_UDP)
+        ep->sock.flags |= COAP_SOCKET_REUSE_PORT;
+
+    // Try to bind endpoin's socket to the @p listen_addr
+    int ret = (proto == COAP_PROTO_TCP) ?
+        coap_socket_bind_tcp(&ep->sock, listen_addr, &ep->bind_addr) :
+        coap_socket_bind_udp(&ep->sock, listen_addr, &ep->bind_addr);
+    if (!ret)
+        goto error;
+    ep->sock.flags |= COAP_SOCKET_WANT_READ;
+
+    // Conditionally log some info 
+    #ifndef NDEBUG
+    if (LOG_DEBUG <= coap_get_log_level()) {
+
+        #ifndef INET6_ADDRSTRLEN
+        #define INET6_ADDRSTRLEN 40
+        #endif
+
+        unsigned char addr_str[INET6_ADDRSTRLEN + 8];
+        if (coap_print_addr(&ep->bind_addr, addr_str, INET6_ADDRSTRLEN + 8)) {
+            coap_log(LOG_DEBUG, "created an endpoint %s\n", addr_str);
+        }
+    }
+    #endif /* NDEBUG */
+
+    // Set endpoint's socket's library-specific flags & MTU
+    ep->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_BOUND;
+    ep->default_mtu = COAP_DEFAULT_MTU;
+
+    // Let the context's I/O backend observe the socket
+    if (!coap_socket_register(context, &ep->sock))
+        goto error;
+
+    // Add the endpoint to the @p context
+    LL_PREPEND(context->endpoint, ep);
+
+    return ep;
+
+error:
+    coap_free_endpoint(ep);
+    return NULL;
+}
+
+
+/**
+ * @brief: Fills @p key with a canonical form of the (@p local_addr, @p remote_addr) pair
+ * 
+ * @param key [out]:
+ *    key to be filled
+ * @param local_addr:
+ *    local address of the session
+ * @param remote_addr:
+ *    remote address of the session
+ */
+static void coap_session_make_key(
+    coap_session_key_t *key,
+    const coap_address_t *local_addr,
+    const coap_address_t *remote_addr
+){
+    // Clear the key, so that unused bytes don't influence the hash
+    memset(key, 0, sizeof(coap_session_key_t));
+
+    key->family = remote_addr->addr.sa.sa_family;
+
+    // Copy ports and IP addresses
+    switch (remote_addr->addr.sa.sa_family) {
+        case AF_INET:
+            key->local_port = local_addr->addr.sin.sin_port;
+            key->remote_port = remote_addr->addr.sin.sin_port;
+            memcpy(key->local_ip, &local_addr->addr.sin.sin_addr, sizeof(struct in_addr));
+            memcpy(key->remote_ip, &remote_addr->addr.sin.sin_addr, sizeof(struct in_addr));
+            break;
+        case AF_INET6:
+            key->local_port = local_addr->addr.sin6.sin6_port;
+            key->remote_port = remote_addr->addr.sin6.sin6_port;
+            memcpy(key->local_ip, &local_addr->addr.sin6.sin6_addr, sizeof(struct in6_addr));
+            memcpy(key->remote_ip, &remote_addr->addr.sin6.sin6_addr, sizeof(struct in6_addr));
+            break;
+    }
+}
+
+
+/**
+ * @brief: Puts the server @p session on the endpoint's idle list if it is not referenced and
+ *    has no delayed messages, or removes it from the list otherwise. Should be called whenever
+ *    session's references counter or delayqueue changes.
+ * 
+ * @param session:
+ *    session to be checked
+ */
+static void coap_session_update_idle(coap_session_t *session){
+
+    // Only endpoint's sessions are accounted
+    coap_endpoint_t *endpoint = session->endpoint;
+    if (endpoint == NULL || session->type != COAP_SESSION_TYPE_SERVER)
+        return;
+
+    // Check if the session is idle now
+    uint8_t idle = (session->ref == 0 && session->delayqueue == NULL);
+    if (idle == session->idle)
+        return;
+
+    // Update the list
+    if (idle) {
+        DL_APPEND2(endpoint->idle_sessions, session, idle_prev, idle_next);
+        endpoint->num_idle++;
+    } else {
+        DL_DELETE2(endpoint->idle_sessions, session, idle_prev, idle_next);
+        endpoint->num_idle--;
+    }
+    session->idle = idle;
+}
@@ -0,0 +1,539 @@
+/* ============================================================================================================
+ *  File: coap_tcp.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      CoAP over TCP (RFC 8323): messages' framing, signaling messages (CSM, Ping, Pong, Release,
+ *      Abort) and BERT support for sessions using the reliable transport
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "coap_io.h"
+#include "coap_tcp.h"
+#include "encode.h"
+#include "mem.h"
+#include "net.h"
+#include "option.h"
+
+static int coap_tcp_handle_stream(coap_session_t *session);
+static size_t coap_tcp_encode_header(uint8_t *header, const coap_pdu_t *pdu);
+static int coap_tcp_parse_header(const uint8_t *data, size_t length, size_t *header_length, size_t *message_length);
+static int coap_tcp_send_signal(coap_session_t *session, coap_pdu_t *pdu);
+static int coap_tcp_send_csm(coap_session_t *session);
+static void coap_tcp_abort(coap_session_t *session, uint16_t bad_option, const char *diagnostic);
+static void coap_tcp_close(coap_session_t *session, coap_nack_reason_t reason);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+int coap_tcp_session_init(coap_session_t *session) {
+
+    // Allocate state of the connection
+    coap_tcp_state_t *tcp = (coap_tcp_state_t *) coap_malloc(sizeof(coap_tcp_state_t));
+    if (!tcp) {
+        coap_log(LOG_WARNING, "coap_tcp_session_init: malloc failed\n");
+        return 0;
+    }
+
+    // Initialize the state (buffers don't need to be cleared)
+    tcp->peer_max_message_size = COAP_TCP_DEFAULT_MAX_MESSAGE_SIZE;
+    tcp->csm_received = 0;
+    tcp->bert = 0;
+    tcp->failed = 0;
+    tcp->rx_length = 0;
+    tcp->tx_length = 0;
+    session->tcp = tcp;
+
+    // Until the peer's CSM is received, messages are limited to the default size
+    session->mtu = COAP_TCP_MAX_MESSAGE_SIZE < COAP_TCP_DEFAULT_MAX_MESSAGE_SIZE ?
+        COAP_TCP_MAX_MESSAGE_SIZE : COAP_TCP_DEFAULT_MAX_MESSAGE_SIZE;
+
+    // Announce own capabilities
+    return coap_tcp_send_csm(session);
+}
+
+
+void coap_tcp_session_free(coap_session_t *session) {
+    coap_free(session->tcp);
+    session->tcp = NULL;
+}
+
+
+void coap_tcp_read(coap_session_t *session, coap_tick_t now) {
+
+    coap_tcp_state_t *tcp = session->tcp;
+
+    // Clear 'readable' flags (socket is read in a moment)
+    session->sock.flags &= ~(COAP_SOCKET_CAN_READ | COAP_SOCKET_READ_MORE);
+
+    // Close the connection that failed while writing
+    if (tcp->failed) {
+        coap_tcp_close(session, COAP_NACK_NOT_DELIVERABLE);
+        return;
+    }
+
+    // Received bytes are stored after the headroom
+    uint8_t *stream = tcp->rx_buffer + COAP_HEADER_SIZE;
+
+    // Read the socket until it's empty or the batch limit is reached
+    for (unsigned int i = 0; i < COAP_IO_BATCH_SIZE; i++) {
+
+        // Read as much as the buffer can hold
+        size_t space = COAP_TCP_MAX_MESSAGE_SIZE - tcp->rx_length;
+        ssize_t bytes_read = coap_socket_read(&session->sock, stream + tcp->rx_length, space);
+
+        // If connection was closed by the peer or broken, disconnect the session
+        if (bytes_read < 0) {
+            coap_log(LOG_DEBUG, "*  %s: connection closed\n", coap_session_str(session));
+            coap_tcp_close(session, COAP_NACK_NOT_DELIVERABLE);
+            return;
+        }
+        // If there is nothing more to read, finish the batch
+        else if (bytes_read == 0)
+            break;
+
+        coap_log(LOG_DEBUG, "*  %s: received %lu bytes\n", coap_session_str(session), (unsigned long) bytes_read);
+
+        // Update RX/TX timestamp
+        session->last_rx_tx = now;
+        tcp->rx_length += (size_t) bytes_read;
+
+        // Handle all messages received completely (stop if connection was closed meanwhile)
+        if (!coap_tcp_handle_stream(session))
+            return;
+
+        // Socket has been drained if it didn't fill the buffer
+        if ((size_t) bytes_read < space)
+            break;
+    }
+}
+
+
+ssize_t coap_tcp_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
+
+    coap_tcp_state_t *tcp = session->tcp;
+
+    // Connection must be open
+    if (!tcp || tcp->failed || session->sock.fd == COAP_INVALID_SOCKET)
+        return -1;
+
+    // Encode the header
+    uint8_t header[COAP_TCP_MAX_HEADER_SIZE];
+    size_t header_length = coap_tcp_encode_header(header, pdu);
+    size_t message_length = header_length + pdu->used_size;
+
+    // Try to make room for the message, if there are bytes waiting in the buffer
+    if (tcp->tx_length + message_length > sizeof(tcp->tx_buffer))
+        coap_tcp_flush(session);
+    if (tcp->tx_length + message_length > sizeof(tcp->tx_buffer)) {
+        coap_log(LOG_DEBUG, "*  %s: failed to send %lu bytes (buffer full)\n", coap_session_str(session), (unsigned long) message_length);
+        return -1;
+    }
+
+    // Append the message to the buffer
+    memcpy(tcp->tx_buffer + tcp->tx_length, header, header_length);
+    memcpy(tcp->tx_buffer + tcp->tx_length + header_length, pdu->token, pdu->used_size);
+    tcp->tx_length += message_length;
+
+    // Write as much as the socket accepts
+    coap_tcp_flush(session);
+    if (tcp->failed)
+        return -1;
+
+    // Log informations about session's transaction
+    coap_tick_t now;
+    coap_ticks(&now);
+    coap_session_touch(session, now);
+    coap_log(LOG_DEBUG, "*  %s: sent %lu bytes\n", coap_session_str(session), (unsigned long) message_length);
+
+    return (ssize_t) message_length;
+}
+
+
+void coap_tcp_flush(coap_session_t *session) {
+
+    coap_tcp_state_t *tcp = session->tcp;
+
+    // Clear 'writable' flag (socket is written in a moment)
+    session->sock.flags &= ~COAP_SOCKET_CAN_WRITE;
+    if (!tcp || tcp->failed)
+        return;
+
+    // Write buffered bytes until the socket accepts them
+    size_t written = 0;
+    while (written < tcp->tx_length) {
+
+        ssize_t bytes_written = coap_socket_write(&session->sock, tcp->tx_buffer + written, tcp->tx_length - written);
+
+        /**
+         * @note: Session must not be disconnected here, as flush may be called while observers
+         *    are being notified. Instead, the socket is marked as readable and the connection is
+         *    closed by coap_tcp_read().
+         */
+        if (bytes_written < 0) {
+            tcp->failed = 1;
+            tcp->tx_length = 0;
+            coap_socket_want_write(session->context, &session->sock, 0);
+            session->sock.flags |= COAP_SOCKET_CAN_READ;
+            return;
+        }
+        // Socket's buffer is full
+        else if (bytes_written == 0)
+            break;
+
+        written += (size_t) bytes_written;
+    }
+
+    // Move the remaining bytes to the buffer's front
+    if (written) {
+        memmove(tcp->tx_buffer, tcp->tx_buffer + written, tcp->tx_length - written);
+        tcp->tx_length -= written;
+    }
+
+    // Wait for the socket to become writable, if anything remains
+    coap_socket_want_write(session->context, &session->sock, tcp->tx_length != 0);
+}
+
+
+void coap_tcp_handle_signaling(coap_session_t *session, coap_pdu_t *pdu) {
+
+    coap_tcp_state_t *tcp = session->tcp;
+
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *option;
+
+    switch (pdu->code) {
+
+        case COAP_SIGNALING_CSM: // Capabilities and Settings
+
+            // Parse peer's capabilities
+            coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL);
+            while ((option = coap_option_next(&opt_iter))) {
+                switch (opt_iter.type) {
+                    case COAP_SIGNALING_OPTION_MAX_MESSAGE_SIZE:
+                        tcp->peer_max_message_size = coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+                        break;
+                    case COAP_SIGNALING_OPTION_BLOCK_WISE_TRANSFER:
+                        tcp->bert = 1;
+                        break;
+                    default:
+                        // Unknown critical option makes the CSM invalid (RFC 8323, section 5.3)
+                        if (opt_iter.type & 0x01) {
+                            coap_tcp_abort(session, opt_iter.type, "Unsupported CSM option");
+                            return;
+                        }
+                }
+            }
+            tcp->csm_received = 1;
+
+            // Messages sent to the peer must not exceed limits of both sides
+            session->mtu = COAP_TCP_MAX_MESSAGE_SIZE < tcp->peer_max_message_size ?
+                COAP_TCP_MAX_MESSAGE_SIZE : tcp->peer_max_message_size;
+
+            coap_log(LOG_DEBUG, "*  %s: peer's CSM: max message size %lu, BERT %s\n", coap_session_str(session),
+                (unsigned long) tcp->peer_max_message_size, tcp->bert ? "supported" : "not supported");
+            break;
+
+        case COAP_SIGNALING_PING: // Ping
+
+            // Answer with Pong carrying the same token
+            {
+                coap_pdu_t *pong = coap_pdu_init(COAP_MESSAGE_NON, COAP_SIGNALING_PONG, 0, pdu->token_length);
+                if (pong && coap_add_token(pong, pdu->token_length, pdu->token))
+                    coap_tcp_send_signal(session, pong);
+                else
+                    coap_delete_pdu(pong);
+            }
+            break;
+
+        case COAP_SIGNALING_PONG: // Pong
+
+            coap_log(LOG_DEBUG, "*  %s: pong received\n", coap_session_str(session));
+            break;
+
+        case COAP_SIGNALING_RELEASE: // Release
+        case COAP_SIGNALING_ABORT:   // Abort
+
+            coap_log(LOG_DEBUG, "*  %s: connection %s by the peer\n", coap_session_str(session),
+                pdu->code == COAP_SIGNALING_RELEASE ? "released" : "aborted");
+            coap_tcp_close(session, COAP_NACK_RST);
+            break;
+
+        default: // Unknown signaling message
+
+            coap_log(LOG_DEBUG, "*  %s: dropped unknown signaling message (7.%02d)\n", coap_session_str(session), pdu->code & 0x1f);
+            break;
+    }
+}
+
+
+int coap_tcp_ping(coap_session_t *session) {
+
+    coap_pdu_t *ping = coap_pdu_init(COAP_MESSAGE_NON, COAP_SIGNALING_PING, 0, 0);
+    if (!ping)
+        return 0;
+
+    return coap_tcp_send_signal(session, ping);
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Dispatches all messages received completely by the @p session. Remaining (incomplete)
+ *    message is moved to the front of the session's buffer.
+ *
+ * @param session:
+ *    session to handle messages of
+ * @returns:
+ *    1 if the connection is still open
+ *    0 if the connection has been closed
+ */
+static int coap_tcp_handle_stream(coap_session_t *session) {
+
+    coap_tcp_state_t *tcp = session->tcp;
+    uint8_t *stream = tcp->rx_buffer + COAP_HEADER_SIZE;
+
+    size_t offset = 0;
+    size_t header_length;
+    size_t message_length;
+
+    // Iterate over messages whose header has been received
+    while (coap_tcp_parse_header(stream + offset, tcp->rx_length - offset, &header_length, &message_length)) {
+
+        // Messages larger than the announced limit violate the protocol
+        if (message_length > COAP_TCP_MAX_MESSAGE_SIZE) {
+            coap_tcp_abort(session, 0, "Message too big");
+            return 0;
+        }
+
+        // Wait for the rest of the message
+        if (offset + message_length > tcp->rx_length)
+            break;
+
+        uint8_t *message = stream + offset;
+        offset += message_length;
+
+        // The first message sent by the peer must be the CSM (RFC 8323, section 5.3)
+        uint8_t code = message[header_length - 1];
+        if (!tcp->csm_received && code != COAP_SIGNALING_CSM) {
+            coap_tcp_abort(session, 0, "CSM expected");
+            return 0;
+        }
+
+        /**
+         * @note: Header is rewritten to the form expected by the PDU's parser just in front of
+         *    the token. As the TCP header takes at least 2 bytes, it overwrites up to 2 bytes of
+         *    the previous (already handled) message or of the buffer's headroom. The message is
+         *    marked as NON, as it does not need to be acknowledged.
+         */
+        uint8_t token_length = message[0] & 0x0f;
+        uint8_t *header = message + header_length - COAP_HEADER_SIZE;
+        header[0] = COAP_DEFAULT_VERSION << 6 | COAP_MESSAGE_NON << 4 | token_length;
+        header[1] = code;
+        header[2] = 0;
+        header[3] = 0;
+
+        // Dispatch the message
+        coap_handle_dgram(session, header, COAP_HEADER_SIZE + message_length - header_length);
+
+        // Stop if the connection was closed while handling the message
+        if (session->sock.fd == COAP_INVALID_SOCKET)
+            return 0;
+    }
+
+    // Move the incomplete message to the buffer's front
+    if (offset) {
+        memmove(stream, stream + offset, tcp->rx_length - offset);
+        tcp->rx_length -= offset;
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief: Encodes header of the @p pdu (RFC 8323, section 3.2)
+ *
+ * @param header [out]:
+ *    buffer of COAP_TCP_MAX_HEADER_SIZE bytes to write the header to
+ * @param pdu:
+ *    pdu to encode header of
+ * @returns:
+ *    length of the header
+ */
+static size_t coap_tcp_encode_header(uint8_t *header, const coap_pdu_t *pdu) {
+
+    // Length of options and payload
+    size_t length = pdu->used_size - pdu->token_length;
+    size_t header_length = 1;
+
+    // Encode length (with extended length, if needed) and token's length
+    if (length < 13)
+        header[0] = (uint8_t) (length << 4);
+    else if (length < 269) {
+        header[0] = 13 << 4;
+        header[header_length++] = (uint8_t) (length - 13);
+    } else if (length < 65805) {
+        header[0] = 14 << 4;
+        header[header_length++] = (uint8_t) ((length - 269) >> 8);
+        header[header_length++] = (uint8_t) (length - 269);
+    } else {
+        header[0] = 15 << 4;
+        for (int i = 3; i >= 0; i--)
+            header[header_length++] = (uint8_t) ((length - 65805) >> (8 * i));
+    }
+    header[0] |= pdu->token_length;
+
+    // Encode the code
+    header[header_length++] = pdu->code;
+
+    return header_length;
+}
+
+
+/**
+ * @brief: Parses header of the message at the beginning of @p data (RFC 8323, section 3.2)
+ *
+ * @param data:
+ *    received bytes
+ * @param length:
+ *    number of received bytes
+ * @param header_length [out]:
+ *    length of the message's header
+ * @param message_length [out]:
+ *    length of the whole message (header included)
+ * @returns:
+ *    1 if the header has been received completely
+ *    0 otherwise
+ */
+static int coap_tcp_parse_header(const uint8_t *data, size_t length, size_t *header_length, size_t *message_length) {
+
+    if (length == 0)
+        return 0;
+
+    // Get size of the extended length
+    uint8_t len = data[0] >> 4;
+    size_t extended = (len < 13) ? 0 : (len == 13) ? 1 : (len == 14) ? 2 : 4;
+
+    // Check whether the whole header has been received (Len/TKL byte, extended length, code)
+    *header_length = 1 + extended + 1;
+    if (length < *header_length)
+        return 0;
+
+    // Decode length of options and payload
+    size_t body_length;
+    if (len < 13)
+        body_length = len;
+    else if (len == 13)
+        body_length = (size_t) data[1] + 13;
+    else if (len == 14)
+        body_length = ((size_t) data[1] << 8 | data[2]) + 269;
+    else
+        body_length = ((size_t) data[1] << 24 | (size_t) data[2] << 16 | (size_t) data[3] << 8 | data[4]) + 65805;
+
+    *message_length = *header_length + (data[0] & 0x0f) + body_length;
+
+    return 1;
+}
+
+
+/**
+ * @brief: Sends the signaling message @p pdu with the @p session
+ *
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+static int coap_tcp_send_signal(coap_session_t *session, coap_pdu_t *pdu) {
+    return coap_send(session, pdu) >= 0;
+}
+
+
+/**
+ * @brief: Sends the CSM message announcing own capabilities to the peer of the @p session
+ *
+ * @returns:
+ *    1 on success
+ *    0 on failure
+ */
+static int coap_tcp_send_csm(coap_session_t *session) {
+
+    coap_pdu_t *csm = coap_pdu_init(COAP_MESSAGE_NON, COAP_SIGNALING_CSM, 0, 8);
+    if (!csm)
+        return 0;
+
+    // Announce the maximal size of messages accepted
+    uint8_t buf[4];
+    size_t length = coap_encode_var_safe(buf, sizeof(buf), COAP_TCP_MAX_MESSAGE_SIZE);
+    coap_add_option(csm, COAP_SIGNALING_OPTION_MAX_MESSAGE_SIZE, length, buf);
+
+    // Announce support for BERT
+    coap_add_option(csm, COAP_SIGNALING_OPTION_BLOCK_WISE_TRANSFER, 0, NULL);
+
+    return coap_tcp_send_signal(session, csm);
+}
+
+
+/**
+ * @brief: Sends the Abort message to the peer of the @p session and closes the connection
+ *
+ * @param session:
+ *    session to be aborted
+ * @param bad_option:
+ *    number of the CSM option causing the abort (0 if none)
+ * @param diagnostic:
+ *    human-readable reason of the abort
+ */
+static void coap_tcp_abort(coap_session_t *session, uint16_t bad_option, const char *diagnostic) {
+
+    coap_log(LOG_WARNING, "*  %s: connection aborted (%s)\n", coap_session_str(session), diagnostic);
+
+    // Send the Abort message
+    size_t diagnostic_length = strlen(diagnostic);
+    coap_pdu_t *abort = coap_pdu_init(COAP_MESSAGE_NON, COAP_SIGNALING_ABORT, 0, 8 + diagnostic_length);
+    if (abort) {
+        if (bad_option) {
+            uint8_t buf[4];
+            size_t length = coap_encode_var_safe(buf, sizeof(buf), bad_option);
+            coap_add_option(abort, COAP_SIGNALING_OPTION_BAD_CSM_OPTION, length, buf);
+        }
+        coap_add_data(abort, diagnostic_length, (const uint8_t *) diagnostic);
+        coap_tcp_send_signal(session, abort);
+    }
+
+    // Close the connection
+    coap_tcp_close(session, COAP_NACK_RST);
+}
+
+
+/**
+ * @brief: Closes the connection of the @p session, drops buffered bytes and marks the session
+ *    as disconnected
+ *
+ * @param session:
+ *    session to be closed
+ * @param reason:
+ *    reason of closing the connection
+ */
+static void coap_tcp_close(coap_session_t *session, coap_nack_reason_t reason) {
+
+    // Drop buffered bytes
+    session->tcp->rx_length = 0;
+    session->tcp->tx_length = 0;
+
+    // Close the socket
+    if (session->sock.flags != COAP_SOCKET_EMPTY) {
+        coap_socket_unregister(session->context, &session->sock);
+        coap_socket_close(&session->sock);
+    }
+
+    // Mark the session as disconnected
+    coap_session_disconnected(session, reason);
+}
@@ -0,0 +1,132 @@
+/* ============================================================================================================
+ *  File: dedup.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Per-endpoint cache of the ACKs sent in reply to CON requests, used to answer retransmitted
+ *      (duplicated) requests without handling them again
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "dedup.h"
+#include "mem.h"
+#include "utlist.h"
+
+static void coap_dedup_remove(coap_dedup_cache_t *cache, coap_dedup_entry_t *entry);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+const coap_dedup_entry_t *coap_dedup_find(
+    coap_dedup_cache_t *cache,
+    struct coap_session_t *session,
+    uint16_t mid,
+    coap_tick_t now
+) {
+    if (!cache->index)
+        return NULL;
+
+    // Prepare the key
+    coap_dedup_entry_t key;
+    memset(&key, 0, sizeof(key));
+    key.session = session;
+    key.mid = mid;
+
+    // Look for the entry in the index
+    coap_dedup_entry_t *entry = NULL;
+    HASH_FIND(hh, cache->index, &key.session, COAP_DEDUP_KEY_SIZE, entry);
+    if (!entry)
+        return NULL;
+
+    // Drop the expired entry
+    if (entry->expires <= now) {
+        coap_dedup_remove(cache, entry);
+        return NULL;
+    }
+
+    // Mark entry as the most recently used one
+    DL_DELETE(cache->lru, entry);
+    DL_APPEND(cache->lru, entry);
+
+    return entry;
+}
+
+
+void coap_dedup_store(
+    coap_dedup_cache_t *cache,
+    struct coap_session_t *session,
+    const coap_pdu_t *ack,
+    coap_tick_t now
+) {
+    size_t length = ack->used_size + COAP_HEADER_SIZE;
+    if (length > COAP_DEDUP_MAX_BYTES)
+        return;
+
+    // Replace the ACK sent earlier for the same request
+    coap_dedup_entry_t *entry = (coap_dedup_entry_t *) coap_dedup_find(cache, session, ack->tid, now);
+    if (entry)
+        coap_dedup_remove(cache, entry);
+
+    // Make room for the new entry (expired entries are evicted first, as they are the least recently used)
+    while (cache->lru && (cache->num >= COAP_DEDUP_MAX_ENTRIES || cache->bytes + length > COAP_DEDUP_MAX_BYTES))
+        coap_dedup_remove(cache, cache->lru);
+
+    // Allocate the entry
+    entry = (coap_dedup_entry_t *) coap_malloc(sizeof(coap_dedup_entry_t) + length);
+    if (!entry) {
+        coap_log(LOG_WARNING, "coap_dedup_store: malloc failed\n");
+        return;
+    }
+
+    // Fill the entry
+    memset(entry, 0, sizeof(coap_dedup_entry_t));
+    entry->session = session;
+    entry->mid = ack->tid;
+    entry->expires = now + COAP_DEDUP_LIFETIME * COAP_TICKS_PER_SECOND;
+    entry->length = length;
+    memcpy(entry->data, ack->token - COAP_HEADER_SIZE, length);
+
+    // Register the entry
+    DL_APPEND(cache->lru, entry);
+    HASH_ADD(hh, cache->index, session, COAP_DEDUP_KEY_SIZE, entry);
+    cache->num++;
+    cache->bytes += length;
+}
+
+
+void coap_dedup_remove_session(coap_dedup_cache_t *cache, struct coap_session_t *session) {
+
+    coap_dedup_entry_t *entry, *tmp;
+
+    DL_FOREACH_SAFE(cache->lru, entry, tmp)
+        if (entry->session == session)
+            coap_dedup_remove(cache, entry);
+}
+
+
+void coap_dedup_clear(coap_dedup_cache_t *cache) {
+    while (cache->lru)
+        coap_dedup_remove(cache, cache->lru);
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Unlinks @p entry from the @p cache and frees it
+ */
+static void coap_dedup_remove(coap_dedup_cache_t *cache, coap_dedup_entry_t *entry) {
+
+    DL_DELETE(cache->lru, entry);
+    HASH_DELETE(hh, cache->index, entry);
+    cache->num--;
+    cache->bytes -= entry->length;
+
+    coap_free(entry);
+}
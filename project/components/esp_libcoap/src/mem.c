@@ -0,0 +1,390 @@
+/* ============================================================================================================
+ *  File: mem.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Size-classed pools serving the objects allocated on the library's message path (PDUs,
+ *      PDUs' buffers, sendqueue's nodes and sessions) and the bump-pointer arena used for
+ *      the transient allocations
+ *
+ * ============================================================================================================ */
+
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "coap_config.h"
+#include "coap_session.h"
+#include "mem.h"
+#include "net.h"
+#include "pdu.h"
+
+static void coap_memory_init(void);
+static void *coap_memory_pool_alloc(coap_memory_tag_t type, size_t size);
+static struct coap_mem_pool_data_t *coap_memory_owner(coap_memory_tag_t type, void *object);
+
+
+/* ------------------------------------------- [Macrofeinitions] ---------------------------------------------- */
+
+/**
+ * @brief: Alignment of the pools' blocks
+ */
+#define COAP_MEM_ALIGN(size) (((size) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+/**
+ * @brief: Number of the uint64_t words needed to hold @p num blocks of the @p size bytes.
+ *    One word is added so that pools of capacity 0 can be declared.
+ */
+#define COAP_MEM_STORAGE(num, size) ((num) * COAP_MEM_ALIGN(size) / sizeof(uint64_t) + 1)
+
+
+/* -------------------------------------------- [Data structures] --------------------------------------------- */
+
+/**
+ * @brief: Free block of the pool
+ */
+typedef struct coap_mem_block_t {
+    struct coap_mem_block_t *next;
+} coap_mem_block_t;
+
+/**
+ * @brief: State of the memory pool
+ */
+typedef struct coap_mem_pool_data_t {
+
+    // Pool's storage
+    uint8_t *storage;
+    // List of free blocks
+    coap_mem_block_t *free_list;
+
+    // Pool's parameters and statistics
+    coap_memory_stats_t stats;
+
+} coap_mem_pool_data_t;
+
+/**
+ * @brief: Heap block allocated by the arena whose buffer was exhausted
+ */
+typedef struct coap_arena_chunk_t {
+
+    // Next block allocated by the arena
+    struct coap_arena_chunk_t *next;
+    // Padding keeping the block's data aligned
+    uint64_t data[];
+
+} coap_arena_chunk_t;
+
+
+/* ---------------------------------------- [Global and static data] ------------------------------------------ */
+
+// Pools' storage
+static uint64_t coap_pdu_storage[COAP_MEM_STORAGE(COAP_MEMPOOL_PDU_NUM, sizeof(coap_pdu_t))];
+static uint64_t coap_buf_small_storage[
+    COAP_MEM_STORAGE(COAP_MEMPOOL_BUF_SMALL_NUM, COAP_MEMPOOL_BUF_SMALL_SIZE + COAP_HEADER_SIZE)];
+static uint64_t coap_buf_medium_storage[
+    COAP_MEM_STORAGE(COAP_MEMPOOL_BUF_MEDIUM_NUM, COAP_MEMPOOL_BUF_MEDIUM_SIZE + COAP_HEADER_SIZE)];
+static uint64_t coap_buf_mtu_storage[
+    COAP_MEM_STORAGE(COAP_MEMPOOL_BUF_MTU_NUM, COAP_MEMPOOL_BUF_MTU_SIZE + COAP_HEADER_SIZE)];
+static uint64_t coap_node_storage[COAP_MEM_STORAGE(COAP_MEMPOOL_NODE_NUM, sizeof(coap_queue_t))];
+static uint64_t coap_session_storage[COAP_MEM_STORAGE(COAP_MEMPOOL_SESSION_NUM, sizeof(coap_session_t))];
+
+/**
+ * @note: Pools serving the same type of objects are placed in the order of the growing blocks' size
+ */
+static coap_mem_pool_data_t coap_pools[COAP_POOL_NUM] = {
+    [COAP_POOL_PDU] = {
+        .storage = (uint8_t *) coap_pdu_storage,
+        .stats   = { COAP_MEM_ALIGN(sizeof(coap_pdu_t)), COAP_MEMPOOL_PDU_NUM, 0, 0, 0 }
+    },
+    [COAP_POOL_BUF_SMALL] = {
+        .storage = (uint8_t *) coap_buf_small_storage,
+        .stats   = {
+            COAP_MEM_ALIGN(COAP_MEMPOOL_BUF_SMALL_SIZE + COAP_HEADER_SIZE), COAP_MEMPOOL_BUF_SMALL_NUM, 0, 0, 0
+        }
+    },
+    [COAP_POOL_BUF_MEDIUM] = {
+        .storage = (uint8_t *) coap_buf_medium_storage,
+        .stats   = {
+            COAP_MEM_ALIGN(COAP_MEMPOOL_BUF_MEDIUM_SIZE + COAP_HEADER_SIZE), COAP_MEMPOOL_BUF_MEDIUM_NUM, 0, 0, 0
+        }
+    },
+    [COAP_POOL_BUF_MTU] = {
+        .storage = (uint8_t *) coap_buf_mtu_storage,
+        .stats   = {
+            COAP_MEM_ALIGN(COAP_MEMPOOL_BUF_MTU_SIZE + COAP_HEADER_SIZE), COAP_MEMPOOL_BUF_MTU_NUM, 0, 0, 0
+        }
+    },
+    [COAP_POOL_NODE] = {
+        .storage = (uint8_t *) coap_node_storage,
+        .stats   = { COAP_MEM_ALIGN(sizeof(coap_queue_t)), COAP_MEMPOOL_NODE_NUM, 0, 0, 0 }
+    },
+    [COAP_POOL_SESSION] = {
+        .storage = (uint8_t *) coap_session_storage,
+        .stats   = { COAP_MEM_ALIGN(sizeof(coap_session_t)), COAP_MEMPOOL_SESSION_NUM, 0, 0, 0 }
+    }
+};
+
+/**
+ * @brief: Ranges of the pools serving objects of the given type ([first, last])
+ */
+static const struct {
+    coap_memory_pool_t first;
+    coap_memory_pool_t last;
+} coap_pools_by_type[] = {
+    [COAP_PDU]     = { COAP_POOL_PDU,       COAP_POOL_PDU     },
+    [COAP_PDU_BUF] = { COAP_POOL_BUF_SMALL, COAP_POOL_BUF_MTU },
+    [COAP_NODE]    = { COAP_POOL_NODE,      COAP_POOL_NODE    },
+    [COAP_SESSION] = { COAP_POOL_SESSION,   COAP_POOL_SESSION }
+};
+
+// Flag set when pools' free lists have been built
+static int coap_pools_initialized = 0;
+
+// Flag set when the library runs in more than one thread (pools are bypassed from then on)
+static int coap_pools_shared = 0;
+// Lock guarding pools' free lists against blocks returned concurrently (taken only if pools are shared)
+static pthread_mutex_t coap_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+void *coap_malloc_type(coap_memory_tag_t type, size_t size){
+
+    /**
+     * @note: Pools are sized for a single context and guarding them with one lock would serialize
+     *    all threads on the message path. Threaded setups allocate from the heap instead.
+     */
+    if (!coap_pools_shared) {
+
+        // Try to take a block from the pools
+        void *object = coap_memory_pool_alloc(type, size);
+        if (object)
+            return object;
+    }
+
+    // Otherwise, fall back to the heap
+    return coap_malloc(size);
+}
+
+
+void *coap_realloc_type(coap_memory_tag_t type, void *object, size_t size){
+
+    if (object == NULL)
+        return coap_malloc_type(type, size);
+
+    coap_mem_pool_data_t *pool = coap_memory_owner(type, object);
+
+    // Heap-allocated objects are reallocated in place (their size is not known)
+    if (pool == NULL)
+        return realloc(object, size);
+
+    // If the current block is big enough, nothing has to be done
+    if (size <= pool->stats.block_size)
+        return object;
+
+    // Otherwise, move the object to a bigger block
+    void *new_object = coap_malloc_type(type, size);
+    if (new_object == NULL)
+        return NULL;
+    memcpy(new_object, object, pool->stats.block_size);
+    coap_free_type(type, object);
+
+    return new_object;
+}
+
+
+void coap_free_type(coap_memory_tag_t type, void *object){
+
+    if (object == NULL)
+        return;
+
+    coap_mem_pool_data_t *pool = coap_memory_owner(type, object);
+
+    // Objects not belonging to any pool were allocated on the heap
+    if (pool == NULL) {
+        coap_free(object);
+        return;
+    }
+
+    // Put block back into the pool (blocks taken before pools got shared may be freed by any thread)
+    if (coap_pools_shared)
+        pthread_mutex_lock(&coap_pools_lock);
+    coap_mem_block_t *block = (coap_mem_block_t *) object;
+    block->next = pool->free_list;
+    pool->free_list = block;
+    pool->stats.used--;
+    if (coap_pools_shared)
+        pthread_mutex_unlock(&coap_pools_lock);
+}
+
+
+void coap_memory_stats(coap_memory_pool_t pool, coap_memory_stats_t *stats){
+
+    assert(pool < COAP_POOL_NUM);
+
+    *stats = coap_pools[pool].stats;
+}
+
+
+void coap_memory_set_shared(void){
+    coap_pools_shared = 1;
+}
+
+
+void *coap_arena_alloc(coap_arena_t *arena, size_t size){
+
+    assert(arena);
+
+    // Allocate arena's buffer when it's used for the first time
+    if (arena->buf == NULL) {
+        arena->buf = (uint8_t *) coap_malloc(COAP_ARENA_SIZE);
+        arena->used = 0;
+    }
+
+    // Keep objects aligned
+    size = COAP_MEM_ALIGN(size);
+
+    // Take memory from the buffer, if it fits
+    if (arena->buf && size <= COAP_ARENA_SIZE - arena->used) {
+        void *object = arena->buf + arena->used;
+        arena->used += size;
+        return object;
+    }
+
+    // Otherwise, allocate a heap block and track it
+    coap_arena_chunk_t *chunk = 
+        (coap_arena_chunk_t *) coap_malloc(sizeof(coap_arena_chunk_t) + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = arena->overflow;
+    arena->overflow = chunk;
+
+    return chunk->data;
+}
+
+
+void coap_arena_reset(coap_arena_t *arena){
+
+    assert(arena);
+
+    // Free heap blocks
+    while (arena->overflow) {
+        coap_arena_chunk_t *chunk = arena->overflow;
+        arena->overflow = chunk->next;
+        coap_free(chunk);
+    }
+
+    // Rewind the buffer
+    arena->used = 0;
+}
+
+
+void coap_arena_release(coap_arena_t *arena){
+
+    assert(arena);
+
+    coap_arena_reset(arena);
+    coap_free(arena->buf);
+    arena->buf = NULL;
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Builds free lists of all pools
+ */
+static void coap_memory_init(void){
+
+    for (int i = 0; i < COAP_POOL_NUM; i++) {
+
+        coap_mem_pool_data_t *pool = &coap_pools[i];
+
+        // Link blocks in the order of growing addresses
+        pool->free_list = NULL;
+        for (size_t n = pool->stats.capacity; n > 0; n--) {
+            coap_mem_block_t *block =
+                (coap_mem_block_t *) (pool->storage + (n - 1) * pool->stats.block_size);
+            block->next = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+
+    coap_pools_initialized = 1;
+}
+
+
+/**
+ * @brief: Takes a block able to hold @p size bytes from the smallest non-empty pool serving
+ *    @p type objects.
+ *
+ * @param type:
+ *    type of the object
+ * @param size:
+ *    size of the object
+ * @returns:
+ *    pointer to the block on success
+ *    NULL if no pool can serve the request (fallback to the heap is counted)
+ */
+static void *coap_memory_pool_alloc(coap_memory_tag_t type, size_t size){
+
+    if (!coap_pools_initialized)
+        coap_memory_init();
+
+    void *object = NULL;
+    for (int i = coap_pools_by_type[type].first; i <= coap_pools_by_type[type].last; i++) {
+
+        coap_mem_pool_data_t *pool = &coap_pools[i];
+
+        // Skip pools with too small blocks and exhausted ones
+        if (size > pool->stats.block_size || pool->free_list == NULL)
+            continue;
+
+        // Take the first free block
+        coap_mem_block_t *block = pool->free_list;
+        pool->free_list = block->next;
+
+        // Update statistics
+        if (++pool->stats.used > pool->stats.high_water)
+            pool->stats.high_water = pool->stats.used;
+
+        object = block;
+        break;
+    }
+
+    // Count the fallback to the heap
+    if (object == NULL)
+        coap_pools[coap_pools_by_type[type].last].stats.fallbacks++;
+
+    return object;
+}
+
+
+/**
+ * @brief: Finds pool that @p object was taken from.
+ *
+ * @param type:
+ *    type of the object
+ * @param object:
+ *    object to be checked
+ * @returns:
+ *    pool owning the @p object
+ *    NULL if the @p object was allocated on the heap
+ */
+static coap_mem_pool_data_t *coap_memory_owner(coap_memory_tag_t type, void *object){
+
+    for (int i = coap_pools_by_type[type].first; i <= coap_pools_by_type[type].last; i++) {
+
+        coap_mem_pool_data_t *pool = &coap_pools[i];
+
+        // Check whether object lies in the pool's storage
+        if ((uint8_t *) object >= pool->storage &&
+            (uint8_t *) object < pool->storage + pool->stats.capacity * pool->stats.block_size)
+            return pool;
+    }
+
+    return NULL;
+}
@@ -50,6 +50,11 @@
 #include "option.h"
 #include "encode.h"
 #include "block.h"
+#include "async.h"
+#include "worker.h"
+#include "coap_hashkey.h"
+#include "coap_tcp.h"
+#include "timer_heap.h"
 #include "net.h"
 
 void coap_free_endpoint(coap_endpoint_t *ep);
@@ -61,9 +66,15 @@ static void coap_read_session(coap_session_t *session, coap_tick_t now);
 static int coap_read_endpoint(coap_endpoint_t *endpoint, coap_tick_t now);
 COAP_STATIC_INLINE int token_match(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen);
 COAP_STATIC_INLINE size_t get_wkc_len(coap_context_t *context, coap_opt_t *query_filter);
+static coap_wkc_cache_t *coap_wellknown_get_cached(coap_context_t *context, coap_opt_t *query_filter);
 static int coap_cancel(coap_context_t *context, const coap_queue_t *sent);
 static enum respond_t no_response(coap_pdu_t *request, coap_pdu_t *response);
 static void handle_request(coap_session_t *session, coap_pdu_t *pdu);
+static int handle_preconditions(coap_resource_t *resource, coap_pdu_t *request, bool validate, coap_pdu_t *response);
+static void handle_etag(coap_resource_t *resource, coap_pdu_t *request, bool validate, coap_pdu_t *response);
+static bool handle_validate(coap_resource_t *resource, coap_pdu_t *request, const coap_string_t *query);
+static void handle_cache(coap_resource_t *resource, coap_pdu_t *request, const coap_string_t *query, bool use_cache, coap_pdu_t *response, coap_tick_t now);
+static bool coap_request_lists_etag(coap_pdu_t *request, uint16_t type, const uint8_t *etag, size_t length);
 static void handle_response(coap_session_t *session, coap_pdu_t *sent, coap_pdu_t *rcvd);
 
 /* -------------------------------------------- [Macrofeinitions] --------------------------------------------- */
@@ -160,114 +171,36 @@ static coap_str_const_t coap_default_uri_wellknown = {
 
 /* ----------------------------------------------- [Functions] ------------------------------------------------ */
 
-unsigned int coap_adjust_basetime(
+int coap_sendqueue_insert(
     coap_context_t *context, 
-    coap_tick_t now
+    coap_queue_t *node
 ) {
-    // Number of elements in the @p context->sendqueue that has expired due to basetime change
-    unsigned int result = 0;
-    
-    // Difference between current and @p new timestamp
-    coap_tick_diff_t delta = now - context->sendqueue_basetime;
-
-    // If @p context->sendqueue is not empty check packets' timeouts
-    if (context->sendqueue) {
-
-        // If new timestamp is earlier than a current, not timeouts will be updated
-        if (delta <= 0)
-            context->sendqueue->t -= delta;
-        // Otherwise, some timeouts can expire
-        else {
-
-            /**
-             * @brief: The time must be advanced forward, thus possibly leading to timed
-             *    out elements at the queue's start. For every element that has timed out,
-             *    its relative time is set to zero and the result counter is increased. 
-             */
-
-            coap_queue_t *packet = context->sendqueue;
-            coap_tick_t timeout = 0;
-
-            // Iterate over all expired packets (sendqueue is sorted in an ascending order with respect to timeouts)
-            while (packet && (packet->t < (coap_tick_t) delta - timeout)) {
-                
-                /**
-                 * @brief: Time out of the packet is calculated as a sum of the context's basetime
-                 *    and '->t' component of all previous packets in the queue.
-                 */
-
-                timeout += packet->t;
-
-                // Expired packet's '->t' component set to 0 signals an 'expired' state
-                packet->t = 0;
-
-                result++;
-                packet = packet->next;
-            }
+    if (!context || !node)
+        return 0;
 
-            // Finally adjust the first element that has not expired
-            if (packet)
-                packet->t = (coap_tick_t) delta - timeout;
-        }
-    }
+    // Put the node into the heap
+    if (!coap_timer_heap_insert(&context->sendqueue, node))
+        return 0;
 
-    // Adjust basetime
-    context->sendqueue_basetime += delta;
+    // Add node to the index
+    HASH_ADD(hh, context->sendqueue_index, session, COAP_QUEUE_KEY_SIZE, node);
 
-    return result;
+    return 1;
 }
 
 
-int coap_insert_node(
-    coap_queue_t **queue, 
+void coap_sendqueue_remove(
+    coap_context_t *context, 
     coap_queue_t *node
 ) {
-    if (!queue || !node)
-        return 0;
-    
-
-    // Set queue head if empty
-    if (!*queue) {
-        *queue = node;
-        return 1;
-    }
-
-    // Replace queue head if PDU's time is less than head's time
-    if (node->t < (*queue)->t) {
-        node->next = *queue;
-        *queue = node;
-
-        /**
-         * @brief: Time out of the packet in queue is calculated as a sum of the context's basetime
-         *    and '->t' component of all previous packets in the queue. For that reasone we need to
-         *    make head->t relative to node->t.
-         */
-
-        (*queue)->t -= node->t;
-        return 1;
-    }
-
-    // Search for right place to insert
-    coap_queue_t *p, *q = *queue;
-    do {
-        // Make node's timeout relative to q's timeout
-        node->t -= q->t;
-
-        // Advance through the list
-        p = q;
-        q = q->next;
-        
-    } while (q && q->t <= node->t);
+    if (!context || !node || node->heap_index == 0)
+        return;
 
-    // Make q'a timeout relative to the node'a timeout
-    if (q)
-        q->t -= node->t;                
+    // Remove node from the index
+    HASH_DELETE(hh, context->sendqueue_index, node);
 
-        // Insert a new item
-    node->next = q;
-    p->next = node;
-    
-    return 1;
+    // Detach the node from the heap
+    coap_timer_heap_remove(&context->sendqueue, node);
 }
 
 
@@ -282,8 +215,7 @@ int coap_delete_node(coap_queue_t *node) {
 
     // Remove node out of context->sendqueue (it could be added in by coap_wait_ack())
     if ( node->session ) {
-        if (node->session->context->sendqueue)
-            LL_DELETE(node->session->context->sendqueue, node);
+        coap_sendqueue_remove(node->session->context, node);
         coap_session_release(node->session);
     }
 
@@ -328,23 +260,18 @@ coap_queue_t *coap_peek_next(coap_context_t *context) {
     if (!context)
         return NULL;
 
-    return context->sendqueue;
+    return (coap_queue_t *) coap_timer_heap_peek(&context->sendqueue);
 }
 
 
 coap_queue_t *coap_pop_next(coap_context_t *context) {
 
-    if (!context || !context->sendqueue)
+    if (!context || !context->sendqueue.len)
         return NULL;
 
     // Detach the head node from the queue
-    coap_queue_t *next = context->sendqueue;
-    context->sendqueue = context->sendqueue->next;
-    next->next = NULL;
-
-    // Update head->next node's timeout, as it was relative to the head's timeout
-    if (context->sendqueue)
-        context->sendqueue->t += next->t;
+    coap_queue_t *next = (coap_queue_t *) coap_timer_heap_peek(&context->sendqueue);
+    coap_sendqueue_remove(context, next);
     
     return next;
 }
@@ -370,9 +297,29 @@ coap_context_t *coap_new_context(const coap_address_t *listen_addr){
     // Clear the memory inside context
     memset(context, 0, sizeof(coap_context_t));
 
+    // Initialize heaps of the retransmissions' and observers' timers
+    coap_timer_heap_init(&context->sendqueue,
+        offsetof(coap_queue_t, t), offsetof(coap_queue_t, heap_index));
+    coap_timer_heap_init(&context->observe_timers,
+        offsetof(coap_subscription_t, timer), offsetof(coap_subscription_t, timer_index));
+
     // Initialize message id
     prng((unsigned char *) &context->message_id, sizeof(uint16_t));
 
+    // Initialize resources' version (0 denotes empty entries of the wkc cache)
+    context->resources_version = 1;
+
+    // Initialize read & send methods to default
+    context->network_send = coap_network_send;
+    context->network_read = coap_network_read;
+
+    // Initialize the default I/O backend
+    context->io_backend = &coap_io_select_backend;
+    if (!context->io_backend->init(context)) {
+        coap_free(context);
+        return NULL;
+    }
+
     // If @p listen_addr has been given, create an initial endpoint to listen on
     if (listen_addr) {
         coap_endpoint_t *endpoint = coap_new_endpoint(context, listen_addr);
@@ -380,19 +327,65 @@ coap_context_t *coap_new_context(const coap_address_t *listen_addr){
             goto onerror;
     }
 
-    // Initialize read & send methods to default
-    context->network_send = coap_network_send;
-    context->network_read = coap_network_read;
-
     return context;
 
     // On error, free allocated context and return NULL
 onerror:
+    context->io_backend->release(context);
     coap_free(context);
     return NULL;
 }
 
 
+int coap_context_set_io_backend(coap_context_t *context, const coap_io_backend_t *backend) {
+
+    assert(context);
+    assert(backend);
+
+    // Keep the current backend's state aside
+    const coap_io_backend_t *old_backend = context->io_backend;
+    void *old_data = context->io_data;
+
+    // Initialize the new backend
+    context->io_backend = backend;
+    context->io_data = NULL;
+    if (!backend->init(context))
+        goto error;
+
+    // Move all registered sockets to the new backend
+    coap_socket_t *sock, *failed;
+    LL_FOREACH(context->io_sockets, sock) {
+        if (!backend->add(context, sock))
+            goto error_add;
+    }
+
+    // Release the old backend
+    void *new_data = context->io_data;
+    context->io_data = old_data;
+    LL_FOREACH(context->io_sockets, sock)
+        old_backend->del(context, sock);
+    old_backend->release(context);
+    context->io_data = new_data;
+
+    return 1;
+
+error_add:
+    // Withdraw sockets that have been already added
+    failed = sock;
+    LL_FOREACH(context->io_sockets, sock) {
+        if (sock == failed)
+            break;
+        backend->del(context, sock);
+    }
+    backend->release(context);
+error:
+    // Restore the old backend
+    context->io_backend = old_backend;
+    context->io_data = old_data;
+    return 0;
+}
+
+
 void coap_set_app_data(coap_context_t *context, void *app_data) {
     assert(context);
     context->app = app_data;
@@ -411,10 +404,26 @@ void coap_free_context(coap_context_t *context) {
         return;    
 
     // Delete all packet's that wait for an acknowledgement
-    coap_delete_all(context->sendqueue);
+    while (context->sendqueue.len)
+        coap_delete_node(context->sendqueue.items[context->sendqueue.len - 1]);
+    coap_timer_heap_free(&context->sendqueue);
+
+    // Free the per-request arena
+    coap_arena_release(&context->request_arena);
+
+    // Free cached /.well-known/core renderings
+    for (int i = 0; i < COAP_WKC_CACHE_SIZE; i++)
+        coap_free(context->wkc_cache[i].buf);
 
-    // Free all server's resources
+    // Stop workers before their requests are dropped
+    coap_workers_stop(context);
+
+    // Drop requests waiting for the separate response (they hold references to sessions)
+    coap_async_clear(context);
+
+    // Free all server's resources (their subscriptions leave the timers' heap)
     coap_delete_all_resources(context);
+    coap_timer_heap_free(&context->observe_timers);
 
     // Free all (server's) endpoints
     coap_endpoint_t *ep, *tmp;
@@ -425,6 +434,9 @@ void coap_free_context(coap_context_t *context) {
     coap_session_t *sp, *stmp;
     LL_FOREACH_SAFE(context->sessions, sp, stmp)
         coap_session_release(sp);
+
+    // Release the I/O backend
+    context->io_backend->release(context);
     
     coap_free(context);
 }
@@ -467,6 +479,8 @@ int coap_option_check_critical(
                 case COAP_OPTION_PROXY_SCHEME:
                 case COAP_OPTION_BLOCK2:
                 case COAP_OPTION_BLOCK1:
+                case COAP_OPTION_Q_BLOCK2:
+                case COAP_OPTION_Q_BLOCK1:
                     break;
                 // Unknown critical options
                 default:
@@ -504,8 +518,9 @@ coap_tid_t coap_send_ack(coap_session_t *session, coap_pdu_t *request) {
 
 ssize_t coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
 
-    // Send a CoAP message using a given @p session 
-    ssize_t bytes_written = 
+    // Send a CoAP message using a given @p session (TCP messages are framed with their own header)
+    ssize_t bytes_written = COAP_PROTO_RELIABLE(session->proto) ?
+        coap_tcp_send_pdu(session, pdu) :
         coap_session_send(session, pdu->token - COAP_HEADER_SIZE, pdu->used_size + COAP_HEADER_SIZE);
 
     coap_show_pdu(LOG_DEBUG, pdu);
@@ -580,32 +595,18 @@ coap_tid_t coap_wait_ack(
     // Increment session's refere counter
     node->session = coap_session_reference(session);
 
-    /**
-     * @note: We need to set timer for pdu retransmission. If this is the first element in
-     *    the retransmission queue, the base time is set to the current time and the 
-     *    retransmission time is node->timeout. If there is already an entry in the sendqueue,
-     *    we must check if this node is to be retransmitted earlier. Therefore, node->timeout
-     *    is first normalized to the base time and then inserted into the queue with an adjusted
-     *    relative time.
-     */
-
     coap_tick_t now;
     coap_ticks(&now);
 
-    // An empty retransmission queue
-    if (session->context->sendqueue == NULL) {
-        node->t = node->timeout;
-        session->context->sendqueue_basetime = now;
-    } 
-    // An non-empty retransmission queue (make node->t relative to session->context->sendqueue_basetime )
-    else 
-        node->t = (now - session->context->sendqueue_basetime) + node->timeout;
+    // Set time of the retransmission
+    node->t = now + node->timeout;
 
     // Add packet to the queue
-    coap_insert_node(&session->context->sendqueue, node);
+    if (!coap_sendqueue_insert(session->context, node))
+        return COAP_INVALID_TID;
 
     coap_log(LOG_DEBUG, "** %s: tid=%d added to retransmit queue (%ums)\n",
-        coap_session_str(node->session), node->id, (unsigned)(node->t * 1000 / COAP_TICKS_PER_SECOND));
+        coap_session_str(node->session), node->id, (unsigned)(node->timeout * 1000 / COAP_TICKS_PER_SECOND));
 
     return node->id;
 }
@@ -618,6 +619,13 @@ coap_tid_t coap_send(
     // Write the header to the pdu's data
     coap_pdu_encode_header(pdu);
 
+    // Remember ACKs, so that duplicated CON requests could be answered without handling them again
+    if (pdu->type == COAP_MESSAGE_ACK && session->endpoint) {
+        coap_tick_t now;
+        coap_ticks(&now);
+        coap_dedup_store(&session->endpoint->dedup, session, pdu, now);
+    }
+
     // Send the PDU
     ssize_t bytes_written = coap_send_pdu( session, pdu, NULL );
     // PDU's dispatch was delayed
@@ -629,8 +637,9 @@ coap_tid_t coap_send(
         return (coap_tid_t) bytes_written;
     }
 
-    // Delete PDU only when it was not put into the retransmission queue (i.e. does not wait for ACK)
-    if (pdu->type != COAP_MESSAGE_CON) {
+    // Delete PDU only when it was not put into the retransmission queue (i.e. does not wait for ACK);
+    // reliable transport takes care of the delivery by itself
+    if (pdu->type != COAP_MESSAGE_CON || COAP_PROTO_RELIABLE(session->proto)) {
         coap_tid_t id = pdu->tid;
         coap_delete_pdu(pdu);
         return id;
@@ -653,7 +662,11 @@ coap_tid_t coap_send(
     node->timeout = coap_calc_timeout(session, random);
 
     // Put the node to the retransmission queue
-    return coap_wait_ack(session, node);
+    coap_tid_t id = coap_wait_ack(session, node);
+    if (id == COAP_INVALID_TID)
+        coap_delete_node(node);
+
+    return id;
 
 error:
     coap_delete_pdu(pdu);
@@ -682,15 +695,11 @@ coap_tid_t coap_retransmit(
          * @note: Node's timeout is set to some value contingent on the basic timeout.
          *    It's actual value grows exponentially with respect the number of retransmissions.
          */
-        if (context->sendqueue == NULL) {
-            node->t = node->timeout << node->retransmit_cnt;
-            context->sendqueue_basetime = now;
+        node->t = now + (node->timeout << node->retransmit_cnt);
+        if (!coap_sendqueue_insert(context, node)) {
+            coap_delete_node(node);
+            return COAP_INVALID_TID;
         }
-        // If queue is not empty, make node->t relative to context->sendqueue_basetime
-        else
-            node->t = (now - context->sendqueue_basetime) + (node->timeout << node->retransmit_cnt);
-
-        coap_insert_node(&context->sendqueue, node);
         coap_log(LOG_DEBUG, "** %s: tid=%d: retransmission #%d\n",
                 coap_session_str(node->session), node->id, node->retransmit_cnt);
 
@@ -857,12 +866,10 @@ unsigned int coap_write(
     nextpdu = coap_peek_next(context);
 
     /**
-     * For all packets in the sendqueue if:
-     *    - context's base time lies in the past
-     *    - retransmission interval time for the has passed
-     * try to retransmit the packet
+     * For all packets in the sendqueue whose retransmission time has passed, try to retransmit
+     * the packet
      */
-    while (nextpdu && now >= context->sendqueue_basetime && nextpdu->t <= now - context->sendqueue_basetime) {
+    while (nextpdu && nextpdu->t <= now) {
         coap_retransmit(context, coap_pop_next(context));
         nextpdu = coap_peek_next(context);
     }
@@ -871,12 +878,32 @@ unsigned int coap_write(
      * If the time to retransmission the next, packet from the sendqueue (if any) is shorter than the
      * timeout of any of the checked sessions, update the timeout.
      */
-    if (nextpdu && (timeout == 0 || nextpdu->t - ( now - context->sendqueue_basetime ) < timeout))
-        timeout = nextpdu->t - (now - context->sendqueue_basetime);
+    if (nextpdu && (timeout == 0 || nextpdu->t - now < timeout))
+        timeout = nextpdu->t - now;
+
+    // The same for the next Block1 transfer's expiration
+    coap_tick_t b_timeout = coap_block1_expire(context, now);
+    if (b_timeout && (timeout == 0 || b_timeout < timeout))
+        timeout = b_timeout;
+
+    // The same for the next separate response's expiration
+    coap_tick_t a_timeout = coap_async_expire(context, now);
+    if (a_timeout && (timeout == 0 || a_timeout < timeout))
+        timeout = a_timeout;
+
+    // The same for the next observers' timer (pmin/pmax) 
+    if (context->observe_timers.len) {
+        coap_tick_t t = coap_timer_heap_time(
+            &context->observe_timers, coap_timer_heap_peek(&context->observe_timers));
+        coap_tick_t o_timeout = t > now ? t - now : 1;
+        if (timeout == 0 || o_timeout < timeout)
+            timeout = o_timeout;
+    }
 
     /**
-     * @note: 'timeout' is the shortest time for the next packet from context->sendqueue to be retransmited
-     *    or the active session to become unactive if no TX/RX will be porformed with it.
+     * @note: 'timeout' is the shortest time for the next packet from context->sendqueue to be retransmited,
+     *    the next observers' timer to expire or the active session to become unactive if no TX/RX will be
+     *    porformed with it.
      */
 
     // Return timeout in [ms]
@@ -891,12 +918,19 @@ void coap_read(
     coap_endpoint_t *endpoint, *endpoint_tmp;
     coap_session_t *session, *session_tmp;
 
+    // Send responses of requests handled by the worker pool
+    coap_workers_complete(context);
+
     // Iterate over all endpoints registered in the @p context 
     LL_FOREACH_SAFE(context->endpoint, endpoint, endpoint_tmp) {
 
-        // Let the endpoint receive the data, if needed
-        if ((endpoint->sock.flags & COAP_SOCKET_CAN_READ) != 0)
-            coap_read_endpoint(endpoint, now);
+        // Let the endpoint receive the data (or accept the TCP connection), if needed
+        if ((endpoint->sock.flags & COAP_SOCKET_CAN_READ) != 0) {
+            if (COAP_PROTO_RELIABLE(endpoint->proto))
+                coap_endpoint_accept_session(endpoint, now);
+            else
+                coap_read_endpoint(endpoint, now);
+        }
 
         // Iterate over all sessions hold by the endpoint
         LL_FOREACH_SAFE(endpoint->sessions, session, session_tmp) {
@@ -907,6 +941,10 @@ void coap_read(
              *    is not deleted in one of the callbacks.
              */
 
+            // Write buffered TCP messages, if socket became writable
+            if ((session->sock.flags & COAP_SOCKET_CAN_WRITE) != 0)
+                coap_tcp_flush(session);
+
             //Let the session receive the data, if needed.
             if ((session->sock.flags & COAP_SOCKET_CAN_READ) != 0) {
                 coap_session_reference(session);
@@ -914,6 +952,9 @@ void coap_read(
                 coap_session_release(session);
             }
 
+            // Free the server's TCP session whose connection has been closed
+            if (COAP_PROTO_RELIABLE(session->proto) && session->state == COAP_SESSION_STATE_NONE && session->ref == 0)
+                coap_session_free(session);
         }
     }
 
@@ -926,6 +967,10 @@ void coap_read(
          *    is not deleted in one of the callbacks.
          */
 
+        // Write buffered TCP messages, if socket became writable
+        if ((session->sock.flags & COAP_SOCKET_CAN_WRITE) != 0)
+            coap_tcp_flush(session);
+
         //Let the session receive the data, if needed.
         if ((session->sock.flags & COAP_SOCKET_CAN_READ) != 0) {
             coap_session_reference(session);
@@ -941,88 +986,50 @@ int coap_handle_dgram(
     uint8_t *msg,
     size_t msg_len
 ) {
-    // Create a new PDU object
-    coap_pdu_t *pdu = coap_pdu_init(0, 0, 0, msg_len - COAP_HEADER_SIZE);
-    if (!pdu)
-        goto error;
+    /**
+     * @note: The PDU is parsed in place, i.e. it's a view over the @p msg buffer. Objects
+     *    that need to keep received PDU after the function returns must copy it with
+     *    coap_pdu_copy().
+     */
+    coap_pdu_t pdu;
 
     // Parse the @p msg buffer to get the informations about the PDU
-    if (!coap_pdu_parse(msg, msg_len, pdu)) {
+    if (!coap_pdu_parse_view(msg, msg_len, &pdu)) {
         coap_log(LOG_WARNING, "discard malformed PDU\n");
-        goto error;
+        // [TODO] Send a (?) RST message back
+        return -1;
     }
 
     // Dispatch the message and send the response
-    coap_dispatch(session, pdu);
+    coap_dispatch(session, &pdu);
 
-    // Clean the PDU up
-    coap_delete_pdu(pdu);
+    // If PDU's content has been moved to the heap in the meantime, free it
+    if (!pdu.borrowed)
+        coap_free_type(COAP_PDU_BUF, pdu.token - COAP_HEADER_SIZE);
 
     return 0;
-
-error:
-    // [TODO] Send a (?) RST message back
-    coap_delete_pdu(pdu);
-    return -1;
 }
 
 
 int coap_remove_from_queue(
-    coap_queue_t **queue, 
+    coap_context_t *context, 
     coap_session_t *session, 
     coap_tid_t id, 
     coap_queue_t **removed_node
 ) {
-    if (!queue || !*queue)
+    // Look for the node in the index
+    coap_queue_t *node = coap_find_transaction(context, session, id);
+    if (!node)
         return 0;
 
-    // Check whether the searched node is located at the head of the @p queue
-    if (session == (*queue)->session && id == (*queue)->id) {
-        
-        // Detach the head from the rest of the queue
-        *removed_node = *queue;
-        (*removed_node)->next = NULL;
-
-        // Update the queue's head
-        *queue = (*queue)->next;
-        
-        // Adjust relative time of new queue's head
-        if (*queue)
-            (*queue)->t += (*removed_node)->t;
-    
-        coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
-                coap_session_str(session), id);
-        return 1;
-    }
-
-    coap_queue_t *p, *q;
-
-    // Iterate over the rest of the queue
-    LL_FOREACH_SAFE(*queue, p, q){
-
-        // If the node is found
-        if (q && session == q->session && id == q->id){
-
-            // Detach the node from the rest of the queue
-            p->next = q->next;
-            q->next = NULL;
+    // Detach the node from the queue
+    coap_sendqueue_remove(context, node);
+    *removed_node = node;
 
-            // Adjust relative time of the node following the detached one
-            if (p->next)
-                p->next->t += q->t;
+    coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
+            coap_session_str(session), id);
 
-            // Return the remove node to the caller
-            *removed_node = q;
-
-            coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
-                coap_session_str(session), id);
-
-            return 1;
-
-        }
-    }
-
-    return 0;
+    return 1;
 }
 
 
@@ -1030,52 +1037,36 @@ void coap_cancel_session_messages(
     coap_session_t *session,
     coap_nack_reason_t reason
 ) {
-    coap_queue_t *p, *q;
+    coap_context_t *context = session->context;
+    coap_queue_t *cancelled = NULL, *q, *tmp;
 
-    // Iterate over the head nodes of the @p context->sendqueue and delete all associated with the @p session
-    while (session->context->sendqueue && session->context->sendqueue->session == session) {
+    /**
+     * @note: Nodes are collected first (on the forward-list build with their @a next fields, unused
+     *    while in the sendqueue), as removing them from the heap reorders the sendqueue.
+     */
+    for (size_t i = 0; i < context->sendqueue.len; i++) {
+        q = (coap_queue_t *) context->sendqueue.items[i];
+        if (q->session == session)
+            LL_PREPEND(cancelled, q);
+    }
 
-        // Detach the head from the queue
-        q = session->context->sendqueue;
+    // Delete all collected nodes
+    LL_FOREACH_SAFE(cancelled, q, tmp) {
 
-        // Update queue's head
-        session->context->sendqueue = q->next;
+        // Detach the node from the queue
+        q->next = NULL;
+        coap_sendqueue_remove(context, q);
 
         // Call the NACK handler if the node represented the CON message
-        if (q->pdu->type == COAP_MESSAGE_CON && session->context->nack_handler)
-            session->context->nack_handler(session->context, session, q->pdu, reason, q->id);
+        if (q->pdu->type == COAP_MESSAGE_CON && context->nack_handler)
+            context->nack_handler(context, session, q->pdu, reason, q->id);
 
         coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
                 coap_session_str(session), q->id);
-                
+
         // Delete the node itself
         coap_delete_node(q);
     }
-
-    // Check whether the queue is empty yet
-    if (!session->context->sendqueue)
-        return;
-
-    // Iterate over the rest of nodes
-    LL_FOREACH_SAFE(session->context->sendqueue, p, q){
-        
-        // If the node is associated with a session
-        if(q && q->session == session){
-            
-            // Detach the node from the queue
-            p->next = q->next;
-
-            // Call the NACK handler if the node represented the CON message
-            if (q->pdu->type == COAP_MESSAGE_CON && session->context->nack_handler)
-                session->context->nack_handler(session->context, session, q->pdu, reason, q->id);
-
-            coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
-                    coap_session_str(session), q->id);
-
-            // Delete the node itself
-            coap_delete_node(q);
-        }
-    }
 }
 
 
@@ -1084,85 +1075,48 @@ void coap_cancel_all_messages(
     const uint8_t *token, 
     size_t token_length
 ) {
-    coap_queue_t *p, *q;
-    
-    bool token_matches = false;
-    if(session->context->sendqueue && session->context->sendqueue->session == session)
-        token_matches = 
-            token_match(token, token_length, session->context->sendqueue->pdu->token, session->context->sendqueue->pdu->token_length);
-
-    // Iterate over the head nodes of the @p session->context->sendqueue and delete all associated with the @p session
-    while (session->context->sendqueue && session->context->sendqueue->session == session && token_matches) {
+    coap_context_t *context = session->context;
+    coap_queue_t *cancelled = NULL, *q, *tmp;
+
+    // Collect all nodes associated with the @p session and @p token
+    for (size_t i = 0; i < context->sendqueue.len; i++) {
+        q = (coap_queue_t *) context->sendqueue.items[i];
+        if (q->session == session && token_match(token, token_length, q->pdu->token, q->pdu->token_length))
+            LL_PREPEND(cancelled, q);
+    }
 
-        // Detach the head from the queue
-        q = session->context->sendqueue;
+    // Delete all collected nodes
+    LL_FOREACH_SAFE(cancelled, q, tmp) {
 
-        // Update queue's head
-        session->context->sendqueue = q->next;
+        // Detach the node from the queue
+        q->next = NULL;
+        coap_sendqueue_remove(context, q);
 
         coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
                 coap_session_str(session), q->id);
-                
+
         // Delete the node itself
         coap_delete_node(q);
-
-        // Check the token match for the next node
-        if(session->context->sendqueue)
-            token_matches = token_match(
-                token, 
-                token_length, 
-                session->context->sendqueue->pdu->token, 
-                session->context->sendqueue->pdu->token_length
-            );
-    }
-
-    // Check whether the queue is empty yet
-    if (!session->context->sendqueue)
-        return;
-
-    p = session->context->sendqueue;
-    q = p->next;
-
-    // Iterate over the rest of nodes
-    LL_FOREACH_SAFE(session->context->sendqueue, p, q){
-
-        if(q)
-            token_matches = token_match(token, token_length, q->pdu->token, q->pdu->token_length);
-        
-        // If the node is associated with a session
-        if(q && q->session == session && session->context->sendqueue->session == session && token_matches){
-            
-            // Detach the node from the queue
-            p->next = q->next;
-
-            coap_log(LOG_DEBUG, "** %s: tid=%d: removed\n",
-                    coap_session_str(session), q->id);
-                    
-            // Delete the node itself
-            coap_delete_node(q);
-
-            // Check the token match for the next node
-            if(session->context->sendqueue)
-                token_matches = token_match(
-                    token, 
-                    token_length, 
-                    session->context->sendqueue->pdu->token, 
-                    session->context->sendqueue->pdu->token_length
-                );
-        }
     }
 }
 
 
 coap_queue_t *coap_find_transaction(
-    coap_queue_t *queue, 
+    coap_context_t *context, 
     coap_session_t *session, 
     coap_tid_t id
 ) {
-    while (queue && queue->session != session && queue->id != id)
-        queue = queue->next;
+    // Prepare the key
+    coap_queue_t key;
+    memset(&key, 0, sizeof(key));
+    key.session = session;
+    key.id = id;
 
-    return queue;
+    // Look for the node in the index
+    coap_queue_t *node = NULL;
+    HASH_FIND(hh, context->sendqueue_index, &key.session, COAP_QUEUE_KEY_SIZE, node);
+
+    return node;
 }
 
 
@@ -1291,8 +1245,9 @@ coap_pdu_t *coap_wellknown_response(
     coap_opt_iterator_t opt_iter;
     coap_opt_t *query_filter = coap_check_option(request, COAP_OPTION_URI_QUERY, &opt_iter);
 
-    // Calculate wkc representation's length
-    size_t wkc_len = get_wkc_len(session->context, query_filter);
+    // Get the wkc representation (rendered only if the resources changed since the last request)
+    coap_wkc_cache_t *wkc = coap_wellknown_get_cached(session->context, query_filter);
+    size_t wkc_len = wkc ? wkc->length : 0;
 
     // As the value of some resources is undefined get_wkc_len() can return 0
     if (wkc_len == 0) {
@@ -1349,6 +1304,9 @@ coap_pdu_t *coap_wellknown_response(
         goto error;
     }
 
+    // Add ETag option to the response (it's stable as long as the document does not change)
+    coap_add_option(resp, COAP_OPTION_ETAG, sizeof(wkc->etag), wkc->etag);
+
     // Add Content-Format option to the response
     uint8_t buf[2];
     coap_add_option(
@@ -1425,12 +1383,8 @@ coap_pdu_t *coap_wellknown_response(
         goto error;
     }
 
-    // Add the data itself
-    int result = coap_print_wellknown(session->context, data, &payload_len, offset, query_filter);
-    if ((result & COAP_PRINT_STATUS_ERROR) != 0) {
-        coap_log(LOG_DEBUG, "coap_print_wellknown failed\n");
-        goto error;
-    }
+    // Add the data itself (slice of the cached document)
+    memcpy(data, wkc->buf + wkc->query_length + offset, payload_len);
 
     return resp;
 
@@ -1470,6 +1424,9 @@ void coap_dispatch(
     }
 #endif
 
+    // Context holding the per-request arena (session may be released while handling the message)
+    coap_context_t *context = session->context;
+
     // Initialize options' filter (it's used to look for critical unknown options in the request)
     coap_opt_filter_t opt_filter;
     memset(opt_filter, 0, sizeof(coap_opt_filter_t));
@@ -1479,12 +1436,19 @@ void coap_dispatch(
     // Holder for an entry of the @p context->sendqueue that will be removed if ACK/RST message was received
     coap_queue_t *sent = NULL;
 
+    // Over reliable transport signaling messages are handled by the connection and Empty messages are ignored
+    if (COAP_PROTO_RELIABLE(session->proto) && (COAP_PDU_IS_SIGNALING(pdu) || COAP_PDU_IS_EMPTY(pdu))) {
+        if (COAP_PDU_IS_SIGNALING(pdu))
+            coap_tcp_handle_signaling(session, pdu);
+        goto cleanup;
+    }
+
     // Dispatch the message with respect to it's type
     switch (pdu->type) {
         case COAP_MESSAGE_ACK: // ACK Message
 
             // Find transaction in a sendqueue and remove it to stop retransmission
-            coap_remove_from_queue(&session->context->sendqueue, session, pdu->tid, &sent);
+            coap_remove_from_queue(session->context, session, pdu->tid, &sent);
 
             // Update the number of CON messages waiting for ACK
             if (session->con_active) {
@@ -1529,7 +1493,7 @@ void coap_dispatch(
             }
 
             // Find transaction in sendqueue and delete it to stop retransmission
-            coap_remove_from_queue(&session->context->sendqueue, session, pdu->tid, &sent);
+            coap_remove_from_queue(session->context, session, pdu->tid, &sent);
 
             // If a message was removed from the queue...
             if (sent) {
@@ -1547,12 +1511,38 @@ void coap_dispatch(
         case COAP_MESSAGE_NON: // NON Message
         
             // Check for unknown critical options. If present, silently discard the message
-            if (coap_option_check_critical(session->context, pdu, opt_filter) == 0)
+            if (coap_option_check_critical(session->context, pdu, opt_filter) == 0) {
+
+                // Over reliable transport there are no RSTs, so requests are answered with an error (RFC 8323, section 3.3)
+                if (COAP_PROTO_RELIABLE(session->proto) && COAP_PDU_IS_REQUEST(pdu)) {
+                    response = coap_new_error_response(pdu, COAP_RESPONSE_CODE(402), opt_filter);
+                    if (!response)
+                        coap_log(LOG_WARNING, "coap_dispatch: cannot create error response\n");
+                    else if (coap_send(session, response) == COAP_INVALID_TID)
+                        coap_log(LOG_WARNING, "coap_dispatch: error sending response\n");
+                }
+
                 goto cleanup;
+            }
         
             break;
 
         case COAP_MESSAGE_CON: // CON Message
+
+            // If the request is a duplicate, send the ACK cached for it
+            if (COAP_PDU_IS_REQUEST(pdu) && session->endpoint) {
+
+                coap_tick_t now;
+                coap_ticks(&now);
+
+                const coap_dedup_entry_t *ack = 
+                    coap_dedup_find(&session->endpoint->dedup, session, pdu->tid, now);
+                if (ack) {
+                    coap_log(LOG_DEBUG, "** %s: tid=%d: duplicate, cached ACK sent\n", coap_session_str(session), pdu->tid);
+                    coap_session_send(session, ack->data, ack->length);
+                    goto cleanup;
+                }
+            }
             
             // Check for unknown critical options. If present, create an appropriate response
             if (coap_option_check_critical(session->context, pdu, opt_filter) == 0) {
@@ -1592,8 +1582,8 @@ void coap_dispatch(
         } else
             coap_log(LOG_DEBUG, "dropped message with invalid code (%d.%02d)\n", COAP_RESPONSE_CLASS(pdu->code), pdu->code & 0x1f);
 
-        // For non-multi-cast message ...
-        if (!coap_is_mcast(&session->local_addr)) {
+        // For non-multi-cast message (reliable transport has no RST messages) ...
+        if (!coap_is_mcast(&session->local_addr) && !COAP_PROTO_RELIABLE(session->proto)) {
 
             // If the message is empty, send the RST response only if the last RST sent earlier than some configured time span
             if (COAP_PDU_IS_EMPTY(pdu)) {
@@ -1614,6 +1604,12 @@ void coap_dispatch(
 
 cleanup:
     coap_delete_node(sent);
+
+    // Release transient allocations made while handling the message
+    coap_arena_reset(&context->request_arena);
+    // Captured segments point into the message, so they must be forgotten too
+    context->route_match.num_captures = 0;
+    context->route_match.wildcard_start = 0;
 }
 
 
@@ -1621,7 +1617,7 @@ int coap_can_exit(coap_context_t *context) {
     
     if (!context)
         return 1;
-    if (context->sendqueue)
+    if (context->sendqueue.len)
         return 0;
 
     coap_endpoint_t *endpoint;
@@ -1663,16 +1659,35 @@ void coap_startup(void) {
 void coap_cleanup(void) {}
 
 
+void coap_handle_offloaded_response(
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    const coap_string_t *query,
+    coap_pdu_t *response
+) {
+    bool get = request->code == COAP_REQUEST_GET;
+
+    // Cache the response (or drop the cache if the resource was modified)
+    coap_tick_t now;
+    coap_ticks(&now);
+    handle_cache(resource, request, query, resource->cacheable && get, response, now);
+
+    // Record the representation's ETag and reply with 2.03 if the client already holds it
+    if (get)
+        handle_etag(resource, request, handle_validate(resource, request, query), response);
+}
+
+
 /* ------------------------------------------- [Static Functions] --------------------------------------------- */
 
 
 COAP_STATIC_INLINE coap_queue_t *coap_malloc_node(void) {
-    return (coap_queue_t *) coap_malloc(sizeof(coap_queue_t));
+    return (coap_queue_t *) coap_malloc_type(COAP_NODE, sizeof(coap_queue_t));
 }
 
 
 COAP_STATIC_INLINE void coap_free_node(coap_queue_t *node) {
-    coap_free(node);
+    coap_free_type(COAP_NODE, node);
 }
 
 
@@ -1714,6 +1729,10 @@ static ssize_t coap_send_pdu(
     if (session->state == COAP_SESSION_STATE_NONE)
         return -1;
 
+    // Messages sent over reliable transport are not acknowledged
+    if (COAP_PROTO_RELIABLE(session->proto))
+        return coap_session_send_pdu(session, pdu);
+
     // If session cannot hold more CON messages open, delay the pdu for later send 
     if (pdu->type == COAP_MESSAGE_CON && session->con_active >= COAP_DEFAULT_NSTART)
         return coap_session_delay_pdu(session, pdu, node);
@@ -1729,7 +1748,8 @@ static ssize_t coap_send_pdu(
 
 /**
  * @brief: Reads data from the socket associated with the @p session. Calls 
- *    coap_handle_dgram() if the reading was succesfull
+ *    coap_handle_dgram() if the reading was succesfull. Up to COAP_IO_BATCH_SIZE
+ *    datagrams are drained from the socket within a single call.
  * 
  * @param session:
  *    session to read from
@@ -1741,27 +1761,42 @@ static void coap_read_session(
     coap_tick_t now
 ) {
     assert(session->sock.flags & (COAP_SOCKET_CONNECTED | COAP_SOCKET_MULTICAST));
+
+    // TCP connections are read as a stream of messages
+    if (COAP_PROTO_RELIABLE(session->proto)) {
+        coap_tcp_read(session, now);
+        return;
+    }
    
     coap_packet_t packet;
 
-    // Make copies of session's addresses
-    coap_packet_set_addr(&packet, &session->remote_addr, &session->local_addr);
+    // Drain the socket until it's empty or the batch limit is reached
+    for (unsigned int i = 0; i < COAP_IO_BATCH_SIZE; i++) {
 
-    // Read data from the socket associated with the session
-    ssize_t bytes_read = session->context->network_read(&session->sock, &packet);
+        // Following reads of the batch must not block when the socket's queue gets empty
+        if (i > 0)
+            session->sock.flags |= COAP_SOCKET_CAN_READ | COAP_SOCKET_READ_MORE;
+
+        // Make copies of session's addresses
+        coap_packet_set_addr(&packet, &session->remote_addr, &session->local_addr);
+
+        // Read data from the socket associated with the session
+        ssize_t bytes_read = session->context->network_read(&session->sock, &packet);
+
+        // If reading failed
+        if (bytes_read < 0) {
+            // If address is unreachable, disconnect the session
+            if (bytes_read == -2)
+                coap_session_disconnected(session, COAP_NACK_RST);
+            // Else, log error
+            else
+                coap_log(LOG_WARNING, "*  %s: read error\n", coap_session_str(session));
+            break;
+        }
+        // If there is nothing more to read, finish the batch
+        else if (bytes_read == 0)
+            break;
 
-    // If reading failed
-    if (bytes_read < 0) {
-        // If address is unreachable, disconnect the session
-        if (bytes_read == -2)
-            coap_session_disconnected(session, COAP_NACK_RST);
-        // Else, log error
-        else
-            coap_log(LOG_WARNING, "*  %s: read error\n", coap_session_str(session));
-    }
-    // Else, if reading succeded
-    else if (bytes_read > 0) {
-        
         coap_log(LOG_DEBUG, "*  %s: received %lu bytes\n", coap_session_str(session), (unsigned long) bytes_read);
 
         // Update RX/TX timestamp
@@ -1772,42 +1807,62 @@ static void coap_read_session(
 
         // Handle the received datagram
         coap_handle_dgram(session, packet.payload, packet.length);
+
+        // Stop if the session's socket was closed while handling the datagram
+        if (session->sock.fd == COAP_INVALID_SOCKET)
+            break;
     }
+
+    // Clear batch-related flags
+    session->sock.flags &= ~(COAP_SOCKET_CAN_READ | COAP_SOCKET_READ_MORE);
 }
 
 
 /**
  * @brief: This function should be called when the underleaying socket is ready to read.
- *    Function handles incoming datagram sending a response, if needed.
+ *    Function handles incoming datagrams sending a response, if needed. Up to 
+ *    COAP_IO_BATCH_SIZE datagrams are drained from the socket within a single call.
  * 
  * @param endpoint:
  *    endopint to read
  * @param now:
  *    timestamp for the session
  * @returns:
- *    0, if message was handle successfully
+ *    0, if the last message was handled successfully
  *    <= 0, otherwise
  */
 static int coap_read_endpoint(coap_endpoint_t *endpoint, coap_tick_t now) {
 
     assert(endpoint->sock.flags & COAP_SOCKET_BOUND);
 
-    // Initialize the packet object to read to
+    // The packet object to read to
     coap_packet_t packet;
-    coap_address_init(&packet.src);
-    coap_address_copy(&packet.dst, &endpoint->bind_addr);
-
-    // perform the read reading
-    ssize_t bytes_read = endpoint->context->network_read(&endpoint->sock, &packet);
 
     // The value to be returned 
     int result = -1;
 
-    // If failed, print a log
-    if (bytes_read < 0)
-        coap_log(LOG_WARNING, "*  %s: read failed\n", coap_endpoint_str(endpoint));
-    // Othwerwise, if succeeded, handle the message
-    else if (bytes_read > 0) {
+    // Drain the socket until it's empty or the batch limit is reached
+    for (unsigned int i = 0; i < COAP_IO_BATCH_SIZE; i++) {
+
+        // Following reads of the batch must not block when the socket's queue gets empty
+        if (i > 0)
+            endpoint->sock.flags |= COAP_SOCKET_CAN_READ | COAP_SOCKET_READ_MORE;
+
+        // Initialize the packet object
+        coap_address_init(&packet.src);
+        coap_address_copy(&packet.dst, &endpoint->bind_addr);
+
+        // perform the read reading
+        ssize_t bytes_read = endpoint->context->network_read(&endpoint->sock, &packet);
+
+        // If failed, print a log
+        if (bytes_read < 0) {
+            coap_log(LOG_WARNING, "*  %s: read failed\n", coap_endpoint_str(endpoint));
+            break;
+        }
+        // If there is nothing more to read, finish the batch
+        else if (bytes_read == 0)
+            break;
 
         // Get / Create a session for the message
         coap_session_t *session = coap_endpoint_get_session(endpoint, &packet, now);
@@ -1817,6 +1872,9 @@ static int coap_read_endpoint(coap_endpoint_t *endpoint, coap_tick_t now) {
         }
     }
 
+    // Clear batch-related flags
+    endpoint->sock.flags &= ~(COAP_SOCKET_CAN_READ | COAP_SOCKET_READ_MORE);
+
     return result;
 }
 
@@ -1854,6 +1912,80 @@ COAP_STATIC_INLINE size_t get_wkc_len(coap_context_t *context, coap_opt_t *query
 }
 
 
+/**
+ * @brief: Returns the /.well-known/core document rendered for the @p query_filter. The document
+ *    is taken from the @p context's cache if the set of resources has not changed since it was
+ *    rendered. Otherwise it's rendered and cached.
+ *
+ * @param context:
+ *    context holding the resources
+ * @param query_filter:
+ *    Uri-Query option of the request (NULL if none)
+ * @returns:
+ *    cache's entry holding the document on success
+ *    NULL if the document is empty or could not be rendered
+ */
+static coap_wkc_cache_t *coap_wellknown_get_cached(coap_context_t *context, coap_opt_t *query_filter) {
+
+    const uint8_t *query = query_filter ? coap_opt_value(query_filter) : NULL;
+    size_t query_length = query_filter ? coap_opt_length(query_filter) : 0;
+
+    coap_wkc_cache_t *entry;
+
+    // Look for the up-to-date rendering for the query
+    for (int i = 0; i < COAP_WKC_CACHE_SIZE; i++) {
+        entry = &context->wkc_cache[i];
+        if (entry->version == context->resources_version && 
+            entry->query_length == query_length    &&
+            (query_length == 0 || memcmp(entry->buf, query, query_length) == 0))
+            return entry;
+    }
+
+    // Calculate wkc representation's length
+    size_t wkc_len = get_wkc_len(context, query_filter);
+    if (wkc_len == 0)
+        return NULL;
+
+    // Allocate storage for the query and the document
+    uint8_t *buf = (uint8_t *) coap_malloc(query_length + wkc_len);
+    if (!buf) {
+        coap_log(LOG_WARNING, "coap_wellknown_get_cached: malloc failed\n");
+        return NULL;
+    }
+
+    // Render the document
+    size_t printed = wkc_len;
+    if (coap_print_wellknown(context, buf + query_length, &printed, 0, query_filter) & COAP_PRINT_STATUS_ERROR || 
+        printed != wkc_len) {
+        coap_log(LOG_DEBUG, "coap_print_wellknown failed\n");
+        coap_free(buf);
+        return NULL;
+    }
+    if (query_length)
+        memcpy(buf, query, query_length);
+
+    // Prefer replacing an outdated entry, otherwise replace entries in the round-robin manner
+    entry = NULL;
+    for (int i = 0; i < COAP_WKC_CACHE_SIZE && !entry; i++)
+        if (context->wkc_cache[i].version != context->resources_version)
+            entry = &context->wkc_cache[i];
+    if (!entry) {
+        entry = &context->wkc_cache[context->wkc_cache_next];
+        context->wkc_cache_next = (context->wkc_cache_next + 1) % COAP_WKC_CACHE_SIZE;
+    }
+
+    // Fill the entry
+    coap_free(entry->buf);
+    entry->version = context->resources_version;
+    entry->query_length = query_length;
+    entry->length = wkc_len;
+    entry->buf = buf;
+    coap_hash(buf + query_length, wkc_len, entry->etag);
+
+    return entry;
+}
+
+
 /**
  * @brief: Cancels outstanding messages for the session and token specified in @p sent. Any
  *    observation relationship for @p sent->session and the token are removed. Calling this
@@ -1877,15 +2009,11 @@ static int coap_cancel(coap_context_t *context, const coap_queue_t *sent) {
     coap_binary_t token = { 0, NULL };
     COAP_SET_STR(&token, sent->pdu->token_length, sent->pdu->token);
 
-    // Iterate over all resources registered in the context
-    RESOURCES_ITER(context->resources, resource) {
-
-        // Remove observers, if message matched
-        num_cancelled += coap_delete_observer(resource, sent->session, &token);
+    // Remove observers, if message matched
+    num_cancelled += coap_delete_observers_by_token(sent->session, &token);
 
-        // Cancell all oustanding messages, if message matched
-        coap_cancel_all_messages(sent->session, token.s, token.length);
-    }
+    // Cancell all oustanding messages, if message matched
+    coap_cancel_all_messages(sent->session, token.s, token.length);
 
     return num_cancelled;
 }
@@ -1985,14 +2113,8 @@ static void handle_request(
     coap_opt_filter_t opt_filter;
     coap_option_filter_clear(opt_filter);
 
-    // Try to find the resource from the request URI 
-    coap_string_t *uri_path = coap_get_uri_path(pdu);
-    if (!uri_path)
-        return;
-    
-    // Get the requested resource
-    coap_str_const_t uri_path_c = { uri_path->length, uri_path->s };
-    coap_resource_t *resource = coap_get_resource_from_uri_path(session->context, &uri_path_c);
+    // Get the requested resource directly from the request's Uri-Path options
+    coap_resource_t *resource = coap_get_resource_from_request(session->context, pdu);
 
     coap_pdu_t *response = NULL;
     
@@ -2016,7 +2138,7 @@ static void handle_request(
          */
 
         // Check whether the URI fits /.well-known/core (wkc)
-        if (coap_string_equal(uri_path, &coap_default_uri_wellknown)) {
+        if (coap_request_uri_path_equal(pdu, &coap_default_uri_wellknown)) {
             // Get the wkc
             if (pdu->code == COAP_REQUEST_GET) {
                 coap_log(LOG_INFO, "create default response for %s\n", COAP_DEFAULT_URI_WELLKNOWN);
@@ -2052,15 +2174,12 @@ static void handle_request(
         } 
         // Request for DELETE on non-existant resource (RFC7252: 5.8.4. DELETE) 
         else if (pdu->code == COAP_REQUEST_DELETE) {
-
-            coap_log(LOG_DEBUG, "handle_request: request for unknown resource '%*.*s', return 2.02 \n",
-                (int)uri_path->length, (int)uri_path->length, uri_path->s);
+            coap_log(LOG_DEBUG, "handle_request: request for unknown resource, return 2.02 \n");
             response = coap_new_error_response(pdu, COAP_RESPONSE_DELETED, opt_filter);
         }
         // For request for any another resource, return 4.04 (Not Found)
         else {
-            coap_log(LOG_DEBUG, "request for unknown resource '%*.*s', return 4.04\n",
-                (int)uri_path->length, (int)uri_path->length, uri_path->s);
+            coap_log(LOG_DEBUG, "request for unknown resource, return 4.04\n");
             response = coap_new_error_response(pdu, COAP_RESPONSE_NOT_FOUND, opt_filter);
         }
 
@@ -2076,9 +2195,6 @@ static void handle_request(
 
         response = NULL;
 
-        // Free the allocated string
-        coap_delete_string(uri_path);
-
         return;
     
     }
@@ -2093,10 +2209,8 @@ static void handle_request(
     // If handler was registered ...
     if (handler) {
         
-        // Parse the query
-        coap_string_t *query = coap_get_query(pdu);
-        // Mark that the query string was not taken over by the subscriber's object
-        int owns_query = 1;
+        // Parse the query (string is released with the arena's reset)
+        coap_string_t *query = coap_get_query_arena(pdu, &session->context->request_arena);
 
         coap_log(LOG_DEBUG, "handle_request: call custom handler for resource '%*.*s'\n",
             (int)resource->uri_path->length, (int)resource->uri_path->length, resource->uri_path->s);
@@ -2150,12 +2264,9 @@ static void handle_request(
                         if (coap_get_block(pdu, COAP_OPTION_BLOCK2, &block2))
                             has_block2 = 1;
                         
-                        // Add the observator to the resource
+                        // Add the observator to the resource (the query is copied to the heap)
                         coap_subscription_t *subscription = coap_add_observer(resource, session, &token, query, has_block2, block2);
 
-                        // Note, that observer's object captured the query string
-                        owns_query = 0;
-
                         // Reset observer's notification failure counter
                         if (subscription)
                            coap_touch_observer(session, &token);
@@ -2168,12 +2279,61 @@ static void handle_request(
                 }
             }
 
-            // Call the request's handler
-            handler(resource, session, pdu, &token, query, response);
+            // Requests to GET (other than observations) may be validated and served from the resource's cache
+            bool plain_get = pdu->code == COAP_REQUEST_GET && !observe;
+            bool use_cache = resource->cacheable && plain_get;
+
+            bool validate = plain_get && handle_validate(resource, pdu, query);
+
+            // Request passed to the handler (body of the request sent with Block1 may be reassembled)
+            coap_pdu_t *request = pdu;
+            int block1 = COAP_BLOCK1_NONE;
 
-            // Delete query string, if observer was not created
-            if (query && owns_query)
-                coap_delete_string(query);
+            // Answer the request basing on its preconditions (ETag, If-Match, If-None-Match) ...
+            if (handle_preconditions(resource, pdu, validate, response))
+                coap_log(LOG_DEBUG, "handle_request: request answered basing on its preconditions\n");
+            // ... handle the block of the request sent with Block1 ...
+            else if ((block1 = coap_block1_handle(session, resource, pdu, response, &request)) == COAP_BLOCK1_ANSWERED)
+                coap_log(LOG_DEBUG, "handle_request: block of the request handled\n");
+            else {
+
+                // Look for the cached response
+                int cached = 0;
+                coap_tick_t now = 0;
+                if (use_cache) {
+                    coap_ticks(&now);
+                    cached = coap_response_cache_serve(&resource->responses, pdu, query, response->max_size, now, response);
+                }
+
+                // ... serve the cached response (response's token and message ID are kept) ...
+                if (cached)
+                    coap_log(LOG_DEBUG, "handle_request: response served from the cache\n");
+                // ... hand the request over to the worker pool (CON request is acknowledged with an Empty ACK) ...
+                else if ((resource->flags & COAP_RESOURCE_FLAGS_WORKER) && !observe && block1 == COAP_BLOCK1_NONE &&
+                         coap_workers_submit(session, resource, handler, pdu, query))
+                    coap_log(LOG_DEBUG, "handle_request: request handed over to the worker pool\n");
+                // ... or call the request's handler
+                else {
+
+                    handler(resource, session, request, &token, query, response);
+
+                    // Complete the response to the request sent with Block1
+                    if (block1 == COAP_BLOCK1_DELIVER)
+                        coap_block1_complete(session, resource, pdu, request, response);
+
+                    // Cache the response (or drop the cache if the resource was modified)
+                    handle_cache(resource, pdu, query, use_cache, response, now);
+                }
+
+                // Record the representation's ETag and reply with 2.03 if the client already holds it
+                if (plain_get)
+                    handle_etag(resource, pdu, validate, response);
+            }
+
+            // Remaining blocks of the Q-Block2 set are sent after the response
+            coap_block_t qblock2;
+            bool send_set = pdu->code == COAP_REQUEST_GET && !observe && response->code == COAP_RESPONSE_CONTENT &&
+                            coap_get_block(response, COAP_OPTION_Q_BLOCK2, &qblock2);
 
             // Check the No-Response option
             respond = no_response(pdu, response);
@@ -2202,6 +2362,8 @@ static void handle_request(
                     ( response->code >= COAP_RESPONSE_CODE(200)) ){
                     if (coap_send(session, response) == COAP_INVALID_TID)
                         coap_log(LOG_DEBUG, "handle_request: cannot send response for message %d\n", pdu->tid);
+                    else if (send_set)
+                        coap_qblock2_send_set(session, resource, pdu, query, &qblock2);
                 }
                 else
                     coap_delete_pdu(response);
@@ -2221,7 +2383,7 @@ static void handle_request(
     // If handler was not registered
     else {
         // Check if /.well.known/core was requesed
-        if (coap_string_equal(uri_path, &coap_default_uri_wellknown)) {
+        if (coap_request_uri_path_equal(pdu, &coap_default_uri_wellknown)) {
             coap_log(LOG_DEBUG, "create default response for %s\n", COAP_DEFAULT_URI_WELLKNOWN);
             response = coap_wellknown_response(session, pdu);  
             coap_log(LOG_DEBUG, "have wellknown response %p\n", (void *)response);
@@ -2242,9 +2404,184 @@ static void handle_request(
     }
 
     assert(response == NULL);
+}
+
+
+/**
+ * @brief: Evaluates preconditions of the @p request to the @p resource basing on the resource's
+ *    recorded ETag:
+ *
+ *     - GET request listing the recorded ETag is answered with 2.03 (Valid)
+ *     - other request with If-None-Match is answered with 4.12 (Precondition Failed) as the
+ *       resource exists
+ *     - other request with If-Match not listing the recorded ETag (nor empty) is answered
+ *       with 4.12 (Precondition Failed); If-Match is evaluated only if the resource was
+ *       created with COAP_RESOURCE_FLAGS_VALIDATE and its ETag is known, otherwise the
+ *       request is passed to the handler
+ *
+ * @param resource:
+ *    requested resource
+ * @param request:
+ *    the request
+ * @param validate:
+ *    true if @p request is a GET for the default representation of the resource created
+ *    with COAP_RESOURCE_FLAGS_VALIDATE (and it is not an observation)
+ * @param response:
+ *    response to be filled
+ * @returns:
+ *    1 if the @p response has been filled and handler must not be called
+ *    0 otherwise
+ */
+static int handle_preconditions(
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    bool validate,
+    coap_pdu_t *response
+) {
+    // Requests to GET are validated with the ETag option
+    if (request->code == COAP_REQUEST_GET) {
+
+        // Check if the client holds the current representation
+        if (!validate || !resource->etag_length ||
+            !coap_request_lists_etag(request, COAP_OPTION_ETAG, resource->etag, resource->etag_length))
+            return 0;
+
+        // Answer with 2.03 (Valid)
+        response->code = COAP_RESPONSE_VALID;
+        coap_add_option(response, COAP_OPTION_ETAG, resource->etag_length, resource->etag);
+
+        return 1;
+    }
+
+    coap_opt_iterator_t opt_iter;
+
+    // The resource exists, so request with If-None-Match must not be performed
+    if (coap_check_option(request, COAP_OPTION_IF_NONE_MATCH, &opt_iter)) {
+        response->code = COAP_RESPONSE_PRECONDITION_FAILED;
+        return 1;
+    }
+
+    // Check if the request's If-Match options list the recorded ETag (if it's known)
+    if ((resource->flags & COAP_RESOURCE_FLAGS_VALIDATE) && resource->etag_length &&
+        coap_check_option(request, COAP_OPTION_IF_MATCH, &opt_iter) &&
+        !coap_request_lists_etag(request, COAP_OPTION_IF_MATCH, resource->etag, resource->etag_length)) {
+        response->code = COAP_RESPONSE_PRECONDITION_FAILED;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief: Checks if the GET @p request asks for the default representation (i.e. has no query
+ *    and no Accept) of the @p resource created with COAP_RESOURCE_FLAGS_VALIDATE, so that its
+ *    ETag may be recorded and validated
+ */
+static bool handle_validate(coap_resource_t *resource, coap_pdu_t *request, const coap_string_t *query) {
+
+    // ETag is validated only if the resource opted in
+    if (!(resource->flags & COAP_RESOURCE_FLAGS_VALIDATE))
+        return false;
+
+    coap_opt_iterator_t opt_iter;
+    return (!query || !query->length) && !coap_check_option(request, COAP_OPTION_ACCEPT, &opt_iter);
+}
+
+
+/**
+ * @brief: Stores the @p response to the GET @p request in the @p resource's cache (if @p use_cache
+ *    is true). Final successful response to other method drops the resource's cached responses
+ *    and the ETag, as they became stale. 2.31 (Continue) answering the not-last block of the
+ *    request streamed with Block1 does not, as the resource is modified by the last block.
+ */
+static void handle_cache(
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    const coap_string_t *query,
+    bool use_cache,
+    coap_pdu_t *response,
+    coap_tick_t now
+) {
+    // Cache the response
+    if (use_cache)
+        coap_response_cache_store(&resource->responses, request, query, response->max_size, response, now);
+    // Successful modification of the resource makes cached responses and the ETag stale
+    else if (request->code != COAP_REQUEST_GET && COAP_RESPONSE_CLASS(response->code) == 2 &&
+             response->code != COAP_RESPONSE_CONTINUE) {
+        coap_response_cache_clear(&resource->responses);
+        resource->etag_length = 0;
+    }
+}
+
+
+/**
+ * @brief: Turns the 2.05 @p response to the GET @p request into 2.03 (Valid) if the request lists
+ *    the response's ETag. If @p validate is true (i.e. @p request asks for the default
+ *    representation of the resource created with COAP_RESOURCE_FLAGS_VALIDATE), the ETag is
+ *    recorded as the @p resource's current one.
+ */
+static void handle_etag(
+    coap_resource_t *resource,
+    coap_pdu_t *request,
+    bool validate,
+    coap_pdu_t *response
+) {
+    // Only 2.05 (Content) responses carry the representation
+    if (response->code != COAP_RESPONSE_CONTENT)
+        return;
+
+    coap_opt_iterator_t opt_iter;
+
+    // Get the response's ETag
+    coap_opt_t *option = coap_check_option(response, COAP_OPTION_ETAG, &opt_iter);
+    if (!option || coap_opt_length(option) == 0 || coap_opt_length(option) > sizeof(resource->etag))
+        return;
+    uint8_t etag[sizeof(resource->etag)];
+    size_t length = coap_opt_length(option);
+    memcpy(etag, coap_opt_value(option), length);
+
+    // Record the ETag of the default representation
+    if (validate) {
+        memcpy(resource->etag, etag, length);
+        resource->etag_length = (uint8_t) length;
+    }
+
+    // Turn the response into 2.03 (Valid) if the client already holds the representation
+    if (coap_request_lists_etag(request, COAP_OPTION_ETAG, etag, length)) {
+
+        // Drop options and payload (token is kept)
+        response->used_size = response->token_length;
+        response->max_delta = 0;
+        response->data = NULL;
+
+        response->code = COAP_RESPONSE_VALID;
+        coap_add_option(response, COAP_OPTION_ETAG, length, etag);
+    }
+}
 
-    // Free the allocated string
-    coap_delete_string(uri_path);
+
+/**
+ * @brief: Checks if any of the @p request's options of the @p type holds the @p etag. Empty
+ *    If-Match option matches any existing representation.
+ */
+static bool coap_request_lists_etag(coap_pdu_t *request, uint16_t type, const uint8_t *etag, size_t length) {
+
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+
+    // Iterate over options of the @p type
+    coap_opt_t *option;
+    while ((option = coap_option_next(&opt_iter))) {
+        if (opt_iter.type != type)
+            continue;
+        if (coap_opt_length(option) == 0 && type == COAP_OPTION_IF_MATCH)
+            return true;
+        if (length != 0 && coap_opt_length(option) == length && memcmp(coap_opt_value(option), etag, length) == 0)
+            return true;
+    }
+
+    return false;
 }
 
 
@@ -2278,3 +2615,4 @@ static void handle_response(
     if (session->context->response_handler)
         session->context->response_handler(session->context, session, sent, received, received->tid);
 }
+
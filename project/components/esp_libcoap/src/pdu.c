@@ -116,15 +116,15 @@ int coap_pdu_clear(coap_pdu_t *pdu, size_t size) {
     assert(pdu);
 
     // If memory was allocated to the PDU, free it
-    if(pdu->token != NULL)
-        coap_free(pdu->token - COAP_HEADER_SIZE);
+    if(pdu->token != NULL && !pdu->borrowed)
+        coap_free_type(COAP_PDU_BUF, pdu->token - COAP_HEADER_SIZE);
 
     // Clear the PDU
     memset(pdu, 0, sizeof(coap_pdu_t));
 
     // Allocate memory for the PDU
     uint8_t *buf = 
-        (uint8_t*) coap_malloc(size + COAP_HEADER_SIZE);
+        (uint8_t*) coap_malloc_type(COAP_PDU_BUF, size + COAP_HEADER_SIZE);
     if(buf == NULL)
         return -1;
 
@@ -147,16 +147,21 @@ coap_pdu_t *coap_pdu_init(
 ){
 
     // Allocate memory for the new PDU
-    coap_pdu_t *pdu = (coap_pdu_t *) coap_malloc(sizeof(coap_pdu_t));
+    coap_pdu_t *pdu = (coap_pdu_t *) coap_malloc_type(COAP_PDU, sizeof(coap_pdu_t));
     if (pdu == NULL) 
         return NULL;
 
     // Clear the allocated region
     memset(pdu, 0, sizeof(coap_pdu_t));
 
-    // Clear the PDU (and allocate some memory for it)
-    if(coap_pdu_clear(pdu, size) < 0){
-        coap_free(pdu);
+    /**
+     * Clear the PDU (and allocate some memory for it)
+     * 
+     * @note: Only the initial part of the @p size is allocated. Buffer grows on demand up
+     *    to the @a max_size, so that short responses do not occupy MTU-sized buffers.
+     */
+    if(coap_pdu_clear(pdu, min(size, COAP_PDU_INITIAL_SIZE)) < 0){
+        coap_free_type(COAP_PDU, pdu);
         return NULL;
     }
 
@@ -189,9 +194,9 @@ coap_pdu_t *coap_new_pdu(const struct coap_session_t *session) {
 void coap_delete_pdu(coap_pdu_t *pdu) {
 
     if (pdu != NULL) {
-        if (pdu->token != NULL)
-            coap_free(pdu->token - COAP_HEADER_SIZE);
-        coap_free(pdu);
+        if (pdu->token != NULL && !pdu->borrowed)
+            coap_free_type(COAP_PDU_BUF, pdu->token - COAP_HEADER_SIZE);
+        coap_free_type(COAP_PDU, pdu);
     }
 }
 
@@ -215,12 +220,25 @@ int coap_pdu_resize(coap_pdu_t *pdu, size_t new_size) {
         } else
             data_offset = 0;
 
-        // Reallocate the data
-        uint8_t *new_hdr = 
-            (uint8_t*) realloc(pdu->token - COAP_HEADER_SIZE, new_size + COAP_HEADER_SIZE);
-        if (new_hdr == NULL) {
-            coap_log(LOG_WARNING, "coap_pdu_resize: realloc failed\n");
-            return 0;
+        uint8_t *new_hdr;
+
+        // Borrowed storage cannot be reallocated; move PDU's content to the heap instead
+        if (pdu->borrowed) {
+            new_hdr = (uint8_t*) coap_malloc_type(COAP_PDU_BUF, new_size + COAP_HEADER_SIZE);
+            if (new_hdr == NULL) {
+                coap_log(LOG_WARNING, "coap_pdu_resize: malloc failed\n");
+                return 0;
+            }
+            memcpy(new_hdr, pdu->token - COAP_HEADER_SIZE, pdu->used_size + COAP_HEADER_SIZE);
+            pdu->borrowed = 0;
+        }
+        // Reallocate the data (buffer stays in place if it's size class can hold @p new_size bytes)
+        else {
+            new_hdr = (uint8_t*) coap_realloc_type(COAP_PDU_BUF, pdu->token - COAP_HEADER_SIZE, new_size + COAP_HEADER_SIZE);
+            if (new_hdr == NULL) {
+                coap_log(LOG_WARNING, "coap_pdu_resize: realloc failed\n");
+                return 0;
+            }
         }
 
         // Set a new token pointer
@@ -288,6 +306,54 @@ size_t coap_add_option(coap_pdu_t *pdu, uint16_t type, size_t len, const uint8_t
 }
 
 
+size_t coap_insert_option(coap_pdu_t *pdu, uint16_t type, size_t len, const uint8_t *data) {
+
+    // Option can be simply appended if it's type is not lower than the last one's
+    if (pdu->data == NULL && type >= pdu->max_delta)
+        return coap_add_option(pdu, type, len, data);
+
+    // Copy PDU's content
+    coap_pdu_t *copy = coap_pdu_copy(pdu);
+    if (copy == NULL)
+        return 0;
+
+    // Drop options and payload (token is kept)
+    pdu->used_size = pdu->token_length;
+    pdu->max_delta = 0;
+    pdu->data = NULL;
+
+    size_t optsize = 0;
+    int ok = 1;
+
+    // Rewrite options inserting the new one in order
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(copy, &opt_iter, COAP_OPT_ALL);
+    coap_opt_t *option;
+    while (ok && (option = coap_option_next(&opt_iter))) {
+        if (optsize == 0 && type < opt_iter.type)
+            ok = (optsize = coap_add_option(pdu, type, len, data)) != 0;
+        if (ok)
+            ok = coap_add_option(pdu, opt_iter.type, coap_opt_length(option), coap_opt_value(option)) != 0;
+    }
+    if (ok && optsize == 0)
+        ok = (optsize = coap_add_option(pdu, type, len, data)) != 0;
+
+    // Rewrite the payload
+    if (ok && copy->data)
+        ok = coap_add_data(pdu, copy->used_size - (copy->data - copy->token), copy->data);
+
+    // Restore the original content on failure
+    if (!ok) {
+        coap_pdu_copy_content(pdu, copy);
+        optsize = 0;
+    }
+
+    coap_delete_pdu(copy);
+
+    return optsize;
+}
+
+
 uint8_t* coap_add_option_later(coap_pdu_t *pdu, uint16_t type, size_t len) {
     
     // Encode the option's header
@@ -510,6 +576,83 @@ int coap_pdu_parse(
 }
 
 
+int coap_pdu_parse_view(
+    uint8_t *data,
+    size_t length,
+    coap_pdu_t *pdu
+){
+    // Check data is long enogh to hold at least the header
+    if (COAP_HEADER_SIZE > length)
+        return 0;
+
+    // Make the PDU point to the @p data
+    memset(pdu, 0, sizeof(coap_pdu_t));
+    pdu->borrowed = 1;
+    pdu->token = data + COAP_HEADER_SIZE;
+    pdu->alloc_size = length - COAP_HEADER_SIZE;
+    pdu->used_size = length - COAP_HEADER_SIZE;
+    pdu->max_size = length - COAP_HEADER_SIZE;
+
+    // perform consistency check of the PDU
+    return coap_pdu_parse_header(pdu) && coap_pdu_parse_opt(pdu);
+}
+
+
+coap_pdu_t *coap_pdu_copy(const coap_pdu_t *pdu) {
+
+    assert(pdu);
+
+    // Create a new PDU big enough to hold @p pdu's content
+    coap_pdu_t *copy = coap_pdu_init(pdu->type, pdu->code, pdu->tid, pdu->used_size);
+    if (copy == NULL)
+        return NULL;
+    if (!coap_pdu_resize(copy, pdu->used_size)) {
+        coap_delete_pdu(copy);
+        return NULL;
+    }
+
+    // Copy header, token, options and payload
+    memcpy(copy->token - COAP_HEADER_SIZE, pdu->token - COAP_HEADER_SIZE, pdu->used_size + COAP_HEADER_SIZE);
+
+    // Copy PDU's metadata
+    copy->max_size = pdu->max_size;
+    copy->max_delta = pdu->max_delta;
+    copy->token_length = pdu->token_length;
+    copy->used_size = pdu->used_size;
+    if (pdu->data != NULL)
+        copy->data = copy->token + (pdu->data - pdu->token);
+
+    return copy;
+}
+
+
+int coap_pdu_copy_content(coap_pdu_t *pdu, const coap_pdu_t *source) {
+
+    assert(pdu); assert(source);
+
+    // Size of the options and payload
+    size_t content_size = source->used_size - source->token_length;
+
+    // Make sure the content fits into the PDU
+    if (!coap_pdu_resize(pdu, pdu->token_length + content_size))
+        return 0;
+
+    // Copy options and payload
+    memcpy(pdu->token + pdu->token_length, source->token + source->token_length, content_size);
+
+    // Copy PDU's metadata
+    pdu->code = source->code;
+    pdu->max_delta = source->max_delta;
+    pdu->used_size = pdu->token_length + content_size;
+    if (source->data != NULL)
+        pdu->data = pdu->token + pdu->token_length + (source->data - source->token - source->token_length);
+    else
+        pdu->data = NULL;
+
+    return 1;
+}
+
+
 void coap_pdu_encode_header(coap_pdu_t *pdu) {
     
     uint8_t* header = pdu->token - COAP_HEADER_SIZE;
@@ -32,6 +32,7 @@
 /* ------------------------------------------------------------------------------------------------------------ */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include "coap_config.h"
 #include "coap.h"
@@ -44,9 +45,17 @@
 
 static int match(const coap_str_const_t *text, const coap_str_const_t *pattern, int match_prefix,int match_substring);
 static void coap_free_resource(coap_resource_t *resource);
+static void coap_retire_resource(coap_resource_t *resource);
+static void coap_resource_queue_dirty(coap_resource_t *resource);
 static coap_subscription_t *coap_find_observer_query(coap_resource_t *resource, coap_session_t *session, const coap_string_t *query);
 static void coap_notify_observers(coap_context_t *context, coap_resource_t *resource);
-static void coap_remove_failed_observer(coap_context_t *context, coap_resource_t *resource, coap_session_t *session, const coap_binary_t *token);
+static void coap_remove_failed_observer(coap_subscription_t *observer);
+static coap_subscription_t *coap_next_indexed_observer(coap_session_t *session, const coap_binary_t *token, coap_subscription_t *prev);
+static void coap_free_observer(coap_subscription_t *observer);
+static void coap_observer_parse_attributes(coap_subscription_t *observer);
+static bool coap_observer_check_conditions(coap_context_t *context, coap_resource_t *resource, coap_subscription_t *observer, coap_tick_t now);
+static void coap_observer_schedule(coap_context_t *context, coap_subscription_t *observer);
+static coap_queue_t *coap_find_delayed_notification(coap_subscription_t *observer);
 
 
 /* -------------------------------------------- [Macrofeinitions] --------------------------------------------- */
@@ -355,6 +364,7 @@ coap_resource_t *coap_resource_init(coap_str_const_t *uri_path, int flags){
         if (uri_path)
             resource->uri_path = uri_path;
         resource->flags = flags;
+        resource->cacheable = (flags & COAP_RESOURCE_FLAGS_CACHE_RESPONSES) ? 1 : 0;
     } 
     // If allocation failed
     else
@@ -423,6 +433,10 @@ coap_attr_t *coap_add_attr(
 
         // Add attribute to @p resource's list
         LL_PREPEND(resource->link_attr, attr);
+
+        // Resource's link description changes
+        if (resource->context)
+            resource->context->resources_version++;
     } 
     // Otherwise, if allocation failed
     else
@@ -469,6 +483,10 @@ void coap_add_resource(
     coap_resource_t *resource
 ){
 
+    // Mark that the set of resources changes
+    context->resources_version++;
+    resource->context = context;
+
     // Add an unknown (unnamed) resource
     if (resource->is_unknown) {
         if (context->unknown_resource)
@@ -490,7 +508,15 @@ void coap_add_resource(
 
         // Register the resource in the context
         RESOURCES_ADD(context->resources, resource);
+
+        // Register the templated path in the routes' tree
+        if (coap_route_is_template(resource->uri_path))
+            resource->is_template = coap_route_add(context, resource);
     }
+
+    // Queue resource that changed before it was added
+    if (resource->dirty || resource->partiallydirty)
+        coap_resource_queue_dirty(resource);
 }
 
 
@@ -501,18 +527,23 @@ int coap_delete_resource(
     if (context == NULL || resource == NULL)
         return 0;
 
+    // Mark that the set of resources changes
+    context->resources_version++;
+
     // Remove unknown (unnamed) resource
     if (resource->is_unknown && (context->unknown_resource == resource)) {
-        coap_free_resource(context->unknown_resource);
         context->unknown_resource = NULL;
+        coap_retire_resource(resource);
         return 1;
     }
 
     // Remove regular (named) resource
     RESOURCES_DELETE(context->resources, resource);
+    if (resource->is_template)
+        coap_route_delete(context, resource);
 
-    // Free resource's memory
-    coap_free_resource(resource);
+    // Free resource's memory (or leave it to the last reference)
+    coap_retire_resource(resource);
 
     return 1;
 }
@@ -531,20 +562,42 @@ void coap_delete_all_resources(coap_context_t *context) {
     // Release all resources
     HASH_ITER(hh, context->resources, res, rtmp) {
         HASH_DELETE(hh, context->resources, res);
-        coap_free_resource(res);
+        coap_retire_resource(res);
     }
 
     // Reste context's resource list
     context->resources = NULL;
+    context->resources_version++;
+
+    // Release the routes' tree
+    coap_route_delete_all(context);
 
     // Release a context's unknown resource, if present
     if (context->unknown_resource) {
-        coap_free_resource(context->unknown_resource);
+        coap_retire_resource(context->unknown_resource);
         context->unknown_resource = NULL;
     }
 }
 
 
+coap_resource_t *coap_resource_reference(coap_resource_t *resource) {
+    ++(resource->ref);
+    return resource;
+}
+
+
+void coap_resource_release(coap_resource_t *resource) {
+
+    assert(resource->ref > 0);
+    if (resource->ref > 0)
+        --resource->ref;
+
+    // Free the resource deleted while it was referenced
+    if (resource->ref == 0 && resource->is_deleted)
+        coap_free_resource(resource);
+}
+
+
 coap_resource_t *coap_get_resource_from_uri_path(
     coap_context_t *context, 
     coap_str_const_t *uri_path
@@ -555,6 +608,40 @@ coap_resource_t *coap_get_resource_from_uri_path(
 }
 
 
+coap_resource_t *coap_get_resource_from_request(
+    coap_context_t *context, 
+    const coap_pdu_t *request
+) {
+    // Forget segments captured for the previous request
+    context->route_match.num_captures = 0;
+    context->route_match.wildcard_start = 0;
+
+    if (!context->resources)
+        return NULL;
+
+    // Hash the path in a single pass over the Uri-Path options
+    size_t length;
+    unsigned hashv = coap_request_uri_path_hash(request, &length);
+
+    // Find the bucket that resource would be placed in
+    UT_hash_table *tbl = context->resources->hh.tbl;
+    unsigned bkt;
+    HASH_TO_BKT(hashv, tbl->num_buckets, bkt);
+
+    // Compare the request's path with resources that have the same hash and length
+    for (UT_hash_handle *hh = tbl->buckets[bkt].hh_head; hh; hh = hh->hh_next) {
+        if (hh->hashv == hashv && hh->keylen == length) {
+            coap_resource_t *resource = (coap_resource_t *) ELMT_FROM_HH(tbl, hh);
+            if (coap_request_uri_path_equal(request, resource->uri_path))
+                return resource;
+        }
+    }
+
+    // Try the templated paths
+    return coap_route_find(context, request);
+}
+
+
 coap_print_status_t coap_print_link(
     const coap_resource_t *resource,
     unsigned char *buf, 
@@ -641,14 +728,18 @@ coap_subscription_t *coap_find_observer(
     assert(session);
 
     coap_subscription_t *s;
-    LL_FOREACH(resource->subscribers, s) {
-
-        bool session_match = s->session == session;
-        bool token_match = !token || 
-            (token->length == s->token_length && memcmp(token->s, s->token, token->length) == 0);
 
-        if (session_match && token_match)
-            return s;
+    // Look for the subscription in the context's index
+    if (token) {
+        for (s = coap_next_indexed_observer(session, token, NULL); s; s = coap_next_indexed_observer(session, token, s))
+            if (s->resource == resource)
+                return s;
+    }
+    // Any token matches; look through the session's subscriptions
+    else {
+        DL_FOREACH2(session->subscriptions, s, session_next)
+            if (s->resource == resource)
+                return s;
     }
 
     return NULL;
@@ -659,21 +750,41 @@ coap_subscription_t *coap_add_observer(
     coap_resource_t *resource,
     coap_session_t *session,
     const coap_binary_t *token,
-    coap_string_t *query,
+    const coap_string_t *query,
     int has_block2,
     coap_block_t block2
 ) {
     assert( session );
 
+    // Promote the query to the heap (it may come from the per-request arena)
+    coap_string_t *query_copy = NULL;
+    if (query) {
+        if (!(query_copy = coap_new_string(query->length)))
+            return NULL;
+        memcpy(query_copy->s, query->s, query->length);
+        query_copy->length = query->length;
+    }
+
     // Check if there is already a subscription for this peer
     coap_subscription_t *observer =
         coap_find_observer(resource, session, token);
 
+    // Time of the registration (it counts as the first notification for conditional attributes)
+    coap_tick_t now;
+    coap_ticks(&now);
+
     // If subscription was found, just update the query
     if (observer) {
         if (observer->query)
             coap_delete_string(observer->query);
-        observer->query = query;
+        observer->query = query_copy;
+
+        // Update conditional attributes
+        coap_observer_parse_attributes(observer);
+        observer->pending = observer->expired = 0;
+        observer->last_notified = now;
+        coap_observer_schedule(session->context, observer);
+
         return observer;
     }
 
@@ -700,8 +811,8 @@ coap_subscription_t *coap_add_observer(
     // Allocate memory for a new subscriber
     observer = (coap_subscription_t*) coap_malloc(sizeof(coap_subscription_t));
     if (!observer) {
-        if (query)
-            coap_delete_string(query);
+        if (query_copy)
+            coap_delete_string(query_copy);
         return NULL;
     }
 
@@ -715,15 +826,27 @@ coap_subscription_t *coap_add_observer(
         memcpy(observer->token, token->s, min(observer->token_length, 8));
     }
 
-    // Take the ownership over the query
-    observer->query = query;
+    // Take the ownership over the query's copy
+    observer->query = query_copy;
 
     // Initialize block-transfer-subscription info
     observer->has_block2 = has_block2;
     observer->block2 = block2;
 
     // Add subscriber to resource
-    LL_PREPEND(resource->subscribers, observer);
+    observer->resource = resource;
+    DL_PREPEND(resource->subscribers, observer);
+
+    // Add subscription to the session's list and to the context's index
+    DL_PREPEND2(session->subscriptions, observer, session_prev, session_next);
+    HASH_ADD(hh, session->context->observers, session, COAP_SUBSCRIPTION_KEY_SIZE, observer);
+
+    // Parse conditional attributes and start the pmax timer
+    coap_observer_parse_attributes(observer);
+    observer->last_notified = now;
+    observer->last_value = resource->value;
+    observer->has_last_value = resource->has_value;
+    coap_observer_schedule(session->context, observer);
     coap_log(LOG_DEBUG, "create new subscription\n");
 
     return observer;
@@ -734,18 +857,11 @@ void coap_touch_observer(
     coap_session_t *session,
     const coap_binary_t *token
 ) {
-    coap_subscription_t *observer;
-
-    // Iterate over all resources in the context
-    RESOURCES_ITER(session->context->resources, resource) {
-
-        // Find an observer
-        observer = coap_find_observer(resource, session, token);
+    coap_subscription_t *observer = NULL;
 
-        // If observer found, reset fail counter
-        if (observer) 
-            observer->fail_cnt = 0;
-    }
+    // Reset fail counter of all subscriptions made with the @p token
+    while ((observer = coap_next_indexed_observer(session, token, observer)))
+        observer->fail_cnt = 0;
 }
 
 
@@ -769,51 +885,36 @@ int coap_delete_observer(
     }
 
     // If observer exists, delete it
-    if (observer) {
+    if (observer)
+        coap_free_observer(observer);
 
-        // Delete observer from the resource's list
-        LL_DELETE(resource->subscribers, observer);
+    return observer != NULL;
+}
 
-        // Decrement sessions reference counter
-        coap_session_release(session);
 
-        // Free observer's resources
-        if (observer->query)
-            coap_delete_string(observer->query);
-        coap_free(observer);
+int coap_delete_observers_by_token(
+    coap_session_t *session,
+    const coap_binary_t *token
+) {
+    int num_deleted = 0;
+
+    // Delete all subscriptions found in the index
+    coap_subscription_t *observer;
+    while ((observer = coap_next_indexed_observer(session, token, NULL))) {
+        coap_free_observer(observer);
+        num_deleted++;
     }
 
-    return observer != NULL;
+    return num_deleted;
 }
 
 
 void coap_delete_observers(
     coap_session_t *session
 ) {
-    // Iterate over all resources registered within context
-    RESOURCES_ITER(session->context->resources, resource) {
-        
-        coap_subscription_t *observer, *observer_tmp;
-
-        // Iterate over all observer registered to the resource
-        LL_FOREACH_SAFE(resource->subscribers, observer, observer_tmp) {
-
-            // If session matches
-            if (observer->session == session) {
-
-                // Delete the observer from the resource's list
-                LL_DELETE(resource->subscribers, observer);
-
-                // Decrement sessions reference counter
-                coap_session_release(session);
-
-                // Release observer's resources
-                if (observer->query)
-                    coap_delete_string(observer->query);
-                coap_free(observer);
-            }
-        }
-    }
+    // Delete all subscriptions made by the session's peer
+    while (session->subscriptions)
+        coap_free_observer(session->subscriptions);
 }
 
 
@@ -821,6 +922,10 @@ int coap_resource_notify_observers(
     coap_resource_t *resource, 
     const coap_string_t *query
 ) {
+    // Cached responses and the ETag no longer reflect the resource's state
+    coap_response_cache_clear(&resource->responses);
+    resource->etag_length = 0;
+
     if ( !resource->observable )
         return 0;
 
@@ -864,6 +969,9 @@ int coap_resource_notify_observers(
         resource->dirty = 1;
     }
 
+    // Queue resource for notifications to be sent in the next coap_check_notify() call
+    coap_resource_queue_dirty(resource);
+
     // Increment value for next Observe use (Observe value must be < 2^24)
     resource->observe = (resource->observe + 1) & 0xFFFFFF;
 
@@ -871,9 +979,69 @@ int coap_resource_notify_observers(
 }
 
 
+int coap_resource_set_value(
+    coap_resource_t *resource, 
+    float value
+) {
+    resource->value = value;
+    resource->has_value = 1;
+
+    return coap_resource_notify_observers(resource, NULL);
+}
+
+
 void coap_check_notify(coap_context_t *context) {
-    RESOURCES_ITER(context->resources, resource)
+
+    // Handle expired observers' timers
+    if (context->observe_timers.len) {
+
+        coap_tick_t now;
+        coap_ticks(&now);
+
+        coap_subscription_t *observer;
+        while ((observer = coap_timer_heap_peek(&context->observe_timers)) && observer->timer <= now) {
+
+            coap_timer_heap_remove(&context->observe_timers, observer);
+
+            // Notification has to be sent, if pmax passed since the last one
+            if (observer->has_pmax && observer->last_notified + observer->pmax <= now)
+                observer->expired = 1;
+
+            // Mark the observer so that held back change (or the expiration) is handled
+            observer->pending = 0;
+            observer->dirty = 1;
+            observer->resource->partiallydirty = 1;
+            coap_resource_queue_dirty(observer->resource);
+        }
+    }
+
+    if (!context->dirty_resources)
+        return;
+
+    /**
+     * @note: Resources queued again during the loop (i.e. partially dirty ones or notified
+     *    from within the handlers) are appended to the list's tail and handled in the next call.
+     *    The loop is bounded by the number of resources queued at it's start rather than by the
+     *    last of them, as queued resources may be deleted while their observers are notified.
+     */
+    coap_resource_t *resource;
+    size_t queued;
+    DL_COUNT2(context->dirty_resources, resource, queued, next_dirty);
+
+    while (queued-- && context->dirty_resources) {
+
+        // Dequeue the first resource
+        resource = context->dirty_resources;
+        DL_DELETE2(context->dirty_resources, resource, prev_dirty, next_dirty);
+        resource->is_queued = 0;
+
+        // Send notifications
         coap_notify_observers(context, resource);
+
+        // Queue again if some observers were not notified
+        if (resource->partiallydirty)
+            coap_resource_queue_dirty(resource);
+    }
 }
 
 
@@ -881,9 +1049,13 @@ void coap_handle_failed_notify(
     coap_session_t *session,
     const coap_binary_t *token
 ) {
-    // Iterate over all resources to find the observer to be removed
-    RESOURCES_ITER(session->context->resources, resource) 
-        coap_remove_failed_observer(session->context, resource, session, token);
+    coap_subscription_t *observer, *next;
+
+    // Check all subscriptions made with the @p token
+    for (observer = coap_next_indexed_observer(session, token, NULL); observer; observer = next) {
+        next = coap_next_indexed_observer(session, token, observer);
+        coap_remove_failed_observer(observer);
+    }
 }
 
 
@@ -992,6 +1164,21 @@ static void coap_free_resource(coap_resource_t *resource) {
 
     assert(resource);
 
+    // Remove resource from the context's dirty list
+    if (resource->is_queued)
+        DL_DELETE2(resource->context->dirty_resources, resource, prev_dirty, next_dirty);
+
+    // Free the shared notification
+    if (resource->notification)
+        coap_delete_pdu(resource->notification);
+
+    // Free cached responses
+    coap_response_cache_clear(&resource->responses);
+
+    // Abandon Block1 transfers to the resource
+    if (resource->context)
+        coap_block1_remove(resource->context, NULL, resource);
+
     coap_attr_t *attr, *tmp;
 
     // Delete registered attributes
@@ -1002,23 +1189,41 @@ static void coap_free_resource(coap_resource_t *resource) {
     coap_delete_str_const(resource->uri_path);
 
 
-    coap_subscription_t *obs, *otmp;
-    
     // Free all elements from resource->subscribers
-    LL_FOREACH_SAFE( resource->subscribers, obs, otmp ) {
+    while (resource->subscribers)
+        coap_free_observer(resource->subscribers);
 
-        // Release observer's session
-        coap_session_release(obs->session);
+    coap_free(resource);
+}
 
-        // Delete observer's query
-        if (obs->query)
-            coap_delete_string(obs->query);
 
-        // Free observer itself
-        coap_free(obs);
+/**
+ * @brief: Frees the @p resource removed from the context. If the resource is referenced,
+ *    it's only detached from the context's state (dirty list, Block1 transfers, observers)
+ *    and freed by coap_resource_release().
+ */
+static void coap_retire_resource(coap_resource_t *resource) {
+
+    if (!resource->ref) {
+        coap_free_resource(resource);
+        return;
     }
 
-    coap_free(resource);
+    // Remove resource from the context's dirty list
+    if (resource->is_queued) {
+        DL_DELETE2(resource->context->dirty_resources, resource, prev_dirty, next_dirty);
+        resource->is_queued = 0;
+    }
+
+    // Abandon Block1 transfers to the resource
+    if (resource->context)
+        coap_block1_remove(resource->context, NULL, resource);
+
+    // Delete all observers
+    while (resource->subscribers)
+        coap_free_observer(resource->subscribers);
+
+    resource->is_deleted = 1;
 }
 
 
@@ -1059,6 +1264,23 @@ static coap_subscription_t *coap_find_observer_query(
 }
 
 
+/**
+ * @brief: Appends @p resource to the dirty list of the context it was added to (if not
+ *    queued yet). Resources that were not added to any context are queued when added.
+ * 
+ * @param resource:
+ *    resource to be queued
+ */
+static void coap_resource_queue_dirty(coap_resource_t *resource) {
+
+    if (resource->is_queued || resource->context == NULL)
+        return;
+
+    DL_APPEND2(resource->context->dirty_resources, resource, prev_dirty, next_dirty);
+    resource->is_queued = 1;
+}
+
+
 /**
  * @brief: Notifies all possible observers of the @p resource registered in the given @p context.
  *    Marks @p resource appropriately if some of them could not be notified.
@@ -1079,8 +1301,17 @@ static void coap_notify_observers(
         // Mark that the notification procedure has begun
         resource->partiallydirty = 0;                
 
+        // Drop the shared notification rendered for the previous state of the resource
+        if (resource->notification && resource->notification_observe != resource->observe) {
+            coap_delete_pdu(resource->notification);
+            resource->notification = NULL;
+        }
+
         coap_subscription_t *observer;
 
+        coap_tick_t now;
+        coap_ticks(&now);
+
         // Iterate over all resource's subscriber
         LL_FOREACH(resource->subscribers, observer) {
 
@@ -1090,13 +1321,27 @@ static void coap_notify_observers(
             if (resource->dirty == 0 && observer->dirty == 0)
                 continue;
 
+            // Continue, if observer's conditional attributes hold the notification back
+            if (!coap_observer_check_conditions(context, resource, observer, now)) {
+                observer->dirty = 0;
+                continue;
+            }
+
 
             bool active_con_limit_reached = observer->session->con_active >= COAP_DEFAULT_NSTART;
             bool notify_by_con = observer->non_cnt >= COAP_OBS_MAX_NON ||
                                  resource->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON;
+            bool notify_latest = resource->flags & COAP_RESOURCE_FLAGS_NOTIFY_LATEST;
+
+            /**
+             * @note: In the latest-state-wins mode notifications that cannot be sent are delayed
+             *    in the session's delayqueue (and sent when the in-flight CON is acknowledged).
+             *    If observer has such a notification, it's content is replaced with the new one.
+             */
+            coap_queue_t *delayed = notify_latest ? coap_find_delayed_notification(observer) : NULL;
                 
             // Continue, if a new CON message connot be sent
-            if ( active_con_limit_reached && notify_by_con){
+            if ( active_con_limit_reached && notify_by_con && !notify_latest){
                 observer->dirty = 1;
                 resource->partiallydirty = 1;
                 continue;
@@ -1126,14 +1371,17 @@ static void coap_notify_observers(
                 continue;
             }
 
-            // Generate a new message ID
-            response->tid = coap_new_message_id(observer->session);
+            // Generate a new message ID (the delayed notification keeps it's own)
+            response->tid = delayed ? delayed->id : coap_new_message_id(observer->session);
 
             // Establish type of the notification response
             if ( (resource->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) == 0 && observer->non_cnt < COAP_OBS_MAX_NON) 
                 response->type = COAP_MESSAGE_NON;
             else
                 response->type = COAP_MESSAGE_CON;
+            // Delayed notification keeps it's type
+            if (delayed)
+                response->type = delayed->pdu->type;
             
             // Get the token entity for user's handler to recognise the observer
             coap_binary_t token = {
@@ -1141,15 +1389,32 @@ static void coap_notify_observers(
                 .s = observer->token
             };
             
-            // Retrieve GET handler
-            coap_method_handler_t handler = 
-                resource->handler[COAP_REQUEST_GET - 1];
-
-            // Subscription is not allowed, when there is no GET handler registered
-            assert(handler);
-
-            // Call user-defined GET handler to fill response with data
-            handler(resource, observer->session, NULL, &token, observer->query, response);
+            /**
+             * @note: Observers that subscribed with the Block2 option receive the first block of
+             *    the size they negotiated, so their notifications are always rendered separately.
+             */
+            bool shared = (resource->flags & COAP_RESOURCE_FLAGS_NOTIFY_PER_OBSERVER) == 0 &&
+                          !observer->has_block2;
+
+            // Reuse the representation rendered for one of the previous observers
+            if ( !(shared && resource->notification && coap_pdu_copy_content(response, resource->notification)) ) {
+
+                // Retrieve GET handler
+                coap_method_handler_t handler = 
+                    resource->handler[COAP_REQUEST_GET - 1];
+
+                // Subscription is not allowed, when there is no GET handler registered
+                assert(handler);
+
+                // Call user-defined GET handler to fill response with data
+                handler(resource, observer->session, NULL, &token, observer->query, response);
+
+                // Keep the representation for the following observers
+                if (shared && !resource->notification && COAP_RESPONSE_CLASS(response->code) == 2) {
+                    resource->notification = coap_pdu_copy(response);
+                    resource->notification_observe = resource->observe;
+                }
+            }
 
             // Update NON counter
             if (response->type == COAP_MESSAGE_CON)
@@ -1160,8 +1425,26 @@ static void coap_notify_observers(
             // Check if response's code set in the handler belongs to 2.XX (Success) group
             if ( COAP_RESPONSE_CLASS(response->code) == 2 ){
 
-                // Send a message
-                coap_tid_t tid = coap_send( observer->session, response );
+                coap_tid_t tid;
+
+                // Replace content of the delayed notification ...
+                if (delayed && coap_pdu_copy_content(delayed->pdu, response)) {
+                    coap_pdu_encode_header(delayed->pdu);
+                    tid = delayed->id;
+                    coap_delete_pdu(response);
+                }
+                // ... or send a message
+                else {
+
+                    // Delayed notification that cannot hold the new state is replaced by the new one
+                    if (delayed) {
+                        LL_DELETE(observer->session->delayqueue, delayed);
+                        coap_delete_node(delayed);
+                        response->tid = coap_new_message_id(observer->session);
+                    }
+
+                    tid = coap_send( observer->session, response );
+                }
 
                 // Update 'dirty' markers if notification sending failed
                 if (COAP_INVALID_TID == tid) {
@@ -1169,88 +1452,349 @@ static void coap_notify_observers(
                     observer->dirty = 1;
                     resource->partiallydirty = 1;
                 }
+                // Otherwise, remember the reported state and restart observer's timer
+                else {
+                    observer->expired = 0;
+                    observer->last_notified = now;
+                    observer->last_value = resource->value;
+                    observer->has_last_value = resource->has_value;
+                    coap_observer_schedule(context, observer);
+                }
 
-            } else
+            } else {
                 coap_log(LOG_INFO, "Notification (MID: %d) won't be sent, as user-handler set return code %d: %s ",
                     response->tid, response-> code, coap_response_phrase(response-> code));
+                coap_delete_pdu(response);
+
+                // Restart the pmax period, so that the handler is asked again (not on every pass)
+                observer->expired = 0;
+                observer->last_notified = now;
+                coap_observer_schedule(context, observer);
+            }
 
         }
     }
     
     resource->dirty = 0;
+
+    // Shared notification is needed only until all observers are notified
+    if (!resource->partiallydirty && resource->notification) {
+        coap_delete_pdu(resource->notification);
+        resource->notification = NULL;
+    }
 }
 
 
 /**
- * @brief: Checks the failure counter for (peer, token) and removes peer from
- *    the list of observers for the given resource when COAP_OBS_MAX_FAIL
- *    is reached.
+ * @brief: Checks the failure counter of the @p observer and removes it from the list of
+ *    observers of it's resource when COAP_OBS_MAX_FAIL is reached.
+ *
+ * @param observer:
+ *     subscription whose notification failed
+ */
+static void coap_remove_failed_observer(coap_subscription_t *observer) {
+
+    // For a regular observer, increment the fail counter
+    if (observer->fail_cnt < COAP_OBS_MAX_FAIL) {
+        observer->fail_cnt++;
+        return;
+    }
+
+    // Log some stuff
+    #ifndef NDEBUG
+    
+    if (LOG_DEBUG <= coap_get_log_level()) {
+
+        #ifndef INET6_ADDRSTRLEN
+        #define INET6_ADDRSTRLEN 40
+        #endif
+        
+        unsigned char addr[INET6_ADDRSTRLEN + 8];
+        if (coap_print_addr(&observer->session->remote_addr, addr, INET6_ADDRSTRLEN + 8))
+            coap_log(LOG_DEBUG, "** removed observer %s\n", addr);
+    }
+
+    #endif /* NDEBUG */
+
+    // Cancel all mesages associated with the observer
+    coap_cancel_all_messages(observer->session, observer->token, observer->token_length);
+
+    // Delete observer
+    coap_free_observer(observer);
+}
+
+
+/**
+ * @brief: Iterates over subscriptions made by the @p session with the @p token (a single token
+ *    may be used to observe a few resources) using the context's index.
  *
- * @param context:
- *     the CoAP context to use
- * @param resource:
- *     the resource to check for (peer, token)
  * @param session:
- *     the observer's session
+ *    the observer's session
  * @param token:
- *     the token that has been used for subscription.
+ *    the token that has been used for subscription
+ * @param prev:
+ *    subscription returned by the previous call (NULL to get the first one)
+ * @returns:
+ *    next matching subscription
+ *    NULL if there are no more subscriptions
  */
-static void
-coap_remove_failed_observer(
-    coap_context_t *context,
-    coap_resource_t *resource,
+static coap_subscription_t *coap_next_indexed_observer(
     coap_session_t *session,
-    const coap_binary_t *token
+    const coap_binary_t *token,
+    coap_subscription_t *prev
 ) {
-    coap_subscription_t *observer, *observer_tmp;
+    coap_subscription_t *observer = NULL;
 
-    // Iterate over all resource's subscribera
-    LL_FOREACH_SAFE(resource->subscribers, observer, observer_tmp) {
+    // Find the first subscription in the index
+    if (!prev) {
 
-        // Check session and token match
-        bool session_match = observer->session == session;
-        bool token_length_match = token->length == observer->token_length;
-        bool token_match = token_length_match &&
-            memcmp(token->s, observer->token, token->length) == 0;
-        
-        if (session_match && token_match) {
+        if (!session->context->observers || token->length > sizeof(prev->token))
+            return NULL;
 
-            // For a regular observer, increment the fail counter
-            if (observer->fail_cnt < COAP_OBS_MAX_FAIL)
-                observer->fail_cnt++;
-            // If fail counter exceeded the limit ...
-            else {
-                
-                // Delete observer from the resource's list
-                LL_DELETE(resource->subscribers, observer);
+        // Prepare the key
+        coap_subscription_t key;
+        memset(&key, 0, sizeof(key));
+        key.session = session;
+        key.token_length = token->length;
+        if (token->length)
+            memcpy(key.token, token->s, token->length);
 
-                // Log some stuff
-                #ifndef NDEBUG
-                
-                if (LOG_DEBUG <= coap_get_log_level()) {
-        
-                    #ifndef INET6_ADDRSTRLEN
-                    #define INET6_ADDRSTRLEN 40
-                    #endif
-                    
-                    unsigned char addr[INET6_ADDRSTRLEN + 8];
-                    if (coap_print_addr(&observer->session->remote_addr, addr, INET6_ADDRSTRLEN + 8))
-                        coap_log(LOG_DEBUG, "** removed observer %s\n", addr);
-                }
+        HASH_FIND(hh, session->context->observers, &key.session, COAP_SUBSCRIPTION_KEY_SIZE, observer);
+        return observer;
+    }
+
+    /**
+     * @note: HASH_FIND() returns the first matching element of the bucket, so the remaining
+     *    subscriptions with the same key follow it in the bucket's chain.
+     */
+    UT_hash_table *tbl = prev->hh.tbl;
+    for (UT_hash_handle *hh = prev->hh.hh_next; hh; hh = hh->hh_next) {
+        if (hh->hashv == prev->hh.hashv && memcmp(hh->key, prev->hh.key, COAP_SUBSCRIPTION_KEY_SIZE) == 0)
+            return (coap_subscription_t *) ELMT_FROM_HH(tbl, hh);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief: Unlinks @p observer from it's resource, session and context's index and frees it.
+ *    Releases the reference to the observer's session.
+ *
+ * @param observer:
+ *    subscription to be freed
+ */
+static void coap_free_observer(coap_subscription_t *observer) {
+
+    coap_session_t *session = observer->session;
+
+    // Stop subscription's timer
+    coap_timer_heap_remove(&session->context->observe_timers, observer);
+
+    // Unlink the subscription
+    DL_DELETE(observer->resource->subscribers, observer);
+    DL_DELETE2(session->subscriptions, observer, session_prev, session_next);
+    HASH_DELETE(hh, session->context->observers, observer);
 
-                #endif /* NDEBUG */
+    // Free observer's resources
+    if (observer->query)
+        coap_delete_string(observer->query);
+    coap_free(observer);
+
+    // Decrement sessions reference counter
+    coap_session_release(session);
+}
 
-                // Cancel all mesages associated with the observer
-                coap_cancel_all_messages(observer->session, observer->token, observer->token_length);
 
-                // Release observer's resources
-                coap_session_release( observer->session );
-                if (observer->query)
-                    coap_delete_string(observer->query);
-                coap_free(observer);
+/**
+ * @brief: Parses conditional attributes ('pmin', 'pmax', 'st', 'gt', 'lt') given in the
+ *    @p observer's query. Attributes with malformed values are ignored.
+ *
+ * @param observer:
+ *    subscription to be updated
+ */
+static void coap_observer_parse_attributes(coap_subscription_t *observer) {
+
+    // Clear previous attributes
+    observer->has_pmin = observer->has_pmax = 0;
+    observer->has_st = observer->has_gt = observer->has_lt = 0;
+
+    if (!observer->query)
+        return;
+
+    const uint8_t *seg = observer->query->s;
+    const uint8_t *end = observer->query->s + observer->query->length;
+
+    // Iterate over the query's segments ('name=value' pairs separated by '&')
+    while (seg < end) {
+
+        const uint8_t *seg_end = (const uint8_t *) memchr(seg, '&', end - seg);
+        if (!seg_end)
+            seg_end = end;
+        const uint8_t *eq = (const uint8_t *) memchr(seg, '=', seg_end - seg);
+
+        // Copy the value so that it could be parsed
+        char buf[16];
+        size_t name_len = eq ? (size_t)(eq - seg) : 0;
+        size_t value_len = eq ? (size_t)(seg_end - eq - 1) : 0;
+
+        if (value_len > 0 && value_len < sizeof(buf)) {
+
+            memcpy(buf, eq + 1, value_len);
+            buf[value_len] = '\0';
+
+            char *value_end;
+            float value = strtof(buf, &value_end);
+
+            // Set the attribute, if value is a valid number
+            if (*value_end == '\0') {
+                if (name_len == 4 && memcmp(seg, "pmin", 4) == 0 && value >= 0) {
+                    observer->pmin = (coap_tick_t)(value * COAP_TICKS_PER_SECOND);
+                    observer->has_pmin = 1;
+                } else if (name_len == 4 && memcmp(seg, "pmax", 4) == 0 && value > 0) {
+                    observer->pmax = (coap_tick_t)(value * COAP_TICKS_PER_SECOND);
+                    observer->has_pmax = 1;
+                } else if (name_len == 2 && memcmp(seg, "st", 2) == 0 && value > 0) {
+                    observer->st = value;
+                    observer->has_st = 1;
+                } else if (name_len == 2 && memcmp(seg, "gt", 2) == 0) {
+                    observer->gt = value;
+                    observer->has_gt = 1;
+                } else if (name_len == 2 && memcmp(seg, "lt", 2) == 0) {
+                    observer->lt = value;
+                    observer->has_lt = 1;
+                }
             }
+        }
 
-            break;
+        seg = seg_end + 1;
+    }
+
+    // Maximal period has to be greater than the minimal one
+    if (observer->has_pmin && observer->has_pmax && observer->pmax <= observer->pmin)
+        observer->has_pmax = 0;
+}
+
+
+/**
+ * @brief: Checks whether the change of the @p resource should be reported to the @p observer
+ *    now according to it's conditional attributes. If the change is held back by 'pmin', the
+ *    observer is marked as pending and it's timer is set to the end of the period.
+ *
+ * @param context:
+ *    context holding the resource
+ * @param resource:
+ *    changed resource
+ * @param observer:
+ *    observer to be checked
+ * @param now:
+ *    current time
+ * @returns:
+ *    true if the notification should be sent now
+ *    false otherwise
+ */
+static bool coap_observer_check_conditions(
+    coap_context_t *context, 
+    coap_resource_t *resource, 
+    coap_subscription_t *observer,
+    coap_tick_t now
+) {
+    // Notification has to be sent when pmax passed
+    if (observer->expired)
+        return true;
+
+    // Check whether the value changed enough since the last notification
+    if (resource->has_value && observer->has_last_value && 
+       (observer->has_st || observer->has_gt || observer->has_lt)) {
+
+        float value = resource->value;
+        float last = observer->last_value;
+        float delta = value > last ? value - last : last - value;
+
+        bool step_reached = observer->has_st && delta >= observer->st;
+        bool gt_crossed = observer->has_gt && (value > observer->gt) != (last > observer->gt);
+        bool lt_crossed = observer->has_lt && (value < observer->lt) != (last < observer->lt);
+
+        // Keep the pmax deadline (observer's timer may have just been popped)
+        if (!step_reached && !gt_crossed && !lt_crossed) {
+            coap_observer_schedule(context, observer);
+            return false;
         }
     }
+
+    // Hold the notification back until pmin passes (the latest state will be sent then)
+    if (observer->has_pmin && now < observer->last_notified + observer->pmin) {
+        observer->pending = 1;
+        coap_observer_schedule(context, observer);
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief: Sets the @p observer's timer to the end of the pmin period (if a change is pending)
+ *    or to the end of the pmax period, whichever comes first. Stops the timer if none is set.
+ *
+ * @param context:
+ *    context holding the timers' heap
+ * @param observer:
+ *    subscription to be scheduled
+ */
+static void coap_observer_schedule(coap_context_t *context, coap_subscription_t *observer) {
+
+    bool scheduled = false;
+    coap_tick_t t = 0;
+
+    // End of the minimal period
+    if (observer->pending) {
+        t = observer->last_notified + observer->pmin;
+        scheduled = true;
+    }
+
+    // End of the maximal period
+    if (observer->has_pmax && (!scheduled || observer->last_notified + observer->pmax < t)) {
+        t = observer->last_notified + observer->pmax;
+        scheduled = true;
+    }
+
+    // Stop the timer, if not needed
+    if (!scheduled) {
+        coap_timer_heap_remove(&context->observe_timers, observer);
+        return;
+    }
+
+    // Move the running timer
+    observer->timer = t;
+    if (coap_timer_heap_contains(&context->observe_timers, observer))
+        coap_timer_heap_update(&context->observe_timers, observer);
+    // Or start a new one
+    else
+        coap_timer_heap_insert(&context->observe_timers, observer);
+}
+
+
+/**
+ * @brief: Finds the @p observer's notification waiting in the session's delayqueue.
+ *
+ * @param observer:
+ *    observer to look for
+ * @returns:
+ *    delayqueue's entry holding the notification
+ *    NULL if there is no such an entry
+ */
+static coap_queue_t *coap_find_delayed_notification(coap_subscription_t *observer) {
+
+    coap_queue_t *node;
+
+    // Look for a response sent with the observer's token
+    LL_FOREACH(observer->session->delayqueue, node) {
+        if (COAP_RESPONSE_CLASS(node->pdu->code) == 2          &&
+            node->pdu->token_length == observer->token_length &&
+            memcmp(node->pdu->token, observer->token, observer->token_length) == 0)
+            return node;
+    }
+
+    return NULL;
 }
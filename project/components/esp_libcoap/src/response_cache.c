@@ -0,0 +1,254 @@
+/* ============================================================================================================
+ *  File: response_cache.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Per-resource cache of the responses to GET requests, used to answer repeated requests
+ *      without calling the resource's handler
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "encode.h"
+#include "mem.h"
+#include "option.h"
+#include "response_cache.h"
+#include "utlist.h"
+
+static void coap_response_cache_make_key(const coap_pdu_t *request, size_t pdu_size, coap_response_cache_key_t *key);
+static coap_response_cache_entry_t *coap_response_cache_lookup(coap_response_cache_t *cache, const coap_response_cache_key_t *key, const coap_string_t *query);
+static void coap_response_cache_remove(coap_response_cache_t *cache, coap_response_cache_entry_t *entry);
+static int coap_response_cache_copy(coap_pdu_t *response, const coap_pdu_t *cached, unsigned int max_age);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+int coap_response_cache_serve(
+    coap_response_cache_t *cache,
+    const coap_pdu_t *request,
+    const coap_string_t *query,
+    size_t pdu_size,
+    coap_tick_t now,
+    coap_pdu_t *response
+) {
+    if (!cache->lru)
+        return 0;
+
+    // Prepare the key
+    coap_response_cache_key_t key;
+    coap_response_cache_make_key(request, pdu_size, &key);
+
+    // Look for the entry
+    coap_response_cache_entry_t *entry = coap_response_cache_lookup(cache, &key, query);
+    if (!entry)
+        return 0;
+
+    // Drop the expired entry
+    if (entry->expires <= now) {
+        coap_response_cache_remove(cache, entry);
+        return 0;
+    }
+
+    // Mark entry as the most recently used one
+    DL_DELETE(cache->lru, entry);
+    DL_APPEND(cache->lru, entry);
+
+    // Remaining freshness (rounded down, so that the client does not keep the response longer than the cache)
+    unsigned int max_age = (unsigned int) ((entry->expires - now) / COAP_TICKS_PER_SECOND);
+
+    return coap_response_cache_copy(response, entry->response, max_age);
+}
+
+
+void coap_response_cache_store(
+    coap_response_cache_t *cache,
+    const coap_pdu_t *request,
+    const coap_string_t *query,
+    size_t pdu_size,
+    const coap_pdu_t *response,
+    coap_tick_t now
+) {
+    // Only 2.05 (Content) responses are cached
+    if (response->code != COAP_RESPONSE_CODE(205) || response->used_size > COAP_RESPONSE_CACHE_MAX_BYTES)
+        return;
+
+    // Get response's lifetime
+    unsigned int max_age = COAP_DEFAULT_MAX_AGE;
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *option = coap_check_option((coap_pdu_t *) response, COAP_OPTION_MAXAGE, &opt_iter);
+    if (option)
+        max_age = coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+    if (max_age == 0)
+        return;
+
+    // Prepare the key
+    coap_response_cache_key_t key;
+    coap_response_cache_make_key(request, pdu_size, &key);
+
+    // Replace the response cached earlier for the same request
+    coap_response_cache_entry_t *entry = coap_response_cache_lookup(cache, &key, query);
+    if (entry)
+        coap_response_cache_remove(cache, entry);
+
+    // Make room for the new entry
+    while (cache->lru && cache->num >= COAP_RESPONSE_CACHE_MAX_ENTRIES)
+        coap_response_cache_remove(cache, cache->lru);
+
+    // Allocate the entry
+    size_t query_length = query ? query->length : 0;
+    entry = (coap_response_cache_entry_t *) coap_malloc(sizeof(coap_response_cache_entry_t) + query_length);
+    if (!entry) {
+        coap_log(LOG_WARNING, "coap_response_cache_store: malloc failed\n");
+        return;
+    }
+
+    // Fill the entry
+    memset(entry, 0, sizeof(coap_response_cache_entry_t));
+    entry->key = key;
+    entry->expires = now + (coap_tick_t) max_age * COAP_TICKS_PER_SECOND;
+    entry->query_length = query_length;
+    if (query_length)
+        memcpy(entry->query, query->s, query_length);
+
+    // Copy the response
+    entry->response = coap_pdu_copy(response);
+    if (!entry->response) {
+        coap_log(LOG_WARNING, "coap_response_cache_store: cannot copy the response\n");
+        coap_free(entry);
+        return;
+    }
+
+    // Register the entry
+    DL_APPEND(cache->lru, entry);
+    cache->num++;
+}
+
+
+void coap_response_cache_clear(coap_response_cache_t *cache) {
+    while (cache->lru)
+        coap_response_cache_remove(cache, cache->lru);
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Fills the @p key with parameters of the @p request
+ */
+static void coap_response_cache_make_key(const coap_pdu_t *request, size_t pdu_size, coap_response_cache_key_t *key) {
+
+    // Clear the key (including padding) so that keys can be compared with memcmp()
+    memset(key, 0, sizeof(coap_response_cache_key_t));
+    key->accept = -1;
+    key->block2 = -1;
+    key->q_block2 = -1;
+    key->pdu_size = pdu_size;
+
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *option;
+
+    // Get the Accept option
+    option = coap_check_option((coap_pdu_t *) request, COAP_OPTION_ACCEPT, &opt_iter);
+    if (option)
+        key->accept = (int32_t) coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+
+    // Get the Block2 option
+    option = coap_check_option((coap_pdu_t *) request, COAP_OPTION_BLOCK2, &opt_iter);
+    if (option)
+        key->block2 = (int32_t) coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+
+    // Get the Q-Block2 option
+    option = coap_check_option((coap_pdu_t *) request, COAP_OPTION_Q_BLOCK2, &opt_iter);
+    if (option)
+        key->q_block2 = (int32_t) coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option));
+}
+
+
+/**
+ * @brief: Finds the entry matching the @p key and the @p query (may be NULL)
+ */
+static coap_response_cache_entry_t *coap_response_cache_lookup(
+    coap_response_cache_t *cache,
+    const coap_response_cache_key_t *key,
+    const coap_string_t *query
+) {
+    size_t query_length = query ? query->length : 0;
+
+    coap_response_cache_entry_t *entry;
+    DL_FOREACH(cache->lru, entry) {
+        if (memcmp(&entry->key, key, sizeof(coap_response_cache_key_t)) == 0 &&
+            entry->query_length == query_length &&
+            (query_length == 0 || memcmp(entry->query, query->s, query_length) == 0))
+            return entry;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief: Unlinks @p entry from the @p cache and frees it
+ */
+static void coap_response_cache_remove(coap_response_cache_t *cache, coap_response_cache_entry_t *entry) {
+
+    DL_DELETE(cache->lru, entry);
+    cache->num--;
+
+    coap_delete_pdu(entry->response);
+    coap_free(entry);
+}
+
+
+/**
+ * @brief: Copies options and payload of the @p cached response into the @p response, replacing
+ *    (or adding) the Max-Age option with the @p max_age
+ *
+ * @returns:
+ *    1 on success
+ *    0 if the @p response cannot hold the copy (it's left empty)
+ */
+static int coap_response_cache_copy(coap_pdu_t *response, const coap_pdu_t *cached, unsigned int max_age) {
+
+    // Encode the Max-Age
+    uint8_t value[4];
+    size_t length = coap_encode_var_safe(value, sizeof(value), max_age);
+
+    response->code = cached->code;
+    int ok = 1, max_age_added = 0;
+
+    // Rewrite options inserting the Max-Age in order
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init((coap_pdu_t *) cached, &opt_iter, COAP_OPT_ALL);
+    coap_opt_t *option;
+    while (ok && (option = coap_option_next(&opt_iter))) {
+        if (!max_age_added && opt_iter.type >= COAP_OPTION_MAXAGE) {
+            ok = coap_add_option(response, COAP_OPTION_MAXAGE, length, value) != 0;
+            max_age_added = 1;
+            if (opt_iter.type == COAP_OPTION_MAXAGE)
+                continue;
+        }
+        if (ok)
+            ok = coap_add_option(response, opt_iter.type, coap_opt_length(option), coap_opt_value(option)) != 0;
+    }
+    if (ok && !max_age_added)
+        ok = coap_add_option(response, COAP_OPTION_MAXAGE, length, value) != 0;
+
+    // Copy the payload
+    if (ok && cached->data)
+        ok = coap_add_data(response, cached->used_size - (cached->data - cached->token), cached->data);
+
+    // Leave the response empty on failure
+    if (!ok) {
+        response->code = 0;
+        response->used_size = response->token_length;
+        response->max_delta = 0;
+        response->data = NULL;
+    }
+
+    return ok;
+}
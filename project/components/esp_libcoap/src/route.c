@@ -0,0 +1,434 @@
+/* ============================================================================================================
+ *  File: route.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Prefix-tree router matching requests' Uri-Path options against resources registered with
+ *      templated paths and trailing wildcards
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "mem.h"
+#include "net.h"
+#include "option.h"
+#include "pdu.h"
+#include "resource.h"
+#include "route.h"
+
+static size_t coap_route_next_segment(const uint8_t *path, size_t length, size_t pos, const uint8_t **seg);
+COAP_STATIC_INLINE int coap_route_is_param(const uint8_t *seg, size_t length);
+COAP_STATIC_INLINE int coap_route_is_wildcard(const uint8_t *seg, size_t length);
+static size_t coap_route_decode(const uint8_t *seg, size_t length, uint8_t *buf);
+static coap_route_node_t *coap_route_new_node(const uint8_t *seg, size_t length);
+static void coap_route_free_node(coap_route_node_t *node);
+static coap_resource_t *coap_route_match(
+    coap_route_node_t *node, const coap_str_const_t *segs, size_t num, size_t pos, coap_route_match_t *match);
+
+
+/* ------------------------------------------- [Macrofeinitions] ---------------------------------------------- */
+
+/**
+ * @brief: Calculates decimal value from hexadecimal ASCII character
+ */
+#define hexchar_to_dec(c) ((c) & 0x40 ? ((c) & 0x0F) + 9 : ((c) & 0x0F))
+
+
+/* ---------------------------------------- [Global and static data] ------------------------------------------ */
+
+// Segments captured for the job run by the current worker thread (NULL in other threads)
+static __thread const coap_route_match_t *coap_route_thread_match = NULL;
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+int coap_route_is_template(const coap_str_const_t *uri_path){
+
+    const uint8_t *seg;
+    size_t pos = 0, seg_len;
+
+    // Look for templated segments and the trailing wildcard
+    while (pos <= uri_path->length) {
+        seg_len = coap_route_next_segment(uri_path->s, uri_path->length, pos, &seg);
+        pos += seg_len + 1;
+        if (coap_route_is_param(seg, seg_len))
+            return 1;
+        if (pos > uri_path->length && coap_route_is_wildcard(seg, seg_len))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+int coap_route_add(coap_context_t *context, coap_resource_t *resource){
+
+    const coap_str_const_t *uri_path = resource->uri_path;
+
+    // Create the root node
+    if (!context->routes && !(context->routes = coap_route_new_node(NULL, 0)))
+        return 0;
+
+    coap_route_node_t *node = context->routes;
+    const uint8_t *seg;
+    size_t pos = 0, seg_len;
+
+    // Walk the path creating missing nodes
+    while (pos <= uri_path->length) {
+
+        seg_len = coap_route_next_segment(uri_path->s, uri_path->length, pos, &seg);
+        pos += seg_len + 1;
+
+        // The trailing wildcard is kept by the last node of the path
+        if (pos > uri_path->length && coap_route_is_wildcard(seg, seg_len)) {
+            if (node->wildcard && node->wildcard != resource)
+                coap_log(LOG_WARNING, "coap_route_add: route '%*.*s' replaced\n",
+                    (int)uri_path->length, (int)uri_path->length, uri_path->s);
+            node->wildcard = resource;
+            return 1;
+        }
+
+        // Templated segment
+        if (coap_route_is_param(seg, seg_len)) {
+            if (!node->param && !(node->param = coap_route_new_node(NULL, 0)))
+                return 0;
+            node = node->param;
+        }
+        // Literal segment
+        else {
+
+            // Decode the segment
+            uint8_t buf[seg_len ? seg_len : 1];
+            size_t len = coap_route_decode(seg, seg_len, buf);
+
+            // Find the matching child
+            coap_route_node_t *child;
+            for (child = node->children; child; child = child->next)
+                if (child->length == len && memcmp(child->segment, buf, len) == 0)
+                    break;
+
+            // Create the child if not present
+            if (!child) {
+                if (!(child = coap_route_new_node(buf, len)))
+                    return 0;
+                child->next = node->children;
+                node->children = child;
+            }
+            node = child;
+        }
+    }
+
+    if (node->resource && node->resource != resource)
+        coap_log(LOG_WARNING, "coap_route_add: route '%*.*s' replaced\n",
+            (int)uri_path->length, (int)uri_path->length, uri_path->s);
+    node->resource = resource;
+
+    return 1;
+}
+
+
+void coap_route_delete(coap_context_t *context, coap_resource_t *resource){
+
+    coap_route_node_t *node = context->routes;
+    if (!node)
+        return;
+
+    const coap_str_const_t *uri_path = resource->uri_path;
+    const uint8_t *seg;
+    size_t pos = 0, seg_len;
+
+    // Walk the path
+    while (node && pos <= uri_path->length) {
+
+        seg_len = coap_route_next_segment(uri_path->s, uri_path->length, pos, &seg);
+        pos += seg_len + 1;
+
+        // Detach resource registered with the trailing wildcard
+        if (pos > uri_path->length && coap_route_is_wildcard(seg, seg_len)) {
+            if (node->wildcard == resource)
+                node->wildcard = NULL;
+            return;
+        }
+
+        // Templated segment
+        if (coap_route_is_param(seg, seg_len))
+            node = node->param;
+        // Literal segment
+        else {
+            uint8_t buf[seg_len ? seg_len : 1];
+            size_t len = coap_route_decode(seg, seg_len, buf);
+            for (node = node->children; node; node = node->next)
+                if (node->length == len && memcmp(node->segment, buf, len) == 0)
+                    break;
+        }
+    }
+
+    // Detach the resource
+    if (node && node->resource == resource)
+        node->resource = NULL;
+}
+
+
+void coap_route_delete_all(coap_context_t *context){
+
+    coap_route_free_node(context->routes);
+    context->routes = NULL;
+}
+
+
+coap_resource_t *coap_route_find(coap_context_t *context, const coap_pdu_t *request){
+    return coap_route_find_match(context, request, &context->route_match);
+}
+
+
+coap_resource_t *coap_route_find_match(
+    coap_context_t *context,
+    const coap_pdu_t *request,
+    coap_route_match_t *match
+){
+    match->num_captures = 0;
+    match->wildcard_start = 0;
+
+    if (!context->routes)
+        return NULL;
+
+    // Create filtering options iterator
+    coap_opt_filter_t filter;
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_URI_PATH);
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, filter);
+
+    // Collect request's segments (they point into the request)
+    coap_str_const_t segs[COAP_ROUTE_MAX_DEPTH];
+    size_t num = 0;
+    coap_opt_t *opt;
+    while ((opt = coap_option_next(&opt_iter))) {
+        if (num == COAP_ROUTE_MAX_DEPTH)
+            return NULL;
+        segs[num].s = coap_opt_value(opt);
+        segs[num].length = coap_opt_length(opt);
+        num++;
+    }
+
+    /**
+     * @note: The request with no Uri-Path options addresses the empty path, which
+     *    is represented by a single empty segment
+     */
+    if (num == 0) {
+        segs[0].s = (const uint8_t *) "";
+        segs[0].length = 0;
+        num = 1;
+    }
+
+    // Match segments against the tree
+    coap_resource_t *resource = coap_route_match(context->routes, segs, num, 0, match);
+    if (!resource)
+        match->num_captures = 0;
+
+    return resource;
+}
+
+
+const coap_route_match_t *coap_route_get_match(const coap_context_t *context){
+
+    // Handler run by the worker thread reads segments captured for its job
+    if (coap_route_thread_match)
+        return coap_route_thread_match;
+
+    return &context->route_match;
+}
+
+
+void coap_route_set_thread_match(const coap_route_match_t *match){
+    coap_route_thread_match = match;
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Finds segment of the @p path starting at @p pos
+ *
+ * @param path:
+ *    path to be split
+ * @param length:
+ *    length of the @p path
+ * @param pos:
+ *    position of the segment's first character
+ * @param seg [out]:
+ *    beginning of the segment
+ * @returns:
+ *    length of the segment
+ */
+static size_t coap_route_next_segment(const uint8_t *path, size_t length, size_t pos, const uint8_t **seg){
+
+    *seg = path + pos;
+
+    size_t end = pos;
+    while (end < length && path[end] != '/')
+        end++;
+
+    return end - pos;
+}
+
+
+/**
+ * @returns:
+ *    1 if the segment is a template's parameter ('{name}'), 0 otherwise
+ */
+COAP_STATIC_INLINE int coap_route_is_param(const uint8_t *seg, size_t length){
+    return length >= 2 && seg[0] == '{' && seg[length - 1] == '}';
+}
+
+
+/**
+ * @returns:
+ *    1 if the segment is a wildcard ('*'), 0 otherwise
+ */
+COAP_STATIC_INLINE int coap_route_is_wildcard(const uint8_t *seg, size_t length){
+    return length == 1 && seg[0] == '*';
+}
+
+
+/**
+ * @brief: Decodes percent-encoded characters of the @p seg into @p buf, so that literal segments
+ *    can be compared directly with the values of the Uri-Path options.
+ *
+ * @param seg:
+ *    segment to decode
+ * @param length:
+ *    length of the @p seg
+ * @param buf [out]:
+ *    buffer of at least @p length bytes
+ * @returns:
+ *    length of the decoded segment
+ */
+static size_t coap_route_decode(const uint8_t *seg, size_t length, uint8_t *buf){
+
+    size_t len = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (seg[i] == '%' && i + 2 < length) {
+            buf[len++] = (hexchar_to_dec(seg[i + 1]) << 4) + hexchar_to_dec(seg[i + 2]);
+            i += 2;
+        }
+        else
+            buf[len++] = seg[i];
+    }
+
+    return len;
+}
+
+
+/**
+ * @brief: Allocates a new node of the tree
+ *
+ * @param seg:
+ *    node's literal segment (may be NULL)
+ * @param length:
+ *    length of the @p seg
+ * @returns:
+ *    new node on success
+ *    NULL on failure
+ */
+static coap_route_node_t *coap_route_new_node(const uint8_t *seg, size_t length){
+
+    coap_route_node_t *node =
+        (coap_route_node_t *) coap_malloc(sizeof(coap_route_node_t) + length);
+    if (!node) {
+        coap_log(LOG_WARNING, "coap_route_new_node: malloc failed\n");
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(coap_route_node_t));
+    node->length = length;
+    if (length)
+        memcpy(node->segment, seg, length);
+
+    return node;
+}
+
+
+/**
+ * @brief: Recursively frees the @p node and it's subtree
+ */
+static void coap_route_free_node(coap_route_node_t *node){
+
+    while (node) {
+        coap_route_node_t *next = node->next;
+        coap_route_free_node(node->children);
+        coap_route_free_node(node->param);
+        coap_free(node);
+        node = next;
+    }
+}
+
+
+/**
+ * @brief: Matches segments starting at @p pos against the subtree of the @p node. Literal
+ *    children are tried first, then the templated one and finally the wildcard.
+ *
+ * @param node:
+ *    root of the subtree
+ * @param segs:
+ *    request's segments
+ * @param num:
+ *    number of the @p segs
+ * @param pos:
+ *    index of the first segment to match
+ * @param match [out]:
+ *    captured segments
+ * @returns:
+ *    matching resource on success
+ *    NULL if no route matches
+ */
+static coap_resource_t *coap_route_match(
+    coap_route_node_t *node,
+    const coap_str_const_t *segs,
+    size_t num,
+    size_t pos,
+    coap_route_match_t *match
+){
+    coap_resource_t *resource;
+
+    // All segments were matched
+    if (pos == num) {
+        match->wildcard_start = match->num_captures;
+        if (node->resource)
+            return node->resource;
+        return node->wildcard;
+    }
+
+    // Try the literal child
+    for (coap_route_node_t *child = node->children; child; child = child->next) {
+        if (child->length == segs[pos].length && memcmp(child->segment, segs[pos].s, child->length) == 0) {
+            if ((resource = coap_route_match(child, segs, num, pos + 1, match)))
+                return resource;
+            break;
+        }
+    }
+
+    // Try the templated child
+    if (node->param) {
+        match->captures[match->num_captures++] = segs[pos];
+        if ((resource = coap_route_match(node->param, segs, num, pos + 1, match)))
+            return resource;
+        match->num_captures--;
+    }
+
+    // Try the wildcard (it captures all remaining segments)
+    if (node->wildcard) {
+        match->wildcard_start = match->num_captures;
+        while (pos < num)
+            match->captures[match->num_captures++] = segs[pos++];
+        return node->wildcard;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,258 @@
+/* ============================================================================================================
+ *  File: shard.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Sharded server mode. Each of N threads owns a full context whose UDP endpoint is bound to the
+ *      same port with SO_REUSEPORT, so that the system spreads clients between shards. Contexts are
+ *      not synchronized - only notifications of the resources' changes are passed between threads.
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "shard.h"
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "coap_session.h"
+#include "mem.h"
+#include "net.h"
+#include "resource.h"
+
+static int coap_shard_init(coap_shard_t *shard, const coap_address_t *listen_addr, coap_shard_setup_t setup, void *arg);
+static void coap_shard_free(coap_shard_t *shard);
+static void *coap_shard_run(void *arg);
+static void coap_shard_deliver(coap_shard_t *shard);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+coap_shard_group_t *coap_shards_start(
+    const coap_address_t *listen_addr,
+    unsigned int num_shards,
+    coap_shard_setup_t setup,
+    void *arg
+) {
+    if (num_shards == 0 || num_shards > COAP_SHARDS_MAX) {
+        coap_log(LOG_WARNING, "coap_shards_start: invalid number of shards (%u)\n", num_shards);
+        return NULL;
+    }
+
+    // Allocate the group
+    coap_shard_group_t *group = (coap_shard_group_t *) coap_malloc(sizeof(coap_shard_group_t));
+    if (!group) {
+        coap_log(LOG_WARNING, "coap_shards_start: malloc failed\n");
+        return NULL;
+    }
+    memset(group, 0, sizeof(coap_shard_group_t));
+
+    // Contexts of all shards allocate from the heap (pools are sized for a single context)
+    coap_memory_set_shared();
+
+    // Create shards' contexts
+    coap_address_t addr = *listen_addr;
+    for (unsigned int i = 0; i < num_shards; i++) {
+
+        group->shards[i].group = group;
+        if (!coap_shard_init(&group->shards[i], &addr, setup, arg))
+            goto error;
+        group->num_shards++;
+
+        // Remaining shards share the port bound by the first one
+        addr = group->shards[0].context->endpoint->bind_addr;
+    }
+
+    // Start threads
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+        if (pthread_create(&group->shards[i].thread, NULL, coap_shard_run, &group->shards[i]) != 0) {
+            coap_log(LOG_WARNING, "coap_shards_start: cannot start the shard's thread\n");
+            goto error;
+        }
+        group->shards[i].started = 1;
+    }
+
+    coap_log(LOG_DEBUG, "coap_shards_start: %u shard(s) started\n", group->num_shards);
+
+    return group;
+
+error:
+    coap_shards_stop(group);
+    return NULL;
+}
+
+
+void coap_shards_stop(coap_shard_group_t *group) {
+
+    if (!group)
+        return;
+
+    // Wake all threads up and wait for them to finish
+    __atomic_store_n(&group->stop, 1, __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+        if (group->shards[i].started) {
+            coap_socket_wakeup(&group->shards[i].wakeup);
+            pthread_join(group->shards[i].thread, NULL);
+        }
+    }
+
+    // Free shards' contexts
+    for (unsigned int i = 0; i < group->num_shards; i++)
+        coap_shard_free(&group->shards[i]);
+
+    coap_free(group);
+}
+
+
+int coap_shards_notify(coap_shard_group_t *group, const coap_str_const_t *uri_path) {
+
+    int ret = 1;
+
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+
+        coap_shard_t *shard = &group->shards[i];
+
+        // Copy the path
+        coap_shard_notify_t *notify =
+            (coap_shard_notify_t *) coap_malloc(sizeof(coap_shard_notify_t) + uri_path->length);
+        if (!notify) {
+            coap_log(LOG_WARNING, "coap_shards_notify: malloc failed\n");
+            ret = 0;
+            continue;
+        }
+        notify->length = uri_path->length;
+        memcpy(notify->uri_path, uri_path->s, uri_path->length);
+
+        // Push the change onto the shard's stack
+        coap_shard_notify_t *head = __atomic_load_n(&shard->notifications, __ATOMIC_RELAXED);
+        do
+            notify->next = head;
+        while (!__atomic_compare_exchange_n(&shard->notifications, &head, notify, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+        // Wake the shard up, unless it has been already woken up
+        if (!head)
+            coap_socket_wakeup(&shard->wakeup);
+    }
+
+    return ret;
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Creates the @p shard's context with the UDP endpoint bound to the @p listen_addr
+ *    (with SO_REUSEPORT) and registers resources with the @p setup
+ *
+ * @returns:
+ *    1 on success
+ *    0 on failure (nothing is left allocated)
+ */
+static int coap_shard_init(
+    coap_shard_t *shard,
+    const coap_address_t *listen_addr,
+    coap_shard_setup_t setup,
+    void *arg
+) {
+    shard->wakeup.fd = COAP_INVALID_SOCKET;
+
+    // Create the context
+    shard->context = coap_new_context(NULL);
+    if (!shard->context)
+        return 0;
+    shard->context->reuse_port = 1;
+
+    // Bind the endpoint
+    if (!coap_new_endpoint(shard->context, listen_addr))
+        goto error;
+
+    // Let the shard's loop be woken up by other threads
+    if (!coap_socket_wakeup_open(&shard->wakeup))
+        goto error;
+    if (!coap_socket_register(shard->context, &shard->wakeup))
+        goto error;
+
+    // Register resources
+    if (setup && !setup(shard->context, arg)) {
+        coap_log(LOG_WARNING, "coap_shard_init: cannot set up the shard's resources\n");
+        goto error;
+    }
+
+    return 1;
+
+error:
+    coap_shard_free(shard);
+    return 0;
+}
+
+
+/**
+ * @brief: Frees the @p shard's context along with changes that have not been delivered
+ */
+static void coap_shard_free(coap_shard_t *shard) {
+
+    // Drop undelivered changes
+    coap_shard_notify_t *notify, *next;
+    for (notify = shard->notifications; notify; notify = next) {
+        next = notify->next;
+        coap_free(notify);
+    }
+    shard->notifications = NULL;
+
+    // Close the wake-up socket
+    coap_socket_unregister(shard->context, &shard->wakeup);
+    coap_socket_close(&shard->wakeup);
+
+    coap_free_context(shard->context);
+    shard->context = NULL;
+}
+
+
+/**
+ * @brief: Shard thread's routine. Runs the context's loop until the group is stopped.
+ */
+static void *coap_shard_run(void *arg) {
+
+    coap_shard_t *shard = (coap_shard_t *) arg;
+
+    while (!__atomic_load_n(&shard->group->stop, __ATOMIC_ACQUIRE)) {
+
+        if (coap_run_once(shard->context, COAP_SHARD_WAIT_TIME) < 0) {
+            coap_log(LOG_WARNING, "coap_shard_run: shard's loop failed\n");
+            break;
+        }
+
+        // Mark changed resources
+        coap_shard_deliver(shard);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief: Marks resources changed by other threads, so that their observers are notified by
+ *    the next coap_run_once()
+ */
+static void coap_shard_deliver(coap_shard_t *shard) {
+
+    // Drain the wake-up socket
+    coap_socket_wakeup_drain(&shard->wakeup);
+
+    // Take all changes
+    coap_shard_notify_t *notify = __atomic_exchange_n(&shard->notifications, NULL, __ATOMIC_ACQUIRE);
+
+    coap_shard_notify_t *next;
+    for (; notify; notify = next) {
+        next = notify->next;
+
+        // Notify resource's observers (if the resource is registered in the shard)
+        coap_str_const_t uri_path = { notify->length, notify->uri_path };
+        coap_resource_t *resource = coap_get_resource_from_uri_path(shard->context, &uri_path);
+        if (resource)
+            coap_resource_notify_observers(resource, NULL);
+
+        coap_free(notify);
+    }
+}
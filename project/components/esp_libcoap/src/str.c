@@ -62,6 +62,26 @@ coap_string_t *coap_new_string(size_t size) {
 }
 
 
+coap_string_t *coap_arena_new_string(coap_arena_t *arena, size_t size) {
+
+    // Alloc mememory for a new string structure and the string itself from the arena
+    coap_string_t *s = (coap_string_t *)coap_arena_alloc(arena, sizeof(coap_string_t) + size + 1);
+    if ( !s ) {
+      #ifndef NDEBUG
+          coap_log(LOG_CRIT, "coap_arena_new_string: alloc\n");
+      #endif
+      return NULL;
+    }
+
+    // Initialize string structure and a string itself as an empty one
+    memset(s, 0, sizeof(coap_string_t));
+    s->s = ((unsigned char *)s) + sizeof(coap_string_t);
+    s->s[size] = '\000';
+    
+    return s;
+}
+
+
 void coap_delete_string(coap_string_t *s) {
     coap_free(s);
 }
@@ -0,0 +1,162 @@
+/* ============================================================================================================
+ *  File: timer_heap.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Binary min-heap of timers ordered by their absolute expiration time
+ *
+ * ============================================================================================================ */
+
+
+#include <stdlib.h>
+
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "timer_heap.h"
+
+static void coap_timer_heap_sift_up(coap_timer_heap_t *heap, size_t pos);
+static void coap_timer_heap_sift_down(coap_timer_heap_t *heap, size_t pos);
+
+
+/* ------------------------------------------- [Macrodefinitions] --------------------------------------------- */
+
+/**
+ * @brief: Accessors of the @p item's expiration time and position in the @p heap
+ */
+#define ITEM_TIME(heap, item)  (*(coap_tick_t *) ((char *) (item) + (heap)->time_offset))
+#define ITEM_INDEX(heap, item) (*(size_t *) ((char *) (item) + (heap)->index_offset))
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+void coap_timer_heap_init(coap_timer_heap_t *heap, size_t time_offset, size_t index_offset) {
+    heap->items = NULL;
+    heap->len = 0;
+    heap->size = 0;
+    heap->time_offset = time_offset;
+    heap->index_offset = index_offset;
+}
+
+
+void coap_timer_heap_free(coap_timer_heap_t *heap) {
+    free(heap->items);
+    heap->items = NULL;
+    heap->len = 0;
+    heap->size = 0;
+}
+
+
+int coap_timer_heap_insert(coap_timer_heap_t *heap, void *item) {
+
+    // Expand the heap's storage if it's full
+    if (heap->len == heap->size) {
+
+        size_t new_size = heap->size ? 2 * heap->size : COAP_TIMER_HEAP_INITIAL_SIZE;
+
+        void **new_items = (void **) realloc(heap->items, new_size * sizeof(void *));
+        if (new_items == NULL) {
+            coap_log(LOG_WARNING, "coap_timer_heap_insert: realloc failed\n");
+            return 0;
+        }
+
+        heap->items = new_items;
+        heap->size = new_size;
+    }
+
+    // Put the item at the end of the heap and restore the heap's order
+    heap->items[heap->len++] = item;
+    ITEM_INDEX(heap, item) = heap->len;
+    coap_timer_heap_sift_up(heap, heap->len - 1);
+
+    return 1;
+}
+
+
+void coap_timer_heap_remove(coap_timer_heap_t *heap, void *item) {
+
+    if (ITEM_INDEX(heap, item) == 0)
+        return;
+
+    // Move the last item of the heap into the freed position
+    size_t pos = ITEM_INDEX(heap, item) - 1;
+    void *last = heap->items[--heap->len];
+    ITEM_INDEX(heap, item) = 0;
+
+    // If it was not the removed item itself, restore the heap's order
+    if (last != item) {
+        heap->items[pos] = last;
+        ITEM_INDEX(heap, last) = pos + 1;
+        coap_timer_heap_sift_up(heap, pos);
+        coap_timer_heap_sift_down(heap, ITEM_INDEX(heap, last) - 1);
+    }
+}
+
+
+void coap_timer_heap_update(coap_timer_heap_t *heap, void *item) {
+
+    if (ITEM_INDEX(heap, item) == 0)
+        return;
+
+    // Item may need to move in either direction
+    coap_timer_heap_sift_up(heap, ITEM_INDEX(heap, item) - 1);
+    coap_timer_heap_sift_down(heap, ITEM_INDEX(heap, item) - 1);
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Moves item at the @p pos position of the @p heap towards the heap's root until it's
+ *    parent does not expire later than the item.
+ */
+static void coap_timer_heap_sift_up(coap_timer_heap_t *heap, size_t pos) {
+
+    void **items = heap->items;
+    void *item = items[pos];
+
+    // Move parents expiring later than the item one level down
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (ITEM_TIME(heap, items[parent]) <= ITEM_TIME(heap, item))
+            break;
+        items[pos] = items[parent];
+        ITEM_INDEX(heap, items[pos]) = pos + 1;
+        pos = parent;
+    }
+
+    // Put the item in the freed position
+    items[pos] = item;
+    ITEM_INDEX(heap, item) = pos + 1;
+}
+
+
+/**
+ * @brief: Moves item at the @p pos position of the @p heap towards the heap's leaves until
+ *    none of it's children expires earlier than the item.
+ */
+static void coap_timer_heap_sift_down(coap_timer_heap_t *heap, size_t pos) {
+
+    void **items = heap->items;
+    size_t len = heap->len;
+    void *item = items[pos];
+
+    // Move children expiring earlier than the item one level up
+    while (2 * pos + 1 < len) {
+
+        // Choose the earlier child
+        size_t child = 2 * pos + 1;
+        if (child + 1 < len && ITEM_TIME(heap, items[child + 1]) < ITEM_TIME(heap, items[child]))
+            child++;
+
+        if (ITEM_TIME(heap, item) <= ITEM_TIME(heap, items[child]))
+            break;
+        items[pos] = items[child];
+        ITEM_INDEX(heap, items[pos]) = pos + 1;
+        pos = child;
+    }
+
+    // Put the item in the freed position
+    items[pos] = item;
+    ITEM_INDEX(heap, item) = pos + 1;
+}
@@ -58,7 +58,8 @@ COAP_STATIC_INLINE int dots(const uint8_t *seg, size_t len);
 static size_t coap_split_path_impl(const uint8_t *str, size_t length, segment_handler_t handler, void *data);
 COAP_STATIC_INLINE int is_unescaped_in_path(const uint8_t c);
 COAP_STATIC_INLINE int is_unescaped_in_query(const uint8_t c);
-static coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_type);
+static coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_type, coap_arena_t *arena);
+COAP_STATIC_INLINE size_t coap_encode_seg_char(uint8_t c, uint8_t *out);
 
 
 /* -------------------------------------------- [Macrofeinitions] --------------------------------------------- */
@@ -398,12 +399,115 @@ coap_uri_t *coap_clone_uri(const coap_uri_t *uri){
 
 
 coap_string_t *coap_get_query(const coap_pdu_t *request) {
-    return coap_get_seg_impl(request, COAP_OPTION_URI_QUERY);
+    return coap_get_seg_impl(request, COAP_OPTION_URI_QUERY, NULL);
 }
 
 
 coap_string_t *coap_get_uri_path(const coap_pdu_t *request) {
-    return coap_get_seg_impl(request, COAP_OPTION_URI_PATH);
+    return coap_get_seg_impl(request, COAP_OPTION_URI_PATH, NULL);
+}
+
+
+coap_string_t *coap_get_query_arena(const coap_pdu_t *request, coap_arena_t *arena) {
+    return coap_get_seg_impl(request, COAP_OPTION_URI_QUERY, arena);
+}
+
+
+coap_string_t *coap_get_uri_path_arena(const coap_pdu_t *request, coap_arena_t *arena) {
+    return coap_get_seg_impl(request, COAP_OPTION_URI_PATH, arena);
+}
+
+
+unsigned coap_uri_path_hash(const uint8_t *s, size_t length) {
+
+    unsigned hash = COAP_URI_PATH_HASH_INIT;
+    for (size_t i = 0; i < length; i++)
+        hash = coap_uri_path_hash_byte(hash, s[i]);
+
+    return hash;
+}
+
+
+unsigned coap_request_uri_path_hash(const coap_pdu_t *request, size_t *length) {
+
+    // Create filtering options iterator
+    coap_opt_filter_t filter;
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_URI_PATH);
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, filter);
+
+    unsigned hash = COAP_URI_PATH_HASH_INIT;
+    size_t len = 0;
+    int first = 1;
+    
+    // Feed the hash with the path encoded on the fly (the same way as coap_get_uri_path() does)
+    coap_opt_t *opt;
+    while ((opt = coap_option_next(&opt_iter))) {
+
+        // Put a '/' between subsequent segments
+        if (!first) {
+            hash = coap_uri_path_hash_byte(hash, '/');
+            len++;
+        }
+        first = 0;
+
+        // Get option's value and length
+        uint16_t seg_len = coap_opt_length(opt);
+        const uint8_t *seg = coap_opt_value(opt);
+
+        // Encode and hash subsequent characters of the segment
+        for (uint16_t i = 0; i < seg_len; i++) {
+            uint8_t enc[3];
+            size_t enc_len = coap_encode_seg_char(seg[i], enc);
+            for (size_t j = 0; j < enc_len; j++)
+                hash = coap_uri_path_hash_byte(hash, enc[j]);
+            len += enc_len;
+        }
+    }
+
+    *length = len;
+    return hash;
+}
+
+
+int coap_request_uri_path_equal(const coap_pdu_t *request, const coap_str_const_t *path) {
+
+    // Create filtering options iterator
+    coap_opt_filter_t filter;
+    coap_option_filter_clear(filter);
+    coap_option_filter_set(filter, COAP_OPTION_URI_PATH);
+    coap_opt_iterator_t opt_iter;
+    coap_option_iterator_init(request, &opt_iter, filter);
+
+    // Position in the @p path
+    size_t pos = 0;
+    int first = 1;
+
+    // Compare the path encoded on the fly with the @p path
+    coap_opt_t *opt;
+    while ((opt = coap_option_next(&opt_iter))) {
+
+        // Compare a '/' between subsequent segments
+        if (!first && (pos >= path->length || path->s[pos++] != '/'))
+            return 0;
+        first = 0;
+
+        // Get option's value and length
+        uint16_t seg_len = coap_opt_length(opt);
+        const uint8_t *seg = coap_opt_value(opt);
+
+        // Encode and compare subsequent characters of the segment
+        for (uint16_t i = 0; i < seg_len; i++) {
+            uint8_t enc[3];
+            size_t enc_len = coap_encode_seg_char(seg[i], enc);
+            if (enc_len > path->length - pos || memcmp(path->s + pos, enc, enc_len) != 0)
+                return 0;
+            pos += enc_len;
+        }
+    }
+
+    return pos == path->length;
 }
 
 
@@ -680,6 +784,35 @@ is_unescaped_in_query(const uint8_t c) {
     return is_unescaped_in_path(c) || c == '/' || c == '?';
 }
 
+/**
+ * @brief: Encodes a single character of the Uri-Path / Uri-Query segment the same way
+ *    coap_get_seg_impl() does.
+ * 
+ * @param c:
+ *    character to be encoded
+ * @param out [out]:
+ *    buffer of at least 3 bytes that the encoded character is written to
+ * @returns:
+ *    number of bytes written to the @p out (1 or 3)
+ */
+COAP_STATIC_INLINE size_t coap_encode_seg_char(uint8_t c, uint8_t *out){
+
+    static const uint8_t hex[] = "0123456789ABCDEF";
+
+    // Unescaped characters are encoded directly
+    if (is_unescaped_in_query(c)) {
+        out[0] = c;
+        return 1;
+    }
+
+    // Escaped characters are encoded in 3-bytes '%' notation
+    out[0] = '%';
+    out[1] = hex[c >> 4];
+    out[2] = hex[c & 0x0F];
+    return 3;
+}
+
+
 /**
  * @brief: Extracts query / path string from request PDU according to the rules
  *    in RFC 8252: Chapter 6.5. It function is an internal implementation of
@@ -690,14 +823,14 @@ is_unescaped_in_query(const uint8_t c) {
  * @param filter_type:
  *      options filter type used to parse segments; either COAP_OPTION_URI_QUERY
  *      or COAP_OPTION_URI_PATH
+ * @param arena:
+ *      arena to allocate the string from (NULL if string should be allocated on the heap)
  * @returns:
  *    reconstructed and escaped query / path string
  * 
  */
 static
-coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_type){
-
-    static const uint8_t hex[] = "0123456789ABCDEF";
+coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_type, coap_arena_t *arena){
 
     // Create an option filter for Uri-Query options
     coap_opt_filter_t filter;
@@ -743,7 +876,8 @@ coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_
     if (length > 0 || filter_type == COAP_OPTION_URI_PATH) {
 
         // Allocate a new string for the whole query
-        if ((string = coap_new_string(length))) {
+        string = arena ? coap_arena_new_string(arena, length) : coap_new_string(length);
+        if (string) {
 
             // Initialize the string
             string->length = length;
@@ -766,18 +900,8 @@ coap_string_t *coap_get_seg_impl(const coap_pdu_t *request, unsigned int filter_
                 const uint8_t *seg= coap_opt_value(opt_tmp);
 
                 // Iterate over the query's segment to encode it into the final string
-                for (unsigned i = 0; i < seg_len; i++) {
-
-                    // Unescaped characters are encoded directly
-                    if (is_unescaped_in_query(seg[i]))
-                        *segment_str++ = seg[i];
-                    // Escaped characters are encoded in 3-bytes '%' notation
-                    else {
-                        *segment_str++ = '%';
-                        *segment_str++ = hex[seg[i] >> 4];
-                        *segment_str++ = hex[seg[i] & 0x0F];
-                    }
-                }
+                for (unsigned i = 0; i < seg_len; i++)
+                    segment_str += coap_encode_seg_char(seg[i], segment_str);
             }
         }
     }
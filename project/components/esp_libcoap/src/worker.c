@@ -0,0 +1,312 @@
+/* ============================================================================================================
+ *  File: worker.c
+ *  Author: Krzysztof Pierczyk
+ *  License: BSD
+ *  Description:
+ *
+ *      Pool of worker threads that run handlers of resources created with COAP_RESOURCE_FLAGS_WORKER.
+ *      Requests are answered with separate responses (@see async.h) that workers pass back to the
+ *      dispatch loop through a lock-free queue. The loop remains the only thread touching sessions
+ *      and sockets.
+ *
+ * ============================================================================================================ */
+
+
+#include <string.h>
+
+#include "worker.h"
+#include "coap_config.h"
+#include "coap_debug.h"
+#include "mem.h"
+#include "net.h"
+#include "route.h"
+
+static void *coap_worker_run(void *arg);
+static void coap_worker_push(coap_worker_pool_t *pool, coap_worker_job_t *job);
+static void coap_worker_drop(coap_worker_job_t *job);
+
+
+/* ----------------------------------------------- [Functions] ------------------------------------------------ */
+
+int coap_workers_start(coap_context_t *context, unsigned int num_workers) {
+
+    if (context->workers) {
+        coap_log(LOG_WARNING, "coap_workers_start: workers already started\n");
+        return 0;
+    }
+
+    if (num_workers == 0 || num_workers > COAP_WORKERS_MAX) {
+        coap_log(LOG_WARNING, "coap_workers_start: invalid number of workers (%u)\n", num_workers);
+        return 0;
+    }
+
+    // Allocate the pool
+    coap_worker_pool_t *pool = (coap_worker_pool_t *) coap_malloc(sizeof(coap_worker_pool_t));
+    if (!pool) {
+        coap_log(LOG_WARNING, "coap_workers_start: malloc failed\n");
+        return 0;
+    }
+    memset(pool, 0, sizeof(coap_worker_pool_t));
+    pool->wakeup.fd = COAP_INVALID_SOCKET;
+
+    // Handlers run by workers allocate from the heap, as the loop does from now on
+    coap_memory_set_shared();
+
+    // Open the wake-up socket
+    if (!coap_socket_wakeup_open(&pool->wakeup)) {
+        coap_free(pool);
+        return 0;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    context->workers = pool;
+
+    // Let the loop wait for the completed jobs
+    if (!coap_socket_register(context, &pool->wakeup)) {
+        coap_workers_stop(context);
+        return 0;
+    }
+
+    // Start threads
+    for (unsigned int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, coap_worker_run, pool) != 0) {
+            coap_log(LOG_WARNING, "coap_workers_start: cannot start the worker thread\n");
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    // Pool without threads would never complete jobs
+    if (pool->num_threads == 0) {
+        coap_workers_stop(context);
+        return 0;
+    }
+
+    coap_log(LOG_DEBUG, "coap_workers_start: %u worker(s) started\n", pool->num_threads);
+
+    return 1;
+}
+
+
+void coap_workers_stop(coap_context_t *context) {
+
+    coap_worker_pool_t *pool = context->workers;
+    if (!pool)
+        return;
+
+    // Wake all threads up and wait for them to finish (jobs in progress are completed)
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    // Drop jobs that have not been started ...
+    coap_worker_job_t *job, *next;
+    for (job = pool->submitted; job; job = next) {
+        next = job->next;
+        coap_worker_drop(job);
+    }
+
+    // ... and jobs that have not been sent
+    for (job = pool->completed; job; job = next) {
+        next = job->next;
+        coap_worker_drop(job);
+    }
+
+    // Close the wake-up socket
+    coap_socket_unregister(context, &pool->wakeup);
+    coap_socket_close(&pool->wakeup);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    coap_free(pool);
+    context->workers = NULL;
+}
+
+
+int coap_workers_submit(
+    coap_session_t *session,
+    coap_resource_t *resource,
+    coap_method_handler_t handler,
+    coap_pdu_t *request,
+    const coap_string_t *query
+) {
+    coap_worker_pool_t *pool = session->context->workers;
+    if (!pool)
+        return 0;
+
+    // Register the request for the separate response
+    coap_async_state_t *async = coap_register_async(session, request, NULL);
+    if (!async)
+        return 0;
+
+    // Allocate the job
+    coap_worker_job_t *job = (coap_worker_job_t *) coap_malloc(sizeof(coap_worker_job_t));
+    if (!job) {
+        coap_log(LOG_WARNING, "coap_workers_submit: malloc failed\n");
+        coap_remove_async(async);
+        return 0;
+    }
+    memset(job, 0, sizeof(coap_worker_job_t));
+    job->async = async;
+    job->resource = resource;
+    job->handler = handler;
+
+    // Create the response
+    job->response = coap_async_response_init(async);
+    if (!job->response)
+        goto error;
+
+    // Copy the query (request's one is released with the arena's reset)
+    if (query) {
+        job->query = coap_new_string(query->length);
+        if (!job->query)
+            goto error;
+        memcpy(job->query->s, query->s, query->length);
+        job->query->length = query->length;
+    }
+
+    // Capture segments of the templated path from the copy of the request (the received one is reused)
+    if (resource->is_template)
+        coap_route_find_match(session->context, async->request, &job->match);
+
+    // Keep the state and the resource until the job is completed
+    async->offloaded = 1;
+    coap_resource_reference(resource);
+
+    // Put the job into the queue
+    pthread_mutex_lock(&pool->lock);
+    if (pool->submitted_tail)
+        pool->submitted_tail->next = job;
+    else
+        pool->submitted = job;
+    pool->submitted_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 1;
+
+error:
+    coap_log(LOG_WARNING, "coap_workers_submit: cannot prepare the job\n");
+    coap_delete_pdu(job->response);
+    coap_free(job);
+    coap_remove_async(async);
+    return 0;
+}
+
+
+void coap_workers_complete(coap_context_t *context) {
+
+    coap_worker_pool_t *pool = context->workers;
+    if (!pool)
+        return;
+
+    // Drain the wake-up socket
+    coap_socket_wakeup_drain(&pool->wakeup);
+
+    // Take all completed jobs
+    coap_worker_job_t *job = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_ACQUIRE);
+
+    // Reverse the stack, so that responses are sent in order of completion
+    coap_worker_job_t *jobs = NULL, *next;
+    for (; job; job = next) {
+        next = job->next;
+        job->next = jobs;
+        jobs = job;
+    }
+
+    for (job = jobs; job; job = next) {
+        next = job->next;
+        job->async->offloaded = 0;
+
+        // Cache the response (or drop the resource's cache and ETag, if it was modified), unless
+        // the resource has been deleted in the meantime
+        if (!job->resource->is_deleted && job->response->code)
+            coap_handle_offloaded_response(job->resource, job->async->request, job->query, job->response);
+        coap_resource_release(job->resource);
+
+        // Send the response (or drop the request, if the handler has not answered it)
+        if (job->response->code)
+            coap_async_send(job->async, job->response);
+        else {
+            coap_delete_pdu(job->response);
+            coap_remove_async(job->async);
+        }
+
+        coap_delete_string(job->query);
+        coap_free(job);
+    }
+}
+
+
+/* ------------------------------------------- [Static Functions] --------------------------------------------- */
+
+/**
+ * @brief: Worker thread's routine. Takes submitted jobs and calls their handlers until the pool
+ *    is stopped.
+ */
+static void *coap_worker_run(void *arg) {
+
+    coap_worker_pool_t *pool = (coap_worker_pool_t *) arg;
+
+    while (1) {
+
+        // Wait for the job
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->submitted && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        coap_worker_job_t *job = pool->submitted;
+        pool->submitted = job->next;
+        if (!pool->submitted)
+            pool->submitted_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Call the handler
+        coap_async_state_t *async = job->async;
+        coap_binary_t token = { async->token_length, async->token };
+        coap_route_set_thread_match(&job->match);
+        job->handler(job->resource, async->session, async->request, &token, job->query, job->response);
+        coap_route_set_thread_match(NULL);
+
+        // Pass the response to the loop
+        coap_worker_push(pool, job);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief: Pushes the completed @p job onto the @p pool's stack and wakes the loop up, if the
+ *    stack was empty (otherwise the loop has been already woken up)
+ */
+static void coap_worker_push(coap_worker_pool_t *pool, coap_worker_job_t *job) {
+
+    coap_worker_job_t *head = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+    do
+        job->next = head;
+    while (!__atomic_compare_exchange_n(&pool->completed, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!head)
+        coap_socket_wakeup(&pool->wakeup);
+}
+
+
+/**
+ * @brief: Frees the @p job without answering its request
+ */
+static void coap_worker_drop(coap_worker_job_t *job) {
+    job->async->offloaded = 0;
+    coap_resource_release(job->resource);
+    coap_remove_async(job->async);
+    coap_delete_pdu(job->response);
+    coap_delete_string(job->query);
+    coap_free(job);
+}